@@ -31,6 +31,10 @@ typedef enum
 	muacc_act_socketchoose_resp_existing,	/**< socketchoose response, choose existing socket */
 	muacc_act_socketchoose_resp_new,		/**< socketchoose response, create new socket */
 	muacc_error_unknown_request,			/**< indicates an error */
+	muacc_act_socketchoose_resync,			/**< socketchoose response, MAM does not know a referenced socket - resend full contexts */
+	muacc_act_flowstats_report,				/**< counters of a flow, MAM does not respond */
+	muacc_act_srcaddrs_req,					/**< asks for the source addresses of all enabled prefixes */
+	muacc_act_srcaddrs_resp,				/**< srcaddrs response, one bind_sa_res per address in order of preference */
 } muacc_mam_action_t;
 
 /** Linked list of socket options to be set */
@@ -54,6 +58,26 @@ typedef struct socketopt {
 	Used as an identifier that is unique per MPTCP session */
 typedef uint64_t muacc_ctxino_t;
 
+/** Reference to a socket context that has already been sent to the MAM
+	Used instead of the full context for members of a socketset */
+struct _muacc_ctxref {
+	uuid_t				ctxid;					/**< identifier of the referenced context */
+	muacc_ctxino_t		ctxino;					/**< inode of the referenced socket */
+};
+
+/** Counters of a flow, reported to the MAM while the flow is active and when it ends
+	Reports of an active flow only hold what happened since the previous one */
+struct _muacc_flowstats {
+	uint64_t			bytes_sent;				/**< bytes sent on the socket */
+	uint64_t			bytes_received;			/**< bytes received on the socket */
+	uint64_t			messages_sent;			/**< send calls (or datagrams) on the socket, 0 if not counted */
+	uint64_t			messages_received;		/**< receive calls (or datagrams) on the socket, 0 if not counted */
+	uint64_t			duration_ms;			/**< time covered by the counters in ms, 0 if unknown */
+	uint64_t			flags;					/**< MUACC_FLOWSTATS_* */
+};
+
+#define MUACC_FLOWSTATS_FINAL 0x0001			/**< last report of the flow */
+
 /** Internal muacc context struct
 	All data will be serialized and sent to MAM */
 struct _muacc_ctx {
@@ -84,6 +108,8 @@ typedef enum
 	action,					/**< action triggering request */
 	socketset_file,			/**< file descriptor of an existing socket from a socketset */
 	calls_performed,		/**< flags of which socket calls have already been performed */
+	socketset_ctxref,		/**< reference to the context of a socketset member the MAM already knows */
+	flowstats,				/**< byte counters of a flow (struct _muacc_flowstats) */
 	ctxid = 0x08,			/**< identifier for the context if sharing mamsock */
     ctxino,                 /**< inode of the socket (used as identifier for MPTCP sessions) */
 	sockfd,
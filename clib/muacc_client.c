@@ -15,6 +15,7 @@
 #include "dlog.h"
 
 #include "lib/intents.h"
+#include "lib/muacc_tlv.h"
 
 #include "muacc_client_util.h"
 
@@ -30,6 +31,11 @@
 #define CLIB_IF_NOISY_DEBUG2 0
 #endif
 
+/* a MAM that went away must not kill the application */
+#ifndef MSG_NOSIGNAL
+#define MSG_NOSIGNAL 0
+#endif
+
 struct socketset *socketsetlist = NULL;
 pthread_rwlock_t socketsetlist_lock = PTHREAD_RWLOCK_INITIALIZER;
 
@@ -513,6 +519,43 @@ int muacc_close(muacc_context_t *ctx,
 	return close(socket);
 }
 
+int muacc_report_flowstats_local(int *mamsock, const struct sockaddr *local_sa, socklen_t local_sa_len, const struct _muacc_flowstats *stats)
+{
+	char buf[MUACC_TLV_MAXLEN];
+	ssize_t pos = 0;
+	muacc_mam_action_t reason = muacc_act_flowstats_report;
+
+	if( mamsock == NULL || local_sa == NULL || stats == NULL )
+		return -1;
+
+	if( _muacc_connect_to_mam(mamsock) != 0 )
+	{
+		DLOG(CLIB_IF_NOISY_DEBUG0, "WARNING: failed to contact MAM - not reporting flow\n");
+		return -1;
+	}
+
+	/* the MAM accounts the flow to the prefix of the requested local address */
+	if( 0 > _muacc_push_tlv(buf, &pos, sizeof(buf), action, &reason, sizeof(muacc_mam_action_t)) ||
+		0 > _muacc_push_tlv(buf, &pos, sizeof(buf), bind_sa_req, local_sa, local_sa_len) ||
+		0 > _muacc_push_tlv(buf, &pos, sizeof(buf), flowstats, stats, sizeof(struct _muacc_flowstats)) ||
+		0 > _muacc_push_tlv_tag(buf, &pos, sizeof(buf), eof) )
+	{
+		DLOG(CLIB_IF_NOISY_DEBUG0, "WARNING: failed to serialize flow report\n");
+		return -1;
+	}
+
+	DLOG(CLIB_IF_NOISY_DEBUG2, "reporting %llu bytes sent, %llu bytes received\n", (unsigned long long) stats->bytes_sent, (unsigned long long) stats->bytes_received);
+	if( send(*mamsock, buf, pos, MSG_NOSIGNAL) != pos )
+	{
+		DLOG(CLIB_IF_NOISY_DEBUG0, "WARNING: error sending flow report: %s\n", strerror(errno));
+		close(*mamsock);
+		*mamsock = -1;
+		return -1;
+	}
+
+	return 0;
+}
+
 int socketconnect(int *s, const char *host, size_t hostlen, const char *serv, size_t servlen, struct socketopt *sockopts, int domain, int type, int proto)
 {
 	DLOG(CLIB_IF_NOISY_DEBUG0, "Socketconnect invoked, socket: %d\n", *s);
@@ -58,6 +58,7 @@ typedef struct socketlist
 } socketlist_t;
 
 #define MUACC_SOCKET_IN_USE 0x01
+#define MUACC_SOCKET_CTX_KNOWN 0x02	/**< Context of this socket has been sent to MAM and can be referenced by ID */
 
 /** wrapper for socket, initializes an uninitialized context
  *
@@ -103,6 +104,19 @@ int muacc_connect(muacc_context_t *ctx,
 int muacc_close(muacc_context_t *ctx,
 		int socket);
 
+/** report the counters of a flow to MAM, e.g. periodically and before closing its socket
+ *  MAM accounts them to the source prefix of the flow, given by its local address - there is
+ *  no response. Set MUACC_FLOWSTATS_FINAL in the flags of the last report of the flow.
+ *  The report can be sent from another thread than the one using the socket: it goes over
+ *  the MAM connection in *mamsock (opened if it is -1, closed again on errors), which must
+ *  not be shared with a context
+ *
+ *  @return 0 on success, -1 otherwise
+ */
+int muacc_report_flowstats_local(int *mamsock,
+		const struct sockaddr *local_sa, socklen_t local_sa_len,
+		const struct _muacc_flowstats *stats);
+
 /** Function that returns a connected socket to the given URL
  *  Supply a "-1" socket and URL, type, proto, family to get a new, freshly connected socket
  *  Alternatively, supply an existing socket as representant of a socket set to choose from
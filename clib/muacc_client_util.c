@@ -36,6 +36,10 @@
 #define MUACC_CLIENT_UTIL_NOISY_DEBUG2 0
 #endif
 
+/** Contexts sent in full by one socketchoose request that are remembered as known to the MAM
+ *  Further ones are simply sent in full again next time */
+#define MUACC_SOCKETCHOOSE_MAX_LEARNED 32
+
 int muacc_init_context(struct muacc_context *ctx)
 {
 	struct _muacc_ctx *_ctx = _muacc_create_ctx();
@@ -172,7 +176,7 @@ int muacc_clone_context(struct muacc_context *dst, struct muacc_context *src)
 
 
 
-int _muacc_connect_ctx_to_mam(muacc_context_t *ctx)
+int _muacc_connect_to_mam(int *mamsock)
 {
 	struct sockaddr_un mams;
 	mams.sun_family = AF_UNIX;
@@ -180,28 +184,33 @@ int _muacc_connect_ctx_to_mam(muacc_context_t *ctx)
 	mams.sun_len = sizeof(struct sockaddr_un);
 	#endif
 
-	if(	ctx->mamsock != -1 )
+	if(	*mamsock != -1 )
 		return 0;
 
 	strncpy( mams.sun_path, MUACC_SOCKET, sizeof(mams.sun_path));
-	ctx->mamsock = socket(AF_UNIX, SOCK_STREAM, 0);
-	if(ctx->mamsock == -1)
+	*mamsock = socket(AF_UNIX, SOCK_STREAM, 0);
+	if(*mamsock == -1)
 	{
 		DLOG(MUACC_CLIENT_UTIL_NOISY_DEBUG0, "WARNING: socket creation failed: %s\n", strerror(errno));
 		return(-errno);
 	}
 
-	if(connect(ctx->mamsock, (struct sockaddr*) &mams, sizeof(mams)) < 0)
+	if(connect(*mamsock, (struct sockaddr*) &mams, sizeof(mams)) < 0)
 	{
 		DLOG(MUACC_CLIENT_UTIL_NOISY_DEBUG0, "WARNING: connect to mam via %s failed: %s\n",  mams.sun_path, strerror(errno));
-		close(ctx->mamsock);
-		ctx->mamsock = -1;
+		close(*mamsock);
+		*mamsock = -1;
 		return(-errno);
 	}
 
 	return 0;
 }
 
+int _muacc_connect_ctx_to_mam(muacc_context_t *ctx)
+{
+	return _muacc_connect_to_mam(&(ctx->mamsock));
+}
+
 
 int _muacc_contact_mam (muacc_mam_action_t reason, muacc_context_t *ctx)
 {
@@ -460,6 +469,27 @@ void muacc_print_socketset(struct socketset *set)
 	DLOG(CLIB_IF_LOCKS, "LOCK: Finished printing - Unlocked %p\n", (void *) set);
 }
 
+/** Mark the contexts the MAM has learned from a socketchoose request as known - the set must be write locked */
+static void _muacc_socketset_learned(struct socketset *set, const int *files, struct _muacc_ctxref *refs, int num)
+{
+	struct socketlist *list;
+	int i;
+
+	for (list = set->sockets; list != NULL; list = list->next)
+	{
+		for (i = 0; i < num; i++)
+		{
+			/* the socket may have been replaced while the set was unlocked */
+			if (list->file == files[i] && list->ctx != NULL && list->ctx->ctxino == refs[i].ctxino &&
+				__uuid_compare(list->ctx->ctxid, refs[i].ctxid) == 0)
+			{
+				list->flags |= MUACC_SOCKET_CTX_KNOWN;
+				break;
+			}
+		}
+	}
+}
+
 int _muacc_send_socketchoose (muacc_context_t *ctx, int *socket, struct socketset *set)
 {
 	DLOG(MUACC_CLIENT_UTIL_NOISY_DEBUG0, "Sending socketchoose\n");
@@ -474,7 +504,13 @@ int _muacc_send_socketchoose (muacc_context_t *ctx, int *socket, struct socketse
 
 	muacc_mam_action_t reason = muacc_act_socketchoose_req;
 
-	struct socketlist *list = set->sockets;
+	struct socketlist *list = NULL;
+	struct _muacc_ctxref ref;
+	int resync = 0;
+	int resync_requested = 0;
+	int learned_files[MUACC_SOCKETCHOOSE_MAX_LEARNED];
+	struct _muacc_ctxref learned_refs[MUACC_SOCKETCHOOSE_MAX_LEARNED];
+	int num_learned = 0;
 
 	if ( _muacc_connect_ctx_to_mam(ctx) != 0 )
 	{
@@ -482,6 +518,12 @@ int _muacc_send_socketchoose (muacc_context_t *ctx, int *socket, struct socketse
 		return -1;
 	}
 
+_muacc_send_socketchoose_pack:
+
+	pos = 0;
+	list = set->sockets;
+	num_learned = 0;
+
 	DLOG(MUACC_CLIENT_UTIL_NOISY_DEBUG2, "Serializing MAM context\n");
 	if ( 0 > _muacc_push_tlv(buf, &pos, sizeof(buf), action, &reason, sizeof(muacc_mam_action_t)) )
 	{
@@ -508,10 +550,33 @@ int _muacc_send_socketchoose (muacc_context_t *ctx, int *socket, struct socketse
 				DLOG(MUACC_CLIENT_UTIL_NOISY_DEBUG1, "Error pushing socket with file descriptor %d\n", list->file);
 				return -1;
 			}
-			if( 0 > _muacc_pack_ctx(buf, &pos, sizeof(buf), list->ctx) )
+			// After a resync request, the MAM has forgotten about our sockets - send all of them in full again
+			if ((list->flags & MUACC_SOCKET_CTX_KNOWN) && !resync)
 			{
-				DLOG(MUACC_CLIENT_UTIL_NOISY_DEBUG1, "Error pushing socket context of %d\n", list->file);
-				return -1;
+				// MAM has seen this context before - only send a reference to it
+				__uuid_copy(ref.ctxid, list->ctx->ctxid);
+				ref.ctxino = list->ctx->ctxino;
+				if( 0 > _muacc_push_tlv(buf, &pos, sizeof(buf), socketset_ctxref, &ref, sizeof(struct _muacc_ctxref)) )
+				{
+					DLOG(MUACC_CLIENT_UTIL_NOISY_DEBUG1, "Error pushing socket context reference of %d\n", list->file);
+					return -1;
+				}
+			}
+			else
+			{
+				if( 0 > _muacc_pack_ctx(buf, &pos, sizeof(buf), list->ctx) )
+				{
+					DLOG(MUACC_CLIENT_UTIL_NOISY_DEBUG1, "Error pushing socket context of %d\n", list->file);
+					return -1;
+				}
+				// the MAM can only learn contexts that carry an ID - the flag is set once it has answered
+				if (!__uuid_is_null(list->ctx->ctxid) && num_learned < MUACC_SOCKETCHOOSE_MAX_LEARNED)
+				{
+					learned_files[num_learned] = list->file;
+					__uuid_copy(learned_refs[num_learned].ctxid, list->ctx->ctxid);
+					learned_refs[num_learned].ctxino = list->ctx->ctxino;
+					num_learned++;
+				}
 			}
 		}
 		list = list->next;
@@ -551,15 +616,25 @@ int _muacc_send_socketchoose (muacc_context_t *ctx, int *socket, struct socketse
 
 				pthread_rwlock_wrlock(&(set->lock));
 				DLOG(CLIB_IF_LOCKS, "LOCK: Checking socketset %p - Locking it\n", (void *)set);
+				_muacc_socketset_learned(set, learned_files, learned_refs, num_learned);
 
 				set_in_use = 1;
 			}
 			else if (*(muacc_mam_action_t *) data == muacc_act_socketchoose_resp_new)
 			{
 				DLOG(MUACC_CLIENT_UTIL_NOISY_DEBUG0, "MAM says: Open a new socket!\n");
+				pthread_rwlock_wrlock(&(set->lock));
+				DLOG(CLIB_IF_LOCKS, "LOCK: Remembering known contexts - Locking %p\n", (void *)set);
+				_muacc_socketset_learned(set, learned_files, learned_refs, num_learned);
+				pthread_rwlock_unlock(&(set->lock));
 				*socket = -1;
 				returnvalue = 1;
 			}
+			else if (*(muacc_mam_action_t *) data == muacc_act_socketchoose_resync && !resync)
+			{
+				DLOG(MUACC_CLIENT_UTIL_NOISY_DEBUG0, "MAM does not know all sockets of the set - resending their contexts\n");
+				resync_requested = 1;
+			}
 			else if (*(muacc_mam_action_t *) data == muacc_error_unknown_request)
 			{
 				DLOG(MUACC_CLIENT_UTIL_NOISY_DEBUG1, "Error: MAM sent error code \"Unknown Request\" -- Aborting.\n");
@@ -634,6 +709,17 @@ int _muacc_send_socketchoose (muacc_context_t *ctx, int *socket, struct socketse
 			}
 		}
     }
+
+	if (resync_requested)
+	{
+		/* response has been read completely - send the request again with full contexts */
+		pthread_rwlock_rdlock(&(set->lock));
+		DLOG(CLIB_IF_LOCKS, "LOCK: Resending socket set - Locking %p\n", (void *)set);
+		resync = 1;
+		resync_requested = 0;
+		goto _muacc_send_socketchoose_pack;
+	}
+
     DLOG(MUACC_CLIENT_UTIL_NOISY_DEBUG0, "Socketchoose done, returnvalue = %d, socket = %d\n", returnvalue, *socket);
 
 	if (set_in_use)
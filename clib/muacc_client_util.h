@@ -89,6 +89,12 @@ int _muacc_contact_mam (
  */
 int _muacc_connect_ctx_to_mam(muacc_context_t *ctx) ;
 
+/** establish a connection to MAM in *mamsock unless it is connected already
+ *
+ * @return 0 on success, a negative number otherwise
+ */
+int _muacc_connect_to_mam(int *mamsock);
+
 /** Add a Socket Intent to a socket options list
  *
  *  @return 0 on success, a negative number otherwise
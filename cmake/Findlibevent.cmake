@@ -4,6 +4,7 @@
 #  Libevent_FOUND             - True if liblzma is found.
 #  Libevent_INCLUDE_DIRS      - Directory where liblzma headers are located.
 #  Libevent_LIBRARIES         - Lzma libraries to link against.
+#  LIBEVENT_PTHREADS_LIBRARY  - pthreads locking support for libevent
 
 
 # Copyright (c) 2013, Alexander Couzens, <lynxis@fe80.eu>
@@ -14,6 +15,7 @@
 
 FIND_PATH(LIBEVENT_INCLUDE_DIR event2/event.h)
 FIND_LIBRARY(LIBEVENT_LIBRARY event)
+FIND_LIBRARY(LIBEVENT_PTHREADS_LIBRARY event_pthreads)
 
 SET(LIBEVENT_LIBRARIES ${LIBEVENT_LIBRARY})
 SET(LIBEVENT_INCLUDE_DIRS ${LIBEVENT_INCLUDE_DIR})
@@ -21,4 +23,4 @@ SET(LIBEVENT_INCLUDE_DIRS ${LIBEVENT_INCLUDE_DIR})
 INCLUDE(FindPackageHandleStandardArgs)
 FIND_PACKAGE_HANDLE_STANDARD_ARGS(Libevent DEFAULT_MSG  LIBEVENT_INCLUDE_DIR LIBEVENT_LIBRARY)
 
-MARK_AS_ADVANCED( LIBEVENT_INCLUDE_DIR LIBEVENT_LIBRARY )
+MARK_AS_ADVANCED( LIBEVENT_INCLUDE_DIR LIBEVENT_LIBRARY LIBEVENT_PTHREADS_LIBRARY )
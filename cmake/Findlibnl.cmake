@@ -14,7 +14,7 @@ if ( ${LIBNL_LIBRARY} MATCHES "LIBNL_LIBRARY-NOTFOUND" OR  ${LIBNL_GENERIC_LIBRA
 	SET (LIBNL_LIBRARY "")
 	SET (NETLINK_CODE_FILES "")
 else ()
-	SET (NETLINK_CODE_FILES "mam_netlink.c" "mptcp_netlink_parser.c")
+	SET (NETLINK_CODE_FILES "mam_netlink.c")
 	SET (HAVE_LIBNL 1)
 endif ()
 
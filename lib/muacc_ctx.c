@@ -85,7 +85,7 @@ void _muacc_print_ctx(strbuf_t *sb, const struct _muacc_ctx *_ctx)
 		strbuf_printf(sb, "\n}\n");
 }
 
-int _muacc_free_ctx (struct _muacc_ctx *_ctx)
+void _muacc_clear_ctx (struct _muacc_ctx *_ctx)
 {
 	DLOG(MUACC_CTX_NOISY_DEBUG2, "trying to free data fields\n");
 
@@ -107,6 +107,12 @@ int _muacc_free_ctx (struct _muacc_ctx *_ctx)
 		_ctx->sockopts_suggested = current->next;
 		free(current);
 	}
+	memset(_ctx, 0x00, sizeof(struct _muacc_ctx));
+}
+
+int _muacc_free_ctx (struct _muacc_ctx *_ctx)
+{
+	_muacc_clear_ctx(_ctx);
 	free(_ctx);
 	DLOG(MUACC_CTX_NOISY_DEBUG1, "context successfully freed\n");
 
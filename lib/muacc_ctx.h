@@ -29,6 +29,11 @@ struct _muacc_ctx *_muacc_create_ctx();
  */
 //muacc_ctxid_t _get_ctxid();
 
+/** Helper to free all data fields of _muacc_ctx and reset it, so the struct can be reused
+ *
+ */
+void _muacc_clear_ctx (struct _muacc_ctx *_ctx);
+
 /** Helper to free _muacc_ctx if reference count reaches 0
  *
  */
@@ -99,7 +99,7 @@ ssize_t _muacc_push_addrinfo_tlv( char *buf, ssize_t *buf_pos, ssize_t buf_len,
 		i += sizeof(struct addrinfo);
 		i += ai->ai_addrlen;
 		if(ai->ai_canonname != NULL)
-			i += strlen(ai->ai_canonname);
+			i += sizeof(ssize_t) + strlen(ai->ai_canonname) + 1; /* length, string and trailing \0 */
 
 		DLOG(MUACC_TLV_NOISY_DEBUG2, "calculated  length of  addrinfo at %p is %ld\n", (void *) ai, (long) i);
 		data_len += i;
@@ -15,33 +15,39 @@
  *  LIBINTENTS_NOISY_DEBUG1 - Socket table modifications
  *  LIBINTENTS_NOISY_DEBUG2 - Internal workings of the functions
  *  Otherwise, print nothing and optimize code out.
+ *
+ *  Set LIBINTENTS_OBSERVE=1 in the environment to also count the bytes and messages
+ *  sent and received on sockets with a context and report them to the MAM.
  */
 
 #include <stdio.h>
 #include <stdlib.h>
 #include <stdbool.h>
-#include <glib.h>
 #include <dlfcn.h>
+#include <pthread.h>
 #include <string.h>
+#include <time.h>
+#include <unistd.h>
 #include <sys/types.h>
 #include <sys/socket.h>
 #include <netdb.h>
 #include <errno.h>
 
-#include "clib/muacc.h"
+#include "clib/muacc_client.h"
+#include "clib/muacc_client_util.h"
 #include "clib/dlog.h"
 
 #ifndef LIBINTENTS_NOISY_DEBUG0
-#define LIBINTENTS_NOISY_DEBUG0 1
+#define LIBINTENTS_NOISY_DEBUG0 0
 #endif
 #ifndef LIBINTENTS_NOISY_DEBUG1
-#define LIBINTENTS_NOISY_DEBUG1 1
+#define LIBINTENTS_NOISY_DEBUG1 0
 #endif
 #ifndef LIBINTENTS_NOISY_DEBUG2
-#define LIBINTENTS_NOISY_DEBUG2 1
+#define LIBINTENTS_NOISY_DEBUG2 0
 #endif
 
-#include "libintents.h"
+#include "intents.h"
 
 /* Original functions */
 int (*orig_socket)(int domain, int type, int protocol) = NULL;
@@ -51,6 +57,17 @@ int (*orig_getaddrinfo)(const char *node, const char *service, const struct addr
 int (*orig_bind)(int sockfd, const struct sockaddr *addr, socklen_t addrlen) = NULL;
 int (*orig_connect)(int sockfd, const struct sockaddr *addr, socklen_t addrlen) = NULL;
 int (*orig_close)(int fd) = NULL;
+int (*orig_accept)(int sockfd, struct sockaddr *addr, socklen_t *addrlen) = NULL;
+int (*orig_accept4)(int sockfd, struct sockaddr *addr, socklen_t *addrlen, int flags) = NULL;
+ssize_t (*orig_send)(int sockfd, const void *buf, size_t len, int flags) = NULL;
+ssize_t (*orig_sendto)(int sockfd, const void *buf, size_t len, int flags, const struct sockaddr *dest_addr, socklen_t addrlen) = NULL;
+ssize_t (*orig_sendmsg)(int sockfd, const struct msghdr *msg, int flags) = NULL;
+int (*orig_sendmmsg)(int sockfd, struct mmsghdr *msgvec, unsigned int vlen, int flags) = NULL;
+ssize_t (*orig_write)(int fd, const void *buf, size_t count) = NULL;
+ssize_t (*orig_recv)(int sockfd, void *buf, size_t len, int flags) = NULL;
+ssize_t (*orig_recvfrom)(int sockfd, void *buf, size_t len, int flags, struct sockaddr *src_addr, socklen_t *addrlen) = NULL;
+ssize_t (*orig_recvmsg)(int sockfd, struct msghdr *msg, int flags) = NULL;
+ssize_t (*orig_read)(int fd, void *buf, size_t count) = NULL;
 
 /** \var int (*orig_socket)(int domain, int type, int protocol)
  *  Pointer to the 'original' socket function in the library that would be loaded without LD_PRELOAD
@@ -73,12 +90,121 @@ int (*orig_close)(int fd) = NULL;
 /** \var int (*orig_close)(int fd)
  *  Pointer to the 'original' close function in the library that would be loaded without LD_PRELOAD
  */
+/** \var int (*orig_accept)(int sockfd, struct sockaddr *addr, socklen_t *addrlen)
+ *  Pointer to the 'original' accept function in the library that would be loaded without LD_PRELOAD
+ */
+/** \var int (*orig_accept4)(int sockfd, struct sockaddr *addr, socklen_t *addrlen, int flags)
+ *  Pointer to the 'original' accept4 function in the library that would be loaded without LD_PRELOAD
+ */
+/* The original send*, recv*, write and read functions are used likewise */
 
+/** Socket table
+ *
+ *  Indexed by the file descriptor: socket_table[fd >> ST_PAGE_BITS][fd & ST_PAGE_MASK].
+ *  Pages are allocated when the first socket in their range is created, published with
+ *  an atomic compare-and-swap and never freed, so readers need no lock to find a slot.
+ *  The context pointer of a slot is published atomically as well - calls on sockets
+ *  without a context only do two atomic loads.
+ *  Everything else a slot holds is protected by its own lock.
+ *
+ *  Contexts are created lazily: socket() only notes the domain, type and protocol of
+ *  AF_INET/AF_INET6 sockets in their slot. The context is allocated on the first
+ *  SOL_INTENTS setsockopt() or on connect() - sockets of other families never touch
+ *  the table at all.
+ */
+#define ST_PAGE_BITS	10
+#define ST_PAGE_SIZE	(1 << ST_PAGE_BITS)
+#define ST_PAGE_MASK	(ST_PAGE_SIZE - 1)
+#define ST_MAX_PAGES	1024	/**< file descriptors beyond ST_MAX_PAGES * ST_PAGE_SIZE are not tracked */
 
-GHashTable *socket_table = NULL;
-static void st_free_socknum(void* data);
-static void st_free_ctx(void* data);
-static void st_print_table(GHashTable* table);
+/** Entry of the socket table */
+struct st_slot {
+	pthread_mutex_t		lock;		/**< Protects the slot and the usage counter of the context */
+	muacc_context_t		*ctx;		/**< Context of the socket, NULL if there is none (yet) */
+	int					domain;		/**< Domain of the socket, AF_UNSPEC if it may not get a context */
+	int					type;		/**< Type of the socket */
+	int					protocol;	/**< Protocol of the socket */
+	unsigned int		gen;		/**< Incremented whenever the slot is set up for a new socket */
+	uint64_t			obs_bytes_sent;			/**< Observed bytes sent, not yet reported */
+	uint64_t			obs_bytes_received;		/**< Observed bytes received, not yet reported */
+	uint64_t			obs_messages_sent;		/**< Observed send calls, not yet reported */
+	uint64_t			obs_messages_received;	/**< Observed receive calls, not yet reported */
+	uint64_t			obs_since;	/**< Time in ms the unreported counters started */
+	int					obs_seen;	/**< Traffic has been observed on the socket */
+	int					obs_dirty;	/**< The slot is on the list of the flusher */
+	struct st_slot		*obs_next;	/**< Next slot on the list of the flusher */
+	struct sockaddr_storage obs_local;	/**< Local address of the socket the counters are reported for */
+	socklen_t			obs_local_len;	/**< Length of obs_local, 0 while it is unknown */
+};
+
+static struct st_slot *socket_table[ST_MAX_PAGES];
+
+/** Flag that indicates if this thread is already inside one of our functions
+ *  Calls made by libmuacc itself (e.g. to talk to the MAM) go straight to the original functions
+ */
+static __thread bool call_in_progress = false;
+
+/** Traffic observation
+ *
+ *  Every intercepted send/recv on a socket with a context adds to a small batch of
+ *  counters owned by the calling thread - no locks, no system calls. Once a second
+ *  (or when the batch is full, or on close) the batch is added atomically to the
+ *  counters in the socket table. A background thread reports the slots that changed
+ *  to the MAM every OBS_FLUSH_INTERVAL seconds, and a final report after the socket
+ *  is closed.
+ *  The background thread never touches the contexts, which the application threads
+ *  use without holding the lock of their slot: it reports the counters by the local
+ *  address of the socket over a MAM connection of its own. Counters that could not
+ *  be reported are added back and go out with the next report.
+ */
+#define OBS_BATCH_SIZE		8	/**< sockets a thread collects counters for before flushing */
+#define OBS_FLUSH_INTERVAL	1	/**< seconds between reports to the MAM */
+#define OBS_FINAL_TRIES		5	/**< attempts to send the final report of a closed socket */
+
+/** Counters a thread collected for one socket */
+struct obs_entry {
+	struct st_slot		*slot;		/**< Slot of the socket, NULL if the entry is unused */
+	unsigned int		gen;		/**< Generation of the slot the counters belong to */
+	int					fd;			/**< The socket */
+	uint64_t			bytes_sent;
+	uint64_t			bytes_received;
+	uint64_t			messages_sent;
+	uint64_t			messages_received;
+};
+
+/** Final report of a closed socket, waiting for the flusher */
+struct obs_report {
+	struct obs_report	*next;
+	struct sockaddr_storage local;	/**< Local address of the socket */
+	socklen_t			local_len;	/**< Length of local */
+	int					tries;		/**< Attempts to send the report so far */
+	struct _muacc_flowstats stats;
+};
+
+static bool obs_enabled = false;
+static __thread struct obs_entry obs_batch[OBS_BATCH_SIZE];
+static __thread time_t obs_batch_time = 0;
+static pthread_once_t obs_once = PTHREAD_ONCE_INIT;
+static pthread_mutex_t obs_lock = PTHREAD_MUTEX_INITIALIZER;	/**< Protects the two lists below */
+static struct st_slot *obs_dirty_slots = NULL;
+static struct obs_report *obs_final_reports = NULL;
+static int obs_mamsock = -1;	/**< MAM connection of the flusher */
+
+static void obs_account(int fd, uint64_t bytes_sent, uint64_t bytes_received, uint64_t messages_sent, uint64_t messages_received);
+static void obs_flush_batch(void);
+static void obs_mark_dirty(struct st_slot *slot);
+static bool obs_take(struct st_slot *slot, struct _muacc_flowstats *stats);
+static void obs_give_back(struct st_slot *slot, unsigned int gen, const struct _muacc_flowstats *stats, uint64_t since);
+static void obs_final(struct st_slot *slot);
+static uint64_t obs_now(void);
+
+static struct st_slot *st_get_slot(int fd, bool create);
+static void st_reset_slot(struct st_slot *slot, int domain, int type, int protocol);
+static void st_track(int fd, int domain, int type, int protocol);
+static bool st_eligible(int domain, int type);
+static muacc_context_t *st_get_ctx(int fd, struct st_slot **slot, bool create);
+static void st_put_ctx(struct st_slot *slot, muacc_context_t *ctx);
+static void st_free_ctx(muacc_context_t *ctx);
 
 int get_orig_function(char* name, void** function);
 
@@ -86,13 +212,12 @@ int get_orig_function(char* name, void** function);
 
 /** Intercepts all 'socket' calls.
  *
- *  Creates a new socket and initializes a new \a muacc_context_t for it.
+ *  Creates a new socket and remembers whether it may get a \a muacc_context_t later on.
  */
 int socket(int domain, int type, int protocol)
 {
 	DLOG(LIBINTENTS_NOISY_DEBUG0, "--- socket( %d, %d, %d ) ---\n", domain, type, protocol);
 
-	static bool call_in_progress = false; // Flag that indicates if this is a nested call
 	int retval = 0;
 
 	if (!orig_socket)
@@ -101,10 +226,7 @@ int socket(int domain, int type, int protocol)
 		 * for being able to call it later.
 		 */
 		if ((retval = get_orig_function("socket", (void **)&orig_socket)) != 0)
-		{
-			call_in_progress = false;
 			return retval;
-		}
 	}
 	/* Check if we are in a nested call of our experimental socket function.
 	 * If so, call the original socket function and return afterwards to prevent loops.
@@ -114,17 +236,7 @@ int socket(int domain, int type, int protocol)
 		DLOG(LIBINTENTS_NOISY_DEBUG0, "Call in progress - calling original socket function\n");
 		return orig_socket(domain, type, protocol);
 	}
-	else
-	{
-		DLOG(LIBINTENTS_NOISY_DEBUG2, "Set 'call in progress' to true\n");
-		call_in_progress = true;
-	}
-
-	if (!socket_table)
-	{
-		DLOG(LIBINTENTS_NOISY_DEBUG1, "+++ Initializing socket table +++\n");
-		socket_table = g_hash_table_new_full(g_int_hash, g_int_equal, st_free_socknum, st_free_ctx);
-	}
+	call_in_progress = true;
 
 	DLOG(LIBINTENTS_NOISY_DEBUG2, "Creating socket.\n");
 	if ((retval = orig_socket(domain, type, protocol)) < 0)
@@ -133,25 +245,7 @@ int socket(int domain, int type, int protocol)
 	}
 	else
 	{
-		DLOG(LIBINTENTS_NOISY_DEBUG2, "Successfully created socket %d \n", retval);
-
-		DLOG(LIBINTENTS_NOISY_DEBUG2, "+++ Initializing muacc context. +++\n");
-		muacc_context_t *newctx = malloc(sizeof(muacc_context_t));
-		newctx -> ctx = NULL;
-		if (muacc_init_context(newctx) < 0)
-		{
-			fprintf(stderr,"Error initializing context for socket %d. \n", retval);
-			errno = ENOMEM;
-		}
-		else
-		{
-			DLOG(LIBINTENTS_NOISY_DEBUG1, "Initialized new muacc_context: %p\n", (void *) newctx);
-			DLOG(LIBINTENTS_NOISY_DEBUG1, "+++ Inserting socket %d and its muacc_context into hash table. +++\n",retval);
-			int *socknum = malloc(sizeof(int));
-			*socknum = retval;
-			g_hash_table_insert(socket_table, (void *) socknum, (void *) newctx);
-			if (LIBINTENTS_NOISY_DEBUG1) st_print_table(socket_table);
-		}
+		st_track(retval, domain, type, protocol);
 	}
 
 	call_in_progress = false;
@@ -166,8 +260,8 @@ int socket(int domain, int type, int protocol)
 int setsockopt(int sockfd, int level, int optname, const void *optval, socklen_t optlen)
 {
 	DLOG(LIBINTENTS_NOISY_DEBUG0, "--- setsockopt ( %d, %d, %d, %d ) --- \n", sockfd, level, optname, (int) optlen);
-	static bool call_in_progress = false; // Flag that indicates if this is a nested call
 	int retval = 0;
+	struct st_slot *slot;
 
 	if (!orig_setsockopt)
 	{
@@ -178,27 +272,24 @@ int setsockopt(int sockfd, int level, int optname, const void *optval, socklen_t
 		DLOG(LIBINTENTS_NOISY_DEBUG0, "Call already in progress. Calling original setsockopt.\n");
 		return orig_setsockopt(sockfd, level, optname, optval, optlen);
 	}
-	else
-	{
-		DLOG(LIBINTENTS_NOISY_DEBUG2, "Set call_in_progress to true.\n");
-		call_in_progress = true;
-	}
+	call_in_progress = true;
 
-	muacc_context_t *ctx = g_hash_table_lookup(socket_table, (const void *) &sockfd);
+	/* the first intent creates the context */
+	muacc_context_t *ctx = st_get_ctx(sockfd, &slot, (level == SOL_INTENTS));
 	if (ctx == NULL)
 	{
 		DLOG(LIBINTENTS_NOISY_DEBUG0, "Failed to look up socket %d in socket table - calling original setsockopt.\n", sockfd);
 		call_in_progress = false;
 		return orig_setsockopt(sockfd, level, optname, optval, optlen);
 	}
-	else
+
+	DLOG(LIBINTENTS_NOISY_DEBUG0, "Found context matching socket %d - calling muacc_setsockopt.\n", sockfd);
+	if ((retval = muacc_setsockopt(ctx, sockfd, level, optname, optval, optlen)) < 0)
 	{
-		DLOG(LIBINTENTS_NOISY_DEBUG0, "Found context matching socket %d - calling muacc_setsockopt.\n", sockfd);
-		if ((retval = muacc_setsockopt(ctx, sockfd, level, optname, optval, optlen)) < 0)
-		{
-			fprintf(stderr, "Error calling muacc_setsockopt: %d\n", retval);
-		}
+		fprintf(stderr, "Error calling muacc_setsockopt: %d\n", retval);
 	}
+	st_put_ctx(slot, ctx);
+
 	call_in_progress = false;
 	return retval;
 }
@@ -211,8 +302,8 @@ int setsockopt(int sockfd, int level, int optname, const void *optval, socklen_t
 int getsockopt(int sockfd, int level, int optname, void *optval, socklen_t *optlen)
 {
 	DLOG(LIBINTENTS_NOISY_DEBUG0, "--- getsockopt ( %d, %d, %d ) --- \n", sockfd, level, optname);
-	static bool call_in_progress = false; // Flag that indicates if this is a nested call
 	int retval = 0;
+	struct st_slot *slot;
 
 	if (!orig_getsockopt)
 	{
@@ -223,27 +314,23 @@ int getsockopt(int sockfd, int level, int optname, void *optval, socklen_t *optl
 		DLOG(LIBINTENTS_NOISY_DEBUG0, "Call already in progress. Calling original getsockopt.\n");
 		return orig_getsockopt(sockfd, level, optname, optval, optlen);
 	}
-	else
-	{
-		DLOG(LIBINTENTS_NOISY_DEBUG2, "Set call_in_progress to true.\n");
-		call_in_progress = true;
-	}
+	call_in_progress = true;
 
-	muacc_context_t *ctx = g_hash_table_lookup(socket_table, (const void *) &sockfd);
+	muacc_context_t *ctx = st_get_ctx(sockfd, &slot, false);
 	if (ctx == NULL)
 	{
 		DLOG(LIBINTENTS_NOISY_DEBUG0, "Failed to look up socket %d in socket table - calling original getsockopt.\n", sockfd);
 		call_in_progress = false;
 		return orig_getsockopt(sockfd, level, optname, optval, optlen);
 	}
-	else
+
+	DLOG(LIBINTENTS_NOISY_DEBUG0, "Found context matching socket %d - calling muacc_getsockopt.\n", sockfd);
+	if ((retval = muacc_getsockopt(ctx, sockfd, level, optname, optval, optlen)) < 0)
 	{
-		DLOG(LIBINTENTS_NOISY_DEBUG0, "Found context matching socket %d - calling muacc_getsockopt.\n", sockfd);
-		if ((retval = muacc_getsockopt(ctx, sockfd, level, optname, optval, optlen)) < 0)
-		{
-			fprintf(stderr, "Error calling muacc_getsockopt: %d\n", retval);
-		}
+		fprintf(stderr, "Error calling muacc_getsockopt: %d\n", retval);
 	}
+	st_put_ctx(slot, ctx);
+
 	call_in_progress = false;
 	return retval;
 }
@@ -254,8 +341,8 @@ int getsockopt(int sockfd, int level, int optname, void *optval, socklen_t *optl
 int getaddrinfo(const char *node, const char *service, const struct addrinfo *hints, struct addrinfo **res)
 {
 	DLOG(LIBINTENTS_NOISY_DEBUG0, "--- getaddrinfo ( %s, %s ) ---\n", node, service);
-	static bool call_in_progress = false; // Flag that indicates if this is a nested call
 	int retval = 0;
+	struct st_slot *slot;
 
 	if (!orig_getaddrinfo)
 	{
@@ -267,29 +354,25 @@ int getaddrinfo(const char *node, const char *service, const struct addrinfo *hi
 		DLOG(LIBINTENTS_NOISY_DEBUG0, "Call already in progress. Calling original getaddrinfo.\n");
 		return orig_getaddrinfo(node, service, hints, res);
 	}
-	else
-	{
-		DLOG(LIBINTENTS_NOISY_DEBUG2, "Set call_in_progress to true.\n");
-		call_in_progress = true;
-	}
+	call_in_progress = true;
 
 	int sockfd = 1; //FIXME: How to get a socket descriptor that makes sense here?
-	muacc_context_t *ctx = g_hash_table_lookup(socket_table, (const void *) &sockfd);
+	muacc_context_t *ctx = st_get_ctx(sockfd, &slot, false);
 
 	if (ctx == NULL)
 	{
 		DLOG(LIBINTENTS_NOISY_DEBUG0, "Failed to look up socket %d in socket table - calling original getaddrinfo.\n", sockfd);
+		call_in_progress = false;
 		return orig_getaddrinfo(node, service, hints, res);
 	}
-	else
-	{
-		DLOG(LIBINTENTS_NOISY_DEBUG1, "Found context matching socket %d\n", sockfd);
-	}
+
+	DLOG(LIBINTENTS_NOISY_DEBUG1, "Found context matching socket %d\n", sockfd);
 	DLOG(LIBINTENTS_NOISY_DEBUG0, "Calling muacc_getaddrinfo.\n");
 	if ((retval = muacc_getaddrinfo(ctx, node, service, hints, res)) < 0)
 	{
 		fprintf(stderr,"Error calling muacc_getaddrinfo.\n");
 	}
+	st_put_ctx(slot, ctx);
 
 	call_in_progress = false;
 	return retval;
@@ -301,7 +384,6 @@ int getaddrinfo(const char *node, const char *service, const struct addrinfo *hi
 int bind(int sockfd, const struct sockaddr *addr, socklen_t addrlen)
 {
 	DLOG(LIBINTENTS_NOISY_DEBUG0, "--- bind ( %d ) --- \n", sockfd);
-	static bool call_in_progress = false; // Flag that indicates if this is a nested call
 	int retval = 0;
 
 	if (!orig_bind)
@@ -309,23 +391,11 @@ int bind(int sockfd, const struct sockaddr *addr, socklen_t addrlen)
 		if ((retval = get_orig_function("bind",(void **)&orig_bind)) < 0) return retval;
 	}
 
-	if (call_in_progress)
-	{
-		DLOG(LIBINTENTS_NOISY_DEBUG0, "Call already in progress. Calling original bind.\n");
-		return orig_bind(sockfd, addr, addrlen);
-	}
-	else
-	{
-		DLOG(LIBINTENTS_NOISY_DEBUG2, "Set call_in_progress to true.\n");
-		call_in_progress = true;
-	}
-
 	DLOG(LIBINTENTS_NOISY_DEBUG0, "Calling original bind.\n");
-	if ((retval = orig_bind(sockfd, addr, addrlen)) < 0)
+	if ((retval = orig_bind(sockfd, addr, addrlen)) < 0 && !call_in_progress)
 	{
 		fprintf(stderr,"Error calling bind.\n");
 	}
-	call_in_progress = false;
 	return retval;
 }
 
@@ -335,8 +405,8 @@ int bind(int sockfd, const struct sockaddr *addr, socklen_t addrlen)
 int connect(int sockfd, const struct sockaddr *addr, socklen_t addrlen)
 {
 	DLOG(LIBINTENTS_NOISY_DEBUG0, "--- connect ( %d ) --- \n", sockfd);
-	static bool call_in_progress = false; // Flag that indicates if this is a nested call
 	int retval = 0;
+	struct st_slot *slot;
 
 	if (!orig_connect)
 	{
@@ -347,31 +417,26 @@ int connect(int sockfd, const struct sockaddr *addr, socklen_t addrlen)
 		DLOG(LIBINTENTS_NOISY_DEBUG0, "Call already in progress. Calling original connect.\n");
 		return orig_connect(sockfd, addr, addrlen);
 	}
-	else
-	{
-		DLOG(LIBINTENTS_NOISY_DEBUG2, "Set call_in_progress to true.\n");
-		call_in_progress = true;
-	}
+	call_in_progress = true;
 
-	muacc_context_t *ctx = g_hash_table_lookup(socket_table, (const void *) &sockfd);
+	muacc_context_t *ctx = st_get_ctx(sockfd, &slot, (addr != NULL && (addr->sa_family == AF_INET || addr->sa_family == AF_INET6)));
 	DLOG(LIBINTENTS_NOISY_DEBUG2, "Looked up %d in socket table, is %p \n", sockfd, (void*) ctx);
 
 	if (ctx == NULL)
 	{
 		DLOG(LIBINTENTS_NOISY_DEBUG0, "Failed to look up socket %d in socket table - Calling original connect.\n", sockfd);
+		call_in_progress = false;
 		return orig_connect(sockfd, addr, addrlen);
 	}
-	else
-	{
-		DLOG(LIBINTENTS_NOISY_DEBUG1, "Found context matching socket %d\n", sockfd);
-	}
 
 	DLOG(LIBINTENTS_NOISY_DEBUG0, "Calling muacc_connect.\n");
-
+	/* the slot is not locked here - another thread may close the socket to abort a blocking connect */
 	if ((retval = muacc_connect(ctx, sockfd, addr, addrlen)) < 0)
 	{
 		fprintf(stderr,"Error calling muacc_connect.\n");
 	}
+	st_put_ctx(slot, ctx);
+
 	call_in_progress = false;
 	return retval;
 }
@@ -379,8 +444,9 @@ int connect(int sockfd, const struct sockaddr *addr, socklen_t addrlen)
 int close(int fd)
 {
 	DLOG(LIBINTENTS_NOISY_DEBUG0, "--- close ( %d ) ---\n", fd);
-	static bool call_in_progress = false; // Flag that indicates if this is a nested call
 	int retval = 0;
+	struct st_slot *slot;
+
 	if (!orig_close)
 	{
 		if ((retval = get_orig_function("close",(void **)&orig_close)) < 0) return retval;
@@ -390,35 +456,220 @@ int close(int fd)
 		DLOG(LIBINTENTS_NOISY_DEBUG0, "Call already in progress. Calling original close.\n");
 		return orig_close(fd);
 	}
-	else
-	{
-		DLOG(LIBINTENTS_NOISY_DEBUG2, "Set call_in_progress to true.\n");
-		call_in_progress = true;
-	}
+	call_in_progress = true;
 
-	if (socket_table != NULL)
+	if ((slot = st_get_slot(fd, false)) != NULL &&
+		(__atomic_load_n(&(slot->ctx), __ATOMIC_ACQUIRE) != NULL || __atomic_load_n(&(slot->domain), __ATOMIC_ACQUIRE) != AF_UNSPEC))
 	{
-		DLOG(LIBINTENTS_NOISY_DEBUG1, "+++ Trying to remove socket %d from socket table. +++\n", fd);
-		if (!(retval = g_hash_table_remove(socket_table, (const void*) &fd)))
-		{
-			DLOG(LIBINTENTS_NOISY_DEBUG1, "Could not find socket %d in socket table - nothing removed.\n", fd);
-		}
-		else
-		{
-			DLOG(LIBINTENTS_NOISY_DEBUG1, "+++ Successfully removed socket %d from socket table. +++\n", fd);
-		}
+		DLOG(LIBINTENTS_NOISY_DEBUG1, "+++ Removing socket %d from socket table. +++\n", fd);
+		/* what this thread counted goes into the final report */
+		if (obs_enabled)
+			obs_flush_batch();
+		st_reset_slot(slot, AF_UNSPEC, 0, 0);
 	}
 
 	DLOG(LIBINTENTS_NOISY_DEBUG0, "Calling original close.\n");
 	if ((retval = orig_close(fd)) < 0)
 	{
-		fprintf(stderr,"Error calling original close.\n");
+		DLOG(LIBINTENTS_NOISY_DEBUG1, "Error calling original close.\n");
 	}
 	
 	call_in_progress = false;
 	return retval;
 }
 
+/** Intercept all 'accept' calls.
+ *
+ *  The new socket may get a context like the listening one.
+ */
+int accept(int sockfd, struct sockaddr *addr, socklen_t *addrlen)
+{
+	DLOG(LIBINTENTS_NOISY_DEBUG0, "--- accept ( %d ) ---\n", sockfd);
+	int retval = 0;
+	struct st_slot *slot;
+
+	if (!orig_accept)
+	{
+		if ((retval = get_orig_function("accept",(void **)&orig_accept)) < 0) return retval;
+	}
+
+	if ((retval = orig_accept(sockfd, addr, addrlen)) >= 0 && !call_in_progress)
+	{
+		call_in_progress = true;
+		slot = st_get_slot(sockfd, false);
+		if (slot != NULL && __atomic_load_n(&(slot->domain), __ATOMIC_ACQUIRE) != AF_UNSPEC)
+			st_track(retval, slot->domain, slot->type, slot->protocol);
+		else
+			st_track(retval, AF_UNSPEC, 0, 0);
+		call_in_progress = false;
+	}
+	return retval;
+}
+
+/** Intercept all 'accept4' calls.
+ *
+ *  The new socket may get a context like the listening one.
+ */
+int accept4(int sockfd, struct sockaddr *addr, socklen_t *addrlen, int flags)
+{
+	DLOG(LIBINTENTS_NOISY_DEBUG0, "--- accept4 ( %d ) ---\n", sockfd);
+	int retval = 0;
+	struct st_slot *slot;
+
+	if (!orig_accept4)
+	{
+		if ((retval = get_orig_function("accept4",(void **)&orig_accept4)) < 0) return retval;
+	}
+
+	if ((retval = orig_accept4(sockfd, addr, addrlen, flags)) >= 0 && !call_in_progress)
+	{
+		call_in_progress = true;
+		slot = st_get_slot(sockfd, false);
+		if (slot != NULL && __atomic_load_n(&(slot->domain), __ATOMIC_ACQUIRE) != AF_UNSPEC)
+			st_track(retval, slot->domain, slot->type, slot->protocol);
+		else
+			st_track(retval, AF_UNSPEC, 0, 0);
+		call_in_progress = false;
+	}
+	return retval;
+}
+
+/* The send and receive functions only count what went through sockets with a context -
+ * all others just take a look at the table
+ */
+
+ssize_t send(int sockfd, const void *buf, size_t len, int flags)
+{
+	ssize_t retval = 0;
+
+	if (!orig_send)
+	{
+		if ((retval = get_orig_function("send",(void **)&orig_send)) < 0) return retval;
+	}
+
+	if ((retval = orig_send(sockfd, buf, len, flags)) > 0 && obs_enabled && !call_in_progress)
+		obs_account(sockfd, retval, 0, 1, 0);
+	return retval;
+}
+
+ssize_t sendto(int sockfd, const void *buf, size_t len, int flags, const struct sockaddr *dest_addr, socklen_t addrlen)
+{
+	ssize_t retval = 0;
+
+	if (!orig_sendto)
+	{
+		if ((retval = get_orig_function("sendto",(void **)&orig_sendto)) < 0) return retval;
+	}
+
+	if ((retval = orig_sendto(sockfd, buf, len, flags, dest_addr, addrlen)) > 0 && obs_enabled && !call_in_progress)
+		obs_account(sockfd, retval, 0, 1, 0);
+	return retval;
+}
+
+ssize_t sendmsg(int sockfd, const struct msghdr *msg, int flags)
+{
+	ssize_t retval = 0;
+
+	if (!orig_sendmsg)
+	{
+		if ((retval = get_orig_function("sendmsg",(void **)&orig_sendmsg)) < 0) return retval;
+	}
+
+	if ((retval = orig_sendmsg(sockfd, msg, flags)) > 0 && obs_enabled && !call_in_progress)
+		obs_account(sockfd, retval, 0, 1, 0);
+	return retval;
+}
+
+int sendmmsg(int sockfd, struct mmsghdr *msgvec, unsigned int vlen, int flags)
+{
+	int retval = 0;
+	uint64_t bytes = 0;
+	int i;
+
+	if (!orig_sendmmsg)
+	{
+		if ((retval = get_orig_function("sendmmsg",(void **)&orig_sendmmsg)) < 0) return retval;
+	}
+
+	if ((retval = orig_sendmmsg(sockfd, msgvec, vlen, flags)) > 0 && obs_enabled && !call_in_progress)
+	{
+		for (i = 0; i < retval; i++)
+			bytes += msgvec[i].msg_len;
+		obs_account(sockfd, bytes, 0, retval, 0);
+	}
+	return retval;
+}
+
+ssize_t write(int fd, const void *buf, size_t count)
+{
+	ssize_t retval = 0;
+
+	if (!orig_write)
+	{
+		if ((retval = get_orig_function("write",(void **)&orig_write)) < 0) return retval;
+	}
+
+	if ((retval = orig_write(fd, buf, count)) > 0 && obs_enabled && !call_in_progress)
+		obs_account(fd, retval, 0, 1, 0);
+	return retval;
+}
+
+ssize_t recv(int sockfd, void *buf, size_t len, int flags)
+{
+	ssize_t retval = 0;
+
+	if (!orig_recv)
+	{
+		if ((retval = get_orig_function("recv",(void **)&orig_recv)) < 0) return retval;
+	}
+
+	if ((retval = orig_recv(sockfd, buf, len, flags)) > 0 && obs_enabled && !call_in_progress)
+		obs_account(sockfd, 0, retval, 0, 1);
+	return retval;
+}
+
+ssize_t recvfrom(int sockfd, void *buf, size_t len, int flags, struct sockaddr *src_addr, socklen_t *addrlen)
+{
+	ssize_t retval = 0;
+
+	if (!orig_recvfrom)
+	{
+		if ((retval = get_orig_function("recvfrom",(void **)&orig_recvfrom)) < 0) return retval;
+	}
+
+	if ((retval = orig_recvfrom(sockfd, buf, len, flags, src_addr, addrlen)) > 0 && obs_enabled && !call_in_progress)
+		obs_account(sockfd, 0, retval, 0, 1);
+	return retval;
+}
+
+ssize_t recvmsg(int sockfd, struct msghdr *msg, int flags)
+{
+	ssize_t retval = 0;
+
+	if (!orig_recvmsg)
+	{
+		if ((retval = get_orig_function("recvmsg",(void **)&orig_recvmsg)) < 0) return retval;
+	}
+
+	if ((retval = orig_recvmsg(sockfd, msg, flags)) > 0 && obs_enabled && !call_in_progress)
+		obs_account(sockfd, 0, retval, 0, 1);
+	return retval;
+}
+
+ssize_t read(int fd, void *buf, size_t count)
+{
+	ssize_t retval = 0;
+
+	if (!orig_read)
+	{
+		if ((retval = get_orig_function("read",(void **)&orig_read)) < 0) return retval;
+	}
+
+	if ((retval = orig_read(fd, buf, count)) > 0 && obs_enabled && !call_in_progress)
+		obs_account(fd, 0, retval, 0, 1);
+	return retval;
+}
+
 /** Fetch the 'original' function from the library that would be used without LD_PRELOAD.
  *  \param name The name of the function/symbol
  *  \param function Buffer where a pointer to the function will be placed on success
@@ -451,69 +702,471 @@ int get_orig_function(char* name, void** function)
 	return 0;
 }
 
-void st_print_table(GHashTable* table)
+/** Find the slot of a file descriptor
+ *  \param fd The file descriptor
+ *  \param create Allocate the page of the slot if it does not exist yet
+ *  \return The slot, NULL if fd cannot be tracked or its page does not exist
+ */
+static struct st_slot *st_get_slot(int fd, bool create)
+{
+	struct st_slot *page;
+	struct st_slot *expected = NULL;
+	int i;
+
+	if (fd < 0 || (fd >> ST_PAGE_BITS) >= ST_MAX_PAGES)
+		return NULL;
+
+	if ((page = __atomic_load_n(&(socket_table[fd >> ST_PAGE_BITS]), __ATOMIC_ACQUIRE)) != NULL || !create)
+		return (page == NULL) ? NULL : &(page[fd & ST_PAGE_MASK]);
+
+	DLOG(LIBINTENTS_NOISY_DEBUG1, "+++ Allocating socket table page %d +++\n", fd >> ST_PAGE_BITS);
+	if ((page = malloc(ST_PAGE_SIZE * sizeof(struct st_slot))) == NULL)
+		return NULL;
+	for (i = 0; i < ST_PAGE_SIZE; i++)
+	{
+		memset(&(page[i]), 0x00, sizeof(struct st_slot));
+		pthread_mutex_init(&(page[i].lock), NULL);
+		page[i].domain = AF_UNSPEC;
+	}
+
+	if (!__atomic_compare_exchange_n(&(socket_table[fd >> ST_PAGE_BITS]), &expected, page, false, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE))
+	{
+		/* another thread was faster */
+		for (i = 0; i < ST_PAGE_SIZE; i++)
+			pthread_mutex_destroy(&(page[i].lock));
+		free(page);
+		page = expected;
+	}
+
+	return &(page[fd & ST_PAGE_MASK]);
+}
+
+/** Check whether a socket of this domain and type may get a context */
+static bool st_eligible(int domain, int type)
 {
-	if (table == NULL)
+	#ifdef SOCK_NONBLOCK
+	type &= ~(SOCK_NONBLOCK | SOCK_CLOEXEC);
+	#endif
+
+	return (domain == AF_INET || domain == AF_INET6) && (type == SOCK_STREAM || type == SOCK_DGRAM);
+}
+
+/** Set up a slot for a new socket, dropping the reference of the table to the context of the old one */
+static void st_reset_slot(struct st_slot *slot, int domain, int type, int protocol)
+{
+	muacc_context_t *oldctx;
+
+	pthread_mutex_lock(&(slot->lock));
+	oldctx = slot->ctx;
+	__atomic_store_n(&(slot->ctx), NULL, __ATOMIC_RELEASE);
+	__atomic_add_fetch(&(slot->gen), 1, __ATOMIC_ACQ_REL);
+	slot->type = type;
+	slot->protocol = protocol;
+	__atomic_store_n(&(slot->domain), domain, __ATOMIC_RELEASE);
+
+	/* calls still using the old context hold their own reference */
+	if (obs_enabled && slot->obs_seen)
+		obs_final(slot);
+	if (oldctx != NULL)
+		st_free_ctx(oldctx);
+	slot->obs_bytes_sent = slot->obs_bytes_received = 0;
+	slot->obs_messages_sent = slot->obs_messages_received = 0;
+	slot->obs_since = 0;
+	slot->obs_seen = 0;
+	__atomic_store_n(&(slot->obs_local_len), 0, __ATOMIC_RELEASE);
+	pthread_mutex_unlock(&(slot->lock));
+}
+
+/** Note a new socket in the table
+ *  Sockets of other families than AF_INET/AF_INET6 only clear a stale entry
+ */
+static void st_track(int fd, int domain, int type, int protocol)
+{
+	struct st_slot *slot;
+
+	if (st_eligible(domain, type))
+	{
+		if ((slot = st_get_slot(fd, true)) == NULL)
+		{
+			DLOG(LIBINTENTS_NOISY_DEBUG1, "No slot for socket %d - not tracking it.\n", fd);
+			return;
+		}
+		DLOG(LIBINTENTS_NOISY_DEBUG1, "+++ Socket %d may get a muacc_context. +++\n", fd);
+		st_reset_slot(slot, domain, type, protocol);
+	}
+	else if ((slot = st_get_slot(fd, false)) != NULL &&
+		(__atomic_load_n(&(slot->ctx), __ATOMIC_ACQUIRE) != NULL || __atomic_load_n(&(slot->domain), __ATOMIC_ACQUIRE) != AF_UNSPEC))
+	{
+		/* the descriptor was closed without us noticing, e.g. by dup2() - forget what we knew */
+		st_reset_slot(slot, AF_UNSPEC, 0, 0);
+	}
+}
+
+/** Create the context of a socket - called with the lock of its slot held */
+static muacc_context_t *st_create_ctx(int fd, struct st_slot *slot)
+{
+	muacc_context_t *ctx;
+
+	DLOG(LIBINTENTS_NOISY_DEBUG2, "+++ Initializing muacc context for socket %d. +++\n", fd);
+	if ((ctx = malloc(sizeof(muacc_context_t))) == NULL || muacc_init_context(ctx) < 0)
+	{
+		fprintf(stderr,"Error initializing context for socket %d. \n", fd);
+		free(ctx);
+		return NULL;
+	}
+
+	/* what muacc_socket() would have noted */
+	ctx->ctx->calls_performed |= MUACC_SOCKET_CALLED;
+	ctx->ctx->domain = slot->domain;
+	ctx->ctx->type = slot->type;
+	ctx->ctx->protocol = slot->protocol;
+	ctx->ctx->sockfd = fd;
+	ctx->ctx->ctxino = _muacc_get_ctxino(fd);
+
+	DLOG(LIBINTENTS_NOISY_DEBUG1, "+++ Inserting socket %d and its muacc_context %p into socket table. +++\n", fd, (void *) ctx);
+	__atomic_store_n(&(slot->ctx), ctx, __ATOMIC_RELEASE);
+
+	return ctx;
+}
+
+/** Get a reference to the context of a socket
+ *  Has to be given back using st_put_ctx()
+ *  \param fd The socket
+ *  \param slot Buffer where the slot of the socket will be placed
+ *  \param create Create the context if the socket does not have one yet but may get one
+ *  \return The context, NULL if the socket has none
+ */
+static muacc_context_t *st_get_ctx(int fd, struct st_slot **slot, bool create)
+{
+	muacc_context_t *ctx;
+
+	/* fast path for sockets without a context */
+	if ((*slot = st_get_slot(fd, false)) == NULL)
+		return NULL;
+	if (__atomic_load_n(&((*slot)->ctx), __ATOMIC_ACQUIRE) == NULL &&
+		(!create || __atomic_load_n(&((*slot)->domain), __ATOMIC_ACQUIRE) == AF_UNSPEC))
+		return NULL;
+
+	pthread_mutex_lock(&((*slot)->lock));
+	if ((ctx = (*slot)->ctx) == NULL && create && (*slot)->domain != AF_UNSPEC)
+		ctx = st_create_ctx(fd, *slot);
+	if (ctx != NULL)
+		muacc_retain_context(ctx);
+	pthread_mutex_unlock(&((*slot)->lock));
+
+	return ctx;
+}
+
+/** Give back a reference to a context, freeing it if it was the last one */
+static void st_put_ctx(struct st_slot *slot, muacc_context_t *ctx)
+{
+	pthread_mutex_lock(&(slot->lock));
+	st_free_ctx(ctx);
+	pthread_mutex_unlock(&(slot->lock));
+}
+
+/** Drop a reference to a context - called with the lock of its slot held */
+static void st_free_ctx(muacc_context_t *ctx)
+{
+	int retval = 0;
+
+	if (ctx->ctx == NULL)
 	{
-		fprintf(stderr, "Cannot print NULL table.\n");
+		DLOG(LIBINTENTS_NOISY_DEBUG2, "Freeing empty muacc_context.\n");
+		free(ctx);
+	}
+	else if ((retval = muacc_release_context(ctx)) > 0)
+	{
+		DLOG(LIBINTENTS_NOISY_DEBUG2, "muacc_context %p still has %d references.\n", (void *) ctx, retval);
 	}
 	else
 	{
-		GList *keys = g_hash_table_get_keys(table);
-		if (keys == NULL)
+		DLOG(LIBINTENTS_NOISY_DEBUG1, "Freed muacc_context %p.\n", (void *) ctx);
+		free(ctx);
+	}
+}
+
+/** Current time in ms */
+static uint64_t obs_now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t) ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+/** Send a report to the MAM over the connection of the flusher */
+static bool obs_send(const struct sockaddr_storage *local, socklen_t local_len, const struct _muacc_flowstats *stats)
+{
+	DLOG(LIBINTENTS_NOISY_DEBUG2, "Reporting %llu bytes sent, %llu bytes received in %llu ms\n",
+			(unsigned long long) stats->bytes_sent, (unsigned long long) stats->bytes_received, (unsigned long long) stats->duration_ms);
+	return (muacc_report_flowstats_local(&obs_mamsock, (const struct sockaddr *) local, local_len, stats) == 0);
+}
+
+/** Report the counters of all changed sockets and closed ones to the MAM */
+static void *obs_flusher(void *arg)
+{
+	struct st_slot *slots;
+	struct st_slot *slot;
+	struct obs_report *reports;
+	struct obs_report *retry;
+	struct obs_report *r;
+	struct _muacc_flowstats stats;
+	struct sockaddr_storage local;
+	socklen_t local_len;
+	unsigned int gen;
+	uint64_t since;
+	bool report;
+
+	/* everything this thread does goes straight to the original functions */
+	call_in_progress = true;
+
+	for (;;)
+	{
+		sleep(OBS_FLUSH_INTERVAL);
+
+		pthread_mutex_lock(&obs_lock);
+		slots = obs_dirty_slots;
+		reports = obs_final_reports;
+		obs_dirty_slots = NULL;
+		obs_final_reports = NULL;
+		pthread_mutex_unlock(&obs_lock);
+
+		while ((slot = slots) != NULL)
 		{
-			printf("Table has no keys.\n");
+			slots = slot->obs_next;
+			__atomic_store_n(&(slot->obs_dirty), 0, __ATOMIC_RELEASE);
+
+			pthread_mutex_lock(&(slot->lock));
+			gen = slot->gen;
+			since = slot->obs_since;
+			if ((local_len = slot->obs_local_len) > 0)
+				memcpy(&local, &(slot->obs_local), local_len);
+			report = (local_len > 0 && obs_take(slot, &stats));
+			pthread_mutex_unlock(&(slot->lock));
+
+			if (report && !obs_send(&local, local_len, &stats))
+				obs_give_back(slot, gen, &stats, since);
 		}
-		else
+
+		retry = NULL;
+		while ((r = reports) != NULL)
 		{
-			printf("+++ Printing table +++\n");
-			for (GList *current = keys; current != NULL; current = current->next)
+			reports = r->next;
+			if (!obs_send(&(r->local), r->local_len, &(r->stats)) && ++(r->tries) < OBS_FINAL_TRIES)
 			{
-				int *item = current->data;
-				printf("Socket %d, muacc_context %p\n", *item, (int) g_hash_table_lookup(table, (const void *) item));
+				r->next = retry;
+				retry = r;
+				continue;
 			}
-			printf("+++ End of table +++\n");
+			free(r);
 		}
 
-		g_list_free(keys);
+		/* try again with the next round */
+		if (retry != NULL)
+		{
+			pthread_mutex_lock(&obs_lock);
+			for (r = retry; r->next != NULL; r = r->next)
+				;
+			r->next = obs_final_reports;
+			obs_final_reports = retry;
+			pthread_mutex_unlock(&obs_lock);
+		}
 	}
+
+	return NULL;
+}
+
+/** Start the flusher thread */
+static void obs_start(void)
+{
+	pthread_t thread;
+	pthread_attr_t attr;
+
+	pthread_attr_init(&attr);
+	pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+	if (pthread_create(&thread, &attr, &obs_flusher, NULL) != 0)
+		fprintf(stderr, "Could not start thread reporting observed traffic.\n");
+	pthread_attr_destroy(&attr);
 }
 
-void st_free_socknum(void* data)
+/** Add the batch of the calling thread to the counters in the socket table */
+static void obs_flush_batch(void)
 {
-	int *sock = data;
-	if ( sock == NULL )
+	struct obs_entry *e;
+	struct st_slot *slot;
+	uint64_t since;
+	int i;
+
+	for (i = 0; i < OBS_BATCH_SIZE; i++)
 	{
-		fprintf(stderr, "Cannot free NULL.\n");
+		e = &(obs_batch[i]);
+		if ((slot = e->slot) == NULL)
+			continue;
+		e->slot = NULL;
+
+		/* the socket has been closed in the meantime - its final report is on the way */
+		if (__atomic_load_n(&(slot->gen), __ATOMIC_ACQUIRE) != e->gen)
+			continue;
+
+		__atomic_add_fetch(&(slot->obs_bytes_sent), e->bytes_sent, __ATOMIC_RELAXED);
+		__atomic_add_fetch(&(slot->obs_bytes_received), e->bytes_received, __ATOMIC_RELAXED);
+		__atomic_add_fetch(&(slot->obs_messages_sent), e->messages_sent, __ATOMIC_RELAXED);
+		__atomic_add_fetch(&(slot->obs_messages_received), e->messages_received, __ATOMIC_RELAXED);
+		__atomic_store_n(&(slot->obs_seen), 1, __ATOMIC_RELEASE);
+
+		/* the first traffic starts the clock */
+		since = 0;
+		__atomic_compare_exchange_n(&(slot->obs_since), &since, obs_now(), false, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE);
+
+		/* the socket is bound by now - note the address the MAM accounts the flow to */
+		if (__atomic_load_n(&(slot->obs_local_len), __ATOMIC_ACQUIRE) == 0)
+		{
+			pthread_mutex_lock(&(slot->lock));
+			if (slot->gen == e->gen && slot->obs_local_len == 0)
+			{
+				socklen_t len = sizeof(struct sockaddr_storage);
+				if (getsockname(e->fd, (struct sockaddr *) &(slot->obs_local), &len) == 0)
+					__atomic_store_n(&(slot->obs_local_len), len, __ATOMIC_RELEASE);
+			}
+			pthread_mutex_unlock(&(slot->lock));
+		}
+
+		obs_mark_dirty(slot);
 	}
-	else
+}
+
+/** Put a slot on the list of the flusher unless it is there already */
+static void obs_mark_dirty(struct st_slot *slot)
+{
+	if (__atomic_exchange_n(&(slot->obs_dirty), 1, __ATOMIC_ACQ_REL) == 0)
 	{
-		free(sock);
+		pthread_once(&obs_once, &obs_start);
+		pthread_mutex_lock(&obs_lock);
+		slot->obs_next = obs_dirty_slots;
+		obs_dirty_slots = slot;
+		pthread_mutex_unlock(&obs_lock);
 	}
 }
 
-void st_free_ctx(void* data)
+/** Count traffic on a socket in the batch of the calling thread */
+static void obs_account(int fd, uint64_t bytes_sent, uint64_t bytes_received, uint64_t messages_sent, uint64_t messages_received)
 {
-	struct muacc_context *ctx = data;
-	int retval = 0;
+	struct st_slot *slot;
+	struct obs_entry *e = NULL;
+	unsigned int gen;
+	time_t now;
+	int i;
 
-	if (LIBINTENTS_NOISY_DEBUG1) muacc_print_context(ctx);
+	/* only sockets with a context are observed */
+	if ((slot = st_get_slot(fd, false)) == NULL || __atomic_load_n(&(slot->ctx), __ATOMIC_ACQUIRE) == NULL)
+		return;
+	gen = __atomic_load_n(&(slot->gen), __ATOMIC_ACQUIRE);
 
-	if ( ctx == NULL)
+	for (i = 0; i < OBS_BATCH_SIZE; i++)
 	{
-		fprintf(stderr,"Cannot free NULL muacc_context.\n");
+		if (obs_batch[i].slot == slot && obs_batch[i].gen == gen)
+		{
+			e = &(obs_batch[i]);
+			break;
+		}
+		if (e == NULL && obs_batch[i].slot == NULL)
+			e = &(obs_batch[i]);
 	}
-	else if ( ctx->ctx == NULL)
+	if (e == NULL)
 	{
-		DLOG(LIBINTENTS_NOISY_DEBUG2, "Freeing empty muacc_context.\n");
-		free(ctx);
+		/* batch full */
+		obs_flush_batch();
+		e = &(obs_batch[0]);
+	}
+	if (e->slot == NULL)
+	{
+		memset(e, 0x00, sizeof(struct obs_entry));
+		e->slot = slot;
+		e->gen = gen;
+		e->fd = fd;
+	}
+
+	e->bytes_sent += bytes_sent;
+	e->bytes_received += bytes_received;
+	e->messages_sent += messages_sent;
+	e->messages_received += messages_received;
+
+	if ((now = time(NULL)) != obs_batch_time)
+	{
+		obs_batch_time = now;
+		obs_flush_batch();
+	}
+}
+
+/** Move the unreported counters of a slot into a report - called with the lock of the slot held
+ *  \return Whether there is anything to report
+ */
+static bool obs_take(struct st_slot *slot, struct _muacc_flowstats *stats)
+{
+	uint64_t now = obs_now();
+
+	memset(stats, 0x00, sizeof(struct _muacc_flowstats));
+	stats->bytes_sent = __atomic_exchange_n(&(slot->obs_bytes_sent), 0, __ATOMIC_ACQ_REL);
+	stats->bytes_received = __atomic_exchange_n(&(slot->obs_bytes_received), 0, __ATOMIC_ACQ_REL);
+	stats->messages_sent = __atomic_exchange_n(&(slot->obs_messages_sent), 0, __ATOMIC_ACQ_REL);
+	stats->messages_received = __atomic_exchange_n(&(slot->obs_messages_received), 0, __ATOMIC_ACQ_REL);
+	if (slot->obs_since != 0 && now > slot->obs_since)
+		stats->duration_ms = now - slot->obs_since;
+	slot->obs_since = now;
+
+	return (stats->messages_sent > 0 || stats->messages_received > 0);
+}
+
+/** Add counters that could not be reported back to a slot, unless its socket has been closed since */
+static void obs_give_back(struct st_slot *slot, unsigned int gen, const struct _muacc_flowstats *stats, uint64_t since)
+{
+	pthread_mutex_lock(&(slot->lock));
+	if (slot->gen != gen)
+	{
+		pthread_mutex_unlock(&(slot->lock));
 		return;
 	}
-	else
+	__atomic_add_fetch(&(slot->obs_bytes_sent), stats->bytes_sent, __ATOMIC_RELAXED);
+	__atomic_add_fetch(&(slot->obs_bytes_received), stats->bytes_received, __ATOMIC_RELAXED);
+	__atomic_add_fetch(&(slot->obs_messages_sent), stats->messages_sent, __ATOMIC_RELAXED);
+	__atomic_add_fetch(&(slot->obs_messages_received), stats->messages_received, __ATOMIC_RELAXED);
+	slot->obs_since = since;
+	pthread_mutex_unlock(&(slot->lock));
+
+	obs_mark_dirty(slot);
+}
+
+/** Hand the final report of a closed socket to the flusher - called with the lock of the slot held */
+static void obs_final(struct st_slot *slot)
+{
+	struct obs_report *r;
+
+	if (slot->obs_local_len == 0)
 	{
-		if ((retval = muacc_release_context(ctx)) > 0)
-		{
-			fprintf(stderr, "Could not free muacc context: Usage counter still at %d\n", retval);
-		}
+		DLOG(LIBINTENTS_NOISY_DEBUG1, "Local address of closed socket unknown - not reporting it.\n");
+		return;
 	}
+	if ((r = malloc(sizeof(struct obs_report))) == NULL)
+		return;
+	memcpy(&(r->local), &(slot->obs_local), slot->obs_local_len);
+	r->local_len = slot->obs_local_len;
+	r->tries = 0;
+	obs_take(slot, &(r->stats));
+	r->stats.flags = MUACC_FLOWSTATS_FINAL;
+
+	pthread_once(&obs_once, &obs_start);
+	pthread_mutex_lock(&obs_lock);
+	r->next = obs_final_reports;
+	obs_final_reports = r;
+	pthread_mutex_unlock(&obs_lock);
+}
+
+/** Read the configuration from the environment when the library is loaded */
+static void libintents_init(void) __attribute__((constructor));
+static void libintents_init(void)
+{
+	const char *observe = getenv("LIBINTENTS_OBSERVE");
+
+	obs_enabled = (observe != NULL && strcmp(observe, "0") != 0);
 }
@@ -86,7 +86,9 @@ const int SCTP_RCV_PORT_OFFSET = 2;   const int SCTP_RCV_PORT_SIZE = 2;
 const int SCTP_DATA_HEADER = 16;
 const int SCTP_TYPE_OFFSET = 0;       const int SCTP_TYPE_SIZE = 1;     //Data chunk type = 0
 const int SCTP_LENGTH_OFFSET = 3;     const int SCTP_LENGTH_SIZE = 1;   //So one may skip to next chunk
-const int SCTP_TSN_OFFSET = 4;        const int SCTP_TSN_SIZE = 4;
+const int SCTP_TSN_OFFSET = 4;        const int SCTP_TSN_SIZE = 4;      //Cumulative TSN ack in SACK chunks
+const int SCTP_GAPS_OFFSET = 12;      const int SCTP_GAPS_SIZE = 2;     //Number of gap ack blocks in SACK chunks
+const int SCTP_DUPS_OFFSET = 14;      const int SCTP_DUPS_SIZE = 2;     //Number of duplicate TSNs in SACK chunks
 
 const int IP_VER_ST_BIT = 4;
 const int IP_VER_LN_BIT = 4;
@@ -130,6 +132,8 @@ int st_sctp_rcv_port() { return ip_end() + SCTP_RCV_PORT_OFFSET;   }    int ln_s
 int st_sctp_type()     { return sctp_jump() + SCTP_TYPE_OFFSET;    }    int ln_sctp_type()     { return SCTP_TYPE_SIZE;     } 
 int st_sctp_length()   { return sctp_jump() + SCTP_LENGTH_OFFSET;  }    int ln_sctp_length()   { return SCTP_LENGTH_SIZE;   }
 int st_sctp_tsn()      { return sctp_jump() + SCTP_TSN_OFFSET;     }    int ln_sctp_tsn()      { return SCTP_TSN_SIZE;      }
+int st_sctp_gaps()     { return sctp_jump() + SCTP_GAPS_OFFSET;    }    int ln_sctp_gaps()     { return SCTP_GAPS_SIZE;     }
+int st_sctp_dups()     { return sctp_jump() + SCTP_DUPS_OFFSET;    }    int ln_sctp_dups()     { return SCTP_DUPS_SIZE;     }
 
 //Get-functions for TCP header fields
 int st_tcp_snd_port()  { return ip_end() + TCP_SND_PORT_OFFSET;    }    int ln_tcp_snd_port() { return TCP_SND_PORT_SIZE;   }  
@@ -332,6 +336,8 @@ header_field get_sctp_rcv_port (pkt_ptr pkt)  { return parse_header_field(pkt, s
 header_field get_sctp_type     (pkt_ptr pkt)  { return parse_header_field(pkt, st_sctp_type(),     ln_sctp_type());     }
 header_field get_sctp_length   (pkt_ptr pkt)  { return parse_header_field(pkt, st_sctp_length(),   ln_sctp_length());   }
 header_field get_sctp_tsn      (pkt_ptr pkt)  { return parse_header_field(pkt, st_sctp_tsn(),      ln_sctp_tsn());      }
+header_field get_sctp_gaps     (pkt_ptr pkt)  { return parse_header_field(pkt, st_sctp_gaps(),     ln_sctp_gaps());     }
+header_field get_sctp_dups     (pkt_ptr pkt)  { return parse_header_field(pkt, st_sctp_dups(),     ln_sctp_dups());     }
 
 header_field get_tcp_snd_port  (pkt_ptr pkt)  { return parse_header_field(pkt, st_tcp_snd_port(),  ln_tcp_snd_port());  }
 header_field get_tcp_rcv_port  (pkt_ptr pkt)  { return parse_header_field(pkt, st_tcp_rcv_port(),  ln_tcp_rcv_port());  }
@@ -360,6 +366,8 @@ unsigned int get_num_ipv6_rcv_addr (pkt_ptr pkt)  { return parse_number_from_cha
 unsigned int get_num_sctp_length   (pkt_ptr pkt)  { return parse_number_from_char(&get_sctp_length(pkt).field_data[0],   0, 7  ); }
 unsigned int get_num_sctp_type     (pkt_ptr pkt)  { return parse_number_from_char(&get_sctp_type(pkt).field_data[0],     0, 7  ); }
 unsigned int get_num_sctp_tsn      (pkt_ptr pkt)  { return parse_number_from_char(&get_sctp_tsn(pkt).field_data[0],      0, 31 ); } 
+unsigned int get_num_sctp_gaps     (pkt_ptr pkt)  { return parse_number_from_char(&get_sctp_gaps(pkt).field_data[0],     0, 15 ); }
+unsigned int get_num_sctp_dups     (pkt_ptr pkt)  { return parse_number_from_char(&get_sctp_dups(pkt).field_data[0],     0, 15 ); }
 unsigned int get_num_sctp_snd_port (pkt_ptr pkt)  { return parse_number_from_char(&get_sctp_snd_port(pkt).field_data[0], 0, 15 ); }
 unsigned int get_num_sctp_rcv_port (pkt_ptr pkt)  { return parse_number_from_char(&get_sctp_rcv_port(pkt).field_data[0], 0, 15 ); }
 
@@ -367,8 +375,16 @@ unsigned int get_num_tcp_snd_port  (pkt_ptr pkt)  { return parse_number_from_cha
 unsigned int get_num_tcp_rcv_port  (pkt_ptr pkt)  { return parse_number_from_char(&get_tcp_rcv_port(pkt).field_data[0],  0, 15 ); }
 unsigned int get_num_tcp_seq_nr    (pkt_ptr pkt)  { return parse_number_from_char(&get_tcp_seq_nr(pkt).field_data[0],    0, 31 ); }
 unsigned int get_num_tcp_ack_nr    (pkt_ptr pkt)  { return parse_number_from_char(&get_tcp_ack_nr(pkt).field_data[0],    0, 31 ); }
-unsigned int get_num_tcp_length    (pkt_ptr pkt)  { return parse_number_from_char(&get_tcp_length(pkt).field_data[0],    0, 3  )*4; } //words to bytes, hence *4
-unsigned int get_num_tcp_is_ack    (pkt_ptr pkt)  { return parse_number_from_char(&get_tcp_is_ack(pkt).field_data[0],    3, 3  ); }
+unsigned int get_num_tcp_length    (pkt_ptr pkt)  { return parse_number_from_char(&get_tcp_length(pkt).field_data[0],    4, 7  )*4; } //data offset is the upper nibble, words to bytes, hence *4
+unsigned int get_num_tcp_is_ack    (pkt_ptr pkt)  { return parse_number_from_char(&get_tcp_is_ack(pkt).field_data[0],    4, 4  ); }
+
+unsigned int get_num_tcp_payload_size(pkt_ptr pkt, packet_info_ptr info)
+{
+	//IPv4 counts its header in the total length, IPv6 does not
+	int ip_payload = (info->ip_version == PROT_IPV4) ? (int)get_num_ipv4_length(pkt) - IP_HEADER : (int)get_num_ipv6_length(pkt);
+	int size = ip_payload - (int)get_num_tcp_length(pkt);
+	return (size > 0) ? size : 0;
+}
 
 /**********************************************************************/
 /* - SCTP chunk handling-                                             */
@@ -442,6 +458,11 @@ void gather_tcp_header_info(pkt_ptr pkt, packet_info_ptr info)
 	info->rcv_port           = get_num_tcp_rcv_port(pkt);                                //Adding rcv port          
 	info->chunk->layer4_type = get_num_tcp_is_ack(pkt);                                  //Adding is ack
 	info->chunk->seq_nr      = get_num_tcp_seq_nr(pkt);                                  //Adding seq nr
+	info->chunk->ack_nr      = 0;
+	info->chunk->packet_size = get_num_tcp_payload_size(pkt, info);                      //Adding payload size
+	info->chunk->retain_diff = 0;
+	info->chunk->gap_blocks  = 0;
+	info->chunk->dup_tsns    = 0;
 	info->chunk->next_chunk  = NULL;
 	if(info->chunk->layer4_type) { info->chunk->ack_nr = get_num_tcp_ack_nr(pkt); }      //Adding ack nr if packet is ack
 	if(TRACE_PARSE)       { log_trace("LEAVING: gather_tcp_header_info");  }  	
@@ -456,6 +477,8 @@ chunk_info_ptr gather_sctp_chunk_header_info(pkt_ptr pkt)
 	chunk->ack_nr        = get_num_sctp_tsn(pkt);
 	chunk->packet_size   = get_num_sctp_length(pkt);
 	chunk->retain_diff   = 0;
+	chunk->gap_blocks    = (chunk->layer4_type == SCTP_SACK_CHUNK) ? get_num_sctp_gaps(pkt) : 0;
+	chunk->dup_tsns      = (chunk->layer4_type == SCTP_SACK_CHUNK) ? get_num_sctp_dups(pkt) : 0;
 	chunk->next_chunk    = NULL;
 	if(TRACE_PARSE)       { log_trace("LEAVING: gather_sctp_chunk_header_info");  }
 	return chunk;
@@ -25,8 +25,10 @@ typedef struct chunk_info {
 	unsigned short int layer4_type;     //Parsed in gather_tcp_header_info() or gather_sctp_chunk_header_info()
 	unsigned int seq_nr;                //Parsed in gather_tcp_header_info() or gather_sctp_chunk_header_info()
 	unsigned int ack_nr;                //Parsed in gather_tcp_header_info() or gather_sctp_chunk_header_info()
-	unsigned int packet_size;
+	unsigned int packet_size;           //TCP payload size or SCTP chunk length
 	unsigned int retain_diff;
+	unsigned int gap_blocks;            //Parsed in gather_sctp_chunk_header_info() for SACK chunks
+	unsigned int dup_tsns;              //Parsed in gather_sctp_chunk_header_info() for SACK chunks
 	struct chunk_info* next_chunk;
 } chunk_info;
 
@@ -21,6 +21,9 @@
 #include <event2/bufferevent.h>
 #include <event2/dns.h>
 
+#include <stdint.h>
+#include <pthread.h>
+
 #include <uuid/uuid.h>
 
 #include <ltdl.h>
@@ -38,9 +41,17 @@ typedef struct request_context {
 	unsigned int		policy_calls_performed; /**< Policy functions that we have already called */
 	struct _muacc_ctx	*ctx;		/**< internal struct with relevant socket context data */
 	struct socketlist	*sockets;	/**< list of existing sockets for socketchoose */
+	int					sockets_unknown; /**< number of referenced sockets that were not found in the socket context cache */
 	struct mam_context	*mctx;		/**< pointer to current mam context */
+	struct mam_worker	*worker;	/**< worker whose event loop serves this client, NULL for the main event loop */
+	struct request_context *next_free; /**< next entry while on the free list of the mam context */
+	struct _muacc_flowstats flowstats; /**< counters of a flowstats report */
+	uint64_t			received;	/**< time the request has been read in microseconds, 0 while there is none */
 } request_context_t;
 
+/** Maximum number of released request contexts kept for reuse */
+#define MAM_REQUEST_FREELIST_MAX 256
+
 #define MAM_POLICY_RESOLVE_CALLED 0x001
 #define MAM_POLICY_CONNECT_CALLED 0x002
 #define MAM_POLICY_SOCKETCONNECT_CALLED 0x004
@@ -74,11 +85,19 @@ typedef struct src_prefix_list {
 	struct sockaddr			*if_netmask;		/**< Netmask of interface */
 	socklen_t				if_netmask_len;		/**< Length of netmask */
 	struct evdns_base 		*evdns_base; 		/**< DNS base to do look ups for that prefix */
+	struct evdns_base		**worker_evdns_bases; /**< DNS bases for that prefix on the event base of each worker, NULL terminated */
 	GHashTable 				*policy_set_dict; 	/**< dictionary for policy configuration */
 	void					*policy_info;		/**< Policy-internal data structure for additional information */
 	GHashTable				*measure_dict;		/**< Dictionary for measurement data of this interface */
+	int						refcount;			/**< References held by the prefix list and by pending work, see mam_prefix_ref() */
 } src_prefix_list_t;
 
+/** Node of the longest-prefix-match tries over the source prefixes */
+struct mam_prefix_node {
+	struct mam_prefix_node	*child[2];			/**< Subtries for the next bit of the address being 0 or 1 */
+	GSList					*prefixes;			/**< Prefixes whose network ends at this node, in list order */
+};
+
 /** list of interfacses */
 typedef struct iface_list {
 	struct iface_list 		*next;				/**< Next item in list */
@@ -86,6 +105,71 @@ typedef struct iface_list {
 	GHashTable 				*policy_set_dict; 	/**< dictionary for policy configuration */
 } iface_list_t;
 
+/** Worker thread that runs its own event loop for a share of the clients
+ *
+ *  Policies that declare themselves thread-safe (see policy.h) get their callbacks
+ *  invoked from the worker threads with the worker's event base. A policy can keep
+ *  per-worker state, e.g. caches or its own resolvers, in policy_data: it is set up
+ *  by the policy's optional init_worker() and torn down by cleanup_worker(), and it
+ *  is only ever touched from that worker's thread in between.
+ */
+typedef struct mam_worker {
+	int						id;					/**< Number of the worker */
+	pthread_t				thread;				/**< Thread running the event loop */
+	struct event_base		*ev_base;			/**< Event base of this worker */
+	struct evdns_base		*evdns_base;		/**< DNS base bound to the worker's event base */
+	int						notify_fd[2];		/**< Pipe used by the acceptor to hand over client sockets */
+	struct event			*notify_event;		/**< Read event on notify_fd[0] */
+	void					*policy_data;		/**< Per-worker policy context */
+	struct mam_context		*mctx;				/**< Pointer to the mam context */
+} mam_worker_t;
+
+/** Number of shards the client table is split into */
+#define MAM_CLIENT_SHARDS 16
+
+/** Shard of the table of clients connected to the MAM */
+struct mam_client_shard {
+	pthread_mutex_t			lock;				/**< Protects clients and their socket tables */
+	GHashTable				*clients;			/**< client_list_t entries keyed by their id */
+};
+
+/** Default lifetime of a cached DNS answer in seconds */
+#ifndef MAM_DNS_TTL
+#define MAM_DNS_TTL 60
+#endif
+
+/** Lifetime of a cached DNS error in seconds */
+#ifndef MAM_DNS_NEG_TTL
+#define MAM_DNS_NEG_TTL 10
+#endif
+
+/** Time in seconds an expired DNS answer is still served while it is being revalidated */
+#ifndef MAM_DNS_STALE
+#define MAM_DNS_STALE 30
+#endif
+
+/** Maximum number of entries in the DNS cache */
+#ifndef MAM_DNS_CACHE_MAX
+#define MAM_DNS_CACHE_MAX 1024
+#endif
+
+/** Events reported to the prefix hook of the MAM context
+ *
+ *  Changes of the prefix list are reported in batches: MAM_PREFIX_UPDATE_START
+ *  precedes the first change, MAM_PREFIX_UPDATE_DONE follows the last one. Both
+ *  are reported with pfx set to NULL.
+ */
+#define MAM_PREFIX_UPDATE_START	0	/**< The prefix list is about to change */
+#define MAM_PREFIX_ADDED		1	/**< The prefix has just been added to the list */
+#define MAM_PREFIX_REMOVED		2	/**< The prefix is about to be removed from the list - it is freed once the last reference is dropped */
+#define MAM_PREFIX_CHANGED		3	/**< Addresses or interface flags of the prefix have changed */
+#define MAM_PREFIX_UPDATE_DONE	4	/**< All changes of the batch have been applied */
+
+struct mam_context;
+
+/** Hook invoked for changes of the prefix list, called with the policy_lock held for writing */
+typedef void (*mam_prefix_hook_t)(struct mam_context *ctx, struct src_prefix_list *pfx, int event);
+
 /** Context of the MAM */
 typedef struct mam_context {
 	int						usage;			/**< Reference counter */
@@ -94,15 +178,35 @@ typedef struct mam_context {
 	struct event_base 		*ev_base;			/**< Libevent Event Base */
 	struct evdns_base 		*evdns_default_base; /**< DNS base to do look ups if all other fails */
 	GHashTable 				*policy_set_dict; /**< dictionary for policy configuration */
-	GSList					*clients;  /**< list of all applications that are connected to the MAM */
+	struct mam_client_shard	clients[MAM_CLIENT_SHARDS]; /**< all applications that are connected to the MAM, sharded by id */
+	GHashTable				*socket_ctxs; /**< socket contexts learned from socketchoose requests, keyed by struct _muacc_ctxref */
+	pthread_mutex_t			socket_ctxs_lock; /**< Protects socket_ctxs */
+	struct mam_worker		*workers;		/**< Worker event loops, NULL if all clients are served by ev_base */
+	int						num_workers;	/**< Number of workers */
+	int						policy_threadsafe; /**< Policy may be called from several workers at once */
+	pthread_rwlock_t		policy_lock;	/**< Held for reading (thread-safe policy) or writing (others) around policy calls */
+	request_context_t		*free_requests;	/**< Released request contexts kept for reuse */
+	int						num_free_requests; /**< Length of free_requests */
+	pthread_mutex_t			free_requests_lock; /**< Protects free_requests */
+	GHashTable				*dns_cache;		/**< DNS answers keyed by name, service, hints and source prefix */
+	pthread_mutex_t			dns_cache_lock;	/**< Protects dns_cache */
+	pthread_mutex_t			measure_lock;	/**< Protects the measure_dicts of the prefixes */
+	mam_prefix_hook_t		prefix_hook;	/**< Invoked for changes of the prefix list, or NULL */
+	int						prefixes_updating; /**< A batch of prefix changes has been started */
+	struct mam_prefix_node	*prefix_trie4;	/**< Longest-prefix-match trie over the IPv4 prefixes */
+	struct mam_prefix_node	*prefix_trie6;	/**< Longest-prefix-match trie over the IPv6 prefixes */
+	GHashTable				*prefixes_by_name; /**< GSList of the prefixes of each interface, keyed by name */
+	GSList					*enabled4;		/**< Enabled IPv4 prefixes, in list order */
+	GSList					*enabled6;		/**< Enabled IPv6 prefixes, in list order */
+	void					*netlink_sock;	/**< Netlink socket receiving interface and address changes */
+	struct event			*netlink_event;	/**< Read event of netlink_sock */
 } mam_context_t;
 
-/** List of clients connected to the MAM */
+/** Client connected to the MAM */
 typedef struct _client_list {
-	int						client_sk;
-	uuid_t					id;
-	GSList					*sockets;
-	void (*callback_function)(GSList*);
+	int						client_sk;		/**< Socket of the client's connection */
+	uuid_t					id;				/**< Identifier of the client, also key in the client table */
+	GHashTable				*sockets;		/**< socket_list_t entries of the client, keyed by socket */
 } client_list_t;
 
 /** List of sockets opened by a client application */
@@ -134,22 +238,151 @@ void mam_print_context(mam_context_t *ctx);
 /** Print contents of a request context: associated _muacc_ctx and mam_context */
 void mam_print_request_context(request_context_t *ctx);
 
-/** Release request context */
+/** Get a request context for a new request, reusing a released one if possible */
+request_context_t *mam_create_request_context(struct mam_context *mctx);
+
+/** Drop everything a request context holds from its last request, so it can take the next one
+ *  Buffers, MAM context and worker are kept, so are the metrics of a request in flight */
+void mam_reset_request_context(request_context_t *ctx);
+
+/** Release request context - it is put on the free list of its mam context for reuse */
 void mam_release_request_context(request_context_t *ctx);
 
-/** update the source prefix list within the mam_context using getifaddrs()*/
+/** Add a client to the client table of the MAM */
+client_list_t *mam_add_client(struct mam_context *ctx, int client_sk, uuid_t id);
+
+/** Remember a socket of the client with the given id */
+int mam_add_client_socket(struct mam_context *ctx, uuid_t id, int sk);
+
+/** Remove a client and all its sockets from the client table of the MAM */
+void mam_remove_client(struct mam_context *ctx, uuid_t id);
+
+/** Resolve a name and service through the DNS cache of the MAM
+ *
+ *  Answers are shared among all policies and workers for the same name, service,
+ *  hints and source prefix. Concurrent lookups for the same key are coalesced into
+ *  one query, errors are cached for MAM_DNS_NEG_TTL seconds and expired answers are
+ *  served for another MAM_DNS_STALE seconds while they are being revalidated.
+ *
+ *  The callback is always invoked from base after this function returned. It owns
+ *  the answer and has to free it using freeaddrinfo(). If the DNS base goes away
+ *  while the lookup is in flight, it is invoked with EVUTIL_EAI_CANCEL.
+ *
+ *  \return 0 if the callback will be invoked, -1 otherwise
+ */
+int mam_dns_getaddrinfo(
+	struct mam_context *mctx,			/**< [in] MAM context holding the cache */
+	struct event_base *base,			/**< [in] event base to invoke the callback from */
+	struct evdns_base *dns_base,		/**< [in] DNS base to use if a lookup is needed */
+	struct src_prefix_list *pfx,		/**< [in] source prefix the lookup is done for, or NULL */
+	const char *name,					/**< [in] host name to resolve */
+	const char *service,				/**< [in] service to resolve */
+	const struct evutil_addrinfo *hints,/**< [in] hints for the lookup, or NULL */
+	evdns_getaddrinfo_cb cb,			/**< [in] callback to invoke with the answer */
+	void *arg							/**< [in] argument for the callback */
+);
+
+/** Drop all answers from the DNS cache */
+void mam_dns_flush(struct mam_context *mctx);
+
+/** update the source prefix list within the mam_context using getifaddrs()
+ *  Prefixes that are still present are kept, including their policy data */
 int update_src_prefix_list (mam_context_t *ctx);
 
+/** Add an address to the prefix list, creating a new prefix if none matches
+ *  Reports MAM_PREFIX_ADDED or MAM_PREFIX_CHANGED to the prefix hook
+ *
+ *  \return 0 on success, -1 otherwise
+ */
+int mam_prefix_add_address (
+	mam_context_t *ctx,				/**< [in] MAM context holding the prefix list */
+	const char *if_name,			/**< [in] name of the interface of the address */
+	unsigned int if_flags,			/**< [in] flags of the interface */
+	int family,						/**< [in] address family, AF_INET or AF_INET6 */
+	struct sockaddr *addr,			/**< [in] address to add */
+	struct sockaddr *mask			/**< [in] netmask of the address */
+);
+
+/** Remove an address from the prefix list, removing its prefix if it was the last one
+ *  Reports MAM_PREFIX_REMOVED or MAM_PREFIX_CHANGED to the prefix hook
+ *
+ *  \return 0 if the address was found, -1 otherwise
+ */
+int mam_prefix_remove_address (
+	mam_context_t *ctx,				/**< [in] MAM context holding the prefix list */
+	const char *if_name,			/**< [in] name of the interface of the address – NULL is a wildcard */
+	const struct sockaddr *addr		/**< [in] address to remove */
+);
+
+/** Update the interface flags of all prefixes of an interface
+ *  Prefixes of interfaces that are no longer up are removed
+ */
+void mam_prefix_set_if_flags (
+	mam_context_t *ctx,				/**< [in] MAM context holding the prefix list */
+	const char *if_name,			/**< [in] name of the interface */
+	unsigned int if_flags			/**< [in] new flags of the interface */
+);
+
+/** Add the addresses of a single interface that has come up to the prefix list
+ *  Unlike update_src_prefix_list(), prefixes of other interfaces are left alone
+ *
+ *  \return 0 on success, -1 otherwise
+ */
+int mam_prefix_scan_interface (
+	mam_context_t *ctx,				/**< [in] MAM context holding the prefix list */
+	const char *if_name				/**< [in] name of the interface */
+);
+
+/** Keep a prefix from being freed while it is used outside of the policy lock,
+ *  e.g. across an asynchronous lookup. A prefix that is removed from the list
+ *  meanwhile stays valid, but is no longer found.
+ */
+void mam_prefix_ref (struct src_prefix_list *pfx);
+
+/** Drop a reference taken with mam_prefix_ref(), freeing the prefix if it was the last one */
+void mam_prefix_unref (struct src_prefix_list *pfx);
+
+/** Finish a batch of prefix changes, reporting MAM_PREFIX_UPDATE_DONE if anything changed */
+void mam_prefix_update_done (mam_context_t *ctx);
+
+/** Subscribe to interface and address changes of the kernel (rtnetlink)
+ *  and apply them to the prefix list from the event base of the MAM context
+ *
+ *  \return 0 on success, -1 if changes are not tracked (e.g. built without libnl)
+ */
+int mam_netlink_start (mam_context_t *ctx);
+
+/** Stop tracking interface and address changes */
+void mam_netlink_stop (mam_context_t *ctx);
+
 /** get the src_prefix_list for a specific interface or prefix
-  */
+ *  If an address is given, returns the matching prefix with the longest network
+ *  containing it, otherwise the first matching prefix of the list
+ */
 struct src_prefix_list *lookup_source_prefix (
- 	struct src_prefix_list *spfxl,	/**< [in] list element to start scanning */
+	mam_context_t *ctx,				/**< [in] MAM context holding the prefix list */
 	unsigned int pfx_flags,			/**< [in] prefix flags that have to be set */
 	const char *if_name,            /**< [in] interface name to look for – NULL ist a wildcard */
-	int family,                     /**< [in] address family to look for */
-	const struct sockaddr *addr     /**< [in] prefix to scan for (uses mask from spfxl)  – NULL ist a wildcard */
+	int family,                     /**< [in] address family to look for, or AF_UNSPEC */
+	const struct sockaddr *addr     /**< [in] address the prefix has to contain – NULL ist a wildcard */
 );
 
+/** get the prefixes of an interface (do not modify or free the list) */
+GSList *mam_prefixes_by_name(mam_context_t *ctx, const char *if_name);
+
+/** get the enabled prefixes of an address family (do not modify or free the list) */
+GSList *mam_enabled_prefixes(mam_context_t *ctx, int family);
+
+/** get the DNS base of a prefix to be used from the event base of a worker,
+ *  or from the event base of the MAM context if worker is NULL
+ *
+ *  \return the DNS base, or NULL if no resolvconf has been configured for the prefix
+ */
+struct evdns_base *mam_prefix_dns_base(struct src_prefix_list *pfx, mam_worker_t *worker);
+
+/** rebuild the lists of enabled prefixes after the pfx_flags have been changed */
+void mam_prefix_index_update_flags(mam_context_t *ctx);
+
 /** Helper function for finding a specific prefix from the prefix list
  *  Returns 0 for the matching element, 1 otherwise
  *  To be called from g_slist_find_custom() */
@@ -173,6 +406,9 @@ void filter_prefix_list (
 /** config read function */
 void mam_read_config(int config_fd, char **p_file_out, struct mam_context *ctx);
 
+/** Apply the prefix statements of the config file to some (new) prefixes, parsing it once */
+void mam_configure_prefixes(int config_fd, struct mam_context *ctx, GSList *pfxs);
+
 /* helper functions */
 #include "mam_util.h"
 
@@ -12,6 +12,7 @@
     #include <arpa/inet.h>
 	 
 	#include "mam.h"
+	#include "mam_util.h"
 	
 	extern int yylex (void);
 	extern void yyset_debug(int);
@@ -24,9 +25,11 @@
 	char *p_file = NULL;				/**< policy share library to load */
 	struct mam_context *yymctx;			/**< mam context to feed */
 	GHashTable *l_set_dict = NULL;		/**< per block set config holder */
-	struct evdns_base *l_evdns_base = NULL;	/**< use a special resolvconf for that prefix */
+	char *l_resolv_conf = NULL;			/**< use a special resolvconf for that prefix */
 	unsigned int pfx_flags_set = 0;		/**< flags to set */
 	unsigned int pfx_flags_values = 0;	/**< values of the flags to set */
+	GHashTable *l_policy_dict = NULL;	/**< holder for the policy set config */
+	GSList *l_only_pfxs = NULL;			/**< only configure these prefixes, NULL for all */
 	
 	char addr_str[INET6_ADDRSTRLEN];	/** string for debug / error printing */
 	
@@ -35,6 +38,16 @@
 		
 	char *idup(int i);
 	char *ddup(double i);
+
+	/** Find the prefix a prefix statement applies to */
+	static struct src_prefix_list *find_prefix(struct src_prefix_model *m)
+	{
+		struct src_prefix_list *spl = lookup_source_prefix(yymctx, PFX_ANY, NULL, m->family, m->addr);
+
+		if (l_only_pfxs != NULL && g_slist_find(l_only_pfxs, spl) == NULL)
+			return NULL;
+		return spl;
+	}
 %}
 
 %token SEMICOLON OBRACE CBRACE EQUAL SLASH
@@ -91,22 +104,22 @@ policy_statements:
 
 policy_set:
 	SETTOK name name
-	{g_hash_table_replace(yymctx->policy_set_dict, $2, $3);}
+	{g_hash_table_replace(l_policy_dict, $2, $3);}
 	|
 	SETTOK name EQUAL name
-	{g_hash_table_replace(yymctx->policy_set_dict, $2, $4);}
+	{g_hash_table_replace(l_policy_dict, $2, $4);}
 	|
 	SETTOK name INTNUMBER
-	{g_hash_table_replace(yymctx->policy_set_dict, $2, idup($3));}
+	{g_hash_table_replace(l_policy_dict, $2, idup($3));}
 	|
 	SETTOK name DOUBLENUMBER
-	{g_hash_table_replace(yymctx->policy_set_dict, $2, ddup($3));}
+	{g_hash_table_replace(l_policy_dict, $2, ddup($3));}
 	|
 	SETTOK name EQUAL INTNUMBER
-	{g_hash_table_replace(yymctx->policy_set_dict, $2, idup($4));}
+	{g_hash_table_replace(l_policy_dict, $2, idup($4));}
 	|
 	SETTOK name EQUAL DOUBLENUMBER
-	{g_hash_table_replace(yymctx->policy_set_dict, $2, ddup($4));}
+	{g_hash_table_replace(l_policy_dict, $2, ddup($4));}
 
 	;
 
@@ -128,12 +141,12 @@ prefix_block:
 		struct sockaddr_in *sa = &($2);
 		inet_ntop(AF_INET, &(sa->sin_addr), addr_str, sizeof(addr_str));
 		struct src_prefix_model m = {PFX_ANY, NULL, AF_INET, (struct sockaddr *) sa, sizeof(struct sockaddr_in)};
-		GSList *listelement = g_slist_find_custom(yymctx->prefixes, (gconstpointer) &m, &compare_src_prefix);
-		if (listelement != NULL){
-			struct src_prefix_list *spl = listelement->data;
+		struct src_prefix_list *spl = find_prefix(&m);
+		if (spl != NULL){
 			// set the dns base and set dictionary
 			spl->policy_set_dict = l_set_dict;
-			spl->evdns_base = l_evdns_base;
+			if (l_resolv_conf != NULL)
+				_mam_prefix_set_resolv_conf(yymctx, spl, l_resolv_conf);
 			// flag them as configured
 			spl->pfx_flags &= (pfx_flags_set ^ spl->pfx_flags);
 			spl->pfx_flags |= pfx_flags_values;			
@@ -143,13 +156,12 @@ prefix_block:
 			DLOG(MAM_CONFIGP_NOISY_DEBUG, "prefix %s/%d configured\n", addr_str, $4);
 		} else {
 			DLOG(MAM_CONFIGP_NOISY_DEBUG, "prefix %s/%d configured but not on any interface\n", addr_str, $4);
-			if (l_evdns_base != NULL)
-				evdns_base_free(l_evdns_base, 0);
 			g_hash_table_destroy(l_set_dict);
 		}
 		pfx_flags_set = 0;
 		pfx_flags_values = 0;
-		l_evdns_base = NULL;
+		free(l_resolv_conf);
+		l_resolv_conf = NULL;
 		l_set_dict = g_hash_table_new_full(&g_str_hash, &g_str_equal, &free, &free);
 	}
 	|
@@ -159,12 +171,12 @@ prefix_block:
 		struct sockaddr_in6 *sa = &($2);
 		inet_ntop(AF_INET6, &(sa->sin6_addr), addr_str, sizeof(addr_str));
 		struct src_prefix_model m = {PFX_ANY, NULL, AF_INET6, (struct sockaddr *) sa, sizeof(struct sockaddr_in6)};
-		GSList *listelement = g_slist_find_custom(yymctx->prefixes, (gconstpointer) &m, &compare_src_prefix);
-		if (listelement != NULL){
-			struct src_prefix_list *spl = listelement->data;
+		struct src_prefix_list *spl = find_prefix(&m);
+		if (spl != NULL){
 			// set the dns base and set dictionary
 			spl->policy_set_dict = l_set_dict;
-			spl->evdns_base = l_evdns_base;
+			if (l_resolv_conf != NULL)
+				_mam_prefix_set_resolv_conf(yymctx, spl, l_resolv_conf);
 			// flag them as configured
 			spl->pfx_flags &= (pfx_flags_set ^ spl->pfx_flags);
 			spl->pfx_flags |= pfx_flags_values;			
@@ -174,13 +186,12 @@ prefix_block:
 			DLOG(MAM_CONFIGP_NOISY_DEBUG, "prefix %s/%d configured\n", addr_str, $4);
 		} else {
 			DLOG(MAM_CONFIGP_NOISY_DEBUG, "prefix %s/%d configured but not on any interface\n", addr_str, $4);
-			if(l_evdns_base != NULL)
-				evdns_base_free(l_evdns_base, 0);
 			g_hash_table_destroy(l_set_dict);
 		}
 		pfx_flags_set = 0;
 		pfx_flags_values = 0;
-		l_evdns_base = NULL;
+		free(l_resolv_conf);
+		l_resolv_conf = NULL;
 		l_set_dict = g_hash_table_new_full(&g_str_hash, &g_str_equal, &free, &free);
 	}
 	;
@@ -225,8 +236,9 @@ prefix_statement:
 	|
 	RESOLVCONFTOK QNAME 
 	{
-		if((l_evdns_base = evdns_base_new(yymctx->ev_base, 0)) != NULL)
-			evdns_base_resolv_conf_parse(l_evdns_base, DNS_OPTIONS_ALL, $2);
+		/* the DNS bases are set up once the prefix is known */
+		free(l_resolv_conf);
+		l_resolv_conf = $2;
 	}
 	;
 	
@@ -242,31 +254,79 @@ int yywrap()
         return 1;
 }
 
-void mam_read_config(int config_fd, char **p_file_out, struct mam_context *ctx)
+/** Forget the configuration of a prefix that has been kept from an earlier scan
+ *  To be called from g_slist_foreach()
+ */
+static void reset_prefix_config(gpointer elem, gpointer data)
 {
+	struct src_prefix_list *spl = elem;
+
+	if(spl->policy_set_dict != NULL)
+		g_hash_table_destroy(spl->policy_set_dict);
+	spl->policy_set_dict = NULL;
+	/* cache entries waiting for these resolvers start over with the new ones */
+	_mam_prefix_free_dns(spl, 1);
+	spl->pfx_flags &= ~(PFX_ENABLED|PFX_CONF|PFX_CONF_PFX|PFX_CONF_IF);
+}
 
+/** Parse the config file, feeding the globals set up by the caller */
+static void parse_config(int config_fd)
+{
 	/* open file */
 	int config_fd2 = dup(config_fd);
 	yyin = fdopen(config_fd2, "r");
 	fseek(yyin, 0, SEEK_SET);
 
+	l_set_dict = g_hash_table_new_full(&g_str_hash, &g_str_equal, &free, &free);
+
+	/* do parse */
+    yyparse();
+
+	/* clean up */
+	fclose(yyin);
+	g_hash_table_destroy(l_set_dict);
+}
+
+void mam_read_config(int config_fd, char **p_file_out, struct mam_context *ctx)
+{
 	/* prepair globals used during parsing */
 	yymctx = ctx;
+	l_only_pfxs = NULL;
+	g_slist_foreach(ctx->prefixes, &reset_prefix_config, NULL);
 	if(yymctx->policy_set_dict != NULL)
 		g_hash_table_destroy(yymctx->policy_set_dict);
 	yymctx->policy_set_dict = g_hash_table_new_full(&g_str_hash, &g_str_equal, &free, &free);
-	l_set_dict = g_hash_table_new_full(&g_str_hash, &g_str_equal, &free, &free);
+	l_policy_dict = yymctx->policy_set_dict;
 
-	/* do parse */
-    yyparse();
+	parse_config(config_fd);
 	
+	mam_prefix_index_update_flags(ctx);
+
 	if(p_file != NULL)
 		*p_file_out = p_file;
+}
 
-	/* clean up */
-	fclose(yyin);
-	g_hash_table_destroy(l_set_dict);
+void mam_configure_prefixes(int config_fd, struct mam_context *ctx, GSList *pfxs)
+{
+	char *p_file_loaded = p_file;
+
+	if (pfxs == NULL)
+		return;
+
+	/* leave the policy and its configuration alone */
+	yymctx = ctx;
+	l_only_pfxs = pfxs;
+	l_policy_dict = g_hash_table_new_full(&g_str_hash, &g_str_equal, &free, &free);
+
+	parse_config(config_fd);
+	mam_prefix_index_update_flags(ctx);
 
+	g_hash_table_destroy(l_policy_dict);
+	l_policy_dict = NULL;
+	l_only_pfxs = NULL;
+	if(p_file != p_file_loaded)
+		free(p_file);
+	p_file = p_file_loaded;
 }
 
 char *idup (int i)
@@ -14,6 +14,7 @@
 
 #include "mam.h"
 #include "mam_util.h"
+#include "mam_metrics.h"
 
 #define BUF_LEN 4096
 
@@ -43,8 +44,22 @@ int mam_init_context(struct mam_context *ctx)
 {
 	DLOG(MAM_CTX_NOISY_DEBUG, "initializing MAM context %p\n", (void *) ctx);
 
+	int i;
+
 	ctx->usage = 1;
-	//TODO
+
+	for (i = 0; i < MAM_CLIENT_SHARDS; i++)
+	{
+		pthread_mutex_init(&(ctx->clients[i].lock), NULL);
+		ctx->clients[i].clients = g_hash_table_new_full(&_mam_uuid_hash, &_mam_uuid_equal, NULL, &_free_client_list);
+	}
+	pthread_mutex_init(&(ctx->socket_ctxs_lock), NULL);
+	pthread_rwlock_init(&(ctx->policy_lock), NULL);
+	pthread_mutex_init(&(ctx->free_requests_lock), NULL);
+	ctx->dns_cache = g_hash_table_new_full(&g_str_hash, &g_str_equal, NULL, &_mam_dns_free_entry);
+	pthread_mutex_init(&(ctx->dns_cache_lock), NULL);
+	pthread_mutex_init(&(ctx->measure_lock), NULL);
+	ctx->prefixes_by_name = g_hash_table_new_full(&g_str_hash, &g_str_equal, &g_free, NULL);
 
 	return 0;
 }
@@ -127,11 +142,51 @@ void mam_print_request_context(request_context_t *ctx)
 
 }
 
-void mam_release_request_context(request_context_t *ctx)
+request_context_t *mam_create_request_context(struct mam_context *mctx)
 {
-	/* clean up old _muacc_ctx */
-	_muacc_free_ctx(ctx->ctx);
+	request_context_t *ctx = NULL;
+
+	pthread_mutex_lock(&(mctx->free_requests_lock));
+	if (mctx->free_requests != NULL)
+	{
+		ctx = mctx->free_requests;
+		mctx->free_requests = ctx->next_free;
+		mctx->num_free_requests--;
+	}
+	pthread_mutex_unlock(&(mctx->free_requests_lock));
 
+	if (ctx == NULL)
+	{
+		/* free list is empty - allocate a new one */
+		if ((ctx = malloc(sizeof(request_context_t))) == NULL)
+		{
+			perror("request_context malloc failed");
+			return NULL;
+		}
+		if ((ctx->ctx = _muacc_create_ctx()) == NULL)
+		{
+			free(ctx);
+			return NULL;
+		}
+	}
+
+	ctx->in = NULL;
+	ctx->out = NULL;
+	ctx->action = 0;
+	ctx->policy_calls_performed = 0;
+	ctx->sockets = NULL;
+	ctx->sockets_unknown = 0;
+	memset(&(ctx->flowstats), 0x00, sizeof(struct _muacc_flowstats));
+	ctx->mctx = mctx;
+	ctx->worker = NULL;
+	ctx->next_free = NULL;
+	ctx->received = 0;
+
+	return ctx;
+}
+
+void mam_reset_request_context(request_context_t *ctx)
+{
 	/* clean up socket list */
 	while (ctx->sockets != NULL)
 	{
@@ -142,6 +197,98 @@ void mam_release_request_context(request_context_t *ctx)
 		free(socklist);
 	}
 
+	_muacc_clear_ctx(ctx->ctx);
+	ctx->action = 0;
+	ctx->policy_calls_performed = 0;
+	ctx->sockets_unknown = 0;
+	memset(&(ctx->flowstats), 0x00, sizeof(struct _muacc_flowstats));
+}
+
+void mam_release_request_context(request_context_t *ctx)
+{
+	struct mam_context *mctx = ctx->mctx;
+
+	/* the request has been answered or dropped */
+	mam_metrics_request_done(ctx);
+
+	/* keep the request context and its _muacc_ctx for the next request */
+	mam_reset_request_context(ctx);
+
+	if (mctx != NULL)
+	{
+		pthread_mutex_lock(&(mctx->free_requests_lock));
+		if (mctx->num_free_requests < MAM_REQUEST_FREELIST_MAX)
+		{
+			ctx->next_free = mctx->free_requests;
+			mctx->free_requests = ctx;
+			mctx->num_free_requests++;
+			ctx = NULL;
+		}
+		pthread_mutex_unlock(&(mctx->free_requests_lock));
+
+		if (ctx == NULL)
+			return;
+	}
+
+	/* clean up old _muacc_ctx */
+	_muacc_free_ctx(ctx->ctx);
 	free(ctx);
 }
 
+
+/** Pick the shard of the client table a client id belongs to */
+static struct mam_client_shard *_mam_client_shard(struct mam_context *ctx, const unsigned char *id)
+{
+	return &(ctx->clients[id[0] % MAM_CLIENT_SHARDS]);
+}
+
+client_list_t *mam_add_client(struct mam_context *ctx, int client_sk, uuid_t id)
+{
+	struct mam_client_shard *shard = _mam_client_shard(ctx, id);
+	client_list_t *client;
+
+	if ((client = malloc(sizeof(client_list_t))) == NULL)
+	{
+		perror("client_list malloc failed");
+		return NULL;
+	}
+	client->client_sk = client_sk;
+	uuid_copy(client->id, id);
+	client->sockets = g_hash_table_new_full(&g_int_hash, &g_int_equal, NULL, &_free_socket_list);
+
+	pthread_mutex_lock(&(shard->lock));
+	g_hash_table_replace(shard->clients, client->id, client);
+	pthread_mutex_unlock(&(shard->lock));
+
+	DLOG(MAM_CTX_NOISY_DEBUG, "added client %d\n", client_sk);
+	return client;
+}
+
+int mam_add_client_socket(struct mam_context *ctx, uuid_t id, int sk)
+{
+	struct mam_client_shard *shard = _mam_client_shard(ctx, id);
+	client_list_t *client;
+	socket_list_t *socket;
+	int ret = -1;
+
+	pthread_mutex_lock(&(shard->lock));
+	if ((client = g_hash_table_lookup(shard->clients, id)) != NULL
+		&& (socket = malloc(sizeof(socket_list_t))) != NULL)
+	{
+		socket->sk = sk;
+		g_hash_table_replace(client->sockets, &(socket->sk), socket);
+		ret = 0;
+	}
+	pthread_mutex_unlock(&(shard->lock));
+
+	return ret;
+}
+
+void mam_remove_client(struct mam_context *ctx, uuid_t id)
+{
+	struct mam_client_shard *shard = _mam_client_shard(ctx, id);
+
+	pthread_mutex_lock(&(shard->lock));
+	g_hash_table_remove(shard->clients, id);
+	pthread_mutex_unlock(&(shard->lock));
+}
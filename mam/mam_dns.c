@@ -0,0 +1,365 @@
+/** \file mam_dns.c
+ *  \brief DNS answer cache of the MAM, shared by all policies and prefixes
+ *
+ *  \copyright Copyright 2013-2015 Philipp Schmidt, Theresa Enghardt, and Mirko Palmer.
+ *  All rights reserved. This project is released under the New BSD License.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include <event2/event.h>
+#include <event2/dns.h>
+#include <event2/util.h>
+
+#include "clib/dlog.h"
+#include "clib/muacc_util.h"
+
+#include "mam.h"
+#include "mam_util.h"
+#include "mam_metrics.h"
+
+#ifndef MAM_DNS_NOISY_DEBUG0
+#define MAM_DNS_NOISY_DEBUG0 0
+#endif
+
+#ifndef MAM_DNS_NOISY_DEBUG1
+#define MAM_DNS_NOISY_DEBUG1 0
+#endif
+
+#ifndef MAM_DNS_NOISY_DEBUG2
+#define MAM_DNS_NOISY_DEBUG2 0
+#endif
+
+/** Callback waiting for the answer of a cache entry */
+struct mam_dns_waiter {
+	evdns_getaddrinfo_cb	cb;			/**< Callback to invoke */
+	void					*arg;		/**< Argument for the callback */
+	struct event_base		*base;		/**< Event base the callback is invoked from */
+	struct mam_context		*mctx;		/**< MAM context whose policy lock is held around the callback */
+	struct src_prefix_list	*pfx;		/**< Prefix the lookup is done for, referenced until the callback returned */
+	int						errcode;	/**< Error code delivered to the callback */
+	struct evutil_addrinfo	*res;		/**< Copy of the answer delivered to the callback */
+};
+
+/** Entry of the DNS cache */
+struct mam_dns_entry {
+	char					*key;		/**< Key of this entry in the cache */
+	struct mam_context		*mctx;		/**< MAM context that holds the cache */
+	struct src_prefix_list	*pfx;		/**< Prefix the lookup is done for, referenced as the key contains its address */
+	char					*name;		/**< Host name to resolve */
+	char					*service;	/**< Service to resolve */
+	struct evutil_addrinfo	hints;		/**< Hints used for the lookup */
+	int						valid;		/**< Entry holds an answer, possibly a negative or stale one */
+	int						pending;	/**< A lookup for this entry is in flight */
+	int						errcode;	/**< Error of the last lookup, 0 for a positive answer */
+	struct evutil_addrinfo	*res;		/**< Answer of the last lookup */
+	time_t					expires;	/**< Time the answer expires */
+	uint64_t				started;	/**< Time the lookup in flight has been started in microseconds */
+	GSList					*waiters;	/**< Callbacks waiting for the lookup in flight */
+};
+
+static char *_mam_dns_make_key(struct src_prefix_list *pfx, const char *name, const char *service, const struct evutil_addrinfo *hints)
+{
+	return g_strdup_printf("%s|%s|%d|%d|%d|%d|%p",
+			(name == NULL ? "" : name),
+			(service == NULL ? "" : service),
+			(hints == NULL ? AF_UNSPEC : hints->ai_family),
+			(hints == NULL ? 0 : hints->ai_socktype),
+			(hints == NULL ? 0 : hints->ai_protocol),
+			(hints == NULL ? 0 : hints->ai_flags),
+			(void *) pfx);
+}
+
+/** Free a waiter, including an answer that has not been handed to its callback */
+static void _mam_dns_free_waiter(gpointer data)
+{
+	struct mam_dns_waiter *waiter = data;
+
+	if (waiter->res != NULL)
+		freeaddrinfo(waiter->res);
+	if (waiter->pfx != NULL)
+		mam_prefix_unref(waiter->pfx);
+	free(waiter);
+}
+
+void _mam_dns_free_entry(gpointer data)
+{
+	struct mam_dns_entry *entry = data;
+
+	if (entry->res != NULL)
+		evutil_freeaddrinfo(entry->res);
+	g_slist_free_full(entry->waiters, &_mam_dns_free_waiter);
+	if (entry->pfx != NULL)
+		mam_prefix_unref(entry->pfx);
+	free(entry->name);
+	free(entry->service);
+	g_free(entry->key);
+	free(entry);
+}
+
+/** Remove entries that are neither fresh nor usable as stale answers
+ *  To be called from g_hash_table_foreach_remove()
+ */
+static gboolean _mam_dns_entry_expired(gpointer key, gpointer value, gpointer data)
+{
+	struct mam_dns_entry *entry = value;
+	time_t now = *((time_t *) data);
+
+	return (!entry->pending && now >= entry->expires + MAM_DNS_STALE);
+}
+
+/** Remove entries that are not waiting for an answer
+ *  To be called from g_hash_table_foreach_remove()
+ */
+static gboolean _mam_dns_entry_idle(gpointer key, gpointer value, gpointer data)
+{
+	return !((struct mam_dns_entry *) value)->pending;
+}
+
+/** Make room for a new entry in the cache - called with the cache lock held */
+static void _mam_dns_evict(struct mam_context *mctx, time_t now)
+{
+	GHashTableIter iter;
+	gpointer key, value;
+
+	g_hash_table_foreach_remove(mctx->dns_cache, &_mam_dns_entry_expired, &now);
+
+	/* still full - drop any entry that is not waiting for an answer */
+	g_hash_table_iter_init(&iter, mctx->dns_cache);
+	while (g_hash_table_size(mctx->dns_cache) >= MAM_DNS_CACHE_MAX && g_hash_table_iter_next(&iter, &key, &value))
+	{
+		if (!((struct mam_dns_entry *) value)->pending)
+			g_hash_table_iter_remove(&iter);
+	}
+}
+
+/** Invoke the callback of a waiter from its event base
+ *  The callbacks are those of the policy, so they are called with the policy lock held
+ */
+static void _mam_dns_deliver_cb(evutil_socket_t fd, short what, void *arg)
+{
+	struct mam_dns_waiter *waiter = arg;
+
+	_mam_policy_lock(waiter->mctx);
+	waiter->cb(waiter->errcode, waiter->res, waiter->arg);
+	_mam_policy_unlock(waiter->mctx);
+	waiter->res = NULL;
+	_mam_dns_free_waiter(waiter);
+}
+
+/** Hand a copy of the entry's answer to a waiter - called with the cache lock held */
+static void _mam_dns_deliver(struct mam_dns_entry *entry, struct mam_dns_waiter *waiter)
+{
+	struct timeval now = {0, 0};
+
+	waiter->errcode = entry->errcode;
+	waiter->res = NULL;
+	if (entry->errcode == 0)
+	{
+		if ((waiter->res = _muacc_clone_addrinfo(entry->res)) == NULL)
+			waiter->errcode = EVUTIL_EAI_MEMORY;
+	}
+
+	/* never call back before the caller returned - the callback may release its request */
+	if (event_base_once(waiter->base, -1, EV_TIMEOUT, &_mam_dns_deliver_cb, waiter, &now) != 0)
+	{
+		DLOG(MAM_DNS_NOISY_DEBUG1, "could not schedule callback - dropping answer for %s\n", entry->key);
+		_mam_dns_free_waiter(waiter);
+	}
+}
+
+/** Hand the answer of the entry to all its waiters - called with the cache lock held */
+static void _mam_dns_deliver_waiters(struct mam_dns_entry *entry)
+{
+	GSList *waiters = entry->waiters;
+
+	entry->waiters = NULL;
+	while (waiters != NULL)
+	{
+		_mam_dns_deliver(entry, waiters->data);
+		waiters = g_slist_delete_link(waiters, waiters);
+	}
+}
+
+/** Store the answer of a lookup and hand it to all waiters */
+static void _mam_dns_result(int errcode, struct evutil_addrinfo *res, void *arg)
+{
+	struct mam_dns_entry *entry = arg;
+	struct mam_context *mctx = entry->mctx;
+	time_t now = time(NULL);
+
+	pthread_mutex_lock(&(mctx->dns_cache_lock));
+
+	mam_metrics_dns_lookup(entry->started, errcode);
+	entry->pending = 0;
+	if (errcode == EVUTIL_EAI_CANCEL)
+	{
+		/* the DNS base went away - fail the waiters, but do not cache that */
+		DLOG(MAM_DNS_NOISY_DEBUG1, "lookup for %s cancelled - dropping entry\n", entry->key);
+		if (res != NULL)
+			evutil_freeaddrinfo(res);
+		entry->errcode = errcode;
+
+		_mam_dns_deliver_waiters(entry);
+		g_hash_table_remove(mctx->dns_cache, entry->key);
+		pthread_mutex_unlock(&(mctx->dns_cache_lock));
+		return;
+	}
+	else if (errcode == 0 && res != NULL)
+	{
+		DLOG(MAM_DNS_NOISY_DEBUG2, "caching answer for %s\n", entry->key);
+		if (entry->res != NULL)
+			evutil_freeaddrinfo(entry->res);
+		entry->res = res;
+		entry->errcode = 0;
+		entry->expires = now + MAM_DNS_TTL;
+	}
+	else if ((errcode == EVUTIL_EAI_AGAIN || errcode == EVUTIL_EAI_FAIL) && entry->valid && entry->errcode == 0 && now < entry->expires + MAM_DNS_STALE)
+	{
+		/* resolver trouble - keep serving the stale answer we have */
+		DLOG(MAM_DNS_NOISY_DEBUG1, "revalidating %s failed: %s - keeping stale answer\n", entry->key, evutil_gai_strerror(errcode));
+		if (res != NULL)
+			evutil_freeaddrinfo(res);
+	}
+	else
+	{
+		DLOG(MAM_DNS_NOISY_DEBUG2, "caching negative answer for %s: %s\n", entry->key, evutil_gai_strerror(errcode));
+		if (res != NULL)
+			evutil_freeaddrinfo(res);
+		if (entry->res != NULL)
+			evutil_freeaddrinfo(entry->res);
+		entry->res = NULL;
+		entry->errcode = (errcode != 0 ? errcode : EVUTIL_EAI_FAIL);
+		entry->expires = now + MAM_DNS_NEG_TTL;
+	}
+	entry->valid = 1;
+
+	_mam_dns_deliver_waiters(entry);
+
+	pthread_mutex_unlock(&(mctx->dns_cache_lock));
+}
+
+int mam_dns_getaddrinfo(
+	struct mam_context *mctx,
+	struct event_base *base,
+	struct evdns_base *dns_base,
+	struct src_prefix_list *pfx,
+	const char *name,
+	const char *service,
+	const struct evutil_addrinfo *hints,
+	evdns_getaddrinfo_cb cb,
+	void *arg)
+{
+	struct mam_dns_entry *entry;
+	struct mam_dns_waiter *waiter;
+	time_t now = time(NULL);
+	char *key;
+	int lookup = 0;
+
+	if (mctx == NULL || base == NULL || dns_base == NULL || cb == NULL || (name == NULL && service == NULL))
+		return -1;
+
+	if ((waiter = malloc(sizeof(struct mam_dns_waiter))) == NULL)
+		return -1;
+	waiter->cb = cb;
+	waiter->arg = arg;
+	waiter->base = base;
+	waiter->mctx = mctx;
+	waiter->pfx = pfx;
+	waiter->res = NULL;
+	if (pfx != NULL)
+		mam_prefix_ref(pfx);
+
+	key = _mam_dns_make_key(pfx, name, service, hints);
+
+	pthread_mutex_lock(&(mctx->dns_cache_lock));
+
+	if ((entry = g_hash_table_lookup(mctx->dns_cache, key)) == NULL)
+	{
+		if (g_hash_table_size(mctx->dns_cache) >= MAM_DNS_CACHE_MAX)
+			_mam_dns_evict(mctx, now);
+
+		if ((entry = malloc(sizeof(struct mam_dns_entry))) == NULL)
+			goto mam_dns_getaddrinfo_err;
+		memset(entry, 0x00, sizeof(struct mam_dns_entry));
+		entry->key = key;
+		entry->mctx = mctx;
+		entry->pfx = pfx;
+		if (pfx != NULL)
+			mam_prefix_ref(pfx);
+		entry->name = _muacc_clone_string(name);
+		entry->service = _muacc_clone_string(service);
+		if (hints != NULL)
+		{
+			entry->hints.ai_family = hints->ai_family;
+			entry->hints.ai_socktype = hints->ai_socktype;
+			entry->hints.ai_protocol = hints->ai_protocol;
+			entry->hints.ai_flags = hints->ai_flags;
+		}
+		else
+		{
+			entry->hints.ai_family = AF_UNSPEC;
+		}
+		g_hash_table_insert(mctx->dns_cache, entry->key, entry);
+	}
+	else
+	{
+		g_free(key);
+	}
+
+	if (entry->valid && now < entry->expires)
+	{
+		/* fresh answer */
+		DLOG(MAM_DNS_NOISY_DEBUG2, "cache hit for %s\n", entry->key);
+		mam_metrics_dns_cache(MAM_METRICS_DNS_HIT);
+		_mam_dns_deliver(entry, waiter);
+	}
+	else if (entry->valid && entry->errcode == 0 && now < entry->expires + MAM_DNS_STALE)
+	{
+		/* stale answer - serve it and revalidate in the background */
+		DLOG(MAM_DNS_NOISY_DEBUG2, "serving stale answer for %s\n", entry->key);
+		mam_metrics_dns_cache(MAM_METRICS_DNS_STALE);
+		_mam_dns_deliver(entry, waiter);
+		lookup = !entry->pending;
+		entry->pending = 1;
+	}
+	else
+	{
+		/* no usable answer - wait for the lookup, starting it unless one is in flight */
+		DLOG(MAM_DNS_NOISY_DEBUG2, "cache miss for %s%s\n", entry->key, (entry->pending ? " - lookup already in flight" : ""));
+		mam_metrics_dns_cache(MAM_METRICS_DNS_MISS);
+		entry->waiters = g_slist_prepend(entry->waiters, waiter);
+		lookup = !entry->pending;
+		entry->pending = 1;
+	}
+
+	if (lookup)
+		entry->started = mam_metrics_now();
+
+	pthread_mutex_unlock(&(mctx->dns_cache_lock));
+
+	/* evdns may answer right away, invoking _mam_dns_result - do not hold the lock here */
+	if (lookup)
+	{
+		DLOG(MAM_DNS_NOISY_DEBUG1, "looking up %s\n", entry->key);
+		evdns_getaddrinfo(dns_base, entry->name, entry->service, &(entry->hints), &_mam_dns_result, entry);
+	}
+
+	return 0;
+
+	mam_dns_getaddrinfo_err:
+	pthread_mutex_unlock(&(mctx->dns_cache_lock));
+	g_free(key);
+	_mam_dns_free_waiter(waiter);
+	return -1;
+}
+
+void mam_dns_flush(struct mam_context *mctx)
+{
+	pthread_mutex_lock(&(mctx->dns_cache_lock));
+	g_hash_table_foreach_remove(mctx->dns_cache, &_mam_dns_entry_idle, NULL);
+	pthread_mutex_unlock(&(mctx->dns_cache_lock));
+}
@@ -0,0 +1,501 @@
+/** \file mam_history.c
+ *  \brief Persistent history of the path measurements of the MAM
+ *
+ *  Records are appended to the mapped file by writing the record first and
+ *  then increasing num_records in the header, so a crash never leaves a
+ *  half-written record behind. Compaction writes a new file next to the old
+ *  one and renames it over the old one. It runs in a thread of its own, so the
+ *  main loop does not wait for the file to be written and synced. Meanwhile,
+ *  the old mapping is only read, and new records are held back until the
+ *  compacted file has been mapped.
+ *
+ *  \copyright Copyright 2013-2015 Philipp Schmidt, Theresa Enghardt, and Mirko Palmer.
+ *  All rights reserved. This project is released under the New BSD License.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <time.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+
+#include <glib.h>
+
+#include "clib/dlog.h"
+
+#include "mam.h"
+#include "mam_history.h"
+
+#ifndef MAM_HISTORY_NOISY_DEBUG0
+#define MAM_HISTORY_NOISY_DEBUG0 0
+#endif
+
+#ifndef MAM_HISTORY_NOISY_DEBUG1
+#define MAM_HISTORY_NOISY_DEBUG1 0
+#endif
+
+#define MAM_HISTORY_MAGIC "MAMHIST"
+#define MAM_HISTORY_VERSION 1
+
+/** Number of measurements in a record */
+#define MAM_HISTORY_VALUES 8
+
+/** Keys of the measure_dict stored in a record - all of them doubles */
+static const char *history_keys[MAM_HISTORY_VALUES] = {
+	"srtt_mean", "srtt_median", "srtt_p90", "srtt_p99",
+	"rttvar_mean", "rttvar_p99", "retrans_rate", "delivery_rate_mean"
+};
+
+struct mam_history_header {
+	char		magic[8];
+	uint32_t	version;
+	uint32_t	record_size;				/**< Size of a record, to detect layout changes */
+	uint64_t	capacity;					/**< Records the file has room for */
+	uint64_t	num_records;				/**< Records written */
+};
+
+/** Summary of the measurements of a prefix pair at a point in time */
+struct mam_history_record {
+	uint64_t	timestamp;					/**< Seconds since the epoch */
+	uint8_t		family;						/**< Address family of the prefixes */
+	uint8_t		src_len;					/**< Length of the source prefix */
+	uint8_t		dst_len;					/**< Length of the destination prefix, 0 for any destination */
+	uint8_t		reserved;
+	uint32_t	valid;						/**< Bit i is set if values[i] holds a measurement */
+	uint8_t		src[16];					/**< Network of the source prefix */
+	uint8_t		dst[16];					/**< Network of the destination prefix */
+	double		values[MAM_HISTORY_VALUES];	/**< Measurements, see history_keys */
+};
+
+static int history_fd = -1;
+static char *history_path = NULL;
+static struct mam_history_header *history = NULL;
+static size_t history_size = 0;
+
+static pthread_t compact_thread;
+static int compact_running = 0;			/**< A compaction thread has been started and not been joined yet */
+static int compact_done = 0;			/**< Set by the compaction thread when it is done */
+static int compact_fd = -1;				/**< Compacted history file, -1 if compaction failed */
+static time_t compact_now;				/**< Time the compaction has been started */
+static GArray *history_pending = NULL;	/**< Records to append once compaction is done */
+
+#define HISTORY_RECORDS(h) ((struct mam_history_record *) ((h) + 1))
+
+static size_t _history_file_size(uint64_t capacity)
+{
+	return sizeof(struct mam_history_header) + capacity * sizeof(struct mam_history_record);
+}
+
+/** Map the history file, initializing it if it is empty or not a history file */
+static int _history_map(int fd)
+{
+	struct stat st;
+	struct mam_history_header *h;
+	size_t size;
+
+	if (fstat(fd, &st) != 0)
+		return -1;
+	size = st.st_size;
+
+	if (size < sizeof(struct mam_history_header) || size < _history_file_size(MAM_HISTORY_CAPACITY))
+	{
+		size = _history_file_size(MAM_HISTORY_CAPACITY);
+		if (ftruncate(fd, size) != 0)
+			return -1;
+	}
+
+	if ((h = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0)) == MAP_FAILED)
+		return -1;
+
+	if (memcmp(h->magic, MAM_HISTORY_MAGIC, sizeof(h->magic)) != 0 || h->version != MAM_HISTORY_VERSION ||
+		h->record_size != sizeof(struct mam_history_record) ||
+		h->capacity == 0 || _history_file_size(h->capacity) > size || h->num_records > h->capacity)
+	{
+		DLOG(MAM_HISTORY_NOISY_DEBUG0, "history file is empty or unusable - starting over\n");
+		memset(h, 0x00, sizeof(struct mam_history_header));
+		memcpy(h->magic, MAM_HISTORY_MAGIC, sizeof(h->magic));
+		h->version = MAM_HISTORY_VERSION;
+		h->record_size = sizeof(struct mam_history_record);
+		h->capacity = (size - sizeof(struct mam_history_header)) / sizeof(struct mam_history_record);
+	}
+
+	history_fd = fd;
+	history = h;
+	history_size = size;
+	return 0;
+}
+
+/** Unmap and close the history file, writing it back first if sync is set */
+static void _history_unmap(int sync)
+{
+	if (history != NULL)
+	{
+		if (sync)
+			msync(history, history_size, MS_SYNC);
+		munmap(history, history_size);
+	}
+	if (history_fd >= 0)
+		close(history_fd);
+	history = NULL;
+	history_size = 0;
+	history_fd = -1;
+}
+
+int mam_history_open(const char *path)
+{
+	int fd;
+
+	if (history != NULL || path == NULL)
+		return -1;
+
+	if ((fd = open(path, O_RDWR | O_CREAT | O_CLOEXEC, 0644)) < 0)
+	{
+		DLOG(MAM_HISTORY_NOISY_DEBUG0, "opening history file %s failed: %s\n", path, strerror(errno));
+		return -1;
+	}
+
+	if (_history_map(fd) != 0)
+	{
+		DLOG(MAM_HISTORY_NOISY_DEBUG0, "mapping history file %s failed: %s\n", path, strerror(errno));
+		close(fd);
+		return -1;
+	}
+	history_path = strdup(path);
+	history_pending = g_array_new(FALSE, FALSE, sizeof(struct mam_history_record));
+
+	DLOG(MAM_HISTORY_NOISY_DEBUG0, "loaded %llu history records from %s\n", (unsigned long long) history->num_records, path);
+	return 0;
+}
+
+/** Fill in the family and source network of a record from a prefix */
+static int _history_set_source(struct mam_history_record *rec, const struct src_prefix_list *pfx)
+{
+	const unsigned char *addr, *mask;
+	int len, i;
+
+	if (pfx->if_addrs == NULL || pfx->if_netmask == NULL)
+		return -1;
+
+	if (pfx->family == AF_INET)
+	{
+		addr = (const unsigned char *) &(((const struct sockaddr_in *) pfx->if_addrs->addr)->sin_addr);
+		mask = (const unsigned char *) &(((const struct sockaddr_in *) pfx->if_netmask)->sin_addr);
+		len = sizeof(struct in_addr);
+	}
+	else if (pfx->family == AF_INET6)
+	{
+		addr = (const unsigned char *) &(((const struct sockaddr_in6 *) pfx->if_addrs->addr)->sin6_addr);
+		mask = (const unsigned char *) &(((const struct sockaddr_in6 *) pfx->if_netmask)->sin6_addr);
+		len = sizeof(struct in6_addr);
+	}
+	else
+	{
+		return -1;
+	}
+
+	rec->family = pfx->family;
+	rec->src_len = 0;
+	for (i = 0; i < len; i++)
+	{
+		rec->src[i] = addr[i] & mask[i];
+		rec->src_len += __builtin_popcount(mask[i]);
+	}
+	return 0;
+}
+
+/** Check whether two records are about the same prefix pair */
+static int _history_same_key(const struct mam_history_record *a, const struct mam_history_record *b)
+{
+	return (a->family == b->family && a->src_len == b->src_len && a->dst_len == b->dst_len &&
+			memcmp(a->src, b->src, sizeof(a->src)) == 0 && memcmp(a->dst, b->dst, sizeof(a->dst)) == 0);
+}
+
+void mam_history_seed(void *pfx, void *data)
+{
+	struct src_prefix_list *prefix = pfx;
+	mam_context_t *ctx = data;
+	struct mam_history_record key, *rec = NULL;
+	uint64_t i, *ts;
+	time_t now = time(NULL);
+	int j;
+
+	if (history == NULL || prefix == NULL || ctx == NULL || prefix->measure_dict == NULL)
+		return;
+
+	memset(&key, 0x00, sizeof(key));
+	if (_history_set_source(&key, prefix) != 0)
+		return;
+
+	/* the latest record is the last one */
+	for (i = history->num_records; i > 0; i--)
+	{
+		if (_history_same_key(&key, &(HISTORY_RECORDS(history)[i - 1])))
+		{
+			rec = &(HISTORY_RECORDS(history)[i - 1]);
+			break;
+		}
+	}
+	if (rec == NULL || rec->timestamp + MAM_HISTORY_MAX_AGE < (uint64_t) now)
+		return;
+
+	pthread_mutex_lock(&(ctx->measure_lock));
+	if (g_hash_table_lookup(prefix->measure_dict, "srtt_mean") == NULL && (ts = malloc(sizeof(uint64_t))) != NULL)
+	{
+		for (j = 0; j < MAM_HISTORY_VALUES; j++)
+		{
+			double *v;
+
+			if ((rec->valid & (1 << j)) == 0 || (v = malloc(sizeof(double))) == NULL)
+				continue;
+			*v = rec->values[j];
+			g_hash_table_replace(prefix->measure_dict, (gpointer) history_keys[j], v);
+		}
+		*ts = rec->timestamp;
+		g_hash_table_replace(prefix->measure_dict, "history_ts", ts);
+
+		DLOG(MAM_HISTORY_NOISY_DEBUG1, "seeded prefix of interface %s with measurements from %llu s ago\n",
+				prefix->if_name, (unsigned long long) (now - rec->timestamp));
+	}
+	pthread_mutex_unlock(&(ctx->measure_lock));
+}
+
+/** Rewrite the history file, keeping recent records and the latest older record of each prefix pair
+ *  Runs in the compaction thread and only reads the current mapping.
+ *
+ *  \return the file descriptor of the compacted file, -1 on error
+ */
+static int _history_compact(time_t now)
+{
+	struct mam_history_record *records = HISTORY_RECORDS(history);
+	struct mam_history_record *kept;
+	struct mam_history_header h;
+	GHashTable *seen;
+	uint64_t i, num_kept = 0;
+	char *tmp_path = NULL;
+	int fd = -1;
+
+	if (history_path == NULL || (kept = malloc(history->num_records * sizeof(struct mam_history_record))) == NULL)
+		return -1;
+	seen = g_hash_table_new_full(&g_bytes_hash, &g_bytes_equal, (GDestroyNotify) &g_bytes_unref, NULL);
+
+	/* newest first, so the first record seen of a prefix pair is its latest one */
+	for (i = history->num_records; i > 0; i--)
+	{
+		struct mam_history_record *rec = &(records[i - 1]);
+		uint64_t age = (rec->timestamp < (uint64_t) now ? now - rec->timestamp : 0);
+		unsigned char buf[3 + sizeof(rec->src) + sizeof(rec->dst)];
+		GBytes *key;
+
+		if (age > MAM_HISTORY_MAX_AGE)
+			continue;
+
+		buf[0] = rec->family;
+		buf[1] = rec->src_len;
+		buf[2] = rec->dst_len;
+		memcpy(buf + 3, rec->src, sizeof(rec->src));
+		memcpy(buf + 3 + sizeof(rec->src), rec->dst, sizeof(rec->dst));
+		key = g_bytes_new(buf, sizeof(buf));
+
+		if (age > MAM_HISTORY_KEEP_ALL && g_hash_table_contains(seen, key))
+		{
+			g_bytes_unref(key);
+			continue;
+		}
+		g_hash_table_add(seen, key);
+		kept[num_kept++] = *rec;
+	}
+	g_hash_table_destroy(seen);
+
+	/* back to chronological order */
+	for (i = 0; i < num_kept / 2; i++)
+	{
+		struct mam_history_record tmp = kept[i];
+		kept[i] = kept[num_kept - 1 - i];
+		kept[num_kept - 1 - i] = tmp;
+	}
+
+	memcpy(&h, history, sizeof(h));
+	h.num_records = num_kept;
+
+	tmp_path = g_strdup_printf("%s.tmp", history_path);
+	if ((fd = open(tmp_path, O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0644)) < 0 ||
+		write(fd, &h, sizeof(h)) != sizeof(h) ||
+		write(fd, kept, num_kept * sizeof(struct mam_history_record)) != (ssize_t) (num_kept * sizeof(struct mam_history_record)) ||
+		ftruncate(fd, _history_file_size(h.capacity)) != 0 ||
+		fsync(fd) != 0 ||
+		rename(tmp_path, history_path) != 0)
+	{
+		DLOG(MAM_HISTORY_NOISY_DEBUG0, "compacting history failed: %s\n", strerror(errno));
+		goto _history_compact_err;
+	}
+
+	DLOG(MAM_HISTORY_NOISY_DEBUG1, "compacted history to %llu records\n", (unsigned long long) num_kept);
+	free(kept);
+	g_free(tmp_path);
+	return fd;
+
+	_history_compact_err:
+	if (fd >= 0)
+	{
+		close(fd);
+		unlink(tmp_path);
+	}
+	free(kept);
+	g_free(tmp_path);
+	return -1;
+}
+
+static void *_history_compact_thread(void *arg)
+{
+	compact_fd = _history_compact(compact_now);
+	__atomic_store_n(&compact_done, 1, __ATOMIC_RELEASE);
+	return NULL;
+}
+
+/** Start compacting the history in the background, unless that is already under way */
+static int _history_compact_start(time_t now)
+{
+	if (compact_running)
+		return 0;
+
+	compact_now = now;
+	compact_done = 0;
+	compact_fd = -1;
+	if (pthread_create(&compact_thread, NULL, &_history_compact_thread, NULL) != 0)
+	{
+		DLOG(MAM_HISTORY_NOISY_DEBUG0, "starting history compaction failed\n");
+		return -1;
+	}
+	compact_running = 1;
+	return 0;
+}
+
+/** Write a record to the mapped history - there has to be room for it */
+static void _history_write(const struct mam_history_record *rec)
+{
+	/* the record has to be in place before it is counted */
+	HISTORY_RECORDS(history)[history->num_records] = *rec;
+	__sync_synchronize();
+	history->num_records++;
+}
+
+/** Switch to the compacted history once the compaction thread is done,
+ *  or wait for it, and append the records held back meanwhile
+ */
+static void _history_compact_finish(int wait)
+{
+	guint i;
+
+	if (!compact_running || (!wait && !__atomic_load_n(&compact_done, __ATOMIC_ACQUIRE)))
+		return;
+
+	pthread_join(compact_thread, NULL);
+	compact_running = 0;
+
+	if (compact_fd >= 0)
+	{
+		/* the old file has been replaced - no need to write it back */
+		_history_unmap(0);
+		if (_history_map(compact_fd) != 0)
+		{
+			DLOG(MAM_HISTORY_NOISY_DEBUG0, "mapping compacted history failed: %s\n", strerror(errno));
+			close(compact_fd);
+		}
+		compact_fd = -1;
+	}
+
+	for (i = 0; history != NULL && i < history_pending->len; i++)
+	{
+		if (history->num_records >= history->capacity)
+		{
+			DLOG(MAM_HISTORY_NOISY_DEBUG1, "history is still full - dropping %u records\n", history_pending->len - i);
+			break;
+		}
+		_history_write(&g_array_index(history_pending, struct mam_history_record, i));
+	}
+	g_array_set_size(history_pending, 0);
+}
+
+/** Append a record to the history, compacting it if it is full */
+static void _history_append(const struct mam_history_record *rec, time_t now)
+{
+	if (compact_running)
+	{
+		g_array_append_val(history_pending, *rec);
+		return;
+	}
+
+	if (history->num_records >= history->capacity)
+	{
+		if (_history_compact_start(now) == 0)
+			g_array_append_val(history_pending, *rec);
+		return;
+	}
+
+	_history_write(rec);
+}
+
+void mam_history_record(mam_context_t *ctx)
+{
+	struct mam_history_record rec;
+	time_t now = time(NULL);
+	GSList *cur;
+	int j;
+
+	if (history == NULL || ctx == NULL)
+		return;
+
+	_history_compact_finish(0);
+	if (history == NULL)
+		return;
+
+	pthread_mutex_lock(&(ctx->measure_lock));
+	for (cur = ctx->prefixes; cur != NULL && history != NULL; cur = cur->next)
+	{
+		struct src_prefix_list *prefix = cur->data;
+
+		/* only record what has been measured - not the priors */
+		if (prefix->measure_dict == NULL || g_hash_table_lookup(prefix->measure_dict, "srtt_mean") == NULL ||
+			g_hash_table_lookup(prefix->measure_dict, "history_ts") != NULL)
+			continue;
+
+		memset(&rec, 0x00, sizeof(rec));
+		if (_history_set_source(&rec, prefix) != 0)
+			continue;
+		rec.timestamp = now;
+
+		for (j = 0; j < MAM_HISTORY_VALUES; j++)
+		{
+			double *v = g_hash_table_lookup(prefix->measure_dict, history_keys[j]);
+
+			if (v == NULL)
+				continue;
+			rec.values[j] = *v;
+			rec.valid |= (1 << j);
+		}
+
+		_history_append(&rec, now);
+	}
+	pthread_mutex_unlock(&(ctx->measure_lock));
+
+	if (history != NULL)
+		msync(history, history_size, MS_ASYNC);
+}
+
+void mam_history_close()
+{
+	_history_compact_finish(1);
+	if (history_pending != NULL)
+		g_array_free(history_pending, TRUE);
+	history_pending = NULL;
+	_history_unmap(1);
+	free(history_path);
+	history_path = NULL;
+}
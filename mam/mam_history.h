@@ -0,0 +1,55 @@
+/** \file   mam/mam_history.h
+ *  \brief  Persistent history of the path measurements of the MAM
+ *
+ *  The measurements of every source prefix (and destination prefix, if known)
+ *  are appended periodically to a memory-mapped file. On startup, and whenever
+ *  a prefix appears, the latest summary found for it is put into its
+ *  measure_dict as a prior, marked by "history_ts", so policies can rank paths
+ *  right away. Priors are kept until pmeasure has measured the prefix itself.
+ *
+ *  The file holds a header and fixed-size records. When it is full, it is
+ *  compacted: recent records are kept as they are, older ones only as the
+ *  latest record of their prefix pair.
+ *
+ *  \copyright Copyright 2013-2015 Philipp Schmidt, Theresa Enghardt, and Mirko Palmer.
+ *  All rights reserved. This project is released under the New BSD License.
+ */
+#ifndef __MAM_HISTORY_H__
+#define __MAM_HISTORY_H__
+
+#include "mam.h"
+
+/** Records the history file can hold before it is compacted */
+#ifndef MAM_HISTORY_CAPACITY
+#define MAM_HISTORY_CAPACITY 16384
+#endif
+
+/** Age in seconds up to which compaction keeps every record */
+#ifndef MAM_HISTORY_KEEP_ALL
+#define MAM_HISTORY_KEEP_ALL 3600
+#endif
+
+/** Age in seconds after which records are dropped altogether */
+#ifndef MAM_HISTORY_MAX_AGE
+#define MAM_HISTORY_MAX_AGE (7 * 24 * 3600)
+#endif
+
+/** Open the history file, creating it if it does not exist
+ *
+ *  \return 0 on success, -1 otherwise - the MAM then runs without history
+ */
+int mam_history_open(const char *path);
+
+/** Seed the measure_dict of a prefix with the latest summary recorded for it,
+ *  unless it already has measurements - to be called from g_slist_foreach()
+ *  with the MAM context as data
+ */
+void mam_history_seed(void *pfx, void *data);
+
+/** Append the current measurements of all measured prefixes to the history */
+void mam_history_record(mam_context_t *ctx);
+
+/** Wait for a compaction in progress, then flush and close the history file */
+void mam_history_close();
+
+#endif /* __MAM_HISTORY_H__ */
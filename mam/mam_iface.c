@@ -136,14 +136,10 @@ void filter_prefix_list (GSList *old, GSList **new, unsigned int pfx_flags, cons
 	/* Set criteria for matching addresses */
 	struct src_prefix_model m = { pfx_flags, if_name, family, addr };
 
-	/* Go through the prefix list */
-	while (old != NULL)
+	/* Go through the prefix list, appending each element that matches our criteria */
+	for (old = g_slist_find_custom(old, (gconstpointer) &m, &compare_src_prefix); old != NULL;
+		 old = g_slist_find_custom(old->next, (gconstpointer) &m, &compare_src_prefix))
 	{
-		/* Find next element that matches our criteria */
-		old = g_slist_find_custom(old->next, (gconstpointer) &m, &compare_src_prefix);
-		if (old == NULL) break;
-
-		/* Append matching element to new list */
 		*new = g_slist_append(*new, old->data);
 	}
 }
@@ -162,85 +158,244 @@ static int _append_sockaddr_list (
 	return(0);
 }
 
-/** Incorporate an address into the source prefix list:
- *  If a matching prefix exists, add it to this prefix' addr_list
- *  If no matching prefix exists yet, create one
+/** Check whether two socket addresses hold the same IP address */
+static int _same_address (const struct sockaddr *a, const struct sockaddr *b)
+{
+	if (a->sa_family != b->sa_family)
+		return 0;
+	if (a->sa_family == AF_INET)
+		return (((struct sockaddr_in *) a)->sin_addr.s_addr == ((struct sockaddr_in *) b)->sin_addr.s_addr);
+	if (a->sa_family == AF_INET6)
+		return (memcmp(&(((struct sockaddr_in6 *) a)->sin6_addr), &(((struct sockaddr_in6 *) b)->sin6_addr), sizeof(struct in6_addr)) == 0);
+	return 0;
+}
+
+/** Remove an address from a sockaddr_list
+ *  Return 0 if it was found, -1 otherwise */
+static int _remove_sockaddr_list (
+	struct sockaddr_list **list,
+	const struct sockaddr *addr )
+{
+	struct sockaddr_list *cur;
+
+	for (; *list != NULL; list = &((*list)->next))
+	{
+		if (_same_address((*list)->addr, addr))
+		{
+			cur = *list;
+			*list = cur->next;
+			free(cur->addr);
+			free(cur);
+			return(0);
+		}
+	}
+	return(-1);
+}
+
+/** Report a change of the prefix list to the prefix hook of the MAM context
+ *  The first change after mam_prefix_update_done() is preceded by MAM_PREFIX_UPDATE_START
  */
-static void _scan_update_prefix (
-	GSList **spfxl,
-	char *if_name, unsigned int if_flags,
+static void _notify_prefix_change (mam_context_t *ctx, struct src_prefix_list *pfx, int event)
+{
+	if (ctx->prefix_hook == NULL)
+		return;
+
+	if (!ctx->prefixes_updating)
+	{
+		ctx->prefixes_updating = 1;
+		ctx->prefix_hook(ctx, NULL, MAM_PREFIX_UPDATE_START);
+	}
+	ctx->prefix_hook(ctx, pfx, event);
+}
+
+void mam_prefix_update_done (mam_context_t *ctx)
+{
+	if (!ctx->prefixes_updating)
+		return;
+
+	ctx->prefixes_updating = 0;
+	if (ctx->prefix_hook != NULL)
+		ctx->prefix_hook(ctx, NULL, MAM_PREFIX_UPDATE_DONE);
+}
+
+/** Take a prefix out of the list of the MAM context and drop the reference of the list
+ *  The prefix still has to hold its addresses, they are needed to find it in the index */
+static void _remove_prefix (mam_context_t *ctx, struct src_prefix_list *pfx)
+{
+	DLOG(MAM_IF_NOISY_DEBUG1, "%s: removing prefix\n", pfx->if_name);
+
+	_notify_prefix_change(ctx, pfx, MAM_PREFIX_REMOVED);
+	_mam_index_remove_prefix(ctx, pfx);
+	ctx->prefixes = g_slist_remove(ctx->prefixes, pfx);
+	/* its resolvers are bound to the worker event bases, which may be gone before the last reference */
+	_mam_prefix_free_dns(pfx, 1);
+	_free_src_prefix_list(pfx);
+}
+
+int mam_prefix_add_address (
+	mam_context_t *ctx,
+	const char *if_name, unsigned int if_flags,
 	int family,
 	struct sockaddr *addr,
 	struct sockaddr *mask)
 {
-	GSList *cur = NULL;
 	size_t family_size = (family == AF_INET)  ? sizeof(struct sockaddr_in)  :
 	 					 (family == AF_INET6) ? sizeof(struct sockaddr_in6) :
 						 -1;
 	struct sockaddr_list *cus;
-	
-	
-	/* scan through prefixes */
-	struct src_prefix_model model = {PFX_ANY, if_name, family, addr, family_size};
-	cur = g_slist_find_custom(*spfxl, (gconstpointer) &model, &compare_src_prefix);
+	struct src_prefix_list *pfx;
+
+	if (family != AF_INET && family != AF_INET6)
+		return(-1);
 
-	if (cur != NULL)
+	if ((pfx = lookup_source_prefix(ctx, PFX_ANY, if_name, family, addr)) != NULL)
 	{
 		/* Prefix already exists within the list: append this address to its address list */
 
-		for(cus = ((struct src_prefix_list *)cur->data)->if_addrs; cus->next != NULL; cus = cus->next);; 
-		_append_sockaddr_list( &(cus->next), addr, family_size);
-		return;			
+		for(cus = pfx->if_addrs; cus != NULL; cus = cus->next)
+		{
+			if (_same_address(cus->addr, addr))
+				break;
+		}
+
+		if (cus == NULL)
+		{
+			for(cus = pfx->if_addrs; cus->next != NULL; cus = cus->next);;
+			if (_append_sockaddr_list( &(cus->next), addr, family_size) != 0)
+				return(-1);
+		}
+		else if (pfx->if_flags == if_flags)
+		{
+			/* nothing new */
+			return(0);
+		}
+
+		pfx->if_flags = if_flags;
+		_notify_prefix_change(ctx, pfx, MAM_PREFIX_CHANGED);
+		return(0);
 	}
-	
+
 	/* we have a new prefix: append it to the prefix list */
-	
+
 	/* allocate memory */
-	struct src_prefix_list *new = NULL;
-	new = malloc(sizeof(struct src_prefix_list));
-	if(new == NULL)
-		{ DLOG(1, "malloc failed"); return; } 
-	memset(new, 0, sizeof(struct src_prefix_list));
-	
+	pfx = malloc(sizeof(struct src_prefix_list));
+	if(pfx == NULL)
+		{ DLOG(1, "malloc failed"); return(-1); }
+	memset(pfx, 0, sizeof(struct src_prefix_list));
+
 	/* copy data */
-	new->if_name = _muacc_clone_string(if_name);
-	new->family = family;
-	new->if_flags = if_flags;
-	_append_sockaddr_list( &(new->if_addrs), addr, family_size);
-	new->if_netmask = _muacc_clone_sockaddr(mask, family_size);
-	new->if_netmask_len = family_size;
-
-	new->measure_dict = g_hash_table_new(g_str_hash, g_str_equal);
-	
+	pfx->if_name = _muacc_clone_string(if_name);
+	pfx->family = family;
+	pfx->if_flags = if_flags;
+	_append_sockaddr_list( &(pfx->if_addrs), addr, family_size);
+	pfx->if_netmask = _muacc_clone_sockaddr(mask, family_size);
+	pfx->if_netmask_len = family_size;
+
+	pfx->measure_dict = g_hash_table_new_full(g_str_hash, g_str_equal, NULL, free);
+	pfx->refcount = 1;
+
 	/* append to list */
-	*spfxl = g_slist_append(*spfxl, (gpointer) new);
+	ctx->prefixes = g_slist_append(ctx->prefixes, (gpointer) pfx);
+	_mam_index_add_prefix(ctx, pfx);
 
-	return;
+	DLOG(MAM_IF_NOISY_DEBUG1, "%s: added new prefix\n", if_name);
+	_notify_prefix_change(ctx, pfx, MAM_PREFIX_ADDED);
+
+	return(0);
 }
 
-/** Scan for interfaces/addresses available on the host
- *  Create a new src_prefix_list and add all active interfaces/addresses to it
- */
-int update_src_prefix_list (mam_context_t *ctx )
+int mam_prefix_remove_address (
+	mam_context_t *ctx,
+	const char *if_name,
+	const struct sockaddr *addr)
 {
-	GSList **spfxl = &ctx->prefixes;
-    struct ifaddrs *ifaddr, *ifa;
-    int family;
+	GSList *cur;
+	struct src_prefix_list *pfx;
 
-    DLOG(MAM_IF_NOISY_DEBUG0, "creating a list of the currently active interfaces\n");
+	for (cur = (if_name != NULL ? mam_prefixes_by_name(ctx, if_name) : ctx->prefixes); cur != NULL; cur = cur->next)
+	{
+		pfx = cur->data;
 
-    if (getifaddrs(&ifaddr) == -1) {
-        perror("getifaddrs");
-        return(-1);
-    }
-	
-	if(*spfxl != NULL) 
-		g_slist_free_full(*spfxl, &_free_src_prefix_list);
+		if (pfx->family != addr->sa_family)
+			continue;
+
+		/* the last address of a prefix takes the prefix with it */
+		if (pfx->if_addrs != NULL && pfx->if_addrs->next == NULL && _same_address(pfx->if_addrs->addr, addr))
+		{
+			_remove_prefix(ctx, pfx);
+			return(0);
+		}
+
+		if (_remove_sockaddr_list(&(pfx->if_addrs), addr) == 0)
+		{
+			_notify_prefix_change(ctx, pfx, MAM_PREFIX_CHANGED);
+			return(0);
+		}
+	}
+
+	return(-1);
+}
+
+void mam_prefix_set_if_flags (
+	mam_context_t *ctx,
+	const char *if_name,
+	unsigned int if_flags)
+{
+	GSList *same_if, *cur;
+	struct src_prefix_list *pfx;
+
+	/* removing prefixes changes the list of the interface */
+	same_if = g_slist_copy(mam_prefixes_by_name(ctx, if_name));
+
+	for (cur = same_if; cur != NULL; cur = cur->next)
+	{
+		pfx = cur->data;
+
+		if (pfx->if_flags == if_flags)
+			continue;
+
+		/* like the scan, only keep prefixes of interfaces that are up */
+		if ((if_flags & IFF_UP) == 0)
+		{
+			_remove_prefix(ctx, pfx);
+		}
+		else
+		{
+			pfx->if_flags = if_flags;
+			_notify_prefix_change(ctx, pfx, MAM_PREFIX_CHANGED);
+		}
+	}
+
+	g_slist_free(same_if);
+}
+
+/** Check whether an address of a prefix is still present in the result of getifaddrs() */
+static int _scan_has_address (struct ifaddrs *ifaddr, struct src_prefix_list *pfx, const struct sockaddr *addr)
+{
+	struct ifaddrs *ifa;
+
+	for (ifa = ifaddr; ifa != NULL; ifa = ifa->ifa_next)
+	{
+		if ((ifa->ifa_flags & IFF_UP) != 0 && ifa->ifa_addr != NULL &&
+			strcmp(ifa->ifa_name, pfx->if_name) == 0 && _same_address(ifa->ifa_addr, addr))
+			return 1;
+	}
+	return 0;
+}
+
+/** Add the addresses of all interfaces that are up, or only those of if_name */
+static void _scan_add_addresses (mam_context_t *ctx, struct ifaddrs *ifaddr, const char *if_name)
+{
+    struct ifaddrs *ifa;
+    int family;
 
     /* Walk through linked list, maintaining head pointer so we
        can free list later */
     for (ifa = ifaddr; ifa != NULL; ifa = ifa->ifa_next) 
     {
+		if (if_name != NULL && strcmp(ifa->ifa_name, if_name) != 0)
+			continue;
+
 		if((ifa->ifa_flags & IFF_UP)==0) 
 		{
             DLOG(MAM_IF_NOISY_DEBUG2, "%s: interface down - skipping\n", ifa->ifa_name);
@@ -280,22 +435,163 @@ int update_src_prefix_list (mam_context_t *ctx )
 			#endif
 				 
 			/* add to our structure */
-			_scan_update_prefix( spfxl,
+			mam_prefix_add_address( ctx,
 				ifa->ifa_name, ifa->ifa_flags,
 				family, ifa->ifa_addr, ifa->ifa_netmask );
 		}
     }
+}
+
+/** Scan for interfaces/addresses available on the host
+ *  Bring the src_prefix_list up to date with all active interfaces/addresses:
+ *  prefixes that are still present keep their configuration, policy_info and
+ *  measurements, new ones are added and vanished ones are removed
+ */
+int update_src_prefix_list (mam_context_t *ctx )
+{
+    struct ifaddrs *ifaddr;
+	struct sockaddr_list *cus, *next_addr;
+	GSList *cur, *next;
+
+    DLOG(MAM_IF_NOISY_DEBUG0, "updating the list of the currently active interfaces\n");
+
+    if (getifaddrs(&ifaddr) == -1) {
+        perror("getifaddrs");
+        return(-1);
+    }
+
+	/* drop addresses that have vanished */
+	for (cur = ctx->prefixes; cur != NULL; cur = next)
+	{
+		struct src_prefix_list *pfx = cur->data;
+		int present = 0, removed = 0;
+
+		next = cur->next;
+		for (cus = pfx->if_addrs; cus != NULL; cus = cus->next)
+			present += _scan_has_address(ifaddr, pfx, cus->addr);
+
+		if (present == 0)
+		{
+			_remove_prefix(ctx, pfx);
+			continue;
+		}
+
+		for (cus = pfx->if_addrs; cus != NULL; cus = next_addr)
+		{
+			next_addr = cus->next;
+			if (!_scan_has_address(ifaddr, pfx, cus->addr))
+			{
+				_remove_sockaddr_list(&(pfx->if_addrs), cus->addr);
+				removed = 1;
+			}
+		}
+
+		if (removed)
+			_notify_prefix_change(ctx, pfx, MAM_PREFIX_CHANGED);
+	}
+
+	_scan_add_addresses(ctx, ifaddr, NULL);
 
     freeifaddrs(ifaddr);
+	mam_prefix_update_done(ctx);
     return(0);
 }
 
-/** Tear down a source prefix list structure */
+int mam_prefix_scan_interface (mam_context_t *ctx, const char *if_name)
+{
+	struct ifaddrs *ifaddr;
+
+	DLOG(MAM_IF_NOISY_DEBUG1, "%s: adding the addresses of the interface\n", if_name);
+
+	if (getifaddrs(&ifaddr) == -1) {
+		perror("getifaddrs");
+		return(-1);
+	}
+
+	_scan_add_addresses(ctx, ifaddr, if_name);
+
+	freeifaddrs(ifaddr);
+	return(0);
+}
+
+int _mam_prefix_set_resolv_conf (mam_context_t *ctx, struct src_prefix_list *pfx, const char *resolv_conf)
+{
+	int i;
+
+	_mam_prefix_free_dns(pfx, 1);
+
+	/* evdns bases must only be used from the thread running their event base */
+	if ((pfx->evdns_base = evdns_base_new(ctx->ev_base, 0)) == NULL ||
+		evdns_base_resolv_conf_parse(pfx->evdns_base, DNS_OPTIONS_ALL, resolv_conf) != 0)
+		goto _mam_prefix_set_resolv_conf_err;
+
+	if (ctx->num_workers > 0)
+	{
+		if ((pfx->worker_evdns_bases = calloc(ctx->num_workers + 1, sizeof(struct evdns_base *))) == NULL)
+			goto _mam_prefix_set_resolv_conf_err;
+
+		for (i = 0; i < ctx->num_workers; i++)
+		{
+			if ((pfx->worker_evdns_bases[i] = evdns_base_new(ctx->workers[i].ev_base, 0)) == NULL ||
+				evdns_base_resolv_conf_parse(pfx->worker_evdns_bases[i], DNS_OPTIONS_ALL, resolv_conf) != 0)
+				goto _mam_prefix_set_resolv_conf_err;
+		}
+	}
+
+	return 0;
+
+	_mam_prefix_set_resolv_conf_err:
+	DLOG(MAM_IF_NOISY_DEBUG0, "setting up DNS bases from %s failed\n", resolv_conf);
+	_mam_prefix_free_dns(pfx, 0);
+	return -1;
+}
+
+void _mam_prefix_free_dns (struct src_prefix_list *pfx, int fail_lookups)
+{
+	struct evdns_base **base;
+
+	if (pfx->evdns_base != NULL)
+		evdns_base_free(pfx->evdns_base, fail_lookups);
+	pfx->evdns_base = NULL;
+
+	if (pfx->worker_evdns_bases != NULL)
+	{
+		for (base = pfx->worker_evdns_bases; *base != NULL; base++)
+			evdns_base_free(*base, fail_lookups);
+		free(pfx->worker_evdns_bases);
+	}
+	pfx->worker_evdns_bases = NULL;
+}
+
+struct evdns_base *mam_prefix_dns_base (struct src_prefix_list *pfx, mam_worker_t *worker)
+{
+	if (worker == NULL)
+		return pfx->evdns_base;
+
+	if (pfx->worker_evdns_bases == NULL)
+		return NULL;
+
+	return pfx->worker_evdns_bases[worker->id];
+}
+
 void _free_src_prefix_list (gpointer data)
 {
-	struct src_prefix_list *element = (struct src_prefix_list *) data;
+	mam_prefix_unref((struct src_prefix_list *) data);
+}
+
+void mam_prefix_ref (struct src_prefix_list *pfx)
+{
+	__atomic_add_fetch(&(pfx->refcount), 1, __ATOMIC_RELAXED);
+}
+
+/** Tear down a source prefix list structure once the last reference is gone */
+void mam_prefix_unref (struct src_prefix_list *element)
+{
 	struct sockaddr_list *addrlist = NULL;
 	struct sockaddr_list *curra = NULL;
+
+	if (__atomic_sub_fetch(&(element->refcount), 1, __ATOMIC_ACQ_REL) > 0)
+		return;
 	
 	if (element->if_name != NULL)
 		free(element->if_name);
@@ -315,8 +611,7 @@ void _free_src_prefix_list (gpointer data)
 	if (element->if_netmask != NULL)
 		free(element->if_netmask);
 
-	if(element->evdns_base != NULL)
-		evdns_base_free(element->evdns_base, 0);
+	_mam_prefix_free_dns(element, 0);
 
 	if(element->policy_set_dict != NULL)
 		g_hash_table_destroy(element->policy_set_dict);
@@ -329,3 +624,18 @@ void _free_src_prefix_list (gpointer data)
 	return;
 }
 
+
+#ifndef HAVE_LIBNL
+/* without libnl, changes are only picked up on reconfiguration (SIGHUP) */
+
+int mam_netlink_start (mam_context_t *ctx)
+{
+	DLOG(MAM_IF_NOISY_DEBUG0, "built without libnl - not tracking interface changes\n");
+	return(-1);
+}
+
+void mam_netlink_stop (mam_context_t *ctx)
+{
+	return;
+}
+#endif
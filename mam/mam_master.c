@@ -5,14 +5,20 @@
  */
 
 #include <signal.h>
+#include <getopt.h>
 #include <sys/un.h>
 #include <sys/stat.h>
 
+#include <event2/thread.h>
+
 #include "clib/muacc.h"
 #include "lib/muacc_ctx.h"
 #include "lib/muacc_tlv.h"
 
 #include "mam_pmeasure.h"
+#include "mam_history.h"
+#include "mam_probe.h"
+#include "mam_metrics.h"
 
 #include "mam_configp.h"
 #include "mam.h"
@@ -35,12 +41,13 @@
 struct mam_context *global_mctx = NULL;
 int config_fd = -1;
 
-void clean_client_state(GSList *client);
-int compare_id_in_struct(gconstpointer list_data,  gconstpointer user_data);
+/** Worker the next accepted client is handed to */
+static int next_worker = 0;
 
 static void process_mam_request(struct request_context *ctx)
 {
 	int (*callback_function)(request_context_t *ctx, struct event_base *base) = NULL;
+	uint64_t start;
 	int ret;
 
 	if (ctx->action == muacc_act_getaddrinfo_resolve_req)
@@ -65,7 +72,9 @@ static void process_mam_request(struct request_context *ctx)
 			/* Call policy module function */
 			DLOG(MAM_MASTER_NOISY_DEBUG2, "calling on_socketconnect_request callback\n");
 			ctx->policy_calls_performed |= MAM_POLICY_SOCKETCONNECT_CALLED;
-			ret = callback_function(ctx, ctx->mctx->ev_base);
+			start = mam_metrics_now();
+			ret = callback_function(ctx, _mam_request_base(ctx));
+			mam_metrics_policy_call(MAM_POLICY_SOCKETCONNECT_CALLED, start);
 			if (ret != 0)
 			{
 				DLOG(MAM_MASTER_NOISY_DEBUG1, "on_socketconnect_request callback returned %d\n", ret);
@@ -81,7 +90,9 @@ static void process_mam_request(struct request_context *ctx)
 				DLOG(MAM_MASTER_NOISY_DEBUG2, "Fallback to resolve_request and connect_request. \n");
 				ctx->action = muacc_act_socketconnect_fallback;
 				ctx->policy_calls_performed |= MAM_POLICY_RESOLVE_CALLED;
-				ret = callback_function(ctx, ctx->mctx->ev_base);
+				start = mam_metrics_now();
+				ret = callback_function(ctx, _mam_request_base(ctx));
+				mam_metrics_policy_call(MAM_POLICY_RESOLVE_CALLED, start);
 				if (ret != 0)
 				{
 					DLOG(MAM_MASTER_NOISY_DEBUG1, "on_resolve_request callback returned %d\n", ret);
@@ -98,7 +109,33 @@ static void process_mam_request(struct request_context *ctx)
 	else if (ctx->action == muacc_act_socketchoose_req)
 	{
 		DLOG(MAM_MASTER_NOISY_DEBUG0, "Received new socketchoose request\n");
-		_mam_callback_or_fail(ctx, "on_socketchoose_request", MAM_POLICY_SOCKETCHOOSE_CALLED, muacc_act_socketchoose_resp_new);
+		_mam_sockctx_learn(ctx);
+		if (ctx->sockets_unknown > 0)
+		{
+			/* we cannot choose from sockets we know nothing about - ask the client to resend them */
+			DLOG(MAM_MASTER_NOISY_DEBUG1, "%d sockets of the set are unknown - requesting resync\n", ctx->sockets_unknown);
+			_muacc_send_ctx_event(ctx, muacc_act_socketchoose_resync);
+		}
+		else
+		{
+			_mam_callback_or_fail(ctx, "on_socketchoose_request", MAM_POLICY_SOCKETCHOOSE_CALLED, muacc_act_socketchoose_resp_new);
+		}
+	}
+	else if (ctx->action == muacc_act_flowstats_report)
+	{
+		/* Account the counters of a flow - the client does not wait for a response */
+		DLOG(MAM_MASTER_NOISY_DEBUG0, "Received new flowstats report\n");
+		if (ctx->ctx->bind_sa_suggested != NULL)
+			pmeasure_account_flow(ctx->mctx, ctx->ctx->bind_sa_suggested, &(ctx->flowstats));
+		else
+			pmeasure_account_flow(ctx->mctx, ctx->ctx->bind_sa_req, &(ctx->flowstats));
+		mam_release_request_context(ctx);
+	}
+	else if (ctx->action == muacc_act_srcaddrs_req)
+	{
+		/* List the source addresses a client may spread its connections over */
+		DLOG(MAM_MASTER_NOISY_DEBUG0, "Received new srcaddrs request\n");
+		_mam_send_srcaddrs(ctx);
 	}
 	else
 	{
@@ -108,78 +145,108 @@ static void process_mam_request(struct request_context *ctx)
 	}
 }
 
+/** process a request while holding the policy lock
+ *
+ *  thread-safe policies may be called from several workers at once,
+ *  all others are called by one thread at a time
+ */
+static void process_mam_request_locked(struct request_context *ctx)
+{
+	struct mam_context *mctx = ctx->mctx;
+
+	_mam_policy_lock(mctx);
+	process_mam_request(ctx);
+	_mam_policy_unlock(mctx);
+}
+
+/** get a request context for the next request of a client
+ *
+ */
+static struct request_context *create_request_context(mam_context_t *mctx, struct mam_worker *worker, uuid_t id)
+{
+	struct request_context *rctx = mam_create_request_context(mctx);
+
+	if (rctx == NULL)
+		return NULL;
+
+	rctx->worker = worker;
+	uuid_copy(rctx->ctx->ctxid, id);
+
+	return rctx;
+}
+
+/** answer a request that cannot be processed, so the client does not wait for it forever
+ *
+ */
+static void send_error_response(struct evbuffer *out, muacc_mam_action_t reason)
+{
+	char buf[64];
+	ssize_t pos = 0;
+
+	if (0 > _muacc_push_tlv(buf, &pos, sizeof(buf), action, &reason, sizeof(muacc_mam_action_t)) ||
+		0 > _muacc_push_tlv_tag(buf, &pos, sizeof(buf), eof) ||
+		0 > evbuffer_add(out, buf, pos))
+	{
+		DLOG(MAM_MASTER_NOISY_DEBUG1, "could not send error response\n");
+	}
+}
+
 /** read next tlvs on one of mam's client sockets
  *
+ *  processes all complete requests that are in the input buffer - responses
+ *  are only written out once control returns to the event loop
  */
 static void mamsock_readcb(struct bufferevent *bev, void *prctx)
 {
 	struct request_context **rctx = (struct request_context **) prctx;
 	uuid_t old;
-	
-#if MAM_MASTER_NOISY_DEBUG2 == 1
-	char uuid_str[37];
-#endif
-		
-    for(;;)
+	int sockfd;
+	int batch = 0;
+	int done = 0;
+
+	while (!done)
 	{
 		/* prepair stuff of this round */
 		struct request_context *crctx = *rctx;
-		
-	    crctx->in = bufferevent_get_input(bev);
-	    crctx->out = bufferevent_get_output(bev);
-		
-    	switch( _muacc_proc_tlv_event(crctx) )
-    	{
-    		case _muacc_proc_tlv_event_too_short:
-    			/* need more data - wait for next read event */
-    			return;
-    		case _muacc_proc_tlv_event_eof:
-				/* re-initialize muacc context to back up further communication (keep uuid)*/
+
+		crctx->in = bufferevent_get_input(bev);
+		crctx->out = bufferevent_get_output(bev);
+
+		switch( _muacc_proc_tlv_event(crctx) )
+		{
+			case _muacc_proc_tlv_event_too_short:
+				/* need more data - wait for next read event */
+				done = 1;
+				break;
+			case _muacc_proc_tlv_event_eof:
+				/* get a fresh request context to back up further communication (keep uuid)*/
 				uuid_copy(old, crctx->ctx->ctxid);
-				 
-				 *rctx = malloc(sizeof(struct request_context));
-				(*rctx)->sockets = NULL;
-				(*rctx)->mctx = global_mctx;
-				(*rctx)->ctx = _muacc_create_ctx();
-				printf("in read cb\n");
-    			uuid_copy((*rctx)->ctx->ctxid, old);
-				
-				/* done processing - do MAM's magic */
-				process_mam_request(crctx);
-												
-				if (global_mctx->clients)
+				sockfd = crctx->ctx->sockfd;
+
+				if ((*rctx = create_request_context(crctx->mctx, crctx->worker, old)) == NULL)
 				{
-					GSList *client_list = g_slist_find_custom(global_mctx->clients, crctx->ctx->ctxid, compare_id_in_struct);
-			
-					if (client_list)
-					{
-						socket_list_t *sk = malloc(sizeof(socket_list_t));
-						sk->sk = crctx->ctx->sockfd;
-
-#if MAM_MASTER_NOISY_DEBUG2 == 1
-						uuid_unparse_lower(crctx->ctx->ctxid, uuid_str);
-						printf("(mam callback) add sockfd: %d to id: %s\n", sk->sk, uuid_str);
-						((client_list_t*)client_list->data)->sockets = g_slist_append(((client_list_t*)client_list->data)->sockets, sk);
-#endif
-					}
+					DLOG(MAM_MASTER_NOISY_DEBUG1, "could not get request context - rejecting request\n");
+					*rctx = crctx;
+					send_error_response(crctx->out, muacc_error_unknown_request);
+					mam_reset_request_context(crctx);
+					uuid_copy(crctx->ctx->ctxid, old);
+					break;
 				}
-    			continue;
-    		default:
-    			/* read a TLV - are there more out there? */
-    			continue;
-    	}
+				batch++;
+				mam_metrics_request_received(crctx);
+
+				/* done processing - do MAM's magic (crctx is released once the response has been sent) */
+				process_mam_request_locked(crctx);
+
+				mam_add_client_socket(global_mctx, old, sockfd);
+				break;
+			default:
+				/* read a TLV - are there more out there? */
+				break;
+		}
 	}
-}
 
-int compare_id_in_struct(gconstpointer list_data,  gconstpointer user_data)
-{
-	client_list_t *list = (client_list_t*) list_data;
-	uuid_t *id = (uuid_t*) user_data;
-	
-	if (uuid_compare(list->id, *id) == 0)
-		return 0;
-	
-	return -1;
+	DLOG(MAM_MASTER_NOISY_DEBUG2, "processed %d requests in this batch\n", batch);
 }
 
 /** handle errors on one of mam's client sockets
@@ -192,14 +259,7 @@ static void mamsock_errorcb(struct bufferevent *bev, short error, void *ctx)
 	
     if (error & BEV_EVENT_EOF) {
         /* connection has been closed, do any clean up here */
-		GSList *client_list = g_slist_find_custom(global_mctx->clients, crctx->ctx->ctxid, compare_id_in_struct);
-		
-		if (client_list)
-		{
-			if (((client_list_t*)client_list->data)->callback_function)
-				((client_list_t*)client_list->data)->callback_function(client_list);
-		}
-		
+		mam_remove_client(global_mctx, crctx->ctx->ctxid);
     } else if (error & BEV_EVENT_ERROR) {
         /* check errno to see what error occurred */
         /* ... */
@@ -215,16 +275,141 @@ static void mamsock_errorcb(struct bufferevent *bev, short error, void *ctx)
     bufferevent_free(bev);
 }
 
-void clean_client_state(GSList *client_list)
+/** set up state and bufferevent for a new client on the given event loop
+ *
+ */
+static void setup_client(mam_context_t *mctx, struct mam_worker *worker, evutil_socket_t fd)
 {
-#if MAM_MASTER_NOISY_DEBUG2 == 1
-	char uuid_str[37];
-	client_list_t *list = ((client_list_t*)client_list->data);
-	uuid_unparse_lower(list->id, uuid_str);
-	printf("cleaning up state for client with fd:%d and id: %s\n", list->client_sk, uuid_str);
-#endif
-	
-	global_mctx->clients = g_slist_remove(global_mctx->clients, client_list->data);
+	struct event_base *base = (worker != NULL ? worker->ev_base : mctx->ev_base);
+	struct bufferevent *bev;
+	request_context_t **ctx;
+	uuid_t id;
+
+	/* initialize request context to back up communication */
+	uuid_generate(id);
+	ctx = malloc(sizeof(struct request_context *));
+	*ctx = create_request_context(mctx, worker, id);
+
+	mam_add_client(mctx, fd, id);
+
+	/* set up bufferevent magic - the policy may answer from another thread */
+	evutil_make_socket_nonblocking(fd);
+	bev = bufferevent_socket_new(base, fd, BEV_OPT_CLOSE_ON_FREE | (mctx->num_workers > 0 ? BEV_OPT_THREADSAFE : 0));
+	bufferevent_setcb(bev, mamsock_readcb, NULL, mamsock_errorcb, (void *) ctx);
+	bufferevent_setwatermark(bev, EV_READ, MIN_BUF, MAX_BUF);
+	bufferevent_enable(bev, EV_READ|EV_WRITE);
+}
+
+/** take over clients handed to this worker by the acceptor
+ *
+ */
+static void worker_notify_cb(evutil_socket_t notify_fd, short event, void *arg)
+{
+	struct mam_worker *worker = arg;
+	evutil_socket_t fd;
+
+	while (read(notify_fd, &fd, sizeof(fd)) == sizeof(fd))
+	{
+		DLOG(MAM_MASTER_NOISY_DEBUG2, "Worker %d took over client %d\n", worker->id, fd);
+		setup_client(worker->mctx, worker, fd);
+	}
+}
+
+/** event loop of a worker thread
+ *
+ */
+static void *worker_main(void *arg)
+{
+	struct mam_worker *worker = arg;
+
+	DLOG(MAM_MASTER_NOISY_DEBUG1, "worker %d running event loop\n", worker->id);
+	event_base_dispatch(worker->ev_base);
+	DLOG(MAM_MASTER_NOISY_DEBUG1, "worker %d done\n", worker->id);
+
+	return NULL;
+}
+
+/** set up and start the worker event loops
+ *
+ */
+static int start_workers(mam_context_t *mctx, int num_workers)
+{
+	int i;
+
+	if (num_workers <= 0)
+		return 0;
+
+	if ((mctx->workers = calloc(num_workers, sizeof(struct mam_worker))) == NULL)
+		return -1;
+
+	for (i = 0; i < num_workers; i++)
+	{
+		struct mam_worker *worker = &(mctx->workers[i]);
+
+		worker->id = i;
+		worker->mctx = mctx;
+		if ((worker->ev_base = event_base_new()) == NULL || pipe(worker->notify_fd) != 0)
+		{
+			DLOG(1, "setting up worker %d failed\n", i);
+			return -1;
+		}
+		evutil_make_socket_nonblocking(worker->notify_fd[0]);
+		worker->evdns_base = evdns_base_new(worker->ev_base, 1);
+		worker->notify_event = event_new(worker->ev_base, worker->notify_fd[0], EV_READ|EV_PERSIST, worker_notify_cb, worker);
+		event_add(worker->notify_event, NULL);
+
+		if (pthread_create(&(worker->thread), NULL, worker_main, worker) != 0)
+		{
+			DLOG(1, "starting worker %d failed\n", i);
+			return -1;
+		}
+		mctx->num_workers++;
+	}
+
+	DLOG(MAM_MASTER_NOISY_DEBUG1, "started %d workers\n", mctx->num_workers);
+	return 0;
+}
+
+/** stop the worker event loops and wait for them to finish
+ *
+ */
+static void stop_workers(mam_context_t *mctx)
+{
+	int i;
+
+	for (i = 0; i < mctx->num_workers; i++)
+	{
+		event_base_loopexit(mctx->workers[i].ev_base, NULL);
+		pthread_join(mctx->workers[i].thread, NULL);
+	}
+}
+
+/** free the workers after they have been stopped
+ *
+ */
+static void free_workers(mam_context_t *mctx)
+{
+	int i;
+	GSList *elem;
+
+	/* the DNS bases of the prefixes are bound to the worker event bases, too */
+	for (elem = mctx->prefixes; elem != NULL; elem = elem->next)
+		_mam_prefix_free_dns(elem->data, 0);
+
+	for (i = 0; i < mctx->num_workers; i++)
+	{
+		struct mam_worker *worker = &(mctx->workers[i]);
+
+		event_free(worker->notify_event);
+		close(worker->notify_fd[0]);
+		close(worker->notify_fd[1]);
+		evdns_base_free(worker->evdns_base, 0);
+		event_base_free(worker->ev_base);
+	}
+
+	free(mctx->workers);
+	mctx->workers = NULL;
+	mctx->num_workers = 0;
 }
 
 /** accept new clients of mam
@@ -235,42 +420,26 @@ static void do_accept(evutil_socket_t listener, short event, void *arg)
     mam_context_t *mctx = arg;
     struct sockaddr_storage ss;
     socklen_t slen = sizeof(ss);
-	client_list_t *client_list;
 	
     int fd = accept(listener, (struct sockaddr*)&ss, &slen);
     if (fd < 0) {
         perror("accept");
     } else if (fd > FD_SETSIZE) {
         close(fd);
-    } else {
+    } else if (mctx->num_workers > 0 && mctx->policy_threadsafe) {
+		/* hand the client over to the next worker */
+		struct mam_worker *worker = &(mctx->workers[next_worker]);
+		next_worker = (next_worker + 1) % mctx->num_workers;
 
+		DLOG(MAM_MASTER_NOISY_DEBUG2, "Accepted client %d - handing it to worker %d\n", fd, worker->id);
+		if (write(worker->notify_fd[1], &fd, sizeof(fd)) != sizeof(fd))
+		{
+			DLOG(MAM_MASTER_NOISY_DEBUG1, "Handing client %d to worker %d failed\n", fd, worker->id);
+			close(fd);
+		}
+    } else {
 		DLOG(MAM_MASTER_NOISY_DEBUG2, "Accepted client %d\n", fd);
-    	struct bufferevent *bev;
-		request_context_t **ctx;
-
-		/* initialize request context to back up communication */
-		ctx = malloc(sizeof(struct request_context *));		
-		*ctx = malloc(sizeof(struct request_context));
-		(*ctx)->ctx = _muacc_create_ctx();
-		(*ctx)->mctx = mctx;
-				
-		client_list = malloc(sizeof(client_list_t));
-		client_list->client_sk = fd; //bufferevent_getfd(bev);
-		uuid_generate((*ctx)->ctx->ctxid);
-		uuid_copy(client_list->id, (*ctx)->ctx->ctxid);
-		client_list->callback_function = &clean_client_state;
-		client_list->sockets = NULL;
-		global_mctx->clients = g_slist_append(global_mctx->clients, client_list);
-						
-		(*ctx)->sockets = NULL;
-		(*ctx)->policy_calls_performed = 0;
-
-    	/* set up bufferevent magic */
-        evutil_make_socket_nonblocking(fd);
-        bev = bufferevent_socket_new(mctx->ev_base, fd, BEV_OPT_CLOSE_ON_FREE);
-        bufferevent_setcb(bev, mamsock_readcb, NULL, mamsock_errorcb, (void *) ctx);
-        bufferevent_setwatermark(bev, EV_READ, MIN_BUF, MAX_BUF);
-        bufferevent_enable(bev, EV_READ|EV_WRITE);
+		setup_client(mctx, NULL, fd);
 		printf("do_accept done\n");
     }
 }
@@ -319,6 +488,67 @@ static int do_listen(mam_context_t *ctx, evutil_socket_t listener, struct sockad
 
 }
 
+/** call the init callback of the loaded policy and set up the per-worker policy contexts
+ */
+static int init_policy_module(mam_context_t *ctx)
+{
+	int i;
+	int (*init_function)() = NULL;
+	int (*init_worker_function)(mam_context_t *, mam_worker_t *) = NULL;
+
+	if (_mam_fetch_policy_function(ctx->policy, "init", (void **)&init_function) != 0)
+		return -1;
+
+	init_function(ctx);
+
+	/* set up per-worker policy contexts */
+	if (_mam_fetch_policy_function(ctx->policy, "init_worker", (void **)&init_worker_function) == 0)
+	{
+		for (i = 0; i < ctx->num_workers; i++)
+			init_worker_function(ctx, &(ctx->workers[i]));
+	}
+
+	return 0;
+}
+
+/** tear down the per-worker policy contexts and call the cleanup callback of the loaded policy
+ */
+static int deinit_policy_module(mam_context_t *ctx)
+{
+	int ret;
+	int i;
+	int (*cleanup_function)() = NULL;
+	int (*cleanup_worker_function)(mam_context_t *, mam_worker_t *) = NULL;
+	
+	/* tear down per-worker policy contexts */
+	if (_mam_fetch_policy_function(ctx->policy, "cleanup_worker", (void **) &cleanup_worker_function) == 0)
+	{
+		for (i = 0; i < ctx->num_workers; i++)
+		{
+			cleanup_worker_function(ctx, &(ctx->workers[i]));
+			ctx->workers[i].policy_data = NULL;
+		}
+	}
+
+	if (_mam_fetch_policy_function(ctx->policy, "cleanup", (void **) &cleanup_function) == 0)
+	{
+		/* Call policy module function */
+		DLOG(MAM_MASTER_NOISY_DEBUG1, "calling policy cleanup callback\n");
+		ret = cleanup_function(ctx);
+		if (ret != 0)
+		{
+			DLOG(1, "cleanup callback returned %d\n", ret);
+		}
+	}
+	else
+	{
+		DLOG(MAM_MASTER_NOISY_DEBUG1, "policy has no cleanup callback\n");
+		ret = -1;
+	}
+
+	return(ret);
+}
+
 /** Initialize the dynamic loader using libltdl,
  *  load the policy module from a file given by filename
  *  and call its init() function
@@ -330,7 +560,6 @@ static int setup_policy_module(mam_context_t *ctx, const char *filename)
 	const char *ltdl_error = NULL;
 
 	lt_dlhandle mam_policy;
-	int (*init_function)() = NULL;
 
 	if (NULL != (mam_policy = lt_dlopen(filename)))
 	{
@@ -354,17 +583,20 @@ static int setup_policy_module(mam_context_t *ctx, const char *filename)
 	/* publish policy */
 	ctx->policy = mam_policy;
 	
-	if (_mam_fetch_policy_function(mam_policy, "init", (void **)&init_function) == 0)
-	{
-		init_function(ctx);
-	}
-	else
+	if (init_policy_module(ctx) != 0)
 	{
 		DLOG(MAM_MASTER_NOISY_DEBUG1, "module %s could not be initialized", filename);
 		return -1;
 	}
 
-	
+	/* check whether the policy may be called from several workers at once */
+	int *threadsafe = NULL;
+	ctx->policy_threadsafe = (_mam_fetch_policy_function(mam_policy, "policy_threadsafe", (void **)&threadsafe) == 0 && threadsafe != NULL && *threadsafe);
+	if (ctx->num_workers > 0 && !ctx->policy_threadsafe)
+	{
+		DLOG(MAM_MASTER_NOISY_DEBUG0, "policy is not thread-safe - serving new clients from the main event loop\n");
+	}
+
 	return 0;
 }
 
@@ -372,30 +604,102 @@ static int setup_policy_module(mam_context_t *ctx, const char *filename)
   */
 static int cleanup_policy_module(mam_context_t *ctx) {
 	
-	int ret;
-	int (*cleanup_function)() = NULL;
-	
-	if (_mam_fetch_policy_function(ctx->policy, "cleanup", (void **) &cleanup_function) == 0)
+	int ret = deinit_policy_module(ctx);
+
+	ctx->policy = NULL;
+	return(ret);
+}
+
+/** Policy is being re-initialized around the prefix changes of the current batch */
+static int policy_reinit = 0;
+
+/** Prefixes added in the current batch, configured and announced to the policy at its end */
+static GSList *prefixes_added = NULL;
+
+/** Hand changes of the prefix list to the policy
+ *
+ *  New prefixes get their configuration from the config file first, which is
+ *  parsed once for all prefixes added in a batch. Policies that implement
+ *  on_prefix_change() are told about each change and keep their state - new
+ *  prefixes are announced once they are configured, at the end of the batch.
+ *  All other policies are cleaned up before the first change of a batch and
+ *  initialized again after the last one, as they may hold pointers to the prefixes.
+ *  Called with the policy_lock held for writing.
+ */
+static void prefix_changed(mam_context_t *ctx, struct src_prefix_list *pfx, int event)
+{
+	int (*change_function)(mam_context_t *, struct src_prefix_list *, int) = NULL;
+	GSList *added;
+
+	/* new prefixes start with what has been measured on them before */
+	if (event == MAM_PREFIX_ADDED)
+		mam_history_seed(pfx, ctx);
+	else if (event == MAM_PREFIX_REMOVED)
+		mam_probe_forget(pfx);
+
+	/* prefixes are (re)configured along with the policy */
+	if (ctx->policy == NULL)
 	{
-		/* Call policy module function */
-		DLOG(MAM_MASTER_NOISY_DEBUG1, "calling policy cleanup callback\n");
-		ret = cleanup_function(ctx);
-		if (ret != 0)
-		{
-			DLOG(1, "cleanup callback returned %d\n", ret);
-		}
-		return(ret);
+		g_slist_free(prefixes_added);
+		prefixes_added = NULL;
+		return;
 	}
-	else
+
+	if (_mam_fetch_policy_function(ctx->policy, "on_prefix_change", (void **) &change_function) != 0)
+		change_function = NULL;
+
+	switch (event)
 	{
-		DLOG(MAM_MASTER_NOISY_DEBUG1, "policy has no cleanup callback\n");
-		ret = -1;
+		case MAM_PREFIX_UPDATE_START:
+			if (change_function == NULL)
+			{
+				DLOG(MAM_MASTER_NOISY_DEBUG1, "prefixes are changing - cleaning up policy\n");
+				deinit_policy_module(ctx);
+				policy_reinit = 1;
+			}
+			break;
+		case MAM_PREFIX_ADDED:
+			prefixes_added = g_slist_append(prefixes_added, pfx);
+			return;
+		case MAM_PREFIX_CHANGED:
+			/* not announced yet - the policy gets to see it as it is at the end of the batch */
+			if (g_slist_find(prefixes_added, pfx) != NULL)
+				return;
+			break;
+		case MAM_PREFIX_REMOVED:
+			/* cached answers are keyed by the prefix */
+			mam_dns_flush(ctx);
+			if (g_slist_find(prefixes_added, pfx) != NULL)
+			{
+				prefixes_added = g_slist_remove(prefixes_added, pfx);
+				return;
+			}
+			break;
+		case MAM_PREFIX_UPDATE_DONE:
+			mam_configure_prefixes(config_fd, ctx, prefixes_added);
+			if (policy_reinit)
+			{
+				DLOG(MAM_MASTER_NOISY_DEBUG1, "prefixes have changed - initializing policy\n");
+				policy_reinit = 0;
+				init_policy_module(ctx);
+			}
+			if (change_function != NULL)
+			{
+				for (added = prefixes_added; added != NULL; added = added->next)
+					change_function(ctx, added->data, MAM_PREFIX_ADDED);
+			}
+			g_slist_free(prefixes_added);
+			prefixes_added = NULL;
+			break;
+		default:
+			break;
 	}
-	
-	ctx->policy = NULL;
-	return(ret);
-}
 
+	if (change_function != NULL)
+		change_function(ctx, pfx, event);
+
+	if (MAM_MASTER_NOISY_DEBUG2 && event == MAM_PREFIX_UPDATE_DONE) mam_print_context(ctx);
+}
 
 /** read config an (re)load policy module
  */
@@ -403,6 +707,9 @@ static void configure_mamma() {
 	
 	char *policy_filename = NULL;
 	
+	/* make sure no worker is inside the policy while we swap it */
+	pthread_rwlock_wrlock(&(global_mctx->policy_lock));
+
 	/* clean up old policy module of present */
 	if(global_mctx->policy != NULL)
 	{
@@ -433,6 +740,8 @@ static void configure_mamma() {
 		DLOG(1, "no policy module given - mamma is useless...\n");
 	}
 	
+	pthread_rwlock_unlock(&(global_mctx->policy_lock));
+
 	DLOG(MAM_MASTER_NOISY_DEBUG1, "(re)configuration done\n");
 	
 }
@@ -467,9 +776,33 @@ main(int c, char **v)
     struct event *term_event, *int_event, *hup_event, *usr1_event;
     struct sockaddr_un sun;
 	int ret;
+	int opt;
+	int num_workers = 0;
+	char *history_file = NULL;
+	char *metrics_address = NULL;
 
     setvbuf(stderr, NULL, _IONBF, 0);
 
+	/* parse command line */
+	while ((opt = getopt(c, v, "w:H:m:")) != -1)
+	{
+		switch (opt)
+		{
+			case 'w':
+				num_workers = atoi(optarg);
+				break;
+			case 'H':
+				history_file = optarg;
+				break;
+			case 'm':
+				metrics_address = optarg;
+				break;
+			default:
+				DLOG(1, "usage: %s [-w workers] [-H history_file] [-m metrics_socket|[address:]port] config_file\n", v[0]);
+				exit(1);
+		}
+	}
+
 	/* create mam context */
 	DLOG(MAM_MASTER_NOISY_DEBUG1, "setting up mam context\n");
 	global_mctx = mam_create_context();
@@ -478,8 +811,13 @@ main(int c, char **v)
         exit(1);
     }
 	
-	/* set up libevent */
+	/* set up libevent - locking has to be enabled before any base is created */
 	DLOG(MAM_MASTER_NOISY_DEBUG1, "setting up event base\n");
+	if (num_workers > 0 && evthread_use_pthreads() != 0)
+	{
+		DLOG(1, "enabling libevent thread support failed\n");
+		exit(1);
+	}
     global_mctx->ev_base = event_base_new();
     if (!global_mctx->ev_base) {
 		/* will log error on it's own */
@@ -511,27 +849,56 @@ main(int c, char **v)
 	event_add(usr1_event, NULL);
 	
 	/* open config file */
-	if ( c < 2 )
+	if ( optind >= c )
 	{
 		DLOG(1, "no config file specified\n");
 		exit(1);
 	}
-	else if ( (config_fd = open(v[1], O_RDONLY)) == -1 )
+	else if ( (config_fd = open(v[optind], O_RDONLY)) == -1 )
 	{
-		DLOG(1, "opening config file %s failed: %s\n", v[1], strerror(errno));
+		DLOG(1, "opening config file %s failed: %s\n", v[optind], strerror(errno));
 		exit(1);
 	} 
 	
+	/* start worker event loops */
+	if (0 > start_workers(global_mctx, num_workers))
+	{
+		DLOG(1, "failed to start workers\n");
+		exit(1);
+	}
+
+	/* load measurement history - prefixes are seeded from it as they are added */
+	if (history_file != NULL && 0 > mam_history_open(history_file))
+	{
+		DLOG(MAM_MASTER_NOISY_DEBUG0, "not using history file %s\n", history_file);
+	}
+
 	/* apply config and read policy */
+	global_mctx->prefix_hook = &prefix_changed;
 	configure_mamma();
 
+	/* follow interface and address changes */
+	if (0 > mam_netlink_start(global_mctx))
+	{
+		DLOG(MAM_MASTER_NOISY_DEBUG0, "not tracking interface changes - send SIGHUP to rescan\n");
+	}
+
 	/* pmeasure event */
-	pmeasure_setup();
+	pmeasure_setup(global_mctx);
 	struct event *pmeasure_event;
 	struct timeval ten_seconds = {10, 0};
 	pmeasure_event = event_new(global_mctx->ev_base, -1, EV_PERSIST, pmeasure_callback, global_mctx);
 	evtimer_add(pmeasure_event, &ten_seconds);
 
+	/* probe event - does nothing unless probe targets are configured */
+	mam_probe_setup(global_mctx);
+
+	/* metrics endpoint */
+	if (metrics_address != NULL && 0 > mam_metrics_setup(global_mctx, metrics_address))
+	{
+		DLOG(MAM_MASTER_NOISY_DEBUG0, "not serving metrics\n");
+	}
+
 	/* set mam socket */
 	DLOG(MAM_MASTER_NOISY_DEBUG1, "setting up mamma's socket %s\n", MUACC_SOCKET);
 	sun.sun_family = AF_UNIX;
@@ -559,8 +926,14 @@ main(int c, char **v)
 	DLOG(MAM_MASTER_NOISY_DEBUG1, "cleaning up\n");
     close(listener);
     unlink(MUACC_SOCKET);
+	mam_netlink_stop(global_mctx);
+	stop_workers(global_mctx);
 	cleanup_policy_module(global_mctx);
+	free_workers(global_mctx);
 	pmeasure_cleanup();
+	mam_probe_cleanup();
+	mam_metrics_cleanup();
+	mam_history_close();
 	mam_release_context(global_mctx);
 	lt_dlexit();
 	DLOG(MAM_MASTER_NOISY_DEBUG1, "exiting\n");
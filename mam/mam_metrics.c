@@ -0,0 +1,545 @@
+/** \file mam_metrics.c
+ *  \brief Request, policy and DNS metrics of the MAM in Prometheus text format
+ *
+ *  All counters are updated with relaxed atomic operations, so workers never
+ *  wait for each other or for a scrape. A scrape may therefore see a sample
+ *  in a bucket before it is in the sum - the count of each histogram is
+ *  derived from its buckets, so both stay consistent with each other.
+ *
+ *  \copyright Copyright 2013-2015 Philipp Schmidt, Theresa Enghardt, and Mirko Palmer.
+ *  All rights reserved. This project is released under the New BSD License.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <inttypes.h>
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <netinet/in.h>
+
+#include <event2/event.h>
+#include <event2/buffer.h>
+#include <event2/bufferevent.h>
+#include <event2/util.h>
+
+#include "clib/dlog.h"
+#include "clib/strbuf.h"
+
+#include "mam.h"
+#include "mam_metrics.h"
+
+#ifndef MAM_METRICS_NOISY_DEBUG0
+#define MAM_METRICS_NOISY_DEBUG0 1
+#endif
+
+#ifndef MAM_METRICS_NOISY_DEBUG1
+#define MAM_METRICS_NOISY_DEBUG1 0
+#endif
+
+/** Request types the metrics are kept for */
+#define METRICS_ACTION_RESOLVE			0
+#define METRICS_ACTION_CONNECT			1
+#define METRICS_ACTION_SOCKETCONNECT	2
+#define METRICS_ACTION_SOCKETCHOOSE		3
+#define METRICS_ACTION_FLOWSTATS		4
+#define METRICS_ACTION_OTHER			5
+#define METRICS_ACTIONS					6
+
+static const char *metrics_action_names[METRICS_ACTIONS] = {
+	"resolve", "connect", "socketconnect", "socketchoose", "flowstats", "other"
+};
+
+/** Policy callbacks, in the order of their MAM_POLICY_*_CALLED flags */
+#define METRICS_CALLBACKS 4
+
+static const char *metrics_callback_names[METRICS_CALLBACKS] = {
+	"on_resolve_request", "on_connect_request", "on_socketconnect_request", "on_socketchoose_request"
+};
+
+static const char *metrics_dns_result_names[MAM_METRICS_DNS_RESULTS] = {
+	"hit", "stale", "miss"
+};
+
+static uint64_t requests[METRICS_ACTIONS];
+static int64_t requests_in_flight = 0;
+static struct mam_histogram request_duration[METRICS_ACTIONS];
+static struct mam_histogram callback_duration[METRICS_CALLBACKS];
+static uint64_t dns_cache_requests[MAM_METRICS_DNS_RESULTS];
+static uint64_t dns_lookup_errors = 0;
+static struct mam_histogram dns_lookup_duration;
+
+static mam_context_t *metrics_ctx = NULL;
+static evutil_socket_t metrics_listener = -1;
+static struct event *metrics_event = NULL;
+static char *metrics_path = NULL;			/**< Path of the unix socket, to unlink it on cleanup */
+
+uint64_t mam_metrics_now()
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t) ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+/** log2 of MAM_METRICS_SUB_BUCKETS */
+static int _metrics_sub_bits()
+{
+	return __builtin_ctz(MAM_METRICS_SUB_BUCKETS);
+}
+
+/** Bucket of a sample - bucket i holds the samples up to and including _metrics_bucket_bound(i) */
+static int _metrics_bucket(uint64_t usec)
+{
+	uint64_t x = (usec > 0 ? usec - 1 : 0);
+	int pow, sub_bits = _metrics_sub_bits();
+
+	if (x < MAM_METRICS_SUB_BUCKETS)
+		return (int) x;
+
+	pow = 63 - __builtin_clzll(x);
+	if (pow >= MAM_METRICS_MAX_POW)
+		return MAM_METRICS_BUCKETS - 1;
+
+	return MAM_METRICS_SUB_BUCKETS * (pow - sub_bits + 1) + (int) ((x >> (pow - sub_bits)) - MAM_METRICS_SUB_BUCKETS);
+}
+
+/** Largest sample of a bucket in microseconds, UINT64_MAX for the overflow bucket */
+static uint64_t _metrics_bucket_bound(int i)
+{
+	int pow, sub_bits = _metrics_sub_bits();
+
+	if (i >= MAM_METRICS_BUCKETS - 1)
+		return UINT64_MAX;
+	if (i < MAM_METRICS_SUB_BUCKETS)
+		return i + 1;
+
+	pow = i / MAM_METRICS_SUB_BUCKETS + sub_bits - 1;
+	return (uint64_t) (MAM_METRICS_SUB_BUCKETS + i % MAM_METRICS_SUB_BUCKETS + 1) << (pow - sub_bits);
+}
+
+void mam_histogram_add(struct mam_histogram *h, uint64_t usec)
+{
+	__atomic_fetch_add(&(h->buckets[_metrics_bucket(usec)]), 1, __ATOMIC_RELAXED);
+	__atomic_fetch_add(&(h->sum), usec, __ATOMIC_RELAXED);
+}
+
+static int _metrics_action(muacc_mam_action_t action)
+{
+	switch (action)
+	{
+		case muacc_act_getaddrinfo_resolve_req:
+			return METRICS_ACTION_RESOLVE;
+		case muacc_act_connect_req:
+			return METRICS_ACTION_CONNECT;
+		case muacc_act_socketconnect_req:
+		case muacc_act_socketconnect_fallback:
+			return METRICS_ACTION_SOCKETCONNECT;
+		case muacc_act_socketchoose_req:
+			return METRICS_ACTION_SOCKETCHOOSE;
+		case muacc_act_flowstats_report:
+			return METRICS_ACTION_FLOWSTATS;
+		default:
+			return METRICS_ACTION_OTHER;
+	}
+}
+
+void mam_metrics_request_received(request_context_t *ctx)
+{
+	ctx->received = mam_metrics_now();
+	__atomic_fetch_add(&(requests[_metrics_action(ctx->action)]), 1, __ATOMIC_RELAXED);
+	__atomic_fetch_add(&requests_in_flight, 1, __ATOMIC_RELAXED);
+}
+
+void mam_metrics_request_done(request_context_t *ctx)
+{
+	if (ctx->received == 0)
+		return;
+
+	mam_histogram_add(&(request_duration[_metrics_action(ctx->action)]), mam_metrics_now() - ctx->received);
+	__atomic_fetch_sub(&requests_in_flight, 1, __ATOMIC_RELAXED);
+	ctx->received = 0;
+}
+
+void mam_metrics_policy_call(unsigned int callback_flag, uint64_t start)
+{
+	int i;
+
+	for (i = 0; i < METRICS_CALLBACKS; i++)
+	{
+		if (callback_flag == (1u << i))
+		{
+			mam_histogram_add(&(callback_duration[i]), mam_metrics_now() - start);
+			return;
+		}
+	}
+}
+
+void mam_metrics_dns_cache(int result)
+{
+	if (result >= 0 && result < MAM_METRICS_DNS_RESULTS)
+		__atomic_fetch_add(&(dns_cache_requests[result]), 1, __ATOMIC_RELAXED);
+}
+
+void mam_metrics_dns_lookup(uint64_t start, int errcode)
+{
+	mam_histogram_add(&dns_lookup_duration, mam_metrics_now() - start);
+	if (errcode != 0)
+		__atomic_fetch_add(&dns_lookup_errors, 1, __ATOMIC_RELAXED);
+}
+
+/** Print a duration in microseconds as seconds, without losing precision */
+static void _metrics_print_seconds(strbuf_t *sb, uint64_t usec)
+{
+	strbuf_printf(sb, "%" PRIu64 ".%06" PRIu64, usec / 1000000, usec % 1000000);
+}
+
+/** Take a snapshot of a histogram, returning the number of samples */
+static uint64_t _metrics_snapshot(const struct mam_histogram *h, uint64_t *buckets, uint64_t *sum)
+{
+	uint64_t count = 0;
+	int i;
+
+	for (i = 0; i < MAM_METRICS_BUCKETS; i++)
+	{
+		buckets[i] = __atomic_load_n(&(h->buckets[i]), __ATOMIC_RELAXED);
+		count += buckets[i];
+	}
+	*sum = __atomic_load_n(&(h->sum), __ATOMIC_RELAXED);
+
+	return count;
+}
+
+/** Print the samples of a histogram with the given label, with a bucket for each power of two */
+static void _metrics_print_histogram(strbuf_t *sb, const char *name, const char *label, const char *value, const struct mam_histogram *h)
+{
+	uint64_t buckets[MAM_METRICS_BUCKETS];
+	uint64_t sum, count, cumulative = 0;
+	char labels[128] = "";
+	int i;
+
+	if (label != NULL)
+		snprintf(labels, sizeof(labels), "%s=\"%s\",", label, value);
+
+	count = _metrics_snapshot(h, buckets, &sum);
+
+	for (i = 0; i < MAM_METRICS_BUCKETS - 1; i++)
+	{
+		uint64_t bound = _metrics_bucket_bound(i);
+
+		cumulative += buckets[i];
+		if ((bound & (bound - 1)) == 0)
+		{
+			strbuf_printf(sb, "%s_bucket{%sle=\"", name, labels);
+			_metrics_print_seconds(sb, bound);
+			strbuf_printf(sb, "\"} %" PRIu64 "\n", cumulative);
+		}
+	}
+	strbuf_printf(sb, "%s_bucket{%sle=\"+Inf\"} %" PRIu64 "\n", name, labels, count);
+
+	labels[strlen(labels) > 0 ? strlen(labels) - 1 : 0] = '\0';
+	strbuf_printf(sb, "%s_sum%s%s%s ", name, (label != NULL ? "{" : ""), labels, (label != NULL ? "}" : ""));
+	_metrics_print_seconds(sb, sum);
+	strbuf_printf(sb, "\n%s_count%s%s%s %" PRIu64 "\n", name, (label != NULL ? "{" : ""), labels, (label != NULL ? "}" : ""), count);
+}
+
+/** Upper bound of the bucket that holds the given quantile of a histogram snapshot */
+static uint64_t _metrics_quantile(const uint64_t *buckets, uint64_t count, double q)
+{
+	uint64_t rank = (uint64_t) (q * count + 0.5);
+	uint64_t cumulative = 0;
+	int i;
+
+	if (rank == 0)
+		rank = 1;
+
+	for (i = 0; i < MAM_METRICS_BUCKETS - 1; i++)
+	{
+		cumulative += buckets[i];
+		if (cumulative >= rank)
+			return _metrics_bucket_bound(i);
+	}
+
+	/* overflow bucket - report its lower bound */
+	return _metrics_bucket_bound(MAM_METRICS_BUCKETS - 2);
+}
+
+/** Count the clients of all shards of the client table */
+static unsigned int _metrics_clients(mam_context_t *ctx)
+{
+	unsigned int clients = 0;
+	int i;
+
+	for (i = 0; i < MAM_CLIENT_SHARDS; i++)
+	{
+		pthread_mutex_lock(&(ctx->clients[i].lock));
+		clients += g_hash_table_size(ctx->clients[i].clients);
+		pthread_mutex_unlock(&(ctx->clients[i].lock));
+	}
+
+	return clients;
+}
+
+void mam_metrics_print(strbuf_t *sb, mam_context_t *ctx)
+{
+	static const double quantiles[] = {0.5, 0.99, 0.999};
+	static const char *quantile_names[] = {"0.5", "0.99", "0.999"};
+	uint64_t buckets[MAM_METRICS_BUCKETS];
+	uint64_t sum, count;
+	unsigned int dns_entries = 0;
+	int i, j;
+
+	strbuf_printf(sb, "# HELP mam_requests_total Requests read from clients.\n");
+	strbuf_printf(sb, "# TYPE mam_requests_total counter\n");
+	for (i = 0; i < METRICS_ACTIONS; i++)
+		strbuf_printf(sb, "mam_requests_total{action=\"%s\"} %" PRIu64 "\n", metrics_action_names[i], __atomic_load_n(&(requests[i]), __ATOMIC_RELAXED));
+
+	strbuf_printf(sb, "# HELP mam_requests_in_flight Requests read from clients that have not been answered yet.\n");
+	strbuf_printf(sb, "# TYPE mam_requests_in_flight gauge\n");
+	strbuf_printf(sb, "mam_requests_in_flight %" PRId64 "\n", __atomic_load_n(&requests_in_flight, __ATOMIC_RELAXED));
+
+	strbuf_printf(sb, "# HELP mam_request_duration_seconds Time from reading a request until it has been answered.\n");
+	strbuf_printf(sb, "# TYPE mam_request_duration_seconds histogram\n");
+	for (i = 0; i < METRICS_ACTIONS; i++)
+		_metrics_print_histogram(sb, "mam_request_duration_seconds", "action", metrics_action_names[i], &(request_duration[i]));
+
+	strbuf_printf(sb, "# HELP mam_request_duration_quantile_seconds Quantiles of mam_request_duration_seconds, within 25%%.\n");
+	strbuf_printf(sb, "# TYPE mam_request_duration_quantile_seconds gauge\n");
+	for (i = 0; i < METRICS_ACTIONS; i++)
+	{
+		if ((count = _metrics_snapshot(&(request_duration[i]), buckets, &sum)) == 0)
+			continue;
+		for (j = 0; j < 3; j++)
+		{
+			strbuf_printf(sb, "mam_request_duration_quantile_seconds{action=\"%s\",quantile=\"%s\"} ", metrics_action_names[i], quantile_names[j]);
+			_metrics_print_seconds(sb, _metrics_quantile(buckets, count, quantiles[j]));
+			strbuf_printf(sb, "\n");
+		}
+	}
+
+	strbuf_printf(sb, "# HELP mam_policy_callback_duration_seconds Time spent in the request callbacks of the policy.\n");
+	strbuf_printf(sb, "# TYPE mam_policy_callback_duration_seconds histogram\n");
+	for (i = 0; i < METRICS_CALLBACKS; i++)
+		_metrics_print_histogram(sb, "mam_policy_callback_duration_seconds", "callback", metrics_callback_names[i], &(callback_duration[i]));
+
+	strbuf_printf(sb, "# HELP mam_dns_cache_requests_total Lookups through the DNS cache by how they were answered.\n");
+	strbuf_printf(sb, "# TYPE mam_dns_cache_requests_total counter\n");
+	for (i = 0; i < MAM_METRICS_DNS_RESULTS; i++)
+		strbuf_printf(sb, "mam_dns_cache_requests_total{result=\"%s\"} %" PRIu64 "\n", metrics_dns_result_names[i], __atomic_load_n(&(dns_cache_requests[i]), __ATOMIC_RELAXED));
+
+	strbuf_printf(sb, "# HELP mam_dns_lookup_duration_seconds Time evdns took to answer the lookups of the DNS cache.\n");
+	strbuf_printf(sb, "# TYPE mam_dns_lookup_duration_seconds histogram\n");
+	_metrics_print_histogram(sb, "mam_dns_lookup_duration_seconds", NULL, NULL, &dns_lookup_duration);
+
+	strbuf_printf(sb, "# HELP mam_dns_lookup_errors_total Lookups of the DNS cache that evdns answered with an error.\n");
+	strbuf_printf(sb, "# TYPE mam_dns_lookup_errors_total counter\n");
+	strbuf_printf(sb, "mam_dns_lookup_errors_total %" PRIu64 "\n", __atomic_load_n(&dns_lookup_errors, __ATOMIC_RELAXED));
+
+	if (ctx == NULL)
+		return;
+
+	pthread_mutex_lock(&(ctx->dns_cache_lock));
+	dns_entries = g_hash_table_size(ctx->dns_cache);
+	pthread_mutex_unlock(&(ctx->dns_cache_lock));
+
+	strbuf_printf(sb, "# HELP mam_dns_cache_entries Entries of the DNS cache.\n");
+	strbuf_printf(sb, "# TYPE mam_dns_cache_entries gauge\n");
+	strbuf_printf(sb, "mam_dns_cache_entries %u\n", dns_entries);
+
+	strbuf_printf(sb, "# HELP mam_clients_connected Clients connected to the MAM.\n");
+	strbuf_printf(sb, "# TYPE mam_clients_connected gauge\n");
+	strbuf_printf(sb, "mam_clients_connected %u\n", _metrics_clients(ctx));
+
+	strbuf_printf(sb, "# HELP mam_workers Worker event loops serving clients.\n");
+	strbuf_printf(sb, "# TYPE mam_workers gauge\n");
+	strbuf_printf(sb, "mam_workers %d\n", ctx->num_workers);
+}
+
+/** Close the connection once the response has been written */
+static void _metrics_writecb(struct bufferevent *bev, void *arg)
+{
+	if (evbuffer_get_length(bufferevent_get_output(bev)) == 0)
+		bufferevent_free(bev);
+}
+
+static void _metrics_errorcb(struct bufferevent *bev, short what, void *arg)
+{
+	bufferevent_free(bev);
+}
+
+/** Answer the HTTP request of a client once its header is complete */
+static void _metrics_readcb(struct bufferevent *bev, void *arg)
+{
+	struct evbuffer *in = bufferevent_get_input(bev);
+	struct evbuffer *out = bufferevent_get_output(bev);
+	struct evbuffer_ptr end;
+	char method[5] = "";
+	strbuf_t sb;
+
+	end = evbuffer_search(in, "\r\n\r\n", 4, NULL);
+	if (end.pos < 0)
+		end = evbuffer_search(in, "\n\n", 2, NULL);
+	if (end.pos < 0)
+	{
+		if (evbuffer_get_length(in) > MAM_METRICS_MAX_REQUEST)
+		{
+			DLOG(MAM_METRICS_NOISY_DEBUG1, "request too long - closing connection\n");
+			bufferevent_free(bev);
+		}
+		return;
+	}
+
+	evbuffer_copyout(in, method, 4);
+	bufferevent_disable(bev, EV_READ);
+	bufferevent_setcb(bev, NULL, &_metrics_writecb, &_metrics_errorcb, NULL);
+
+	if (strcmp(method, "GET ") != 0)
+	{
+		evbuffer_add_printf(out, "HTTP/1.0 405 Method Not Allowed\r\nAllow: GET\r\nContent-Length: 0\r\nConnection: close\r\n\r\n");
+		return;
+	}
+
+	strbuf_init(&sb);
+	mam_metrics_print(&sb, metrics_ctx);
+
+	evbuffer_add_printf(out, "HTTP/1.0 200 OK\r\nContent-Type: text/plain; version=0.0.4\r\nContent-Length: %zu\r\nConnection: close\r\n\r\n", sb.pos);
+	evbuffer_add(out, strbuf_export(&sb), sb.pos);
+	strbuf_release(&sb);
+}
+
+/** Accept a client of the metrics endpoint */
+static void _metrics_accept(evutil_socket_t listener, short event, void *arg)
+{
+	struct event_base *base = arg;
+	struct bufferevent *bev;
+	struct timeval timeout = {MAM_METRICS_TIMEOUT, 0};
+	evutil_socket_t fd;
+
+	if ((fd = accept(listener, NULL, NULL)) < 0)
+	{
+		DLOG(MAM_METRICS_NOISY_DEBUG1, "accept failed: %s\n", strerror(errno));
+		return;
+	}
+
+	evutil_make_socket_nonblocking(fd);
+	if ((bev = bufferevent_socket_new(base, fd, BEV_OPT_CLOSE_ON_FREE)) == NULL)
+	{
+		evutil_closesocket(fd);
+		return;
+	}
+	bufferevent_setcb(bev, &_metrics_readcb, NULL, &_metrics_errorcb, NULL);
+	bufferevent_set_timeouts(bev, &timeout, &timeout);
+	bufferevent_enable(bev, EV_READ|EV_WRITE);
+}
+
+/** Parse the address of the endpoint - a unix socket path, a port, or address:port */
+static int _metrics_parse_address(const char *address, struct sockaddr_storage *ss, int *ss_len)
+{
+	struct sockaddr_un *sun = (struct sockaddr_un *) ss;
+	char buf[64];
+
+	memset(ss, 0x00, sizeof(struct sockaddr_storage));
+
+	if (strchr(address, '/') != NULL)
+	{
+		if (strlen(address) >= sizeof(sun->sun_path))
+			return -1;
+		sun->sun_family = AF_UNIX;
+		#ifdef HAVE_SOCKADDR_LEN
+		sun->sun_len = sizeof(struct sockaddr_un);
+		#endif
+		strncpy(sun->sun_path, address, sizeof(sun->sun_path) - 1);
+		*ss_len = sizeof(struct sockaddr_un);
+		return 0;
+	}
+
+	if (strspn(address, "0123456789") == strlen(address))
+	{
+		/* only a port - stay local */
+		snprintf(buf, sizeof(buf), "127.0.0.1:%s", address);
+		address = buf;
+	}
+
+	*ss_len = sizeof(struct sockaddr_storage);
+	return evutil_parse_sockaddr_port(address, (struct sockaddr *) ss, ss_len);
+}
+
+int mam_metrics_setup(mam_context_t *ctx, const char *address)
+{
+	struct sockaddr_storage ss;
+	struct stat st;
+	int ss_len;
+	int one = 1;
+
+	if (ctx == NULL || address == NULL || metrics_listener >= 0)
+		return -1;
+
+	if (_metrics_parse_address(address, &ss, &ss_len) != 0)
+	{
+		DLOG(MAM_METRICS_NOISY_DEBUG0, "cannot parse metrics address %s\n", address);
+		return -1;
+	}
+
+	if (ss.ss_family == AF_UNIX && stat(address, &st) == 0)
+	{
+		/* replace a socket left over by an earlier run, but nothing else */
+		if (!S_ISSOCK(st.st_mode))
+		{
+			DLOG(MAM_METRICS_NOISY_DEBUG0, "cannot serve metrics on %s: File exists\n", address);
+			return -1;
+		}
+		unlink(address);
+	}
+
+	if ((metrics_listener = socket(ss.ss_family, SOCK_STREAM, 0)) < 0)
+	{
+		DLOG(MAM_METRICS_NOISY_DEBUG0, "cannot create metrics socket: %s\n", strerror(errno));
+		return -1;
+	}
+	setsockopt(metrics_listener, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+	evutil_make_socket_nonblocking(metrics_listener);
+
+	if (bind(metrics_listener, (struct sockaddr *) &ss, ss_len) != 0 || listen(metrics_listener, 8) != 0)
+	{
+		DLOG(MAM_METRICS_NOISY_DEBUG0, "cannot serve metrics on %s: %s\n", address, strerror(errno));
+		evutil_closesocket(metrics_listener);
+		metrics_listener = -1;
+		return -1;
+	}
+
+	if (ss.ss_family == AF_UNIX)
+		metrics_path = strdup(address);
+
+	metrics_ctx = ctx;
+	metrics_event = event_new(ctx->ev_base, metrics_listener, EV_READ|EV_PERSIST, &_metrics_accept, ctx->ev_base);
+	event_add(metrics_event, NULL);
+
+	DLOG(MAM_METRICS_NOISY_DEBUG0, "serving metrics on %s\n", address);
+	return 0;
+}
+
+void mam_metrics_cleanup()
+{
+	if (metrics_event != NULL)
+	{
+		event_free(metrics_event);
+		metrics_event = NULL;
+	}
+	if (metrics_listener >= 0)
+	{
+		evutil_closesocket(metrics_listener);
+		metrics_listener = -1;
+	}
+	if (metrics_path != NULL)
+	{
+		unlink(metrics_path);
+		free(metrics_path);
+		metrics_path = NULL;
+	}
+	metrics_ctx = NULL;
+}
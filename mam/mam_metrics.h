@@ -0,0 +1,89 @@
+/** \file   mam/mam_metrics.h
+ *  \brief  Request, policy and DNS metrics of the MAM in Prometheus text format
+ *
+ *  Counters and histograms are updated lock-free from all workers. Latencies
+ *  are kept in microseconds in log-linear buckets: MAM_METRICS_SUB_BUCKETS
+ *  per power of two up to 2^MAM_METRICS_MAX_POW microseconds, so quantiles
+ *  are known to within 25%. They are exported as histograms with a bucket for
+ *  each power of two, plus p50/p99/p999 of the request durations.
+ *
+ *  mamma serves the metrics on a unix socket or a TCP port (-m), answering any
+ *  HTTP GET request, e.g. "curl --unix-socket /tmp/mam-metrics http://mam/metrics".
+ *
+ *  \copyright Copyright 2013-2015 Philipp Schmidt, Theresa Enghardt, and Mirko Palmer.
+ *  All rights reserved. This project is released under the New BSD License.
+ */
+#ifndef __MAM_METRICS_H__
+#define __MAM_METRICS_H__
+
+#include <stdint.h>
+
+#include "clib/strbuf.h"
+#include "mam.h"
+
+/** Linear buckets per power of two */
+#define MAM_METRICS_SUB_BUCKETS 4
+
+/** Latencies above 2^MAM_METRICS_MAX_POW microseconds (about 4.5 minutes) go into the overflow bucket */
+#define MAM_METRICS_MAX_POW 28
+
+/** Number of buckets of a histogram, including the overflow bucket */
+#define MAM_METRICS_BUCKETS (MAM_METRICS_SUB_BUCKETS * (MAM_METRICS_MAX_POW - 1) + 1)
+
+/** Maximum size of an HTTP request to the metrics endpoint */
+#define MAM_METRICS_MAX_REQUEST 8192
+
+/** Seconds a client of the metrics endpoint may take to send its request */
+#define MAM_METRICS_TIMEOUT 5
+
+/** Latency histogram in microseconds */
+struct mam_histogram {
+	uint64_t				buckets[MAM_METRICS_BUCKETS]; /**< Samples per bucket */
+	uint64_t				sum;		/**< Sum of all samples */
+};
+
+/** Current time in microseconds from a monotonic clock */
+uint64_t mam_metrics_now();
+
+/** Add a sample to a histogram */
+void mam_histogram_add(struct mam_histogram *h, uint64_t usec);
+
+/** Count a request that has been read completely and start timing it */
+void mam_metrics_request_received(request_context_t *ctx);
+
+/** Account the duration of a request - called once it has been answered or dropped */
+void mam_metrics_request_done(request_context_t *ctx);
+
+/** Account the time spent in a policy callback
+ *  The callback is given by its MAM_POLICY_*_CALLED flag
+ */
+void mam_metrics_policy_call(unsigned int callback_flag, uint64_t start);
+
+/** DNS cache results accounted by mam_metrics_dns_cache() */
+#define MAM_METRICS_DNS_HIT			0	/**< Answered from a fresh cache entry */
+#define MAM_METRICS_DNS_STALE		1	/**< Answered from a stale entry that is being revalidated */
+#define MAM_METRICS_DNS_MISS		2	/**< Had to wait for a lookup */
+#define MAM_METRICS_DNS_RESULTS		3
+
+/** Count a request to the DNS cache */
+void mam_metrics_dns_cache(int result);
+
+/** Account the latency of an evdns lookup that has been started at start */
+void mam_metrics_dns_lookup(uint64_t start, int errcode);
+
+/** Print all metrics in Prometheus text format */
+void mam_metrics_print(strbuf_t *sb, mam_context_t *ctx);
+
+/** Serve the metrics on the event base of the MAM context
+ *
+ *  address is either the path of a unix socket (anything containing a '/'),
+ *  "port" for the loopback address, or "address:port" / "[address]:port"
+ *
+ *  \return 0 on success, -1 otherwise
+ */
+int mam_metrics_setup(mam_context_t *ctx, const char *address);
+
+/** Stop serving the metrics */
+void mam_metrics_cleanup();
+
+#endif /* __MAM_METRICS_H__ */
@@ -0,0 +1,287 @@
+/** \file mam_netlink.c
+ *  \brief Tracking of interface and address changes through rtnetlink
+ *
+ *  The MAM subscribes to the link and address groups of rtnetlink and applies
+ *  the announcements to the prefix list as they arrive, instead of rescanning all
+ *  interfaces. If the kernel drops announcements because the socket buffer
+ *  overflowed, the prefix list is brought up to date by a full scan.
+ *
+ *  \copyright Copyright 2013-2015 Philipp Schmidt, Theresa Enghardt, and Mirko Palmer.
+ *  All rights reserved. This project is released under the New BSD License.
+ */
+
+#include <arpa/inet.h>
+#include <sys/ioctl.h>
+#include <sys/socket.h>
+#include <net/if.h>
+
+#include <linux/rtnetlink.h>
+#include <linux/if_addr.h>
+
+#include <netlink/netlink.h>
+#include <netlink/socket.h>
+#include <netlink/msg.h>
+#include <netlink/attr.h>
+
+#include "clib/dlog.h"
+
+#include "mam.h"
+
+#ifndef MAM_NETLINK_NOISY_DEBUG0
+#define MAM_NETLINK_NOISY_DEBUG0 1
+#endif
+
+#ifndef MAM_NETLINK_NOISY_DEBUG1
+#define MAM_NETLINK_NOISY_DEBUG1 0
+#endif
+
+#ifndef MAM_NETLINK_NOISY_DEBUG2
+#define MAM_NETLINK_NOISY_DEBUG2 0
+#endif
+
+/** Get the flags of an interface, 0 if it does not exist (any more) */
+static unsigned int _mam_netlink_if_flags(const char *if_name)
+{
+	struct ifreq ifr;
+	int sk;
+	unsigned int flags = 0;
+
+	if ((sk = socket(AF_INET, SOCK_DGRAM, 0)) < 0)
+		return 0;
+
+	memset(&ifr, 0x00, sizeof(ifr));
+	strncpy(ifr.ifr_name, if_name, IFNAMSIZ - 1);
+	if (ioctl(sk, SIOCGIFFLAGS, &ifr) == 0)
+		flags = (unsigned short) ifr.ifr_flags;
+
+	close(sk);
+	return flags;
+}
+
+/** Fill in a socket address and netmask from an address announcement */
+static int _mam_netlink_make_addr(
+	struct ifaddrmsg *ifa,
+	struct nlattr *attr,
+	struct sockaddr_storage *addr,
+	struct sockaddr_storage *mask)
+{
+	unsigned char *bytes;
+	int len, i;
+
+	memset(addr, 0x00, sizeof(struct sockaddr_storage));
+	memset(mask, 0x00, sizeof(struct sockaddr_storage));
+
+	if (ifa->ifa_family == AF_INET && nla_len(attr) >= sizeof(struct in_addr))
+	{
+		struct sockaddr_in *sin = (struct sockaddr_in *) addr;
+
+		sin->sin_family = AF_INET;
+		memcpy(&(sin->sin_addr), nla_data(attr), sizeof(struct in_addr));
+		((struct sockaddr_in *) mask)->sin_family = AF_INET;
+		bytes = (unsigned char *) &(((struct sockaddr_in *) mask)->sin_addr);
+		len = sizeof(struct in_addr);
+	}
+	else if (ifa->ifa_family == AF_INET6 && nla_len(attr) >= sizeof(struct in6_addr))
+	{
+		struct sockaddr_in6 *sin6 = (struct sockaddr_in6 *) addr;
+
+		sin6->sin6_family = AF_INET6;
+		memcpy(&(sin6->sin6_addr), nla_data(attr), sizeof(struct in6_addr));
+		/* getifaddrs() sets the scope id of link-local addresses, so do we */
+		if (IN6_IS_ADDR_LINKLOCAL(&(sin6->sin6_addr)))
+			sin6->sin6_scope_id = ifa->ifa_index;
+		((struct sockaddr_in6 *) mask)->sin6_family = AF_INET6;
+		bytes = (unsigned char *) &(((struct sockaddr_in6 *) mask)->sin6_addr);
+		len = sizeof(struct in6_addr);
+	}
+	else
+	{
+		return -1;
+	}
+
+	/* turn the prefix length into a netmask */
+	for (i = 0; i < len && i < ifa->ifa_prefixlen / 8; i++)
+		bytes[i] = 0xff;
+	if (i < len && ifa->ifa_prefixlen % 8 != 0)
+		bytes[i] = (unsigned char) (0xff << (8 - ifa->ifa_prefixlen % 8));
+
+	return 0;
+}
+
+/** Apply an RTM_NEWADDR or RTM_DELADDR message to the prefix list */
+static void _mam_netlink_addr(mam_context_t *ctx, struct nlmsghdr *nlh)
+{
+	struct ifaddrmsg *ifa = nlmsg_data(nlh);
+	struct nlattr *tb[IFA_MAX + 1];
+	struct nlattr *attr;
+	struct sockaddr_storage addr, mask;
+	char if_name_buf[IF_NAMESIZE];
+	char *if_name;
+	unsigned int if_flags;
+
+	if (nlmsg_parse(nlh, sizeof(struct ifaddrmsg), tb, IFA_MAX, NULL) < 0)
+		return;
+
+	if (ifa->ifa_family != AF_INET && ifa->ifa_family != AF_INET6)
+		return;
+
+	/* on point-to-point links IFA_ADDRESS holds the address of the peer */
+	attr = (tb[IFA_LOCAL] != NULL ? tb[IFA_LOCAL] : tb[IFA_ADDRESS]);
+	if (attr == NULL || _mam_netlink_make_addr(ifa, attr, &addr, &mask) != 0)
+		return;
+
+	/* the interface may already be gone for RTM_DELADDR */
+	if ((if_name = if_indextoname(ifa->ifa_index, if_name_buf)) == NULL && tb[IFA_LABEL] != NULL)
+		if_name = nla_data(tb[IFA_LABEL]);
+
+	if (nlh->nlmsg_type == RTM_NEWADDR)
+	{
+		if (if_name == NULL)
+			return;
+
+		if_flags = _mam_netlink_if_flags(if_name);
+		if ((if_flags & IFF_UP) == 0)
+		{
+			DLOG(MAM_NETLINK_NOISY_DEBUG2, "%s: new address on interface that is down - skipping\n", if_name);
+			return;
+		}
+
+		DLOG(MAM_NETLINK_NOISY_DEBUG1, "%s: address added\n", if_name);
+		mam_prefix_add_address(ctx, if_name, if_flags, ifa->ifa_family, (struct sockaddr *) &addr, (struct sockaddr *) &mask);
+	}
+	else
+	{
+		DLOG(MAM_NETLINK_NOISY_DEBUG1, "%s: address removed\n", (if_name != NULL ? if_name : "(gone)"));
+		mam_prefix_remove_address(ctx, if_name, (struct sockaddr *) &addr);
+	}
+}
+
+/** Apply an RTM_NEWLINK or RTM_DELLINK message to the prefix list */
+static void _mam_netlink_link(mam_context_t *ctx, struct nlmsghdr *nlh)
+{
+	struct ifinfomsg *ifi = nlmsg_data(nlh);
+	struct nlattr *tb[IFLA_MAX + 1];
+	const char *if_name;
+
+	if (nlmsg_parse(nlh, sizeof(struct ifinfomsg), tb, IFLA_MAX, NULL) < 0 || tb[IFLA_IFNAME] == NULL)
+		return;
+	if_name = nla_get_string(tb[IFLA_IFNAME]);
+
+	if (nlh->nlmsg_type == RTM_DELLINK)
+	{
+		DLOG(MAM_NETLINK_NOISY_DEBUG1, "%s: interface removed\n", if_name);
+		mam_prefix_set_if_flags(ctx, if_name, 0);
+	}
+	else if ((ifi->ifi_change & IFF_UP) != 0 && (ifi->ifi_flags & IFF_UP) != 0 && mam_prefixes_by_name(ctx, if_name) == NULL)
+	{
+		/* the kernel does not announce the addresses an interface already had - scan it */
+		DLOG(MAM_NETLINK_NOISY_DEBUG1, "%s: interface is up - scanning it\n", if_name);
+		mam_prefix_scan_interface(ctx, if_name);
+	}
+	else
+	{
+		DLOG(MAM_NETLINK_NOISY_DEBUG2, "%s: interface flags are now 0x%x\n", if_name, ifi->ifi_flags);
+		mam_prefix_set_if_flags(ctx, if_name, ifi->ifi_flags);
+	}
+}
+
+/** Dispatch a message received on the netlink socket
+ *  To be called from nl_recvmsgs()
+ */
+static int _mam_netlink_msg_cb(struct nl_msg *msg, void *arg)
+{
+	mam_context_t *ctx = arg;
+	struct nlmsghdr *nlh = nlmsg_hdr(msg);
+
+	switch (nlh->nlmsg_type)
+	{
+		case RTM_NEWADDR:
+		case RTM_DELADDR:
+			_mam_netlink_addr(ctx, nlh);
+			break;
+		case RTM_NEWLINK:
+		case RTM_DELLINK:
+			_mam_netlink_link(ctx, nlh);
+			break;
+		default:
+			break;
+	}
+
+	return NL_OK;
+}
+
+/** Read pending announcements from the netlink socket */
+static void _mam_netlink_readcb(evutil_socket_t fd, short what, void *arg)
+{
+	mam_context_t *ctx = arg;
+	int ret;
+
+	/* keep workers out of the policy while the prefix list changes */
+	pthread_rwlock_wrlock(&(ctx->policy_lock));
+
+	ret = nl_recvmsgs_default(ctx->netlink_sock);
+	if (ret == -NLE_NOMEM)
+	{
+		/* the socket buffer overflowed and announcements were lost */
+		DLOG(MAM_NETLINK_NOISY_DEBUG0, "lost interface announcements - rescanning\n");
+		update_src_prefix_list(ctx);
+	}
+	else if (ret < 0 && ret != -NLE_AGAIN)
+	{
+		DLOG(MAM_NETLINK_NOISY_DEBUG1, "receiving from netlink socket failed: %s\n", nl_geterror(ret));
+	}
+
+	mam_prefix_update_done(ctx);
+
+	pthread_rwlock_unlock(&(ctx->policy_lock));
+}
+
+int mam_netlink_start(mam_context_t *ctx)
+{
+	struct nl_sock *sk;
+	int ret;
+
+	if (ctx->netlink_sock != NULL)
+		return 0;
+
+	if ((sk = nl_socket_alloc()) == NULL)
+		return -1;
+
+	/* announcements are not replies to our requests */
+	nl_socket_disable_seq_check(sk);
+	nl_socket_modify_cb(sk, NL_CB_VALID, NL_CB_CUSTOM, &_mam_netlink_msg_cb, ctx);
+
+	if ((ret = nl_connect(sk, NETLINK_ROUTE)) < 0 ||
+		(ret = nl_socket_add_memberships(sk, RTNLGRP_LINK, RTNLGRP_IPV4_IFADDR, RTNLGRP_IPV6_IFADDR, 0)) < 0 ||
+		(ret = nl_socket_set_nonblocking(sk)) < 0)
+	{
+		DLOG(MAM_NETLINK_NOISY_DEBUG0, "setting up netlink socket failed: %s\n", nl_geterror(ret));
+		goto mam_netlink_start_err;
+	}
+
+	if ((ctx->netlink_event = event_new(ctx->ev_base, nl_socket_get_fd(sk), EV_READ|EV_PERSIST, &_mam_netlink_readcb, ctx)) == NULL)
+		goto mam_netlink_start_err;
+	ctx->netlink_sock = sk;
+	event_add(ctx->netlink_event, NULL);
+
+	DLOG(MAM_NETLINK_NOISY_DEBUG1, "tracking interface and address changes\n");
+	return 0;
+
+	mam_netlink_start_err:
+	nl_socket_free(sk);
+	return -1;
+}
+
+void mam_netlink_stop(mam_context_t *ctx)
+{
+	if (ctx->netlink_event != NULL)
+	{
+		event_free(ctx->netlink_event);
+		ctx->netlink_event = NULL;
+	}
+	if (ctx->netlink_sock != NULL)
+	{
+		nl_socket_free(ctx->netlink_sock);
+		ctx->netlink_sock = NULL;
+	}
+}
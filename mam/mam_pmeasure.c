@@ -14,12 +14,24 @@
 #include <arpa/inet.h>
 #include <math.h>
 #include <unistd.h>
+#include <time.h>
 #include <sys/types.h>
+#include <sys/socket.h>
+
+#ifdef __linux__
+#include <linux/netlink.h>
+#include <linux/rtnetlink.h>
+#include <linux/sock_diag.h>
+#include <linux/inet_diag.h>
+#include <linux/tcp.h>
+#endif
 
 #include <glib.h>
 #include "mam.h"
 #include "mam_pmeasure.h"
 #include "mam_addr_manager.h"
+#include "mam_sketch.h"
+#include "mam_history.h"
 
 #include "clib/muacc_util.h"
 #include "clib/dlog.h"
@@ -39,6 +51,52 @@
 #define EXEC_ERROR -1
 #define TRACE_ERROR 1
 
+/** Size of the buffer for the answers to a socket dump */
+#define PMEASURE_DIAG_BUF 32768
+
+/** Seconds to wait for the next answer to a socket dump before giving up on it */
+#define PMEASURE_DIAG_TIMEOUT 1
+
+/** TCP states whose sockets are measured */
+#define PMEASURE_TCP_STATES ((1 << 1) | (1 << 4) | (1 << 5) | (1 << 8))	/* ESTABLISHED, FIN_WAIT1, FIN_WAIT2, CLOSE_WAIT */
+
+/** Measurements of the TCP sockets of a prefix, collected during one dump */
+struct pmeasure_tcp_acc {
+	mam_sketch_t srtt;				/**< Smoothed RTTs of the sockets in ms */
+	mam_sketch_t rttvar;			/**< RTT variations of the sockets in ms */
+	uint64_t	retrans;			/**< Retransmitted segments */
+	uint64_t	segs_out;			/**< Segments sent */
+	double		delivery_rate_sum;	/**< Sum of the delivery rates in bytes/s */
+	int			num_rate;			/**< Sockets that reported a delivery rate */
+};
+
+/** Netlink socket for dumping the TCP sockets through sock_diag */
+static int diag_sk = -1;
+
+/** Netlink port id of diag_sk - answers for other ports are ignored */
+static uint32_t diag_pid = 0;
+
+/** Sequence number of the last socket dump requested - answers to earlier dumps are ignored */
+static uint32_t diag_seq = 0;
+
+/** Event for the answers arriving on diag_sk */
+static struct event *diag_event = NULL;
+
+/** Address families whose TCP sockets are dumped, one after the other */
+static const int diag_families[] = { AF_INET, AF_INET6 };
+
+/** Index of the address family currently dumped in diag_families */
+static int diag_family = -1;
+
+/** Measurements per prefix collected by the running socket dump, NULL if there is none */
+static GHashTable *diag_accs = NULL;
+
+/** Number of sockets measured by the running socket dump */
+static int diag_num = 0;
+
+/** Start of the running socket dump */
+static struct timespec diag_start;
+
 void compute_srtt(void *pfx, void *data);
 
 /** Print the flow table of every prefix that has one, 
@@ -59,36 +117,438 @@ void pmeasure_print_summary(void *pfx, void *data)
 	if (medianvalue != NULL)
 		printf("\tMedian SRTT: %f ms\n", *medianvalue);
 
+	double *srtt_p90 = g_hash_table_lookup(prefix->measure_dict, "srtt_p90");
+	double *srtt_p99 = g_hash_table_lookup(prefix->measure_dict, "srtt_p99");
+	if (srtt_p90 != NULL && srtt_p99 != NULL)
+		printf("\tSRTT p90: %f ms, p99: %f ms\n", *srtt_p90, *srtt_p99);
+
+	double *rttvar_p50 = g_hash_table_lookup(prefix->measure_dict, "rttvar_p50");
+	double *rttvar_p90 = g_hash_table_lookup(prefix->measure_dict, "rttvar_p90");
+	double *rttvar_p99 = g_hash_table_lookup(prefix->measure_dict, "rttvar_p99");
+	if (rttvar_p50 != NULL && rttvar_p90 != NULL && rttvar_p99 != NULL)
+		printf("\tRTT variation p50: %f ms, p90: %f ms, p99: %f ms\n", *rttvar_p50, *rttvar_p90, *rttvar_p99);
+
+	double *rttvar = g_hash_table_lookup(prefix->measure_dict, "rttvar_mean");
+	double *retrans = g_hash_table_lookup(prefix->measure_dict, "retrans_rate");
+	if (rttvar != NULL && retrans != NULL)
+		printf("\tMean RTT variation: %f ms, retransmission rate: %f\n", *rttvar, *retrans);
+
+	double *rate = g_hash_table_lookup(prefix->measure_dict, "delivery_rate_mean");
+	if (rate != NULL)
+		printf("\tMean delivery rate: %.0f bytes/s\n", *rate);
+
+	uint64_t *flows = g_hash_table_lookup(prefix->measure_dict, "flows");
+	uint64_t *sent = g_hash_table_lookup(prefix->measure_dict, "bytes_sent");
+	uint64_t *received = g_hash_table_lookup(prefix->measure_dict, "bytes_received");
+	if (flows != NULL && sent != NULL && received != NULL)
+		printf("\tFlows: %llu, bytes sent: %llu, bytes received: %llu\n", (unsigned long long) *flows, (unsigned long long) *sent, (unsigned long long) *received);
+
+	/* what applications really did, as observed by libintents */
+	uint64_t *active = g_hash_table_lookup(prefix->measure_dict, "active_ms");
+	uint64_t *msgs_sent = g_hash_table_lookup(prefix->measure_dict, "messages_sent");
+	uint64_t *msgs_received = g_hash_table_lookup(prefix->measure_dict, "messages_received");
+	if (sent != NULL && received != NULL && flows != NULL && *flows > 0)
+		printf("\tObserved filesize: %llu bytes per flow\n", (unsigned long long) ((*sent + *received) / *flows));
+	if (sent != NULL && received != NULL && active != NULL && *active > 0)
+		printf("\tObserved bitrate: %llu bytes/s\n", (unsigned long long) ((*sent + *received) * 1000 / *active));
+	if (sent != NULL && received != NULL && msgs_sent != NULL && msgs_received != NULL && *msgs_sent + *msgs_received > 0)
+		printf("\tObserved message size: %llu bytes\n", (unsigned long long) ((*sent + *received) / (*msgs_sent + *msgs_received)));
+
 	printf("\n");
 }
 
+/** Set a floating point value in the measure_dict, replacing the old one */
+static void _pmeasure_set_double(GHashTable *dict, const char *key, double value)
+{
+	double *v;
+
+	if ((v = malloc(sizeof(double))) == NULL)
+		return;
+	*v = value;
+	g_hash_table_replace(dict, (gpointer) key, v);
+}
+
+/** Set a sketch in the measure_dict, replacing the old one */
+static void _pmeasure_set_sketch(GHashTable *dict, const char *key, const mam_sketch_t *sketch)
+{
+	mam_sketch_t *copy;
+
+	if ((copy = mam_sketch_dup(sketch)) == NULL)
+		return;
+	g_hash_table_replace(dict, (gpointer) key, copy);
+}
+
+/** Keys of the values compute_srtt() derives from the TCP sockets of a prefix */
+static const char *tcp_keys[] = {
+	"srtt_mean", "srtt_median", "srtt_p90", "srtt_p99", "sketch_srtt",
+	"rttvar_mean", "rttvar_p50", "rttvar_p90", "rttvar_p99", "sketch_rttvar",
+	"retrans_rate", "delivery_rate_mean", NULL
+};
+
 /** Compute the SRTT on an interface
- *  Insert it into the measure_dict as "srtt_median"
+ *  from the TCP sockets of the last dump, given as table of pmeasure_tcp_acc by prefix.
+ *  Insert it into the measure_dict as "srtt_mean", "srtt_median", "srtt_p90" and "srtt_p99",
+ *  the RTT variation as "rttvar_mean", "rttvar_p50", "rttvar_p90" and "rttvar_p99", along with
+ *  "retrans_rate" and "delivery_rate_mean". The distributions the quantiles have been
+ *  estimated from are kept as "sketch_srtt" and "sketch_rttvar", so they can be merged.
+ *  Prefixes without sockets lose their values - they would be stale - unless
+ *  they are priors from the history, which are kept until the first measurement.
  */
 void compute_srtt(void *pfx, void *data)
 {
 	struct src_prefix_list *prefix = pfx;
+	struct pmeasure_tcp_acc *acc;
+	int i;
 
-	if (prefix == NULL || prefix->measure_dict == NULL)
+	if (prefix == NULL || prefix->measure_dict == NULL || data == NULL)
+		return;
+
+	if ((acc = g_hash_table_lookup((GHashTable *) data, prefix)) == NULL || acc->srtt.count == 0)
+	{
+		if (g_hash_table_lookup(prefix->measure_dict, "history_ts") != NULL)
+			return;
+		for (i = 0; tcp_keys[i] != NULL; i++)
+			g_hash_table_remove(prefix->measure_dict, tcp_keys[i]);
+		return;
+	}
+
+	/* measured ourselves - the priors are no longer needed */
+	g_hash_table_remove(prefix->measure_dict, "history_ts");
+
+	DLOG(MAM_PMEASURE_NOISY_DEBUG2, "Computing SRTT quantiles of %llu sockets for a prefix of interface %s\n", (unsigned long long) acc->srtt.count, prefix->if_name);
+
+	_pmeasure_set_double(prefix->measure_dict, "srtt_mean", acc->srtt.sum / acc->srtt.count);
+	_pmeasure_set_double(prefix->measure_dict, "srtt_median", mam_sketch_quantile(&(acc->srtt), 0.5));
+	_pmeasure_set_double(prefix->measure_dict, "srtt_p90", mam_sketch_quantile(&(acc->srtt), 0.9));
+	_pmeasure_set_double(prefix->measure_dict, "srtt_p99", mam_sketch_quantile(&(acc->srtt), 0.99));
+	_pmeasure_set_sketch(prefix->measure_dict, "sketch_srtt", &(acc->srtt));
+	_pmeasure_set_double(prefix->measure_dict, "rttvar_mean", acc->rttvar.sum / acc->rttvar.count);
+	_pmeasure_set_double(prefix->measure_dict, "rttvar_p50", mam_sketch_quantile(&(acc->rttvar), 0.5));
+	_pmeasure_set_double(prefix->measure_dict, "rttvar_p90", mam_sketch_quantile(&(acc->rttvar), 0.9));
+	_pmeasure_set_double(prefix->measure_dict, "rttvar_p99", mam_sketch_quantile(&(acc->rttvar), 0.99));
+	_pmeasure_set_sketch(prefix->measure_dict, "sketch_rttvar", &(acc->rttvar));
+	_pmeasure_set_double(prefix->measure_dict, "retrans_rate", (acc->segs_out > 0) ? (double) acc->retrans / acc->segs_out : 0);
+	if (acc->num_rate > 0)
+		_pmeasure_set_double(prefix->measure_dict, "delivery_rate_mean", acc->delivery_rate_sum / acc->num_rate);
+	else
+		g_hash_table_remove(prefix->measure_dict, "delivery_rate_mean");
+}
+
+#ifdef __linux__
+/** Add the tcp_info of a socket to the measurements of its source prefix */
+static void _pmeasure_account_socket(mam_context_t *ctx, GHashTable *accs, struct inet_diag_msg *msg, const struct tcp_info *info)
+{
+	struct sockaddr_storage src;
+	struct src_prefix_list *prefix;
+	struct pmeasure_tcp_acc *acc;
+
+	memset(&src, 0x00, sizeof(src));
+	src.ss_family = msg->idiag_family;
+	if (msg->idiag_family == AF_INET)
+		memcpy(&(((struct sockaddr_in *) &src)->sin_addr), msg->id.idiag_src, sizeof(struct in_addr));
+	else
+		memcpy(&(((struct sockaddr_in6 *) &src)->sin6_addr), msg->id.idiag_src, sizeof(struct in6_addr));
+
+	if ((prefix = lookup_source_prefix(ctx, PFX_ANY, NULL, msg->idiag_family, (struct sockaddr *) &src)) == NULL)
+		return;
+
+	if ((acc = g_hash_table_lookup(accs, prefix)) == NULL)
+	{
+		if ((acc = malloc(sizeof(struct pmeasure_tcp_acc))) == NULL)
+			return;
+		memset(acc, 0x00, sizeof(struct pmeasure_tcp_acc));
+		g_hash_table_insert(accs, prefix, acc);
+	}
+
+	/* the kernel reports microseconds */
+	mam_sketch_add(&(acc->srtt), info->tcpi_rtt / 1000.0);
+	mam_sketch_add(&(acc->rttvar), info->tcpi_rttvar / 1000.0);
+	acc->retrans += info->tcpi_total_retrans;
+	acc->segs_out += info->tcpi_segs_out;
+	if (info->tcpi_delivery_rate > 0)
+	{
+		acc->delivery_rate_sum += info->tcpi_delivery_rate;
+		acc->num_rate++;
+	}
+}
+
+/** Ask the kernel for a dump of the TCP sockets of an address family
+ *  Return 0 on success, -1 on error
+ */
+static int _pmeasure_request_dump(int family)
+{
+	struct {
+		struct nlmsghdr nlh;
+		struct inet_diag_req_v2 req;
+	} request;
+	struct sockaddr_nl kernel = { .nl_family = AF_NETLINK };
+
+	memset(&request, 0x00, sizeof(request));
+	request.nlh.nlmsg_len = sizeof(request);
+	request.nlh.nlmsg_type = SOCK_DIAG_BY_FAMILY;
+	request.nlh.nlmsg_flags = NLM_F_REQUEST | NLM_F_DUMP;
+	request.nlh.nlmsg_seq = ++diag_seq;
+	request.req.sdiag_family = family;
+	request.req.sdiag_protocol = IPPROTO_TCP;
+	request.req.idiag_states = PMEASURE_TCP_STATES;
+	request.req.idiag_ext = (1 << (INET_DIAG_INFO - 1));
+
+	if (sendto(diag_sk, &request, sizeof(request), 0, (struct sockaddr *) &kernel, sizeof(kernel)) < 0)
+	{
+		DLOG(MAM_PMEASURE_NOISY_DEBUG1, "Requesting socket dump failed: %s\n", strerror(errno));
+		return -1;
+	}
+	return 0;
+}
+
+/** Account the sockets in a batch of answers to the running dump to their prefixes
+ *  Return 1 if the dump of the current address family is complete, 0 if more answers follow
+ */
+static int _pmeasure_parse_dump(mam_context_t *ctx, char *buf, ssize_t len)
+{
+	struct nlmsghdr *nlh;
+
+	for (nlh = (struct nlmsghdr *) buf; NLMSG_OK(nlh, len); nlh = NLMSG_NEXT(nlh, len))
+	{
+		struct inet_diag_msg *msg = NLMSG_DATA(nlh);
+		struct rtattr *attr;
+		int attr_len;
+
+		if (nlh->nlmsg_seq != diag_seq || (diag_pid != 0 && nlh->nlmsg_pid != diag_pid))
+		{
+			DLOG(MAM_PMEASURE_NOISY_DEBUG2, "Ignoring answer to an earlier socket dump\n");
+			continue;
+		}
+		if (nlh->nlmsg_type == NLMSG_DONE)
+		{
+			/* errors during the dump are reported here */
+			if (nlh->nlmsg_len >= NLMSG_LENGTH(sizeof(int)) && *((int *) NLMSG_DATA(nlh)) < 0)
+				DLOG(MAM_PMEASURE_NOISY_DEBUG1, "Socket dump failed: %s\n", strerror(-*((int *) NLMSG_DATA(nlh))));
+			return 1;
+		}
+		if (nlh->nlmsg_type == NLMSG_ERROR)
+		{
+			struct nlmsgerr *error = NLMSG_DATA(nlh);
+
+			DLOG(MAM_PMEASURE_NOISY_DEBUG1, "Socket dump failed: %s\n",
+					(nlh->nlmsg_len >= NLMSG_LENGTH(sizeof(struct nlmsgerr)) ? strerror(-error->error) : "truncated error message"));
+			return 1;
+		}
+		if (nlh->nlmsg_type != SOCK_DIAG_BY_FAMILY)
+			continue;
+
+		attr = (struct rtattr *) (msg + 1);
+		attr_len = nlh->nlmsg_len - NLMSG_LENGTH(sizeof(struct inet_diag_msg));
+		for (; RTA_OK(attr, attr_len); attr = RTA_NEXT(attr, attr_len))
+		{
+			if (attr->rta_type == INET_DIAG_INFO)
+			{
+				/* older kernels report a shorter tcp_info */
+				struct tcp_info info;
+				size_t info_len = RTA_PAYLOAD(attr);
+
+				memset(&info, 0x00, sizeof(info));
+				memcpy(&info, RTA_DATA(attr), (info_len < sizeof(info) ? info_len : sizeof(info)));
+				if (info.tcpi_rtt > 0)
+				{
+					_pmeasure_account_socket(ctx, diag_accs, msg, &info);
+					diag_num++;
+				}
+			}
+		}
+	}
+	return 0;
+}
+#endif
+
+/** Update the measure_dicts of all prefixes from the socket dump and record them in the history */
+static void _pmeasure_finish_dump(mam_context_t *ctx)
+{
+	struct timespec end;
+
+	if (diag_event != NULL)
+		event_del(diag_event);
+
+	pthread_mutex_lock(&(ctx->measure_lock));
+	g_slist_foreach(ctx->prefixes, &compute_srtt, diag_accs);
+	pthread_mutex_unlock(&(ctx->measure_lock));
+
+	clock_gettime(CLOCK_MONOTONIC, &end);
+	DLOG(MAM_PMEASURE_NOISY_DEBUG1, "Measured %d TCP sockets in %ld us\n", diag_num,
+			(long) ((end.tv_sec - diag_start.tv_sec) * 1000000 + (end.tv_nsec - diag_start.tv_nsec) / 1000));
+
+	g_hash_table_destroy(diag_accs);
+	diag_accs = NULL;
+
+	mam_history_record(ctx);
+	if (MAM_PMEASURE_NOISY_DEBUG2)
+	{
+		DLOG(MAM_PMEASURE_NOISY_DEBUG2, "Printing summary\n");
+		g_slist_foreach(ctx->prefixes, &pmeasure_print_summary, NULL);
+	}
+}
+
+/** Request the dump of the next address family, or finish the dump if all are done */
+static void _pmeasure_dump_next(mam_context_t *ctx)
+{
+#ifdef __linux__
+	struct timeval timeout = { PMEASURE_DIAG_TIMEOUT, 0 };
+
+	while (diag_sk >= 0 && diag_event != NULL && ++diag_family < (int) (sizeof(diag_families) / sizeof(int)))
+	{
+		if (_pmeasure_request_dump(diag_families[diag_family]) == 0)
+		{
+			/* the answers are handled by _pmeasure_diag_readcb */
+			event_add(diag_event, &timeout);
+			return;
+		}
+	}
+#endif
+	_pmeasure_finish_dump(ctx);
+}
+
+#ifdef __linux__
+/** Read the answers to the running socket dump without blocking the event loop */
+static void _pmeasure_diag_readcb(evutil_socket_t fd, short what, void *arg)
+{
+	mam_context_t *ctx = (mam_context_t *) arg;
+	char buf[PMEASURE_DIAG_BUF] __attribute__ ((aligned(NLMSG_ALIGNTO)));
+	ssize_t len = -1;
+
+	if (diag_accs == NULL)
+		return;
+
+	if (what & EV_TIMEOUT)
+	{
+		DLOG(MAM_PMEASURE_NOISY_DEBUG1, "Socket dump timed out\n");
+		_pmeasure_dump_next(ctx);
 		return;
+	}
 
-	if (prefix->if_name != NULL)
-		DLOG(MAM_PMEASURE_NOISY_DEBUG1, "Computing median SRTTs for a prefix of interface %s:\n", prefix->if_name);
-	
-	// TODO
-	DLOG(MAM_PMEASURE_NOISY_DEBUG1, "Not implemented yet.\n");
+	while (diag_accs != NULL && (len = recv(fd, buf, sizeof(buf), MSG_DONTWAIT)) > 0)
+	{
+		if (_pmeasure_parse_dump(ctx, buf, len))
+			_pmeasure_dump_next(ctx);
+	}
 
-	return;
+	if (diag_accs != NULL && (len == 0 || (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)))
+	{
+		DLOG(MAM_PMEASURE_NOISY_DEBUG1, "Socket dump ended unexpectedly: %s\n", (len < 0 ? strerror(errno) : "EOF"));
+		_pmeasure_dump_next(ctx);
+	}
 }
+#endif
 
-void pmeasure_setup()
+/** Start measuring the TCP sockets of the host - the measure_dicts of all prefixes
+ *  are updated once the dump is complete
+ */
+static void _pmeasure_tcp(mam_context_t *ctx)
+{
+	if (diag_accs != NULL)
+	{
+		DLOG(MAM_PMEASURE_NOISY_DEBUG1, "Previous socket dump has not finished yet - using what it got so far\n");
+		_pmeasure_finish_dump(ctx);
+	}
+
+	diag_accs = g_hash_table_new_full(&g_direct_hash, &g_direct_equal, NULL, &free);
+	diag_family = -1;
+	diag_num = 0;
+	clock_gettime(CLOCK_MONOTONIC, &diag_start);
+
+	_pmeasure_dump_next(ctx);
+}
+
+/** Add a value to a counter of the measure_dict, creating it if necessary */
+static void _pmeasure_add_counter(GHashTable *dict, const char *key, uint64_t value)
+{
+	uint64_t *counter = g_hash_table_lookup(dict, key);
+
+	if (counter == NULL)
+	{
+		if ((counter = malloc(sizeof(uint64_t))) == NULL)
+			return;
+		*counter = 0;
+		g_hash_table_insert(dict, (gpointer) key, counter);
+	}
+	*counter += value;
+}
+
+void pmeasure_account_flow(mam_context_t *mctx, const struct sockaddr *src, const struct _muacc_flowstats *stats)
+{
+	struct src_prefix_list *prefix;
+
+	if (mctx == NULL || src == NULL || stats == NULL)
+		return;
+
+	if ((prefix = lookup_source_prefix(mctx, PFX_ANY, NULL, src->sa_family, src)) == NULL)
+	{
+		DLOG(MAM_PMEASURE_NOISY_DEBUG2, "No prefix for the source address of the flow - not accounting it\n");
+		return;
+	}
+
+	if (prefix->measure_dict == NULL)
+		return;
+
+	pthread_mutex_lock(&(mctx->measure_lock));
+	_pmeasure_add_counter(prefix->measure_dict, "bytes_sent", stats->bytes_sent);
+	_pmeasure_add_counter(prefix->measure_dict, "bytes_received", stats->bytes_received);
+	_pmeasure_add_counter(prefix->measure_dict, "messages_sent", stats->messages_sent);
+	_pmeasure_add_counter(prefix->measure_dict, "messages_received", stats->messages_received);
+	_pmeasure_add_counter(prefix->measure_dict, "active_ms", stats->duration_ms);
+	if (stats->flags & MUACC_FLOWSTATS_FINAL)
+		_pmeasure_add_counter(prefix->measure_dict, "flows", 1);
+	pthread_mutex_unlock(&(mctx->measure_lock));
+
+	DLOG(MAM_PMEASURE_NOISY_DEBUG2, "Accounted %s%llu bytes sent, %llu bytes received in %llu ms to prefix of interface %s\n",
+			(stats->flags & MUACC_FLOWSTATS_FINAL) ? "flow with " : "",
+			(unsigned long long) stats->bytes_sent, (unsigned long long) stats->bytes_received,
+			(unsigned long long) stats->duration_ms, prefix->if_name);
+}
+
+void pmeasure_setup(mam_context_t *ctx)
 {
 	DLOG(MAM_PMEASURE_NOISY_DEBUG0, "Setting up pmeasure \n");
+
+#ifdef __linux__
+	struct sockaddr_nl local = { .nl_family = AF_NETLINK };
+	socklen_t local_len = sizeof(local);
+
+	/* the answers are read from the event loop, so the socket must never block it */
+	if ((diag_sk = socket(AF_NETLINK, SOCK_DGRAM | SOCK_CLOEXEC | SOCK_NONBLOCK, NETLINK_SOCK_DIAG)) < 0)
+	{
+		DLOG(MAM_PMEASURE_NOISY_DEBUG0, "Cannot open sock_diag socket - not measuring TCP sockets: %s\n", strerror(errno));
+		return;
+	}
+
+	/* let the kernel pick our port id, so answers can be told apart from anything else */
+	if (bind(diag_sk, (struct sockaddr *) &local, sizeof(local)) == 0 &&
+		getsockname(diag_sk, (struct sockaddr *) &local, &local_len) == 0)
+		diag_pid = local.nl_pid;
+
+	if ((diag_event = event_new(ctx->ev_base, diag_sk, EV_READ|EV_PERSIST, &_pmeasure_diag_readcb, ctx)) == NULL)
+	{
+		DLOG(MAM_PMEASURE_NOISY_DEBUG0, "Cannot set up sock_diag event - not measuring TCP sockets\n");
+		close(diag_sk);
+		diag_sk = -1;
+		diag_pid = 0;
+	}
+#endif
 }
 
 void pmeasure_cleanup()
 {
 	DLOG(MAM_PMEASURE_NOISY_DEBUG0, "Cleaning up\n");
+
+	if (diag_event != NULL)
+		event_free(diag_event);
+	diag_event = NULL;
+	if (diag_accs != NULL)
+		g_hash_table_destroy(diag_accs);
+	diag_accs = NULL;
+	if (diag_sk >= 0)
+		close(diag_sk);
+	diag_sk = -1;
+	diag_pid = 0;
 }
 
 void pmeasure_callback(evutil_socket_t fd, short what, void *arg)
@@ -100,12 +560,7 @@ void pmeasure_callback(evutil_socket_t fd, short what, void *arg)
 		return;
 
 	DLOG(MAM_PMEASURE_NOISY_DEBUG2, "Computing SRTTs\n");
-	g_slist_foreach(ctx->prefixes, &compute_srtt, NULL);
-	if (MAM_PMEASURE_NOISY_DEBUG2)
-	{
-		DLOG(MAM_PMEASURE_NOISY_DEBUG2, "Printing summary\n");
-		g_slist_foreach(ctx->prefixes, &pmeasure_print_summary, NULL);
-	}
+	_pmeasure_tcp(ctx);
 
 	DLOG(MAM_PMEASURE_NOISY_DEBUG1, "Callback finished.\n\n");
 }
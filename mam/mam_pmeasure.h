@@ -7,8 +7,17 @@
 
 #include "mam.h"
 
-void pmeasure_setup();
+/** Open the sock_diag socket and register it on the event base of the MAM -
+ *  the TCP sockets are dumped from pmeasure_callback without blocking the event loop
+ */
+void pmeasure_setup(mam_context_t *ctx);
 void pmeasure_callback(evutil_socket_t fd, short what, void *arg);
 void pmeasure_cleanup();
 
 void pmeasure_print_summary(void *pfx, void *data);
+
+/** Add the counters of a flow report to the measure_dict of its source prefix
+ *  as "bytes_sent", "bytes_received", "messages_sent", "messages_received" and "active_ms" -
+ *  the final report of a flow also counts it in "flows"
+ */
+void pmeasure_account_flow(mam_context_t *mctx, const struct sockaddr *src, const struct _muacc_flowstats *stats);
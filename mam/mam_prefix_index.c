@@ -0,0 +1,306 @@
+/** \file mam_prefix_index.c
+ *  \brief Indexes over the source prefixes of the MAM
+ *
+ *  Maintained alongside the prefix list of the MAM context:
+ *  - one binary trie per address family, keyed by the network of each prefix,
+ *    to find the prefix owning an address by longest prefix match
+ *  - the prefixes of each interface, keyed by interface name
+ *  - the enabled prefixes of each address family
+ *
+ *  The tries and the interface table are updated as prefixes are added and
+ *  removed. The enabled lists depend on the configuration and are rebuilt by
+ *  mam_prefix_index_update_flags() after pfx_flags have been changed.
+ *
+ *  \copyright Copyright 2013-2015 Philipp Schmidt, Theresa Enghardt, and Mirko Palmer.
+ *  All rights reserved. This project is released under the New BSD License.
+ */
+
+#include <arpa/inet.h>
+#include <sys/socket.h>
+
+#include "clib/dlog.h"
+
+#include "mam.h"
+#include "mam_util.h"
+
+#ifndef MAM_PREFIX_INDEX_NOISY_DEBUG
+#define MAM_PREFIX_INDEX_NOISY_DEBUG 0
+#endif
+
+/** Get the address bytes of a socket address and their number of bits */
+static const unsigned char *_index_addr_bytes(const struct sockaddr *sa, int *bits)
+{
+	if (sa->sa_family == AF_INET)
+	{
+		*bits = 32;
+		return (const unsigned char *) &(((const struct sockaddr_in *) sa)->sin_addr);
+	}
+	else if (sa->sa_family == AF_INET6)
+	{
+		*bits = 128;
+		return (const unsigned char *) &(((const struct sockaddr_in6 *) sa)->sin6_addr);
+	}
+	return NULL;
+}
+
+/** Get a bit of an address, counting from the most significant one */
+static inline int _index_bit(const unsigned char *bytes, int i)
+{
+	return (bytes[i / 8] >> (7 - i % 8)) & 1;
+}
+
+/** Get the length of a prefix, i.e. the number of leading one bits of its netmask
+ *  Returns -1 if the prefix has no usable netmask */
+static int _index_prefix_len(const struct src_prefix_list *pfx)
+{
+	const unsigned char *mask;
+	int bits, len;
+
+	if (pfx->if_netmask == NULL || (mask = _index_addr_bytes(pfx->if_netmask, &bits)) == NULL)
+		return -1;
+
+	for (len = 0; len < bits && _index_bit(mask, len); len++);
+	return len;
+}
+
+/** Get the trie of an address family */
+static struct mam_prefix_node **_index_trie(mam_context_t *ctx, int family)
+{
+	if (family == AF_INET)
+		return &(ctx->prefix_trie4);
+	if (family == AF_INET6)
+		return &(ctx->prefix_trie6);
+	return NULL;
+}
+
+/** Check whether a prefix matches the flags and interface name given to a lookup */
+static int _index_matches(const struct src_prefix_list *pfx, unsigned int pfx_flags, const char *if_name)
+{
+	if (((pfx->pfx_flags ^ pfx_flags) & pfx_flags) != 0)
+		return 0;
+	if (if_name != NULL && strcmp(pfx->if_name, if_name) != 0)
+		return 0;
+	return 1;
+}
+
+void _mam_index_add_prefix(mam_context_t *ctx, struct src_prefix_list *pfx)
+{
+	struct mam_prefix_node **node;
+	const unsigned char *bytes;
+	GSList *same_if;
+	int bits, len, i;
+
+	if (pfx->if_addrs == NULL || (node = _index_trie(ctx, pfx->family)) == NULL ||
+		(bytes = _index_addr_bytes(pfx->if_addrs->addr, &bits)) == NULL)
+		return;
+
+	/* without a netmask, the prefix would sit at the root and own every address */
+	if ((len = _index_prefix_len(pfx)) < 0)
+	{
+		DLOG(MAM_PREFIX_INDEX_NOISY_DEBUG, "%s: prefix has no netmask - not indexing its network\n", pfx->if_name);
+		goto _index_add_name;
+	}
+
+	/* walk down to the node of the network, creating the path on the way */
+	for (i = 0; ; i++)
+	{
+		if (*node == NULL)
+		{
+			if ((*node = malloc(sizeof(struct mam_prefix_node))) == NULL)
+			{
+				DLOG(1, "malloc failed");
+				return;
+			}
+			memset(*node, 0x00, sizeof(struct mam_prefix_node));
+		}
+		if (i == len)
+			break;
+		node = &((*node)->child[_index_bit(bytes, i)]);
+	}
+	(*node)->prefixes = g_slist_append((*node)->prefixes, pfx);
+
+	_index_add_name:
+	same_if = g_hash_table_lookup(ctx->prefixes_by_name, pfx->if_name);
+	g_hash_table_insert(ctx->prefixes_by_name, g_strdup(pfx->if_name), g_slist_append(same_if, pfx));
+
+	DLOG(MAM_PREFIX_INDEX_NOISY_DEBUG, "%s: indexed prefix of length %d\n", pfx->if_name, len);
+}
+
+/** Remove a prefix from a subtrie, freeing nodes that became empty
+ *  Return 1 if the node has been freed, 0 otherwise */
+static int _index_trie_remove(struct mam_prefix_node **node, const unsigned char *bytes, int depth, int len, struct src_prefix_list *pfx)
+{
+	if (*node == NULL)
+		return 0;
+
+	if (depth == len)
+		(*node)->prefixes = g_slist_remove((*node)->prefixes, pfx);
+	else
+		_index_trie_remove(&((*node)->child[_index_bit(bytes, depth)]), bytes, depth + 1, len, pfx);
+
+	if ((*node)->prefixes == NULL && (*node)->child[0] == NULL && (*node)->child[1] == NULL)
+	{
+		free(*node);
+		*node = NULL;
+		return 1;
+	}
+	return 0;
+}
+
+void _mam_index_remove_prefix(mam_context_t *ctx, struct src_prefix_list *pfx)
+{
+	struct mam_prefix_node **node;
+	const unsigned char *bytes;
+	GSList *same_if;
+	int bits, len;
+
+	if (pfx->if_addrs != NULL && (node = _index_trie(ctx, pfx->family)) != NULL &&
+		(bytes = _index_addr_bytes(pfx->if_addrs->addr, &bits)) != NULL &&
+		(len = _index_prefix_len(pfx)) >= 0)
+		_index_trie_remove(node, bytes, 0, len, pfx);
+
+	if ((same_if = g_hash_table_lookup(ctx->prefixes_by_name, pfx->if_name)) != NULL)
+	{
+		if ((same_if = g_slist_remove(same_if, pfx)) == NULL)
+			g_hash_table_remove(ctx->prefixes_by_name, pfx->if_name);
+		else
+			g_hash_table_insert(ctx->prefixes_by_name, g_strdup(pfx->if_name), same_if);
+	}
+
+	ctx->enabled4 = g_slist_remove(ctx->enabled4, pfx);
+	ctx->enabled6 = g_slist_remove(ctx->enabled6, pfx);
+}
+
+/** Free a subtrie */
+static void _index_trie_free(struct mam_prefix_node *node)
+{
+	if (node == NULL)
+		return;
+
+	_index_trie_free(node->child[0]);
+	_index_trie_free(node->child[1]);
+	g_slist_free(node->prefixes);
+	free(node);
+}
+
+/** Free a list of the interface table - to be called from g_hash_table_foreach() */
+static void _index_free_name_list(gpointer key, gpointer value, gpointer data)
+{
+	g_slist_free(value);
+}
+
+void _mam_index_free(mam_context_t *ctx)
+{
+	_index_trie_free(ctx->prefix_trie4);
+	_index_trie_free(ctx->prefix_trie6);
+	ctx->prefix_trie4 = NULL;
+	ctx->prefix_trie6 = NULL;
+
+	if (ctx->prefixes_by_name != NULL)
+	{
+		g_hash_table_foreach(ctx->prefixes_by_name, &_index_free_name_list, NULL);
+		g_hash_table_destroy(ctx->prefixes_by_name);
+		ctx->prefixes_by_name = NULL;
+	}
+
+	g_slist_free(ctx->enabled4);
+	g_slist_free(ctx->enabled6);
+	ctx->enabled4 = NULL;
+	ctx->enabled6 = NULL;
+}
+
+void mam_prefix_index_update_flags(mam_context_t *ctx)
+{
+	GSList *cur;
+	struct src_prefix_list *pfx;
+
+	g_slist_free(ctx->enabled4);
+	g_slist_free(ctx->enabled6);
+	ctx->enabled4 = NULL;
+	ctx->enabled6 = NULL;
+
+	/* prepend and reverse to keep the order of the prefix list */
+	for (cur = ctx->prefixes; cur != NULL; cur = cur->next)
+	{
+		pfx = cur->data;
+		if ((pfx->pfx_flags & PFX_ENABLED) == 0)
+			continue;
+		if (pfx->family == AF_INET)
+			ctx->enabled4 = g_slist_prepend(ctx->enabled4, pfx);
+		else if (pfx->family == AF_INET6)
+			ctx->enabled6 = g_slist_prepend(ctx->enabled6, pfx);
+	}
+	ctx->enabled4 = g_slist_reverse(ctx->enabled4);
+	ctx->enabled6 = g_slist_reverse(ctx->enabled6);
+}
+
+GSList *mam_prefixes_by_name(mam_context_t *ctx, const char *if_name)
+{
+	if (ctx->prefixes_by_name == NULL || if_name == NULL)
+		return NULL;
+
+	return g_hash_table_lookup(ctx->prefixes_by_name, if_name);
+}
+
+GSList *mam_enabled_prefixes(mam_context_t *ctx, int family)
+{
+	if (family == AF_INET)
+		return ctx->enabled4;
+	if (family == AF_INET6)
+		return ctx->enabled6;
+	return NULL;
+}
+
+struct src_prefix_list *lookup_source_prefix (
+	mam_context_t *ctx,
+	unsigned int pfx_flags,
+	const char *if_name,
+	int family,
+	const struct sockaddr *addr)
+{
+	struct mam_prefix_node **trie;
+	struct mam_prefix_node *node;
+	struct src_prefix_list *best = NULL;
+	const unsigned char *bytes;
+	GSList *cur;
+	int bits, i;
+
+	if (addr == NULL)
+	{
+		/* no address - take the first prefix that matches, using the smallest list at hand */
+		if (if_name != NULL)
+			cur = mam_prefixes_by_name(ctx, if_name);
+		else if ((pfx_flags & PFX_ENABLED) != 0 && family != AF_UNSPEC)
+			cur = mam_enabled_prefixes(ctx, family);
+		else
+			cur = ctx->prefixes;
+
+		for (; cur != NULL; cur = cur->next)
+		{
+			struct src_prefix_list *pfx = cur->data;
+			if ((family == AF_UNSPEC || pfx->family == family) && _index_matches(pfx, pfx_flags, if_name))
+				return pfx;
+		}
+		return NULL;
+	}
+
+	if ((family != AF_UNSPEC && addr->sa_family != family) ||
+		(trie = _index_trie(ctx, addr->sa_family)) == NULL ||
+		(bytes = _index_addr_bytes(addr, &bits)) == NULL)
+		return NULL;
+
+	/* follow the address down the trie, remembering the longest match */
+	for (node = *trie, i = 0; node != NULL; node = (i < bits ? node->child[_index_bit(bytes, i)] : NULL), i++)
+	{
+		for (cur = node->prefixes; cur != NULL; cur = cur->next)
+		{
+			if (_index_matches(cur->data, pfx_flags, if_name))
+			{
+				best = cur->data;
+				break;
+			}
+		}
+	}
+
+	return best;
+}
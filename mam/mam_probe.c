@@ -0,0 +1,485 @@
+/** \file mam_probe.c
+ *  \brief Active probing of the enabled prefixes of the MAM
+ *
+ *  Runs on the main event loop, like pmeasure: a timer hands out probes to the
+ *  prefixes that are due, most overdue first, as long as the token bucket of
+ *  the probe rate allows. Each prefix has at most one probe in flight.
+ *
+ *  \copyright Copyright 2013-2015 Philipp Schmidt, Theresa Enghardt, and Mirko Palmer.
+ *  All rights reserved. This project is released under the New BSD License.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stddef.h>
+#include <string.h>
+#include <stdint.h>
+#include <errno.h>
+#include <math.h>
+#include <time.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+
+#include <glib.h>
+#include <event2/event.h>
+
+#include "clib/dlog.h"
+
+#include "mam.h"
+#include "mam_probe.h"
+
+#ifndef MAM_PROBE_NOISY_DEBUG0
+#define MAM_PROBE_NOISY_DEBUG0 1
+#endif
+
+#ifndef MAM_PROBE_NOISY_DEBUG1
+#define MAM_PROBE_NOISY_DEBUG1 0
+#endif
+
+/** Probing state of a prefix */
+struct probe_state {
+	struct src_prefix_list	*pfx;
+	struct probe			*inflight;		/**< Probe waiting for an answer, NULL if none */
+	double					rtts[MAM_PROBE_WINDOW]; /**< RTTs of the last answered probes in ms */
+	unsigned int			num_rtts;		/**< Number of valid entries of rtts */
+	unsigned int			next_rtt;		/**< Entry of rtts to overwrite next */
+	double					loss;			/**< Moving average of the fraction of lost probes */
+	uint64_t				answered;		/**< Answered probes */
+	int						interval;		/**< Current seconds between two probes */
+	time_t					next;			/**< Time the next probe is due */
+	unsigned int			target;			/**< Index of the target probed last */
+};
+
+/** A probe in flight */
+struct probe {
+	struct probe_state		*state;
+	evutil_socket_t			fd;
+	struct event			*ev;
+	struct timeval			sent;
+	uint32_t				cookie;			/**< Payload of UDP probes, to recognize the echo */
+};
+
+static mam_context_t *probe_ctx = NULL;
+static struct event *probe_timer = NULL;
+static GHashTable *probe_states = NULL;		/**< struct probe_state by prefix */
+
+static char *probe_targets_conf = NULL;		/**< probe_targets the targets have been parsed from */
+static struct sockaddr_storage probe_targets[MAM_PROBE_MAX_TARGETS];
+static int num_probe_targets = 0;
+static int probe_udp = 0;
+static int probe_rate = MAM_PROBE_RATE;
+static int probe_interval = MAM_PROBE_INTERVAL_MIN;
+static double probe_tokens = MAM_PROBE_BURST;
+
+static socklen_t _probe_addr_len(const struct sockaddr *sa)
+{
+	return (sa->sa_family == AF_INET) ? sizeof(struct sockaddr_in) : sizeof(struct sockaddr_in6);
+}
+
+/** Parse a target "address:port" or "[address]:port" */
+static int _probe_parse_target(const char *s, struct sockaddr_storage *ss)
+{
+	char host[INET6_ADDRSTRLEN];
+	const char *end, *port;
+	struct sockaddr_in *sin = (struct sockaddr_in *) ss;
+	struct sockaddr_in6 *sin6 = (struct sockaddr_in6 *) ss;
+
+	if (*s == '[')
+	{
+		if ((end = strchr(s, ']')) == NULL || end[1] != ':')
+			return -1;
+		s++;
+		port = end + 2;
+	}
+	else
+	{
+		if ((end = strrchr(s, ':')) == NULL)
+			return -1;
+		port = end + 1;
+	}
+	if (end - s >= (ptrdiff_t) sizeof(host) || atoi(port) <= 0 || atoi(port) > 65535)
+		return -1;
+	memcpy(host, s, end - s);
+	host[end - s] = '\0';
+
+	memset(ss, 0x00, sizeof(struct sockaddr_storage));
+	if (inet_pton(AF_INET, host, &(sin->sin_addr)) == 1)
+	{
+		sin->sin_family = AF_INET;
+		sin->sin_port = htons(atoi(port));
+	}
+	else if (inet_pton(AF_INET6, host, &(sin6->sin6_addr)) == 1)
+	{
+		sin6->sin6_family = AF_INET6;
+		sin6->sin6_port = htons(atoi(port));
+	}
+	else
+	{
+		return -1;
+	}
+	return 0;
+}
+
+/** Pick up the probe settings of the configuration, which may have been reloaded */
+static void _probe_read_config(mam_context_t *ctx)
+{
+	const char *targets = NULL, *mode = NULL;
+	int *value;
+
+	probe_udp = 0;
+	probe_rate = MAM_PROBE_RATE;
+	probe_interval = MAM_PROBE_INTERVAL_MIN;
+
+	if (ctx->policy_set_dict != NULL)
+	{
+		targets = g_hash_table_lookup(ctx->policy_set_dict, "probe_targets");
+		mode = g_hash_table_lookup(ctx->policy_set_dict, "probe_mode");
+		if ((value = g_hash_table_lookup(ctx->policy_set_dict, "probe_rate")) != NULL && *value > 0)
+			probe_rate = *value;
+		if ((value = g_hash_table_lookup(ctx->policy_set_dict, "probe_interval")) != NULL && *value > 0)
+			probe_interval = *value;
+	}
+	probe_udp = (mode != NULL && strcmp(mode, "udp") == 0);
+
+	if (targets == NULL)
+	{
+		num_probe_targets = 0;
+		free(probe_targets_conf);
+		probe_targets_conf = NULL;
+		return;
+	}
+	if (probe_targets_conf != NULL && strcmp(targets, probe_targets_conf) == 0)
+		return;
+
+	free(probe_targets_conf);
+	probe_targets_conf = strdup(targets);
+	num_probe_targets = 0;
+
+	char *copy = strdup(targets), *saveptr = NULL, *token;
+	for (token = strtok_r(copy, " ,", &saveptr); token != NULL && num_probe_targets < MAM_PROBE_MAX_TARGETS; token = strtok_r(NULL, " ,", &saveptr))
+	{
+		if (_probe_parse_target(token, &(probe_targets[num_probe_targets])) == 0)
+			num_probe_targets++;
+		else
+			DLOG(MAM_PROBE_NOISY_DEBUG0, "ignoring invalid probe target %s\n", token);
+	}
+	free(copy);
+
+	DLOG(MAM_PROBE_NOISY_DEBUG0, "probing %d targets using %s\n", num_probe_targets, probe_udp ? "UDP echo" : "TCP SYN");
+}
+
+/** Get the next target of the address family of a prefix, NULL if there is none */
+static const struct sockaddr *_probe_next_target(struct probe_state *st)
+{
+	int i;
+
+	for (i = 1; i <= num_probe_targets; i++)
+	{
+		unsigned int t = (st->target + i) % num_probe_targets;
+		if (probe_targets[t].ss_family == st->pfx->family)
+		{
+			st->target = t;
+			return (const struct sockaddr *) &(probe_targets[t]);
+		}
+	}
+	return NULL;
+}
+
+static int _probe_cmp_double(const void *a, const void *b)
+{
+	double x = *(const double *) a, y = *(const double *) b;
+	return (x > y) - (x < y);
+}
+
+static void _probe_set_double(GHashTable *dict, const char *key, double value)
+{
+	double *v;
+
+	if ((v = malloc(sizeof(double))) == NULL)
+		return;
+	*v = value;
+	g_hash_table_replace(dict, (gpointer) key, v);
+}
+
+/** Check whether a prefix carries traffic that is measured passively */
+static int _probe_has_traffic(struct src_prefix_list *pfx)
+{
+	int ret;
+
+	pthread_mutex_lock(&(probe_ctx->measure_lock));
+	ret = (g_hash_table_lookup(pfx->measure_dict, "srtt_mean") != NULL && g_hash_table_lookup(pfx->measure_dict, "history_ts") == NULL);
+	pthread_mutex_unlock(&(probe_ctx->measure_lock));
+	return ret;
+}
+
+/** Account the result of a probe - rtt in ms, negative if the probe was lost */
+static void _probe_account(struct probe_state *st, double rtt)
+{
+	double sorted[MAM_PROBE_WINDOW], sum = 0, median = 0;
+	unsigned int i;
+	uint64_t *samples;
+	int stable;
+
+	if (st->num_rtts > 0)
+	{
+		memcpy(sorted, st->rtts, st->num_rtts * sizeof(double));
+		qsort(sorted, st->num_rtts, sizeof(double), &_probe_cmp_double);
+		median = sorted[st->num_rtts / 2];
+	}
+
+	/* stable: answered, and within half the median (or a millisecond) of what we have seen before */
+	stable = (rtt >= 0 && (st->num_rtts == 0 || fabs(rtt - median) <= MAX(0.5 * median, 1.0)));
+	st->loss = 0.875 * st->loss + 0.125 * (rtt < 0 ? 1.0 : 0.0);
+	st->interval = stable ? MIN(2 * st->interval, MAM_PROBE_INTERVAL_MAX) : probe_interval;
+	/* prefixes with traffic only need to be checked once in a while */
+	st->next = time(NULL) + (_probe_has_traffic(st->pfx) ? MAM_PROBE_INTERVAL_MAX : st->interval);
+
+	if (rtt >= 0)
+	{
+		st->rtts[st->next_rtt] = rtt;
+		st->next_rtt = (st->next_rtt + 1) % MAM_PROBE_WINDOW;
+		if (st->num_rtts < MAM_PROBE_WINDOW)
+			st->num_rtts++;
+		st->answered++;
+	}
+
+	DLOG(MAM_PROBE_NOISY_DEBUG1, "%s: probe %s (%.3f ms), next one in %d s\n", st->pfx->if_name, rtt < 0 ? "lost" : "answered", rtt, st->interval);
+
+	if (st->num_rtts > 0)
+	{
+		memcpy(sorted, st->rtts, st->num_rtts * sizeof(double));
+		qsort(sorted, st->num_rtts, sizeof(double), &_probe_cmp_double);
+		for (i = 0; i < st->num_rtts; i++)
+			sum += sorted[i];
+	}
+
+	pthread_mutex_lock(&(probe_ctx->measure_lock));
+	if (st->num_rtts > 0)
+	{
+		_probe_set_double(st->pfx->measure_dict, "probe_rtt_mean", sum / st->num_rtts);
+		_probe_set_double(st->pfx->measure_dict, "probe_rtt_median", sorted[st->num_rtts / 2]);
+		_probe_set_double(st->pfx->measure_dict, "probe_rtt_p90", sorted[(st->num_rtts * 9) / 10]);
+	}
+	_probe_set_double(st->pfx->measure_dict, "probe_loss", st->loss);
+	if ((samples = malloc(sizeof(uint64_t))) != NULL)
+	{
+		*samples = st->answered;
+		g_hash_table_replace(st->pfx->measure_dict, "probe_samples", samples);
+	}
+	pthread_mutex_unlock(&(probe_ctx->measure_lock));
+}
+
+/** Tear down a probe */
+static void _probe_free(struct probe *probe)
+{
+	if (probe->ev != NULL)
+		event_free(probe->ev);
+	if (probe->fd >= 0)
+		close(probe->fd);
+	if (probe->state != NULL)
+		probe->state->inflight = NULL;
+	free(probe);
+}
+
+/** A probe has been answered, or has timed out */
+static void _probe_event(evutil_socket_t fd, short what, void *arg)
+{
+	struct probe *probe = arg;
+	struct timeval now, diff;
+	double rtt = -1;
+	int err = 0;
+	socklen_t errlen = sizeof(err);
+	uint32_t cookie;
+
+	gettimeofday(&now, NULL);
+	timersub(&now, &(probe->sent), &diff);
+
+	if ((what & EV_TIMEOUT) == 0)
+	{
+		if (probe_udp)
+		{
+			ssize_t len = recv(fd, &cookie, sizeof(cookie), 0);
+			if (len == sizeof(cookie) && cookie == probe->cookie)
+				err = 0;
+			else
+				err = (len < 0) ? errno : EPROTO;
+		}
+		else if (getsockopt(fd, SOL_SOCKET, SO_ERROR, &err, &errlen) != 0)
+		{
+			err = errno;
+		}
+
+		/* a refused connection has crossed the path as well */
+		if (err == 0 || err == ECONNREFUSED)
+			rtt = diff.tv_sec * 1000.0 + diff.tv_usec / 1000.0;
+	}
+
+	_probe_account(probe->state, rtt);
+	_probe_free(probe);
+}
+
+/** Send a probe from a prefix to a target */
+static void _probe_launch(struct probe_state *st, const struct sockaddr *target)
+{
+	struct probe *probe;
+	struct sockaddr_storage src;
+	struct timeval timeout = { MAM_PROBE_TIMEOUT, 0 };
+
+	if ((probe = malloc(sizeof(struct probe))) == NULL)
+		return;
+	memset(probe, 0x00, sizeof(struct probe));
+	probe->state = st;
+	probe->cookie = (uint32_t) random();
+
+	if ((probe->fd = socket(target->sa_family, (probe_udp ? SOCK_DGRAM : SOCK_STREAM) | SOCK_NONBLOCK | SOCK_CLOEXEC, 0)) < 0)
+		goto _probe_launch_err;
+
+	/* leave through the prefix - and its interface, if we are allowed to */
+	#ifdef SO_BINDTODEVICE
+	setsockopt(probe->fd, SOL_SOCKET, SO_BINDTODEVICE, st->pfx->if_name, strlen(st->pfx->if_name) + 1);
+	#endif
+	memcpy(&src, st->pfx->if_addrs->addr, _probe_addr_len(st->pfx->if_addrs->addr));
+	if (src.ss_family == AF_INET)
+		((struct sockaddr_in *) &src)->sin_port = 0;
+	else
+		((struct sockaddr_in6 *) &src)->sin6_port = 0;
+	if (bind(probe->fd, (struct sockaddr *) &src, _probe_addr_len((struct sockaddr *) &src)) != 0)
+		goto _probe_launch_err;
+
+	gettimeofday(&(probe->sent), NULL);
+	if (connect(probe->fd, target, _probe_addr_len(target)) != 0 && errno != EINPROGRESS)
+		goto _probe_launch_err;
+	if (probe_udp && send(probe->fd, &(probe->cookie), sizeof(probe->cookie), 0) != sizeof(probe->cookie))
+		goto _probe_launch_err;
+
+	if ((probe->ev = event_new(probe_ctx->ev_base, probe->fd, probe_udp ? EV_READ : EV_WRITE, &_probe_event, probe)) == NULL ||
+		event_add(probe->ev, &timeout) != 0)
+		goto _probe_launch_err;
+
+	st->inflight = probe;
+	return;
+
+	_probe_launch_err:
+	/* nothing went out, or it cannot get anywhere - either way the path is unusable now */
+	DLOG(MAM_PROBE_NOISY_DEBUG1, "%s: cannot send probe: %s\n", st->pfx->if_name, strerror(errno));
+	probe->state = NULL;
+	_probe_free(probe);
+	_probe_account(st, -1);
+}
+
+static void _probe_free_state(gpointer data)
+{
+	struct probe_state *st = data;
+
+	if (st->inflight != NULL)
+	{
+		st->inflight->state = NULL;
+		_probe_free(st->inflight);
+	}
+	free(st);
+}
+
+/** Get the state of a prefix, creating it if needed */
+static struct probe_state *_probe_state(struct src_prefix_list *pfx, time_t now)
+{
+	struct probe_state *st;
+
+	if ((st = g_hash_table_lookup(probe_states, pfx)) != NULL)
+		return st;
+
+	if ((st = malloc(sizeof(struct probe_state))) == NULL)
+		return NULL;
+	memset(st, 0x00, sizeof(struct probe_state));
+	st->pfx = pfx;
+	st->interval = probe_interval;
+	st->next = now;
+	g_hash_table_insert(probe_states, pfx, st);
+	return st;
+}
+
+/** Hand out probes to the prefixes that are due, as the rate allows */
+static void _probe_tick(evutil_socket_t fd, short what, void *arg)
+{
+	mam_context_t *ctx = arg;
+	time_t now = time(NULL);
+	GSList *cur;
+
+	_probe_read_config(ctx);
+	if (num_probe_targets == 0)
+		return;
+
+	probe_tokens = MIN(probe_tokens + probe_rate / 60.0, MAM_PROBE_BURST);
+
+	while (probe_tokens >= 1)
+	{
+		struct probe_state *due = NULL;
+		const struct sockaddr *target;
+
+		for (cur = ctx->prefixes; cur != NULL; cur = cur->next)
+		{
+			struct src_prefix_list *pfx = cur->data;
+			struct probe_state *st;
+
+			if ((pfx->pfx_flags & PFX_ENABLED) == 0 || pfx->if_addrs == NULL || pfx->measure_dict == NULL ||
+				(st = _probe_state(pfx, now)) == NULL || st->inflight != NULL || st->next > now)
+				continue;
+			if (due == NULL || st->next < due->next)
+				due = st;
+		}
+		if (due == NULL)
+			break;
+
+		if ((target = _probe_next_target(due)) == NULL)
+		{
+			due->next = now + probe_interval;
+			continue;
+		}
+
+		probe_tokens -= 1;
+		_probe_launch(due, target);
+	}
+}
+
+int mam_probe_setup(mam_context_t *ctx)
+{
+	struct timeval one_second = {1, 0};
+
+	if (ctx == NULL || ctx->ev_base == NULL || probe_timer != NULL)
+		return -1;
+
+	probe_ctx = ctx;
+	probe_states = g_hash_table_new_full(&g_direct_hash, &g_direct_equal, NULL, &_probe_free_state);
+	if ((probe_timer = event_new(ctx->ev_base, -1, EV_PERSIST, &_probe_tick, ctx)) == NULL ||
+		evtimer_add(probe_timer, &one_second) != 0)
+	{
+		DLOG(MAM_PROBE_NOISY_DEBUG0, "cannot set up probe timer\n");
+		mam_probe_cleanup();
+		return -1;
+	}
+	return 0;
+}
+
+void mam_probe_forget(struct src_prefix_list *pfx)
+{
+	if (probe_states != NULL)
+		g_hash_table_remove(probe_states, pfx);
+}
+
+void mam_probe_cleanup()
+{
+	if (probe_timer != NULL)
+		event_free(probe_timer);
+	probe_timer = NULL;
+
+	if (probe_states != NULL)
+		g_hash_table_destroy(probe_states);
+	probe_states = NULL;
+
+	free(probe_targets_conf);
+	probe_targets_conf = NULL;
+	num_probe_targets = 0;
+	probe_ctx = NULL;
+}
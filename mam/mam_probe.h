@@ -0,0 +1,76 @@
+/** \file   mam/mam_probe.h
+ *  \brief  Active probing of the enabled prefixes of the MAM
+ *
+ *  Passive measurements only cover prefixes that carry traffic. The prober
+ *  sends a TCP SYN (connect) or a UDP echo request from each enabled prefix
+ *  to the targets of the configuration, one at a time and round robin, and
+ *  puts the results into the measure_dict of the prefix:
+ *  "probe_rtt_mean", "probe_rtt_median", "probe_rtt_p90" (milliseconds, over the
+ *  last MAM_PROBE_WINDOW answered probes), "probe_loss" (moving average of the
+ *  fraction of unanswered probes) and "probe_samples" (answered probes).
+ *
+ *  Configured in the policy block:
+ *  - probe_targets: addresses with ports, e.g. "192.0.2.1:7 [2001:db8::1]:7" -
+ *    probing is off without targets
+ *  - probe_mode: tcp (default) or udp
+ *  - probe_rate: probes per minute for all prefixes together
+ *  - probe_interval: seconds between the probes of a prefix at least
+ *
+ *  The interval of a prefix doubles while its results stay stable, up to
+ *  MAM_PROBE_INTERVAL_MAX, and is reset to probe_interval when a probe is lost
+ *  or its RTT deviates from the median. Prefixes that carry traffic, i.e. have
+ *  passive measurements, are probed at MAM_PROBE_INTERVAL_MAX.
+ *
+ *  \copyright Copyright 2013-2015 Philipp Schmidt, Theresa Enghardt, and Mirko Palmer.
+ *  All rights reserved. This project is released under the New BSD License.
+ */
+#ifndef __MAM_PROBE_H__
+#define __MAM_PROBE_H__
+
+#include "mam.h"
+
+/** Probes per minute, unless set as probe_rate */
+#ifndef MAM_PROBE_RATE
+#define MAM_PROBE_RATE 6
+#endif
+
+/** Probes that may be sent at once after the prober has been idle */
+#ifndef MAM_PROBE_BURST
+#define MAM_PROBE_BURST 3
+#endif
+
+/** Seconds between the probes of a prefix at least, unless set as probe_interval */
+#ifndef MAM_PROBE_INTERVAL_MIN
+#define MAM_PROBE_INTERVAL_MIN 10
+#endif
+
+/** Seconds between the probes of a prefix at most */
+#ifndef MAM_PROBE_INTERVAL_MAX
+#define MAM_PROBE_INTERVAL_MAX 600
+#endif
+
+/** Seconds after which a probe is lost */
+#ifndef MAM_PROBE_TIMEOUT
+#define MAM_PROBE_TIMEOUT 3
+#endif
+
+/** Answered probes the RTT statistics are computed from */
+#ifndef MAM_PROBE_WINDOW
+#define MAM_PROBE_WINDOW 32
+#endif
+
+/** Maximum number of probe targets */
+#ifndef MAM_PROBE_MAX_TARGETS
+#define MAM_PROBE_MAX_TARGETS 16
+#endif
+
+/** Start the prober on the event base of the MAM context */
+int mam_probe_setup(mam_context_t *ctx);
+
+/** Drop the state of a prefix that is removed, cancelling its probe */
+void mam_probe_forget(struct src_prefix_list *pfx);
+
+/** Stop the prober and free its state */
+void mam_probe_cleanup();
+
+#endif /* __MAM_PROBE_H__ */
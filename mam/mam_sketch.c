@@ -0,0 +1,136 @@
+/** \file mam_sketch.c
+ *  \brief Streaming quantile sketch for RTT and jitter distributions
+ *
+ *  Bucket i counts the samples v with
+ *  MAM_SKETCH_MIN_VALUE * gamma^(i-1) < v <= MAM_SKETCH_MIN_VALUE * gamma^i,
+ *  where gamma = (1 + MAM_SKETCH_ACCURACY) / (1 - MAM_SKETCH_ACCURACY).
+ *  Every sample of a bucket is within MAM_SKETCH_ACCURACY of the value
+ *  reported for the bucket.
+ *
+ *  \copyright Copyright 2013-2015 Philipp Schmidt, Theresa Enghardt, and Mirko Palmer.
+ *  All rights reserved. This project is released under the New BSD License.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+
+#include "mam_sketch.h"
+
+#define MAM_SKETCH_GAMMA ((1.0 + MAM_SKETCH_ACCURACY) / (1.0 - MAM_SKETCH_ACCURACY))
+
+/** Get the bucket of a sample that is at least MAM_SKETCH_MIN_VALUE */
+static int _mam_sketch_index(double value)
+{
+	double i = ceil(log(value / MAM_SKETCH_MIN_VALUE) / log(MAM_SKETCH_GAMMA));
+
+	if (i < 0)
+		return 0;
+	if (i >= MAM_SKETCH_BUCKETS)
+		return MAM_SKETCH_BUCKETS - 1;
+	return (int) i;
+}
+
+/** Get the value reported for the samples of a bucket */
+static double _mam_sketch_value(int i)
+{
+	return 2.0 * MAM_SKETCH_MIN_VALUE * pow(MAM_SKETCH_GAMMA, i) / (MAM_SKETCH_GAMMA + 1.0);
+}
+
+mam_sketch_t *mam_sketch_new()
+{
+	mam_sketch_t *sketch;
+
+	if ((sketch = malloc(sizeof(mam_sketch_t))) == NULL)
+		return NULL;
+	mam_sketch_clear(sketch);
+	return sketch;
+}
+
+mam_sketch_t *mam_sketch_dup(const mam_sketch_t *sketch)
+{
+	mam_sketch_t *copy;
+
+	if (sketch == NULL || (copy = malloc(sizeof(mam_sketch_t))) == NULL)
+		return NULL;
+	memcpy(copy, sketch, sizeof(mam_sketch_t));
+	return copy;
+}
+
+void mam_sketch_clear(mam_sketch_t *sketch)
+{
+	memset(sketch, 0x00, sizeof(mam_sketch_t));
+}
+
+void mam_sketch_add(mam_sketch_t *sketch, double value)
+{
+	if (sketch == NULL || !(value >= 0))
+		return;
+
+	if (sketch->count == 0 || value < sketch->min)
+		sketch->min = value;
+	if (sketch->count == 0 || value > sketch->max)
+		sketch->max = value;
+	sketch->count++;
+	sketch->sum += value;
+
+	if (value < MAM_SKETCH_MIN_VALUE)
+		sketch->zero_count++;
+	else
+		sketch->buckets[_mam_sketch_index(value)]++;
+}
+
+void mam_sketch_merge(mam_sketch_t *sketch, const mam_sketch_t *other)
+{
+	int i;
+
+	if (sketch == NULL || other == NULL || other->count == 0)
+		return;
+
+	if (sketch->count == 0 || other->min < sketch->min)
+		sketch->min = other->min;
+	if (sketch->count == 0 || other->max > sketch->max)
+		sketch->max = other->max;
+	sketch->count += other->count;
+	sketch->zero_count += other->zero_count;
+	sketch->sum += other->sum;
+
+	for (i = 0; i < MAM_SKETCH_BUCKETS; i++)
+		sketch->buckets[i] += other->buckets[i];
+}
+
+double mam_sketch_quantile(const mam_sketch_t *sketch, double q)
+{
+	uint64_t rank, seen;
+	double value;
+	int i;
+
+	if (sketch == NULL || sketch->count == 0)
+		return -1;
+
+	if (q <= 0)
+		return sketch->min;
+	if (q >= 1)
+		return sketch->max;
+
+	/* zero-based rank of the sample we are looking for */
+	rank = (uint64_t) (q * (sketch->count - 1));
+
+	if ((seen = sketch->zero_count) > rank)
+		return sketch->min;
+
+	for (i = 0; i < MAM_SKETCH_BUCKETS - 1; i++)
+	{
+		seen += sketch->buckets[i];
+		if (seen > rank)
+			break;
+	}
+
+	/* the exact extremes are known - never report anything beyond them */
+	value = _mam_sketch_value(i);
+	if (value < sketch->min)
+		return sketch->min;
+	if (value > sketch->max)
+		return sketch->max;
+	return value;
+}
@@ -0,0 +1,62 @@
+/** \file   mam/mam_sketch.h
+ *  \brief  Streaming quantile sketch for RTT and jitter distributions
+ *
+ *  A DDSketch: every sample is counted in a bucket of logarithmically growing
+ *  width, so quantiles are estimated within a relative error of
+ *  MAM_SKETCH_ACCURACY using a fixed amount of memory, no matter how many
+ *  samples have been added. Samples below MAM_SKETCH_MIN_VALUE are counted as
+ *  zero, samples beyond the last bucket in the last bucket.
+ *
+ *  All sketches share the same buckets, so sketches of different sniffer
+ *  shards or measurement intervals can be merged by adding them up.
+ *  A sketch is a single allocation without pointers: it can be copied with
+ *  memcpy() and released with free(), e.g. as value of a measure_dict.
+ *
+ *  \copyright Copyright 2013-2015 Philipp Schmidt, Theresa Enghardt, and Mirko Palmer.
+ *  All rights reserved. This project is released under the New BSD License.
+ */
+#ifndef __MAM_SKETCH_H__
+#define __MAM_SKETCH_H__
+
+#include <stdint.h>
+
+/** Relative accuracy of the quantiles */
+#define MAM_SKETCH_ACCURACY 0.02
+
+/** Smallest value that is not counted as zero */
+#define MAM_SKETCH_MIN_VALUE 0.001
+
+/** Number of buckets - covers values up to about 10^14 times MAM_SKETCH_MIN_VALUE */
+#define MAM_SKETCH_BUCKETS 800
+
+typedef struct mam_sketch {
+	uint64_t	count;						/**< Number of samples */
+	uint64_t	zero_count;					/**< Samples below MAM_SKETCH_MIN_VALUE */
+	double		sum;						/**< Sum of all samples */
+	double		min;						/**< Smallest sample */
+	double		max;						/**< Largest sample */
+	uint32_t	buckets[MAM_SKETCH_BUCKETS];/**< Samples per bucket */
+} mam_sketch_t;
+
+/** Allocate an empty sketch, NULL if out of memory */
+mam_sketch_t *mam_sketch_new();
+
+/** Copy a sketch, NULL if out of memory */
+mam_sketch_t *mam_sketch_dup(const mam_sketch_t *sketch);
+
+/** Remove all samples from a sketch */
+void mam_sketch_clear(mam_sketch_t *sketch);
+
+/** Add a sample to a sketch - negative samples are ignored */
+void mam_sketch_add(mam_sketch_t *sketch, double value);
+
+/** Add all samples of another sketch to a sketch */
+void mam_sketch_merge(mam_sketch_t *sketch, const mam_sketch_t *other);
+
+/** Estimate the q-quantile (0 <= q <= 1) of the samples of a sketch
+ *
+ *  \return the estimate, or -1 if the sketch holds no samples
+ */
+double mam_sketch_quantile(const mam_sketch_t *sketch, double q);
+
+#endif /* __MAM_SKETCH_H__ */
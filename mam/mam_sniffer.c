@@ -19,43 +19,133 @@
 #include "header_parser.h"
 #include "si_exp.h"
 #include "query_handler.h"
+#include "mam_sketch.h"
 
 #define TRACE_FLOW 0          //Only trace if no daemonize
 static volatile int keep_running = 1; // graceful shutdown
 const float ALPHA = 0.125;           // the aplha constant in rtt calcualtions
 const float BETA  = 0.250;
+const float GAMMA = 0.125;           // weight of the last window in the loss and rate averages of aggregates
 
 int packets = 0;          
 int pairs   = 0;          
 
+long long memory_used   = 0;                 // bytes held by pairs, flows and queued packets
+long long memory_budget = 16 * 1024 * 1024;  // least recently active pairs are evicted beyond this, set with -m
+int max_pkts_per_pair   = 1024;              // oldest outstanding packets are dropped beyond this, set with -q
+int evicted_pairs = 0;
+int evicted_aggs  = 0;
+int evicted_flows = 0;
+int dropped_pkts  = 0;
+int aggregates    = 0;
+
 #define BUFFER_SIZE 65536
 #define PAIR_TTL 600      // TTL in seconds, freeing memory used by this pair.
 #define DATA_IS_OLD 2     // data is old after xx seconds
+#define RATE_WINDOW 1000000LL    // window of the loss and delivery rate estimates in micro seconds
+#define DUP_ACK_THRESHOLD 3      // duplicate acks (or SACKs reporting gaps) that mark a segment as lost
+#define SCTP_DATA_CHUNK_HEADER 16
+#define MAX_FLOWS_PER_PAIR 256   // least recently active flows of a pair are evicted beyond this
+#define AGG_TTL 3600             // TTL in seconds of destination aggregates no pair contributes to anymore
+#define MAX_AGGREGATES 1024      // least recently active aggregates without pairs are evicted beyond this
+#define AGG_HASH_SIZE 2048       // buckets of the aggregate hash table, a power of two above MAX_AGGREGATES
+#define NUM_AGG_LEVELS 3         // destination /24 and /16 (/48 and /32 for IPv6), bucket of the bucket table
 
 typedef struct packet_list {
 	packet_info* pkt_info;
 	long long time_stamp;
+	int incoming;               // received from another host, 0 if sent by this host or unknown
 	struct packet_list* next;
 } packet_list;
 
+typedef struct flow_state {
+	unsigned short int snd_port;
+	unsigned short int rcv_port;
+	int seen_data;
+	int seen_ack;
+	unsigned int next_seq;      // sequence number (TSN for SCTP) following the highest one sent
+	unsigned int last_ack;      // highest (cumulative) ack received
+	int dup_acks;               // duplicate acks, or SACKs with gap reports, for last_ack
+	int lost_valid;
+	unsigned int lost_seq;      // segment already counted as lost through dup_acks
+	long long time_stamp;
+	struct flow_state* next;
+} flow_state;
+
+typedef struct aggregate {   // path metrics of all pairs from a local address to a destination prefix or bucket
+	char local_addr[FIELD_LIMIT];
+	int family;
+	unsigned char prefix[16];
+	int prefix_len;             // 0 for buckets
+	int bucket;                 // bucket of the bucket table, -1 for prefixes
+	int srtt;
+	int jitt;
+	int loss;
+	int rate;                   // bytes/s of a single pair
+	int num_pairs;              // pairs contributing to this aggregate
+	mam_sketch_t* srtt_sketch;  // allocated with the first sample, NULL before
+	mam_sketch_t* jitt_sketch;
+	long long time_stamp;
+	unsigned int hash;          // bucket of agg_hash the aggregate is chained into
+	struct aggregate* hash_next;
+	struct aggregate* prev;
+	struct aggregate* next;
+} aggregate;
+
+typedef struct bucket_entry { // line of the bucket table: prefix and the bucket (e.g. the ASN) it belongs to
+	int family;
+	unsigned char prefix[16];
+	int prefix_len;
+	int bucket;
+	struct bucket_entry* next;
+} bucket_entry;
+
 typedef struct snd_rcv_pair {
 	char snd_addr[FIELD_LIMIT];
 	char rcv_addr[FIELD_LIMIT];
 	int addr_size;
+	int local_is_rcv;           // the first packet was received from snd_addr, so rcv_addr is the local side
 	packet_list* pkts;
+	int num_pkts;
 	long long time_stamp;
-	int pkts_sent;
-	int pkts_lost;
+	int pkts_sent;              // segments sent in the current window
+	int pkts_lost;              // segments lost in the current window
 	int srtt;
 	int jitt;
-	int loss;
-	int rate;
+	int loss;                   // percent * 1000 of the segments lost in the last window
+	int rate;                   // bytes/s acked in the last window
+	flow_state* flows;          // per port pair state for loss detection, most recently active first
+	int num_flows;
+	long long window_start;     // start of the current window in micro seconds, 0 if none
+	long long acked_bytes;      // bytes acked in the current window
+	int last_rtt;               // last rtt sample, -1 if there was none yet
+	mam_sketch_t* srtt_sketch;  // distribution of the rtt samples, allocated with the first sample
+	mam_sketch_t* jitt_sketch;  // distribution of the differences between consecutive rtt samples, allocated with the second
+	aggregate* aggs[NUM_AGG_LEVELS]; // aggregates of the destination, most specific first, NULL if none
+	struct snd_rcv_pair* prev;
 	struct snd_rcv_pair* next;
 } snd_rcv_pair;
 
-snd_rcv_pair* pair_list = NULL;   // global head of pair list
+snd_rcv_pair* pair_list = NULL;   // global head of pair list, most recently active first
+snd_rcv_pair* pair_tail = NULL;   // least recently active pair, evicted first
+aggregate* agg_list = NULL;       // global head of aggregate list, most recently active first
+aggregate* agg_tail = NULL;       // least recently active aggregate
+static aggregate* agg_hash[AGG_HASH_SIZE]; // aggregates by local address and destination, chained through hash_next
+bucket_entry* bucket_table = NULL;
 
 long long get_time_stamp();
+static void get_quantiles(snd_rcv_pair* pair, int* srtt_q, int* jitt_q);
+static void attach_aggregates(snd_rcv_pair* pair);
+static void detach_aggregates(snd_rcv_pair* pair);
+static void remove_old_aggregates(long long time_stamp);
+static void free_aggregate(aggregate* agg);
+
+// stages of the packet processing, also driven by sniffer_bench.c
+packet_list* parse_frame(char* buffer, unsigned int size, long long time_stamp);
+snd_rcv_pair* pair_of_packet(packet_list* pkt);
+void process_in_pair(snd_rcv_pair* pair, packet_list* pkt);
+void enforce_memory_budget();
+int load_bucket_table(char* file_name);
 
 char snd_intents[20];
 char rcv_intents[20];
@@ -130,6 +220,40 @@ void print_packet_list(packet_list* pkts)
 /* - Removing compund structs -                                       */
 /**********************************************************************/
 
+static long long pkt_memory(packet_list* pkt)
+{
+	long long size = sizeof(packet_list);
+	chunk_info* chunk;
+	if(pkt->pkt_info != NULL)
+	{
+		size += sizeof(packet_info);
+		for(chunk = pkt->pkt_info->chunk; chunk != NULL; chunk = chunk->next_chunk) { size += sizeof(chunk_info); }
+	}
+	return size;
+}
+
+static long long pair_memory() { return sizeof(snd_rcv_pair); } // sketches are accounted once they are allocated
+static long long agg_memory()  { return sizeof(aggregate);    }
+
+// Most pairs never see an rtt sample (one-way traffic, short flows), so sketches are only allocated with the first sample
+static void add_sketch_sample(mam_sketch_t** sketch, double value)
+{
+	if(*sketch == NULL)
+	{
+		if((*sketch = mam_sketch_new()) == NULL) { return; }
+		memory_used += sizeof(mam_sketch_t);
+	}
+	mam_sketch_add(*sketch, value);
+}
+
+static void free_sketch(mam_sketch_t** sketch)
+{
+	if(*sketch == NULL) { return; }
+	memory_used -= sizeof(mam_sketch_t);
+	free(*sketch);
+	*sketch = NULL;
+}
+
 void free_pkt(packet_list* pkt)
 {
 	if(TRACE_FLOW) { sniffer_trace("ENTERING: free_pkt");    }
@@ -158,8 +282,21 @@ void free_pair_and_packets(snd_rcv_pair* pair)
 		packets--;
 		pkt = pair->pkts;
 		pair->pkts = pkt->next;
+		memory_used -= pkt_memory(pkt);
 		free_pkt(pkt);
 	}
+	flow_state* flow;
+	while(pair->flows != NULL)
+	{
+		flow = pair->flows;
+		pair->flows = flow->next;
+		memory_used -= sizeof(flow_state);
+		free(flow);
+	}
+	detach_aggregates(pair);
+	memory_used -= pair_memory();
+	free_sketch(&pair->srtt_sketch);
+	free_sketch(&pair->jitt_sketch);
 	free(pair);
 	if(TRACE_FLOW) { sniffer_trace("LEAVING: free_pair_and_packets");    }
 }
@@ -203,28 +340,62 @@ int count_pairs()
 	return result;
 }
 
+static void drop_oldest_packet(snd_rcv_pair* pair)
+{
+	packet_list** last = &pair->pkts;
+	if(*last == NULL) { return; }
+	while((*last)->next != NULL) { last = &(*last)->next; }
+	packets--;
+	dropped_pkts++;
+	pair->num_pkts--;
+	memory_used -= pkt_memory(*last);
+	free_pkt(*last);
+	*last = NULL;
+}
+
 void add_packet_to_list(packet_list* pkt, snd_rcv_pair* pair)
 {
 	packets++;
 	if(TRACE_FLOW) { sniffer_trace("ENTERING: add_packet_to_list");    }
 	if (pair->pkts == NULL) { pkt->next = NULL; pair->pkts = pkt;      }
 	else                    { pkt->next = pair->pkts; pair->pkts = pkt;}
+	pair->num_pkts++;
+	memory_used += pkt_memory(pkt);
+	if (pair->num_pkts > max_pkts_per_pair) { drop_oldest_packet(pair); } // one-way traffic, nothing will ack these
 	if(TRACE_FLOW) { sniffer_trace("LEAVING: add_packet_to_list");     }
 }
 
 
-void remove_acked_packets(packet_list* head)
+static unsigned int payload_size(packet_list* pkt)
+{
+	unsigned int size = 0;
+	chunk_info* chunk = pkt->pkt_info->chunk;
+	if(pkt->pkt_info->layer4_prot == L4_PROT_TCP) { return (chunk != NULL) ? chunk->packet_size : 0; }
+	while(chunk != NULL)
+	{
+		if(chunk->layer4_type == CHUNK_DATA && chunk->packet_size > SCTP_DATA_CHUNK_HEADER) { size += chunk->packet_size - SCTP_DATA_CHUNK_HEADER; }
+		chunk = chunk->next_chunk;
+	}
+	return size;
+}
+
+unsigned int remove_acked_packets(snd_rcv_pair* pair, packet_list* head)
 {
 	if(TRACE_FLOW) { sniffer_trace("ENTERING: remove_acked_packets"); }
 	packet_list* pkt = head;
+	unsigned int acked = 0;
 	while(head != NULL)
 	{
 		packets--;
 		pkt = head;
 		head = head->next;
+		acked += payload_size(pkt);
+		pair->num_pkts--;
+		memory_used -= pkt_memory(pkt);
 		free_pkt(pkt);
 	}
 	if(TRACE_FLOW) { sniffer_trace("LEAVING: remove_acked_packets"); }
+	return acked;
 }
 
 /**********************************************************************/
@@ -287,20 +458,33 @@ snd_rcv_pair* get_pair(char* snd, char* rcv)
 	return NULL;
 }
 
-snd_rcv_pair* init_new_pair(snd_rcv_pair* new_pair, char* snd_addr, char* rcv_addr, int addr_size)
+snd_rcv_pair* init_new_pair(snd_rcv_pair* new_pair, char* snd_addr, char* rcv_addr, int addr_size, int incoming)
 {
 	pairs++;
 	if(TRACE_FLOW) { sniffer_trace("ENTERING: init_new_pair"); }
 	new_pair = malloc(sizeof(snd_rcv_pair));
 	new_pair->pkts = NULL; 
+	new_pair->num_pkts = 0;
 	new_pair->srtt = 0;
 	new_pair->jitt = 0;
 	new_pair->loss = 0;
 	new_pair->rate = 0;
+	new_pair->pkts_sent = 0;
+	new_pair->pkts_lost = 0;
+	new_pair->flows = NULL;
+	new_pair->num_flows = 0;
+	new_pair->window_start = 0;
+	new_pair->acked_bytes = 0;
+	new_pair->last_rtt = -1;
+	new_pair->srtt_sketch = NULL;
+	new_pair->jitt_sketch = NULL;
 	new_pair->time_stamp = get_time_stamp();
 	memcpy(new_pair->snd_addr, snd_addr, FIELD_LIMIT);
 	memcpy(new_pair->rcv_addr, rcv_addr, FIELD_LIMIT);
 	new_pair->addr_size = addr_size;
+	new_pair->local_is_rcv = incoming;
+	memory_used += pair_memory();
+	attach_aggregates(new_pair);
 	if(TRACE_FLOW) { sniffer_trace("LEAVING: init_new_pair"); }
 	return new_pair;
 }
@@ -308,11 +492,24 @@ snd_rcv_pair* init_new_pair(snd_rcv_pair* new_pair, char* snd_addr, char* rcv_ad
 void add_pair_to_list(snd_rcv_pair* new_pair)
 {
 	if(TRACE_FLOW)         { sniffer_trace("ENTERING: add_pair_to_list");       }
-	if (pair_list == NULL) { pair_list = new_pair; new_pair->next = NULL;       }
-	else                   { new_pair ->next = pair_list; pair_list = new_pair; }
+	new_pair->prev = NULL;
+	new_pair->next = pair_list;
+	if (pair_list == NULL) { pair_tail = new_pair;                              }
+	else                   { pair_list->prev = new_pair;                        }
+	pair_list = new_pair;
 	if(TRACE_FLOW)         { sniffer_trace("LEAVING: add_pair_to_list");        }
 }
 
+static void unlink_pair(snd_rcv_pair* pair)
+{
+	if(pair->prev == NULL) { pair_list = pair->next;        }
+	else                   { pair->prev->next = pair->next; }
+	if(pair->next == NULL) { pair_tail = pair->prev;        }
+	else                   { pair->next->prev = pair->prev; }
+	pair->prev = NULL;
+	pair->next = NULL;
+}
+
 int pair_exist(char* snd_addr, char* rcv_addr, int addr_size)
 {
 	if(TRACE_FLOW)    { sniffer_trace("ENTERING: pair_exist");  }
@@ -327,43 +524,96 @@ int pair_exist(char* snd_addr, char* rcv_addr, int addr_size)
 	return 0;
 }
 
-void add_new_pair(char* snd, char* rcv, int addr_size)
+void add_new_pair(char* snd, char* rcv, int addr_size, int incoming)
 {
 	if(TRACE_FLOW)    { sniffer_trace("ENTERING: add_new_pair");  }
 	snd_rcv_pair* new_pair = NULL;
-	new_pair = init_new_pair(new_pair, snd, rcv, addr_size);
+	new_pair = init_new_pair(new_pair, snd, rcv, addr_size, incoming);
 	add_pair_to_list(new_pair);
 	if(TRACE_FLOW)    { sniffer_trace("LEAVING: add_new_pair");  }
 }
 
+static void remove_old_flows(snd_rcv_pair* pair, long long time_stamp)
+{
+	flow_state** flow = &pair->flows, * old;
+	while(*flow != NULL)
+	{
+		if((time_stamp - (*flow)->time_stamp) > PAIR_TTL) { old = *flow; *flow = old->next; free(old); pair->num_flows--; memory_used -= sizeof(flow_state); }
+		else                                              { flow = &(*flow)->next;                     }
+	}
+}
+
 void remove_old_pairs(long long time_stamp)
 {
 	if(TRACE_FLOW)    { sniffer_trace("ENTERING: remove_old_pair");  }
-	snd_rcv_pair* item = pair_list, * prev_pair;
+	snd_rcv_pair* item = pair_list, * next_pair;
 	while(item != NULL)
 	{
-		if((time_stamp - item->time_stamp) > PAIR_TTL)
+		next_pair = item->next;
+		if((time_stamp - item->time_stamp) > PAIR_TTL) { unlink_pair(item); free_pair_and_packets(item); }
+		else                                           { remove_old_flows(item, time_stamp);              }
+		item = next_pair;
+	}
+	if(TRACE_FLOW)    { sniffer_trace("LEAVING: remove_old_pair");  }
+}
+
+static void touch_pair(snd_rcv_pair* pair) // move to the front, so the pair list is ordered by last activity
+{
+	if(pair == pair_list) { return; }
+	unlink_pair(pair);
+	add_pair_to_list(pair);
+}
+
+static void add_aggregate_to_list(aggregate* agg)
+{
+	agg->prev = NULL;
+	agg->next = agg_list;
+	if(agg_list == NULL) { agg_tail = agg;       }
+	else                 { agg_list->prev = agg; }
+	agg_list = agg;
+}
+
+static void unlink_aggregate(aggregate* agg)
+{
+	if(agg->prev == NULL) { agg_list = agg->next;       }
+	else                  { agg->prev->next = agg->next; }
+	if(agg->next == NULL) { agg_tail = agg->prev;       }
+	else                  { agg->next->prev = agg->prev; }
+	agg->prev = NULL;
+	agg->next = NULL;
+}
+
+static aggregate* oldest_unused_aggregate() // least recently active aggregate no pair contributes to, NULL if none
+{
+	aggregate* agg = agg_tail;
+	while(agg != NULL && agg->num_pairs > 0) { agg = agg->prev; }
+	return agg;
+}
+
+void enforce_memory_budget() // evict whatever has been inactive longest, pairs or aggregates without pairs, but never the most recent pair
+{
+	if(TRACE_FLOW)    { sniffer_trace("ENTERING: enforce_memory_budget");  }
+	snd_rcv_pair* last;
+	aggregate* unused;
+	while(memory_used > memory_budget)
+	{
+		last = (pair_tail != pair_list) ? pair_tail : NULL;
+		unused = oldest_unused_aggregate();
+		if(unused != NULL && (last == NULL || unused->time_stamp <= last->time_stamp))
 		{
-			if(item == pair_list)
-			{
-				pair_list = item->next;
-				free_pair_and_packets(item);
-				item = pair_list;
-			}
-			else
-			{
-				prev_pair->next = item->next;
-				free_pair_and_packets(item);
-				item = prev_pair->next;
-			}
+			unlink_aggregate(unused);
+			free_aggregate(unused);
+			evicted_aggs++;
 		}
-		else
+		else if(last != NULL)
 		{
-			prev_pair = item;
-			item = item->next;
+			unlink_pair(last);
+			free_pair_and_packets(last);
+			evicted_pairs++;
 		}
+		else { break; }
 	}
-	if(TRACE_FLOW)    { sniffer_trace("LEAVING: remove_old_pair");  }
+	if(TRACE_FLOW)    { sniffer_trace("LEAVING: enforce_memory_budget");  }
 }
 
 /**********************************************************************/
@@ -389,6 +639,7 @@ void remove_old(long long time_stamp)
 {
 	if(TRACE_FLOW)    { sniffer_trace("ENTERING: remove_old");  }
 	remove_old_pairs(time_stamp);
+	remove_old_aggregates(time_stamp);
 	//remove_old_packets(time_stamp);
 	if(TRACE_FLOW)    { sniffer_trace("LEAVING: remove_old");  }
 }
@@ -429,13 +680,17 @@ void print_statistics()
 	printf("\n    NETWORK STATISTICS");
 	print_double_bar();
 	print_double_bar();
-	printf("\n%20s%20s%10s%10s%10s%10s", "snd", "rcv", "srtt", "jitt", "loss", "rate");
+	printf("\n%20s%20s%10s%10s%10s%10s%24s%24s", "snd", "rcv", "srtt", "jitt", "loss", "rate", "srtt p50/p90/p99", "jitt p50/p90/p99");
 	snd_rcv_pair* tail = pair_list;
 	while(tail != NULL)
 	{
-		printf("\n%20s%20s%10.2f%10.2f%10d%10d", tail->snd_addr, tail->rcv_addr, get_float_value(tail->srtt), get_float_value(tail->jitt), tail->loss, tail->rate);	
+		int srtt_q[NUM_QUANTILES], jitt_q[NUM_QUANTILES];
+		get_quantiles(tail, srtt_q, jitt_q);
+		printf("\n%20s%20s%10.2f%10.2f%10.2f%10d", tail->snd_addr, tail->rcv_addr, get_float_value(tail->srtt), get_float_value(tail->jitt), get_float_value(tail->loss), tail->rate);	
+		printf("%8.2f%8.2f%8.2f%8.2f%8.2f%8.2f", get_float_value(srtt_q[0]), get_float_value(srtt_q[1]), get_float_value(srtt_q[2]), get_float_value(jitt_q[0]), get_float_value(jitt_q[1]), get_float_value(jitt_q[2]));
 		tail = tail->next;
 	}
+	printf("\n%d pairs, %d packets, %d aggregates, %lld of %lld bytes used; evicted %d pairs, %d aggregates, %d flows; dropped %d packets", pairs, packets, aggregates, memory_used, memory_budget, evicted_pairs, evicted_aggs, evicted_flows, dropped_pkts);
 	print_double_bar();
 	printf("\n    END");
 	print_double_bar();
@@ -463,9 +718,398 @@ void print_statistics()
 /**********************************************************************/
 
 unsigned int time_diff(int ack_time_stamp, int pkt_time_stamp)  { return ack_time_stamp - pkt_time_stamp;                                         }
-unsigned int calculate_new_srtt(int old_srtt, int new_srtt)     { return (((1.0 - ALPHA) * old_srtt) + (ALPHA * new_srtt)) + 0.5;                 }
+static unsigned int calculate_ewma(int old_value, int sample, float weight) { return (((1.0 - weight) * old_value) + (weight * sample)) + 0.5;         }
+unsigned int calculate_new_srtt(int old_srtt, int new_srtt)     { return calculate_ewma(old_srtt, new_srtt, ALPHA);                               }
 unsigned int calculate_new_jitt(int old_jitt, int new_srtt)     { return (((1.0 - BETA)  * old_jitt) + (BETA  * abs(new_srtt - old_jitt))) + 0.5; }
 
+static void add_rtt_sample(snd_rcv_pair* pair, int rtt)
+{
+	pair->srtt = calculate_new_srtt(pair->srtt, rtt);
+	pair->jitt = calculate_new_jitt(pair->jitt, rtt);
+
+	add_sketch_sample(&pair->srtt_sketch, rtt);
+	if(pair->last_rtt >= 0) { add_sketch_sample(&pair->jitt_sketch, abs(rtt - pair->last_rtt)); }
+
+	int i;
+	for(i = 0; i < NUM_AGG_LEVELS; i++)
+	{
+		aggregate* agg = pair->aggs[i];
+		if(agg == NULL) { continue; }
+		agg->srtt = (agg->srtt_sketch != NULL) ? calculate_new_srtt(agg->srtt, rtt) : rtt;
+		agg->jitt = calculate_new_jitt(agg->jitt, rtt);
+		add_sketch_sample(&agg->srtt_sketch, rtt);
+		if(pair->last_rtt >= 0) { add_sketch_sample(&agg->jitt_sketch, abs(rtt - pair->last_rtt)); }
+		agg->time_stamp = get_time_stamp();
+	}
+	pair->last_rtt = rtt;
+}
+
+static void get_sketch_quantiles(mam_sketch_t* srtt_sketch, mam_sketch_t* jitt_sketch, int* srtt_q, int* jitt_q)
+{
+	int i;
+	for(i = 0; i < NUM_QUANTILES; i++)
+	{
+		srtt_q[i] = (srtt_sketch != NULL && srtt_sketch->count > 0) ? mam_sketch_quantile(srtt_sketch, QUANTILES[i]) + 0.5 : 0;
+		jitt_q[i] = (jitt_sketch != NULL && jitt_sketch->count > 0) ? mam_sketch_quantile(jitt_sketch, QUANTILES[i]) + 0.5 : 0;
+	}
+}
+
+static void get_quantiles(snd_rcv_pair* pair, int* srtt_q, int* jitt_q) { get_sketch_quantiles(pair->srtt_sketch, pair->jitt_sketch, srtt_q, jitt_q); }
+
+/**********************************************************************/
+/* - Destination aggregates -                                         */
+/**********************************************************************/
+
+// Pairs feed the aggregates of their destination, so a query for a host not talked to recently
+// can be answered with the most specific aggregate known for it. Aggregates outlive their pairs.
+
+const int AGG_LEN_V4[NUM_AGG_LEVELS - 1] = { 24, 16 };
+const int AGG_LEN_V6[NUM_AGG_LEVELS - 1] = { 48, 32 };
+
+static int parse_addr(char* text, int* family, unsigned char* bytes)
+{
+	memset(bytes, 0, 16);
+	if(inet_pton(AF_INET,  text, bytes) == 1) { *family = AF_INET;  return 1; }
+	if(inet_pton(AF_INET6, text, bytes) == 1) { *family = AF_INET6; return 1; }
+	return 0;
+}
+
+static void mask_addr(unsigned char* bytes, int prefix_len)
+{
+	int i;
+	for(i = 0; i < 16; i++)
+	{
+		if     (prefix_len >= 8 * (i + 1)) { continue;                                          }
+		else if(prefix_len <= 8 * i)       { bytes[i] = 0;                                      }
+		else                               { bytes[i] &= 0xff << (8 * (i + 1) - prefix_len);    }
+	}
+}
+
+static int in_prefix(unsigned char* bytes, unsigned char* prefix, int prefix_len)
+{
+	unsigned char masked[16];
+	memcpy(masked, bytes, 16);
+	mask_addr(masked, prefix_len);
+	return memcmp(masked, prefix, 16) == 0;
+}
+
+static int lookup_bucket(int family, unsigned char* bytes) // longest match in the bucket table, -1 if none
+{
+	bucket_entry* entry;
+	int bucket = -1, best_len = -1;
+	for(entry = bucket_table; entry != NULL; entry = entry->next)
+	{
+		if(entry->family == family && entry->prefix_len > best_len && in_prefix(bytes, entry->prefix, entry->prefix_len))
+		{
+			bucket = entry->bucket;
+			best_len = entry->prefix_len;
+		}
+	}
+	return bucket;
+}
+
+// Read the bucket table: one "prefix/length bucket" per line, e.g. "192.0.2.0/24 64496", # starts a comment
+int load_bucket_table(char* file_name)
+{
+	FILE* file = fopen(file_name, "r");
+	char line[256], addr[64];
+	int prefix_len, bucket, num = 0;
+	if(file == NULL) { return -1; }
+	while(fgets(line, sizeof(line), file) != NULL)
+	{
+		bucket_entry* entry;
+		if(line[0] == '#' || sscanf(line, "%63[^/]/%d %d", addr, &prefix_len, &bucket) != 3 || bucket < 0) { continue; }
+		if((entry = malloc(sizeof(bucket_entry))) == NULL) { break; }
+		if(!parse_addr(addr, &entry->family, entry->prefix) || prefix_len < 0 || prefix_len > (entry->family == AF_INET ? 32 : 128)) { free(entry); continue; }
+		mask_addr(entry->prefix, prefix_len);
+		entry->prefix_len = prefix_len;
+		entry->bucket = bucket;
+		entry->next = bucket_table;
+		bucket_table = entry;
+		num++;
+	}
+	fclose(file);
+	return num;
+}
+
+static unsigned int agg_hash_of(char* local_addr, int family, unsigned char* prefix, int prefix_len, int bucket) // FNV-1a over what agg_match compares
+{
+	unsigned int hash = 2166136261u;
+	int i;
+	for(i = 0; i < FIELD_LIMIT && local_addr[i] != '\0'; i++) { hash = (hash ^ (unsigned char) local_addr[i]) * 16777619u; }
+	hash = (hash ^ family) * 16777619u;
+	hash = (hash ^ bucket) * 16777619u;
+	if(bucket < 0)
+	{
+		hash = (hash ^ prefix_len) * 16777619u;
+		for(i = 0; i < 16; i++) { hash = (hash ^ prefix[i]) * 16777619u; }
+	}
+	return hash & (AGG_HASH_SIZE - 1);
+}
+
+static void unhash_aggregate(aggregate* agg)
+{
+	aggregate** item = &agg_hash[agg->hash];
+	while(*item != NULL && *item != agg) { item = &(*item)->hash_next; }
+	if(*item != NULL) { *item = agg->hash_next; }
+	agg->hash_next = NULL;
+}
+
+static void free_aggregate(aggregate* agg)
+{
+	unhash_aggregate(agg);
+	aggregates--;
+	memory_used -= agg_memory();
+	free_sketch(&agg->srtt_sketch);
+	free_sketch(&agg->jitt_sketch);
+	free(agg);
+}
+
+static int agg_match(aggregate* agg, char* local_addr, int family, unsigned char* prefix, int prefix_len, int bucket)
+{
+	if(!addr_cmp(agg->local_addr, local_addr, 0) || agg->family != family || agg->bucket != bucket) { return 0; }
+	return bucket >= 0 || (agg->prefix_len == prefix_len && memcmp(agg->prefix, prefix, 16) == 0);
+}
+
+static aggregate* get_aggregate(char* local_addr, int family, unsigned char* prefix, int prefix_len, int bucket, int create)
+{
+	aggregate* agg, * unused;
+	unsigned int hash = agg_hash_of(local_addr, family, prefix, prefix_len, bucket);
+	for(agg = agg_hash[hash]; agg != NULL; agg = agg->hash_next)
+	{
+		if(agg_match(agg, local_addr, family, prefix, prefix_len, bucket))
+		{
+			unlink_aggregate(agg);       // move to the front
+			add_aggregate_to_list(agg);
+			return agg;
+		}
+	}
+	if(!create) { return NULL; }
+	if(aggregates >= MAX_AGGREGATES)
+	{
+		if((unused = oldest_unused_aggregate()) == NULL) { return NULL; }
+		unlink_aggregate(unused);
+		free_aggregate(unused);
+	}
+	if((agg = malloc(sizeof(aggregate))) == NULL) { return NULL; }
+	memset(agg, 0, sizeof(aggregate));
+	memcpy(agg->local_addr, local_addr, FIELD_LIMIT);
+	agg->family = family;
+	memcpy(agg->prefix, prefix, 16);
+	agg->prefix_len = prefix_len;
+	agg->bucket = bucket;
+	agg->time_stamp = get_time_stamp();
+	agg->hash = hash;
+	agg->hash_next = agg_hash[hash];
+	agg_hash[hash] = agg;
+	add_aggregate_to_list(agg);
+	aggregates++;
+	memory_used += agg_memory();
+	return agg;
+}
+
+// Find the aggregates of the remote side of an address pair, most specific first; return their number
+static int find_aggregates(char* local_addr, char* remote_addr, aggregate** aggs, int create)
+{
+	unsigned char bytes[16], prefix[16];
+	int family, i, num = 0;
+	if(!parse_addr(remote_addr, &family, bytes)) { return 0; }
+	for(i = 0; i < NUM_AGG_LEVELS - 1; i++)
+	{
+		int prefix_len = (family == AF_INET) ? AGG_LEN_V4[i] : AGG_LEN_V6[i];
+		memcpy(prefix, bytes, 16);
+		mask_addr(prefix, prefix_len);
+		if((aggs[num] = get_aggregate(local_addr, family, prefix, prefix_len, -1, create)) != NULL) { num++; }
+	}
+	int bucket = lookup_bucket(family, bytes);
+	memset(prefix, 0, 16);
+	if(bucket >= 0 && (aggs[num] = get_aggregate(local_addr, family, prefix, 0, bucket, create)) != NULL) { num++; }
+	return num;
+}
+
+static void attach_aggregates(snd_rcv_pair* pair)
+{
+	int i, num;
+	memset(pair->aggs, 0, sizeof(pair->aggs));
+	if(pair->local_is_rcv) { num = find_aggregates(pair->rcv_addr, pair->snd_addr, pair->aggs, 1); }
+	else                   { num = find_aggregates(pair->snd_addr, pair->rcv_addr, pair->aggs, 1); }
+	for(i = 0; i < num; i++) { pair->aggs[i]->num_pairs++; }
+}
+
+static void detach_aggregates(snd_rcv_pair* pair)
+{
+	int i;
+	for(i = 0; i < NUM_AGG_LEVELS; i++)
+	{
+		if(pair->aggs[i] == NULL) { continue; }
+		pair->aggs[i]->num_pairs--;
+		pair->aggs[i]->time_stamp = get_time_stamp();
+		pair->aggs[i] = NULL;
+	}
+}
+
+// The most specific aggregate of the remote host that has samples, NULL if none
+static aggregate* lookup_aggregate(char* local_addr, char* remote_addr)
+{
+	aggregate* aggs[NUM_AGG_LEVELS];
+	int i, num = find_aggregates(local_addr, remote_addr, aggs, 0);
+	for(i = 0; i < num; i++)
+	{
+		if(aggs[i]->srtt_sketch != NULL && aggs[i]->srtt_sketch->count > 0) { return aggs[i]; }
+	}
+	return NULL;
+}
+
+static void get_agg_quantiles(aggregate* agg, int* srtt_q, int* jitt_q) { get_sketch_quantiles(agg->srtt_sketch, agg->jitt_sketch, srtt_q, jitt_q); }
+
+static void remove_old_aggregates(long long time_stamp)
+{
+	aggregate* agg = agg_list, * next_agg;
+	while(agg != NULL)
+	{
+		next_agg = agg->next;
+		if(agg->num_pairs == 0 && (time_stamp - agg->time_stamp) > AGG_TTL) { unlink_aggregate(agg); free_aggregate(agg); }
+		agg = next_agg;
+	}
+}
+
+/**********************************************************************/
+/* - Loss and delivery rate -                                         */
+/**********************************************************************/
+
+static int seq_after(unsigned int a, unsigned int b) { return (int)(a - b) > 0; } // a later than b, modulo wrap-around
+
+static flow_state* get_flow(snd_rcv_pair* pair, unsigned short int snd_port, unsigned short int rcv_port, int create)
+{
+	flow_state** item = &pair->flows, * flow;
+	while(*item != NULL)
+	{
+		flow = *item;
+		if(flow->snd_port == snd_port && flow->rcv_port == rcv_port)
+		{
+			*item = flow->next;          // move to the front
+			flow->next = pair->flows;
+			pair->flows = flow;
+			flow->time_stamp = get_time_stamp();
+			return flow;
+		}
+		if(flow->next == NULL && pair->num_flows >= MAX_FLOWS_PER_PAIR && create)
+		{
+			*item = NULL;                // evict the least recently active flow
+			free(flow);
+			pair->num_flows--;
+			memory_used -= sizeof(flow_state);
+			evicted_flows++;
+			break;
+		}
+		item = &flow->next;
+	}
+	if(!create || (flow = malloc(sizeof(flow_state))) == NULL) { return NULL; }
+	memset(flow, 0, sizeof(flow_state));
+	flow->snd_port = snd_port;
+	flow->rcv_port = rcv_port;
+	flow->time_stamp = get_time_stamp();
+	flow->next = pair->flows;
+	pair->flows = flow;
+	pair->num_flows++;
+	memory_used += sizeof(flow_state);
+	return flow;
+}
+
+// A segment is sent; count it as lost if it covers nothing new, unless dup acks counted it already
+static void account_sent_segment(snd_rcv_pair* pair, flow_state* flow, unsigned int seq, unsigned int end)
+{
+	pair->pkts_sent++;
+	if(flow->seen_data && !seq_after(end, flow->next_seq))
+	{
+		if(!(flow->lost_valid && flow->lost_seq == seq)) { pair->pkts_lost++; }
+		flow->lost_valid = 0;
+	}
+	else { flow->next_seq = end; }
+	flow->seen_data = 1;
+}
+
+// An ack is received; the segment at ack is lost after DUP_ACK_THRESHOLD duplicates
+static void account_ack(snd_rcv_pair* pair, flow_state* flow, unsigned int ack, int is_dup)
+{
+	if(flow->seen_ack && ack == flow->last_ack)
+	{
+		if(is_dup && ++flow->dup_acks == DUP_ACK_THRESHOLD && !(flow->lost_valid && flow->lost_seq == ack))
+		{
+			pair->pkts_lost++;
+			flow->lost_seq = ack;
+			flow->lost_valid = 1;
+		}
+	}
+	else if(!flow->seen_ack || seq_after(ack, flow->last_ack))
+	{
+		flow->last_ack = ack;
+		flow->dup_acks = is_dup;
+	}
+	flow->seen_ack = 1;
+}
+
+static void account_tcp_data(snd_rcv_pair* pair, packet_list* pkt)
+{
+	chunk_info* chunk = pkt->pkt_info->chunk;
+	if(chunk->packet_size == 0) { return; }
+	flow_state* flow = get_flow(pair, pkt->pkt_info->snd_port, pkt->pkt_info->rcv_port, 1);
+	if(flow != NULL) { account_sent_segment(pair, flow, chunk->seq_nr, chunk->seq_nr + chunk->packet_size); }
+}
+
+static void account_tcp_ack(snd_rcv_pair* pair, packet_list* ack)
+{
+	chunk_info* chunk = ack->pkt_info->chunk;
+	flow_state* flow = get_flow(pair, ack->pkt_info->rcv_port, ack->pkt_info->snd_port, 0);
+	// only a pure ack for data still outstanding is a duplicate
+	if(flow != NULL) { account_ack(pair, flow, chunk->ack_nr, chunk->packet_size == 0 && flow->seen_data && seq_after(flow->next_seq, chunk->ack_nr)); }
+}
+
+static void account_sctp_data(snd_rcv_pair* pair, packet_list* pkt)
+{
+	chunk_info* chunk = pkt->pkt_info->chunk;
+	flow_state* flow = get_flow(pair, pkt->pkt_info->snd_port, pkt->pkt_info->rcv_port, 1);
+	for(; flow != NULL && chunk != NULL; chunk = chunk->next_chunk)
+	{
+		if(chunk->layer4_type == CHUNK_DATA) { account_sent_segment(pair, flow, chunk->seq_nr, chunk->seq_nr + 1); }
+	}
+}
+
+static void account_sctp_sack(snd_rcv_pair* pair, packet_list* ack)
+{
+	chunk_info* chunk = ack->pkt_info->chunk;
+	flow_state* flow = get_flow(pair, ack->pkt_info->rcv_port, ack->pkt_info->snd_port, 0);
+	for(; flow != NULL && chunk != NULL; chunk = chunk->next_chunk)
+	{
+		if(chunk->layer4_type != CHUNK_SACK) { continue; }
+		// gap reports are miss indications for the TSN after the cumulative ack
+		account_ack(pair, flow, chunk->ack_nr + 1, chunk->gap_blocks > 0);
+		// duplicate TSNs were retransmitted without being lost
+		pair->pkts_lost -= (chunk->dup_tsns < pair->pkts_lost) ? chunk->dup_tsns : pair->pkts_lost;
+	}
+}
+
+static void update_window(snd_rcv_pair* pair, unsigned int acked, long long now)
+{
+	pair->acked_bytes += acked;
+	if(pair->window_start == 0) { pair->window_start = now; return; }
+	if(now - pair->window_start < RATE_WINDOW) { return; }
+
+	pair->rate = pair->acked_bytes * 1000000LL / (now - pair->window_start);
+	if(pair->pkts_sent > 0) { pair->loss = pair->pkts_lost * 100000LL / pair->pkts_sent; }
+	int i;
+	for(i = 0; i < NUM_AGG_LEVELS; i++)
+	{
+		if(pair->aggs[i] == NULL) { continue; }
+		pair->aggs[i]->loss = calculate_ewma(pair->aggs[i]->loss, pair->loss, GAMMA);
+		pair->aggs[i]->rate = calculate_ewma(pair->aggs[i]->rate, pair->rate, GAMMA);
+	}
+	pair->window_start = now;
+	pair->acked_bytes = 0;
+	pair->pkts_sent = 0;
+	pair->pkts_lost = 0;
+}
+
 /**********************************************************************/
 /* - Handle new packet -                                              */
 /**********************************************************************/
@@ -474,20 +1118,21 @@ void set_new_data_for_tcp_pair(snd_rcv_pair* pair, packet_list* ack)
 {
 	if(TRACE_FLOW) { sniffer_trace("ENTERING: set_new_srtt"); }
 	packet_list* pkt = pair->pkts, * prev_pkt;
+	unsigned int acked = 0;
 	while(pkt != NULL)
 	{
 		if(snd_rcv_match(pair, pkt, ack) && is_seq_nr_lower(pkt, ack))
 		{
-			pair->srtt = calculate_new_srtt(pair->srtt, time_diff(ack->time_stamp, pkt->time_stamp));
-			pair->jitt = calculate_new_jitt(pair->jitt, time_diff(ack->time_stamp, pkt->time_stamp));
+			add_rtt_sample(pair, time_diff(ack->time_stamp, pkt->time_stamp));
 			
-			if(pkt == pair->pkts) { remove_acked_packets(pkt); pair->pkts     = NULL; }
-			else                  { remove_acked_packets(pkt); prev_pkt->next = NULL; }
+			if(pkt == pair->pkts) { acked = remove_acked_packets(pair, pkt); pair->pkts     = NULL; }
+			else                  { acked = remove_acked_packets(pair, pkt); prev_pkt->next = NULL; }
 			break;			
 		}
 		prev_pkt = pkt;
 		pkt = pkt->next;
 	}
+	update_window(pair, acked, ack->time_stamp);
 	if(TRACE_FLOW) { sniffer_trace("LEAVING: set_new_srtt"); }
 }
 
@@ -495,20 +1140,21 @@ void set_new_data_for_sctp_pair(snd_rcv_pair* pair, unsigned int sack, packet_li
 {
 	if(TRACE_FLOW) { sniffer_trace("ENTERING: set_new_srtt_chunk"); }
 	packet_list* pkt = pair->pkts, * prev_pkt;
+	unsigned int acked = 0;
 	while(pkt != NULL)
 	{
 		if(snd_rcv_match(pair, pkt, ack) && is_seq_nr_lower_or_equal(pkt, sack))
 		{
-			pair->srtt = calculate_new_srtt(pair->srtt, time_diff(ack->time_stamp, pkt->time_stamp));
-			pair->jitt = calculate_new_jitt(pair->jitt, time_diff(ack->time_stamp, pkt->time_stamp));
+			add_rtt_sample(pair, time_diff(ack->time_stamp, pkt->time_stamp));
 
-			if(pkt == pair->pkts) { remove_acked_packets(pkt); pair->pkts     = NULL; }
-			else                  {	remove_acked_packets(pkt); prev_pkt->next = NULL; }
+			if(pkt == pair->pkts) { acked = remove_acked_packets(pair, pkt); pair->pkts     = NULL; }
+			else                  {	acked = remove_acked_packets(pair, pkt); prev_pkt->next = NULL; }
 			break;			
 		}
 		prev_pkt = pkt;
 		pkt = pkt->next;
 	}
+	update_window(pair, acked, ack->time_stamp);
 	if(TRACE_FLOW) { sniffer_trace("LEAVING: set_new_srtt_chunk"); }
 }
 
@@ -523,11 +1169,11 @@ long long get_time_stamp()
 	return te.tv_sec; // seconds
 }
 
-void set_time_stamp (packet_list* pkt) 
+static long long get_micro_time_stamp()
 {
 	struct timeval te; 
 	gettimeofday(&te, NULL); // get current time
-	pkt->time_stamp = 1000000LL * te.tv_sec + te.tv_usec; // in micro	
+	return 1000000LL * te.tv_sec + te.tv_usec; // in micro
 }
 
 /**********************************************************************/
@@ -541,12 +1187,16 @@ void process_tcp_packet(snd_rcv_pair* pair, packet_list* pkt)
 	if(TRACE_FLOW) { sniffer_trace("ENTERING: process_tcp_packet"); }
 	if(pair != NULL && is_tcp_ack(pkt) && addr_cmp(pkt->pkt_info->snd_addr, pair->rcv_addr, pair->addr_size))
 	{
+		account_tcp_ack(pair, pkt);
 		set_new_data_for_tcp_pair(pair, pkt);
+		free_pkt(pkt); // acks are not queued
 	}
 	else if(pair != NULL && addr_cmp(pkt->pkt_info->snd_addr, pair->snd_addr, pair->addr_size))
 	{
+		account_tcp_data(pair, pkt);
 		add_packet_to_list(pkt, pair);
 	}
+	else { free_pkt(pkt); }
 	if(TRACE_FLOW) { sniffer_trace("LEAVING: process_tcp_packet"); }
 }
 
@@ -572,12 +1222,16 @@ void process_sctp_packet(snd_rcv_pair* pair, packet_list* pkt)
 	if(pair != NULL && addr_cmp(pkt->pkt_info->snd_addr, pair->rcv_addr, pair->addr_size)) 
 	{
 		unsigned int sack_nr = get_sack(pkt->pkt_info->chunk);
+		account_sctp_sack(pair, pkt);
 		if(sack_nr != 0) set_new_data_for_sctp_pair(pair, sack_nr, pkt);
+		free_pkt(pkt); // sacks are not queued
 	}
 	else if(pair != NULL && addr_cmp(pkt->pkt_info->snd_addr, pair->snd_addr, pair->addr_size))
 	{
+		account_sctp_data(pair, pkt);
 		add_packet_to_list(pkt, pair);
 	}
+	else { free_pkt(pkt); }
 	if(TRACE_FLOW) { sniffer_trace("LEAVING: process_sctp_packet"); }
 }
 
@@ -611,7 +1265,18 @@ void process_query(query_addrs* addrs)
 		while(rcv_addrs_head != NULL)
 		{
 			snd_rcv_pair* pair = get_pair(snd_addrs_head->addr, rcv_addrs_head->addr);
-			if(pair != NULL) { push_reply_addr_pair(pair->snd_addr, pair->rcv_addr, pair->srtt, pair->jitt, pair->loss, pair->rate); } 
+			aggregate* agg;
+			int srtt_q[NUM_QUANTILES], jitt_q[NUM_QUANTILES];
+			if(pair != NULL)
+			{
+				get_quantiles(pair, srtt_q, jitt_q);
+				push_reply_addr_pair(pair->snd_addr, pair->rcv_addr, pair->srtt, pair->jitt, pair->loss, pair->rate, srtt_q, jitt_q, 8 * pair->addr_size, pair->srtt_sketch != NULL ? pair->srtt_sketch->count : 0);
+			}
+			else if((agg = lookup_aggregate(snd_addrs_head->addr, rcv_addrs_head->addr)) != NULL) // unseen host, answer for its destination prefix or bucket
+			{
+				get_agg_quantiles(agg, srtt_q, jitt_q);
+				push_reply_addr_pair(snd_addrs_head->addr, rcv_addrs_head->addr, agg->srtt, agg->jitt, agg->loss, agg->rate, srtt_q, jitt_q, agg->prefix_len, agg->srtt_sketch->count);
+			}
 			rcv_addrs_head = rcv_addrs_head->next;
 		}
 		snd_addrs_head = snd_addrs_head->next;
@@ -651,17 +1316,43 @@ int is_valid_protol(packet_list* pkt)
 	return 0;
 } 
 
-void process(packet_list* pkt)
+// The stages a packet goes through: parse_frame(), pair_of_packet() (flow table), process_in_pair() (rtt, loss and rate)
+
+packet_list* parse_frame(char* buffer, unsigned int size, long long time_stamp)
 {
-	if(TRACE_FLOW) { sniffer_trace("ENTERING: process"); }
-	if(!pair_exist(pkt->pkt_info->snd_addr, pkt->pkt_info->rcv_addr, pkt->pkt_info->ip_addr_size)) { add_new_pair(pkt->pkt_info->snd_addr, pkt->pkt_info->rcv_addr, pkt->pkt_info->ip_addr_size); }
+	struct packet frame = { buffer, size };
+	packet_list* pkt = malloc(sizeof(packet_list));
+	pkt->time_stamp = time_stamp;
+	pkt->incoming = 0;
+	pkt->pkt_info = get_packet_info(&frame);
+	if(is_valid_protol(pkt)) { return pkt; }
+	free_pkt(pkt);
+	return NULL;
+}
+
+snd_rcv_pair* pair_of_packet(packet_list* pkt)
+{
+	if(!pair_exist(pkt->pkt_info->snd_addr, pkt->pkt_info->rcv_addr, pkt->pkt_info->ip_addr_size)) { add_new_pair(pkt->pkt_info->snd_addr, pkt->pkt_info->rcv_addr, pkt->pkt_info->ip_addr_size, pkt->incoming); }
 	snd_rcv_pair* pair = get_pair(pkt->pkt_info->snd_addr, pkt->pkt_info->rcv_addr);
+	if(pair != NULL) { touch_pair(pair); }
+	return pair;
+}
+
+void process_in_pair(snd_rcv_pair* pair, packet_list* pkt)
+{
 	if(pkt->pkt_info->chunk != NULL)
 	{
 		if      (pkt->pkt_info->layer4_prot == L4_PROT_TCP)  { process_tcp_packet(pair, pkt);  }
 		else if (pkt->pkt_info->layer4_prot == L4_PROT_SCTP) { process_sctp_packet(pair, pkt); }
 	}
 	else { free_pkt(pkt); }
+}
+
+void process(packet_list* pkt)
+{
+	if(TRACE_FLOW) { sniffer_trace("ENTERING: process"); }
+	process_in_pair(pair_of_packet(pkt), pkt);
+	enforce_memory_budget();
 	if(TRACE_FLOW) { sniffer_trace("LEAVING: process"); }
 }
 
@@ -673,10 +1364,10 @@ void gather_data()
 {
 	if(TRACE_FLOW) { sniffer_trace("ENTERING: gather_data"); }
 	int sockfd = setup_data_sniffer_socket();
-	struct sockaddr saddr;
-	socklen_t saddr_size = sizeof(saddr);
+	struct sockaddr_ll saddr;
+	socklen_t saddr_size;
 	char buffer[BUFFER_SIZE];
-	pkt_ptr ppkt = malloc(sizeof(pkt_ptr)); 
+	ssize_t size;
 	query_addrs* addrs;
 	long long last_update = get_time_stamp();
 	long long closing_time = get_time_stamp();
@@ -691,15 +1382,12 @@ void gather_data()
 			commit_reply();
 		}
 		
-        ppkt->packet_size = recvfrom(sockfd , buffer , BUFFER_SIZE , 0 , &saddr , &saddr_size);  		
-		if(ppkt->packet_size != -1 && ppkt->packet_size != EAGAIN && ppkt->packet_size != EWOULDBLOCK) 
+		saddr_size = sizeof(saddr);
+        size = recvfrom(sockfd , buffer , BUFFER_SIZE , 0 , (struct sockaddr*) &saddr , &saddr_size);  		
+		if(size > 0) 
 		{
-			packet_list* pkt = malloc(sizeof(packet_list));
-			set_time_stamp(pkt);
-			ppkt->packet_data = buffer;
-			pkt->pkt_info = get_packet_info(ppkt);
-			if(is_valid_protol(pkt)) { process(pkt);  }
-			else                     { free_pkt(pkt); }
+			packet_list* pkt = parse_frame(buffer, size, get_micro_time_stamp());
+			if(pkt != NULL) { pkt->incoming = (saddr.sll_pkttype != PACKET_OUTGOING); process(pkt); }
 		}
 		
 		if((get_time_stamp() - last_update) > DATA_IS_OLD)
@@ -745,13 +1433,31 @@ void daemonize()
 /* - Main -                                                           */
 /**********************************************************************/
 
-int main()
+#ifndef SNIFFER_BENCH // the benchmark has its own main and feeds packets through the stages itself
+
+static void usage(char* name)
+{
+	printf("Usage: %s [-m memory budget in KiB] [-q max. outstanding packets per pair] [-b bucket table]\n", name);
+	exit(1);
+}
+
+int main(int argc, char** argv)
 {	
+	int opt;
+	while((opt = getopt(argc, argv, "m:q:b:")) != -1)
+	{
+		if      (opt == 'm' && atoll(optarg) > 0) { memory_budget = atoll(optarg) * 1024; }
+		else if (opt == 'q' && atoi(optarg) > 0)  { max_pkts_per_pair = atoi(optarg);     }
+		else if (opt == 'b')                      { if(load_bucket_table(optarg) < 0) { printf("Cannot read bucket table %s\n", optarg); exit(1); } }
+		else                                      { usage(argv[0]);                       }
+	}
 	setup_query_listener();
 	gather_data();
 	return 0;
 }
 
+#endif
+
 /**********************************************************************/
 /* - End -                                                            */
 /**********************************************************************/
@@ -8,6 +8,7 @@
 #include <stdlib.h>
 #include <ltdl.h>
 #include <assert.h>
+#include <time.h>
 
 #include "clib/muacc_util.h"
 #include "lib/muacc_tlv.h"
@@ -16,7 +17,9 @@
 #include "clib/strbuf.h"
 
 #include "mam_util.h"
+#include "mam_metrics.h"
 #include "mam_pmeasure.h"
+#include "mam_sketch.h"
 
 #ifndef MAM_UTIL_NOISY_DEBUG0
 #define MAM_UTIL_NOISY_DEBUG0 0
@@ -30,6 +33,22 @@
 #define MAM_UTIL_NOISY_DEBUG2 0
 #endif
 
+/** Maximum number of socket contexts kept for socketchoose requests */
+#ifndef MAM_SOCKCTX_MAX
+#define MAM_SOCKCTX_MAX 4096
+#endif
+
+/** Seconds after which an unused socket context may be dropped from the cache */
+#ifndef MAM_SOCKCTX_TTL
+#define MAM_SOCKCTX_TTL 600
+#endif
+
+/** Entry of the socket context cache */
+struct sockctx_entry {
+	struct _muacc_ctx	*ctx;			/**< copy of the socket context as sent by the client */
+	time_t				last_used;		/**< when the context was last sent or referenced */
+};
+
 void _mam_print_sockaddr_list(strbuf_t *sb, const struct sockaddr_list *list)
 {
 	const struct sockaddr_list *current = list;
@@ -66,10 +85,23 @@ static void _mam_print_dict_kv (gpointer key,  gpointer val, gpointer sb)
 
 void _mam_print_measure_dict (gpointer key,  gpointer val, gpointer sb)
 {
-	if (strncmp((const char *) key, "srtt", 4) == 0)
+	if (strncmp((const char *) key, "sketch", 6) == 0)
+	{
+		mam_sketch_t *sketch = val;
+		strbuf_printf((strbuf_t *) sb, " %s -> (%llu samples)", (char *) key, (unsigned long long) sketch->count);
+	}
+	else if (strncmp((const char *) key, "srtt", 4) == 0 || strncmp((const char *) key, "rttvar", 6) == 0 ||
+		strcmp((const char *) key, "retrans_rate") == 0 || strcmp((const char *) key, "delivery_rate_mean") == 0 ||
+		strncmp((const char *) key, "probe_rtt", 9) == 0 || strcmp((const char *) key, "probe_loss") == 0)
 	{
 		strbuf_printf((strbuf_t *) sb, " %s -> %f", (char *) key, *(double *) val);
 	}
+	else if (strncmp((const char *) key, "bytes", 5) == 0 || strncmp((const char *) key, "messages", 8) == 0 ||
+		strcmp((const char *) key, "flows") == 0 || strcmp((const char *) key, "active_ms") == 0 ||
+		strcmp((const char *) key, "history_ts") == 0 || strcmp((const char *) key, "probe_samples") == 0)
+	{
+		strbuf_printf((strbuf_t *) sb, " %s -> %llu", (char *) key, (unsigned long long) *(uint64_t *) val);
+	}
 	else
 		strbuf_printf((strbuf_t *) sb, " %s -> (unknown format)", (char *) key);
 }
@@ -163,12 +195,15 @@ void _free_client_list (gpointer data)
 		
 	client_list_t *element = (client_list_t *) data;
 	
-	char uuid_str[37];
-	uuid_unparse_lower(element->id, uuid_str);
-	printf("cleaning client list %s:\n", uuid_str);
+	if (MAM_UTIL_NOISY_DEBUG2)
+	{
+		char uuid_str[37];
+		uuid_unparse_lower(element->id, uuid_str);
+		DLOG(MAM_UTIL_NOISY_DEBUG2, "cleaning client list %s\n", uuid_str);
+	}
 	
 	if (element->sockets != NULL)
-		g_slist_free_full(element->sockets,  &_free_socket_list);
+		g_hash_table_destroy(element->sockets);
 		
 	free (element);
 	return;
@@ -181,7 +216,7 @@ void _free_socket_list (gpointer data)
 	
 	socket_list_t *element = (socket_list_t *) data;
 	
-	printf("list had socket: %d\n", element->sk);
+	DLOG(MAM_UTIL_NOISY_DEBUG2, "list had socket: %d\n", element->sk);
 	
 	free(data);
 	return;
@@ -196,13 +231,234 @@ int _mam_free_ctx(struct mam_context *ctx)
 		return -1;
 	}
 
+	int i;
+
+	_mam_index_free(ctx);
+	/* cache entries hold references to the prefixes */
+	if (ctx->dns_cache != NULL)
+		g_hash_table_destroy(ctx->dns_cache);
+	ctx->dns_cache = NULL;
 	g_slist_free_full(ctx->prefixes, &_free_src_prefix_list);
-	g_slist_free_full(ctx->clients,  &_free_client_list);
+	for (i = 0; i < MAM_CLIENT_SHARDS; i++)
+	{
+		if (ctx->clients[i].clients != NULL)
+			g_hash_table_destroy(ctx->clients[i].clients);
+		pthread_mutex_destroy(&(ctx->clients[i].lock));
+	}
+	if (ctx->socket_ctxs != NULL)
+		g_hash_table_destroy(ctx->socket_ctxs);
+	pthread_mutex_destroy(&(ctx->socket_ctxs_lock));
+	pthread_rwlock_destroy(&(ctx->policy_lock));
+	while (ctx->free_requests != NULL)
+	{
+		request_context_t *rctx = ctx->free_requests;
+		ctx->free_requests = rctx->next_free;
+
+		_muacc_free_ctx(rctx->ctx);
+		free(rctx);
+	}
+	pthread_mutex_destroy(&(ctx->free_requests_lock));
+	pthread_mutex_destroy(&(ctx->dns_cache_lock));
+	pthread_mutex_destroy(&(ctx->measure_lock));
 	free(ctx);
 
 	return 0;
 }
 
+guint _mam_uuid_hash(gconstpointer key)
+{
+	const unsigned char *id = key;
+	guint h = 2166136261u;
+	int i;
+
+	for (i = 0; i < sizeof(uuid_t); i++)
+		h = (h ^ id[i]) * 16777619u;
+
+	return h;
+}
+
+gboolean _mam_uuid_equal(gconstpointer a, gconstpointer b)
+{
+	return (memcmp(a, b, sizeof(uuid_t)) == 0);
+}
+
+void _mam_policy_lock(struct mam_context *ctx)
+{
+	if (ctx->num_workers == 0)
+		return;
+
+	if (ctx->policy_threadsafe)
+		pthread_rwlock_rdlock(&(ctx->policy_lock));
+	else
+		pthread_rwlock_wrlock(&(ctx->policy_lock));
+}
+
+void _mam_policy_unlock(struct mam_context *ctx)
+{
+	if (ctx->num_workers == 0)
+		return;
+
+	pthread_rwlock_unlock(&(ctx->policy_lock));
+}
+
+struct event_base *_mam_request_base(request_context_t *ctx)
+{
+	if (ctx->worker != NULL)
+		return ctx->worker->ev_base;
+
+	return ctx->mctx->ev_base;
+}
+
+static guint _mam_sockctx_hash(gconstpointer key)
+{
+	const struct _muacc_ctxref *ref = key;
+
+	return _mam_uuid_hash(ref->ctxid) ^ (guint) ref->ctxino ^ (guint) (ref->ctxino >> 32);
+}
+
+static gboolean _mam_sockctx_equal(gconstpointer a, gconstpointer b)
+{
+	const struct _muacc_ctxref *ra = a;
+	const struct _muacc_ctxref *rb = b;
+
+	return (ra->ctxino == rb->ctxino && memcmp(ra->ctxid, rb->ctxid, sizeof(uuid_t)) == 0);
+}
+
+static void _mam_sockctx_free_entry(gpointer data)
+{
+	struct sockctx_entry *entry = data;
+
+	_muacc_free_ctx(entry->ctx);
+	free(entry);
+}
+
+static gboolean _mam_sockctx_expired(gpointer key, gpointer value, gpointer now)
+{
+	return (((struct sockctx_entry *) value)->last_used + MAM_SOCKCTX_TTL < *(time_t *) now);
+}
+
+/** Least recently used entries to drop from the socket context cache */
+struct sockctx_eviction {
+	time_t				cutoff;			/**< entries used before are dropped */
+	guint				ties;			/**< number of entries last used at cutoff to drop as well */
+};
+
+static gboolean _mam_sockctx_evicted(gpointer key, gpointer value, gpointer data)
+{
+	struct sockctx_eviction *ev = data;
+	time_t last_used = ((struct sockctx_entry *) value)->last_used;
+
+	if (last_used < ev->cutoff)
+		return TRUE;
+	if (last_used == ev->cutoff && ev->ties > 0)
+	{
+		ev->ties--;
+		return TRUE;
+	}
+	return FALSE;
+}
+
+static void _mam_sockctx_collect_last_used(gpointer key, gpointer value, gpointer times)
+{
+	g_array_append_val((GArray *) times, ((struct sockctx_entry *) value)->last_used);
+}
+
+static gint _mam_sockctx_cmp_time(gconstpointer a, gconstpointer b)
+{
+	time_t x = *((const time_t *) a);
+	time_t y = *((const time_t *) b);
+
+	return (x > y) - (x < y);
+}
+
+/** Make room in the full socket context cache
+ *  Drops the expired entries, or else the least recently used quarter of them
+ */
+static void _mam_sockctx_evict(GHashTable *socket_ctxs, time_t now)
+{
+	GArray *times;
+	struct sockctx_eviction ev;
+	guint last, first;
+
+	g_hash_table_foreach_remove(socket_ctxs, &_mam_sockctx_expired, &now);
+	if (g_hash_table_size(socket_ctxs) < MAM_SOCKCTX_MAX)
+		return;
+
+	times = g_array_sized_new(FALSE, FALSE, sizeof(time_t), g_hash_table_size(socket_ctxs));
+	g_hash_table_foreach(socket_ctxs, &_mam_sockctx_collect_last_used, times);
+	g_array_sort(times, &_mam_sockctx_cmp_time);
+
+	/* drop the entries up to the end of the first quarter, splitting ties by count */
+	last = times->len / 4;
+	ev.cutoff = g_array_index(times, time_t, last);
+	for (first = last; first > 0 && g_array_index(times, time_t, first - 1) == ev.cutoff; first--);
+	ev.ties = last - first + 1;
+	g_array_free(times, TRUE);
+
+	DLOG(MAM_UTIL_NOISY_DEBUG1, "socket context cache full - dropping %u least recently used entries\n", last + 1);
+	g_hash_table_foreach_remove(socket_ctxs, &_mam_sockctx_evicted, &ev);
+}
+
+void _mam_sockctx_learn(request_context_t *ctx)
+{
+	struct socketlist *slist;
+	struct sockctx_entry *entry;
+	struct _muacc_ctxref *ref;
+	time_t now = time(NULL);
+
+	pthread_mutex_lock(&(ctx->mctx->socket_ctxs_lock));
+
+	if (ctx->mctx->socket_ctxs == NULL)
+	{
+		ctx->mctx->socket_ctxs = g_hash_table_new_full(&_mam_sockctx_hash, &_mam_sockctx_equal, &free, &_mam_sockctx_free_entry);
+	}
+
+	for (slist = ctx->sockets; slist != NULL; slist = slist->next)
+	{
+		/* sockets that were referenced by ID are already known */
+		if ((slist->flags & MUACC_SOCKET_CTX_KNOWN) || slist->ctx == NULL || __uuid_is_null(slist->ctx->ctxid))
+			continue;
+
+		/* clients resend evicted contexts on demand */
+		if (g_hash_table_size(ctx->mctx->socket_ctxs) >= MAM_SOCKCTX_MAX)
+			_mam_sockctx_evict(ctx->mctx->socket_ctxs, now);
+
+		ref = malloc(sizeof(struct _muacc_ctxref));
+		entry = malloc(sizeof(struct sockctx_entry));
+		if (ref == NULL || entry == NULL)
+		{
+			free(ref);
+			free(entry);
+			break;
+		}
+		__uuid_copy(ref->ctxid, slist->ctx->ctxid);
+		ref->ctxino = slist->ctx->ctxino;
+		entry->ctx = _muacc_clone_ctx(slist->ctx);
+		entry->last_used = now;
+
+		DLOG(MAM_UTIL_NOISY_DEBUG2, "learned context of socketset member %d\n", slist->file);
+		g_hash_table_replace(ctx->mctx->socket_ctxs, ref, entry);
+	}
+
+	pthread_mutex_unlock(&(ctx->mctx->socket_ctxs_lock));
+}
+
+struct _muacc_ctx *_mam_sockctx_lookup(struct mam_context *mctx, const struct _muacc_ctxref *ref)
+{
+	struct sockctx_entry *entry;
+	struct _muacc_ctx *known = NULL;
+
+	pthread_mutex_lock(&(mctx->socket_ctxs_lock));
+	if (mctx->socket_ctxs != NULL && (entry = g_hash_table_lookup(mctx->socket_ctxs, ref)) != NULL)
+	{
+		entry->last_used = time(NULL);
+		known = _muacc_clone_ctx(entry->ctx);
+	}
+	pthread_mutex_unlock(&(mctx->socket_ctxs_lock));
+
+	return known;
+}
+
 int _mam_fetch_policy_function(lt_dlhandle policy, const char *name, void **function)
 {
 	if (policy == 0 || name == NULL || function == NULL)
@@ -235,9 +491,11 @@ int _mam_callback_or_fail(request_context_t *ctx, const char *function, unsigned
 	if (_mam_fetch_policy_function(ctx->mctx->policy, function, (void **) &callback_function) == 0)
 	{
 		int ret;
+		uint64_t start = mam_metrics_now();
 		DLOG(MAM_UTIL_NOISY_DEBUG2,"Calling %s\n", function);
 		ctx->policy_calls_performed |= flag_if_success;
-		ret = callback_function(ctx, ctx->mctx->ev_base);
+		ret = callback_function(ctx, _mam_request_base(ctx));
+		mam_metrics_policy_call(flag_if_success, start);
 		if (ret != 0)
 		{
 			DLOG(MAM_UTIL_NOISY_DEBUG1,"Callback %s returned %d\n", function, ret);
@@ -331,6 +589,56 @@ int _muacc_send_ctx_event(request_context_t *ctx, muacc_mam_action_t reason)
 	return(-1);
 }
 
+int _mam_send_srcaddrs(request_context_t *ctx)
+{
+	muacc_mam_action_t reason = muacc_act_srcaddrs_resp;
+	struct evbuffer_iovec v[1];
+	ssize_t pos = 0;
+	int family;
+	GSList *cur;
+	struct sockaddr_list *sa;
+
+	if (evbuffer_reserve_space(ctx->out, MUACC_TLV_MAXLEN, v, 1) <= 0)
+	{
+		DLOG(MAM_UTIL_NOISY_DEBUG1,"ERROR reserving buffer\n");
+		mam_release_request_context(ctx);
+		return(-1);
+	}
+
+	/* the client tells the responses apart by the inode it sent */
+	if( 0 > _muacc_push_tlv(v[0].iov_base, &pos, v[0].iov_len, action, &reason, sizeof(muacc_mam_action_t)) ) goto _mam_send_srcaddrs_err;
+	if( 0 > _muacc_push_tlv(v[0].iov_base, &pos, v[0].iov_len, ctxino, &(ctx->ctx->ctxino), sizeof(ctx->ctx->ctxino)) ) goto _mam_send_srcaddrs_err;
+
+	for (family = AF_INET; family != 0; family = (family == AF_INET) ? AF_INET6 : 0)
+	{
+		if (ctx->ctx->domain != AF_UNSPEC && ctx->ctx->domain != family)
+			continue;
+
+		/* one address per prefix is enough to use it */
+		for (cur = mam_enabled_prefixes(ctx->mctx, family); cur != NULL; cur = cur->next)
+		{
+			if ((sa = ((struct src_prefix_list *) cur->data)->if_addrs) != NULL &&
+				0 > _muacc_push_tlv(v[0].iov_base, &pos, v[0].iov_len, bind_sa_res, sa->addr, sa->addr_len) ) goto _mam_send_srcaddrs_err;
+		}
+	}
+
+	if( 0 > _muacc_push_tlv_tag(v[0].iov_base, &pos, v[0].iov_len, eof) ) goto _mam_send_srcaddrs_err;
+	v[0].iov_len = pos;
+
+	if (evbuffer_commit_space(ctx->out, v, 1) < 0)
+	{
+		DLOG(MAM_UTIL_NOISY_DEBUG1,"ERROR committing buffer\n");
+		mam_release_request_context(ctx);
+		return(-1);
+	}
+	mam_release_request_context(ctx);
+	return(0);
+
+	_mam_send_srcaddrs_err:
+	DLOG(MAM_UTIL_NOISY_DEBUG1,"ERROR packing srcaddrs response\n");
+	mam_release_request_context(ctx);
+	return(-1);
+}
 
 int _muacc_proc_tlv_event(request_context_t *ctx)
 {
@@ -397,6 +705,7 @@ int _muacc_proc_tlv_event(request_context_t *ctx)
 			DLOG(MAM_UTIL_NOISY_DEBUG2, "Receiving new socket set\n");
 			ctx->sockets = malloc(sizeof(struct socketlist));
 			ctx->sockets->next = NULL;
+			ctx->sockets->flags = 0;
 			ctx->sockets->file = *(int *) data;
 			ctx->sockets->ctx = _muacc_create_ctx();
 		}
@@ -412,10 +721,40 @@ int _muacc_proc_tlv_event(request_context_t *ctx)
 			/* Creating socket set member */
 			new->next = malloc(sizeof(struct socketlist));
 			new->next->next = NULL;
+			new->next->flags = 0;
 			new->next->file = *(int *) data;
 			new->next->ctx = _muacc_create_ctx();
 		}
 	}
+	else if (*tag == flowstats && *data_len == sizeof(struct _muacc_flowstats))
+	{
+		memcpy(&(ctx->flowstats), data, sizeof(struct _muacc_flowstats));
+		DLOG(MAM_UTIL_NOISY_DEBUG2, "flow stats: %llu bytes sent, %llu bytes received\n",
+				(unsigned long long) ctx->flowstats.bytes_sent, (unsigned long long) ctx->flowstats.bytes_received);
+	}
+	else if (*tag == socketset_ctxref && ctx->sockets != NULL && *data_len == sizeof(struct _muacc_ctxref))
+	{
+		struct socketlist *socklist = ctx->sockets;
+		struct _muacc_ctx *known;
+
+		while (socklist->next != NULL)
+		{
+			socklist = socklist->next;
+		}
+
+		if ((known = _mam_sockctx_lookup(ctx->mctx, (struct _muacc_ctxref *) data)) != NULL)
+		{
+			DLOG(MAM_UTIL_NOISY_DEBUG2, "using known context for socketset member %d\n", socklist->file);
+			_muacc_free_ctx(socklist->ctx);
+			socklist->ctx = known;
+			socklist->flags |= MUACC_SOCKET_CTX_KNOWN;
+		}
+		else
+		{
+			DLOG(MAM_UTIL_NOISY_DEBUG1, "context of socketset member %d unknown - client has to resync\n", socklist->file);
+			ctx->sockets_unknown++;
+		}
+	}
 	else
 	{
 		struct _muacc_ctx *parsectx = ctx->ctx;
@@ -24,12 +24,48 @@ void _mam_print_ctx(strbuf_t *sb, const struct mam_context *ctx);
 /** Helper that prints the measurement dictionary */
 void _mam_print_measure_dict (gpointer key,  gpointer val, gpointer sb);
 
-/** Helper that frees a source prefix list - to be called using g_slist_free_full */
+/** Helper that drops the reference the prefix list holds on a prefix - to be called using g_slist_free_full */
 void _free_src_prefix_list (gpointer data);
 
+/** Helper that sets up the DNS bases of a prefix from a resolv.conf file,
+ *  one for the event base of the MAM context and one for each worker
+ *
+ *  \return 0 on success, -1 otherwise
+ */
+int _mam_prefix_set_resolv_conf (mam_context_t *ctx, struct src_prefix_list *pfx, const char *resolv_conf);
+
+/** Helper that frees the DNS bases of a prefix
+ *  With fail_lookups set, lookups in flight are answered with EVUTIL_EAI_CANCEL,
+ *  otherwise they are dropped silently - only to be used when shutting down */
+void _mam_prefix_free_dns (struct src_prefix_list *pfx, int fail_lookups);
+
+/** Helpers that take and release the policy lock around policy callbacks
+ *  invoked from an event loop - no-ops if there are no workers */
+void _mam_policy_lock (struct mam_context *ctx);
+void _mam_policy_unlock (struct mam_context *ctx);
+
+/** Helpers that keep the prefix indexes of the MAM context up to date - to be called
+ *  after a prefix has been added to the list and before it is removed, respectively */
+void _mam_index_add_prefix (mam_context_t *ctx, struct src_prefix_list *pfx);
+void _mam_index_remove_prefix (mam_context_t *ctx, struct src_prefix_list *pfx);
+
+/** Helper that frees the prefix indexes of the MAM context */
+void _mam_index_free (mam_context_t *ctx);
+
+/** Helpers that free client and socket entries - to be used as destroy functions of their tables */
 void _free_client_list (gpointer data);
 void _free_socket_list (gpointer data);
 
+/** Helper to free an entry of the DNS cache */
+void _mam_dns_free_entry (gpointer data);
+
+/** Hash and compare functions for tables keyed by uuid_t */
+guint _mam_uuid_hash(gconstpointer key);
+gboolean _mam_uuid_equal(gconstpointer a, gconstpointer b);
+
+/** Event base that policy callbacks of this request run on */
+struct event_base *_mam_request_base(request_context_t *ctx);
+
 /** Helper that frees a context */
 int _mam_free_ctx(struct mam_context *ctx);
 
@@ -52,6 +88,23 @@ int _muacc_proc_tlv_event(
  */
 int _muacc_send_ctx_event(request_context_t *ctx, muacc_mam_action_t reason);
 
+/** answer a srcaddrs request with the addresses of the enabled prefixes of the requested family
+ *
+ * @return 0 on success, -1 if there was an error.
+ */
+int _mam_send_srcaddrs(request_context_t *ctx);
+
+/** remember the contexts of socketset members that were sent in full,
+ *  so that later socketchoose requests can reference them by ID
+ */
+void _mam_sockctx_learn(request_context_t *ctx);
+
+/** look up a socket context that has been learned from an earlier socketchoose request
+ *
+ * @return a copy of the cached context, or NULL if the MAM does not know it (anymore)
+ */
+struct _muacc_ctx *_mam_sockctx_lookup(struct mam_context *mctx, const struct _muacc_ctxref *ref);
+
 /** helper to print a prefix list flags into a string
  *
  */
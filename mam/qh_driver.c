@@ -130,63 +130,63 @@ void test_socket_reply() {
 	commit_reply();
 	
 	printf("\n\n  Size 1 reply:\n");
-	push_reply_addr_pair("10.0.0.3", "170.0.0.4", 0, 1, 2, 3);
+	push_reply_addr_pair("10.0.0.3", "170.0.0.4", 0, 1, 2, 3, NULL, NULL, 32, 0);
 	commit_reply();
 	path = convert_reply_to_struct(path, get_current_reply());
 	
 	printf("\n\n  Size 2 reply:\n");
-	push_reply_addr_pair("10.0.0.3", "170.0.0.4", 0, 1, 2, 3);
-	push_reply_addr_pair("10.0.0.6", "170.0.0.4", 0, 1, 2, 3);
+	push_reply_addr_pair("10.0.0.3", "170.0.0.4", 0, 1, 2, 3, NULL, NULL, 32, 0);
+	push_reply_addr_pair("10.0.0.6", "170.0.0.4", 0, 1, 2, 3, NULL, NULL, 32, 0);
 	commit_reply();
 	
 	printf("\n\n  Size 6 reply:\n");
-	push_reply_addr_pair("170.100.100.200", "255.255.255.255", 0, 1, 2, 3);
-	push_reply_addr_pair("170.100.100.210", "255.255.255.255", 0, 10, 20, 30);
-	push_reply_addr_pair("170.100.100.220", "255.255.255.255", 0, 100, 200, 300);
-	push_reply_addr_pair("170.100.100.230", "255.255.255.255", 0, 100, 200, 301);
-	push_reply_addr_pair("170.100.100.240", "255.255.255.255", 0, 100, 200, 302);
-	push_reply_addr_pair("170.100.100.250", "255.255.255.255", 0, 100, 200, 303);
+	push_reply_addr_pair("170.100.100.200", "255.255.255.255", 0, 1, 2, 3, NULL, NULL, 32, 0);
+	push_reply_addr_pair("170.100.100.210", "255.255.255.255", 0, 10, 20, 30, NULL, NULL, 32, 0);
+	push_reply_addr_pair("170.100.100.220", "255.255.255.255", 0, 100, 200, 300, NULL, NULL, 32, 0);
+	push_reply_addr_pair("170.100.100.230", "255.255.255.255", 0, 100, 200, 301, NULL, NULL, 32, 0);
+	push_reply_addr_pair("170.100.100.240", "255.255.255.255", 0, 100, 200, 302, NULL, NULL, 32, 0);
+	push_reply_addr_pair("170.100.100.250", "255.255.255.255", 0, 100, 200, 303, NULL, NULL, 32, 0);
 	commit_reply();
 	path = convert_reply_to_struct(path, get_current_reply());
 	
 	
 	printf("\n\n  Size 24 reply (to big):\n");
-	push_reply_addr_pair("170.100.100.200", "255.255.255.255", 0, 1, 2, 3);
-	push_reply_addr_pair("170.100.100.210", "255.255.255.255", 0, 10, 20, 30);
-	push_reply_addr_pair("170.100.100.220", "255.255.255.255", 0, 100, 200, 300);
-	push_reply_addr_pair("170.100.100.230", "255.255.255.255", 0, 100, 200, 301);
-	push_reply_addr_pair("170.100.100.240", "255.255.255.255", 0, 100, 200, 302);
-	push_reply_addr_pair("170.100.100.250", "255.255.255.255", 0, 100, 200, 303);
-	push_reply_addr_pair("170.100.100.200", "255.255.255.255", 0, 1, 2, 3);
-	push_reply_addr_pair("170.100.100.210", "255.255.255.255", 0, 10, 20, 30);
-	push_reply_addr_pair("170.100.100.220", "255.255.255.255", 0, 100, 200, 300);
-	push_reply_addr_pair("170.100.100.230", "255.255.255.255", 0, 100, 200, 301);
-	push_reply_addr_pair("170.100.100.240", "255.255.255.255", 0, 100, 200, 302);
-	push_reply_addr_pair("170.100.100.250", "255.255.255.255", 0, 100, 200, 303);
-	push_reply_addr_pair("170.100.100.200", "255.255.255.255", 0, 1, 2, 3);
-	push_reply_addr_pair("170.100.100.210", "255.255.255.255", 0, 10, 20, 30);
-	push_reply_addr_pair("170.100.100.220", "255.255.255.255", 0, 100, 200, 300);
-	push_reply_addr_pair("170.100.100.230", "255.255.255.255", 0, 100, 200, 301);
-	push_reply_addr_pair("170.100.100.240", "255.255.255.255", 0, 100, 200, 302);
-	push_reply_addr_pair("170.100.100.250", "255.255.255.255", 0, 100, 200, 303);
-	push_reply_addr_pair("170.100.100.200", "255.255.255.255", 0, 1, 2, 3);
-	push_reply_addr_pair("170.100.100.210", "255.255.255.255", 0, 10, 20, 30);
-	push_reply_addr_pair("170.100.100.220", "255.255.255.255", 0, 100, 200, 300);
-	push_reply_addr_pair("170.100.100.230", "255.255.255.255", 0, 100, 200, 301);
-	push_reply_addr_pair("170.100.100.240", "255.255.255.255", 0, 100, 200, 302);
-	push_reply_addr_pair("170.100.100.250", "255.255.255.255", 0, 100, 200, 303);
+	push_reply_addr_pair("170.100.100.200", "255.255.255.255", 0, 1, 2, 3, NULL, NULL, 32, 0);
+	push_reply_addr_pair("170.100.100.210", "255.255.255.255", 0, 10, 20, 30, NULL, NULL, 32, 0);
+	push_reply_addr_pair("170.100.100.220", "255.255.255.255", 0, 100, 200, 300, NULL, NULL, 32, 0);
+	push_reply_addr_pair("170.100.100.230", "255.255.255.255", 0, 100, 200, 301, NULL, NULL, 32, 0);
+	push_reply_addr_pair("170.100.100.240", "255.255.255.255", 0, 100, 200, 302, NULL, NULL, 32, 0);
+	push_reply_addr_pair("170.100.100.250", "255.255.255.255", 0, 100, 200, 303, NULL, NULL, 32, 0);
+	push_reply_addr_pair("170.100.100.200", "255.255.255.255", 0, 1, 2, 3, NULL, NULL, 32, 0);
+	push_reply_addr_pair("170.100.100.210", "255.255.255.255", 0, 10, 20, 30, NULL, NULL, 32, 0);
+	push_reply_addr_pair("170.100.100.220", "255.255.255.255", 0, 100, 200, 300, NULL, NULL, 32, 0);
+	push_reply_addr_pair("170.100.100.230", "255.255.255.255", 0, 100, 200, 301, NULL, NULL, 32, 0);
+	push_reply_addr_pair("170.100.100.240", "255.255.255.255", 0, 100, 200, 302, NULL, NULL, 32, 0);
+	push_reply_addr_pair("170.100.100.250", "255.255.255.255", 0, 100, 200, 303, NULL, NULL, 32, 0);
+	push_reply_addr_pair("170.100.100.200", "255.255.255.255", 0, 1, 2, 3, NULL, NULL, 32, 0);
+	push_reply_addr_pair("170.100.100.210", "255.255.255.255", 0, 10, 20, 30, NULL, NULL, 32, 0);
+	push_reply_addr_pair("170.100.100.220", "255.255.255.255", 0, 100, 200, 300, NULL, NULL, 32, 0);
+	push_reply_addr_pair("170.100.100.230", "255.255.255.255", 0, 100, 200, 301, NULL, NULL, 32, 0);
+	push_reply_addr_pair("170.100.100.240", "255.255.255.255", 0, 100, 200, 302, NULL, NULL, 32, 0);
+	push_reply_addr_pair("170.100.100.250", "255.255.255.255", 0, 100, 200, 303, NULL, NULL, 32, 0);
+	push_reply_addr_pair("170.100.100.200", "255.255.255.255", 0, 1, 2, 3, NULL, NULL, 32, 0);
+	push_reply_addr_pair("170.100.100.210", "255.255.255.255", 0, 10, 20, 30, NULL, NULL, 32, 0);
+	push_reply_addr_pair("170.100.100.220", "255.255.255.255", 0, 100, 200, 300, NULL, NULL, 32, 0);
+	push_reply_addr_pair("170.100.100.230", "255.255.255.255", 0, 100, 200, 301, NULL, NULL, 32, 0);
+	push_reply_addr_pair("170.100.100.240", "255.255.255.255", 0, 100, 200, 302, NULL, NULL, 32, 0);
+	push_reply_addr_pair("170.100.100.250", "255.255.255.255", 0, 100, 200, 303, NULL, NULL, 32, 0);
 	commit_reply();
 	
 	printf("\n\n  Size 1 reply:\n");
-	push_reply_addr_pair("1.1.1.1", "2.2.2.2", 90, 90, 90, 90);
+	push_reply_addr_pair("1.1.1.1", "2.2.2.2", 90, 90, 90, 90, NULL, NULL, 32, 0);
 	commit_reply();
 	
 	printf("\n\n  Empty reply:\n");
 	commit_reply();
 	
 	printf("\n\n  Size 2 reply:\n");
-	push_reply_addr_pair("1.1.1.1", "2.2.2.2", 9, 9, 9, 9);
-	push_reply_addr_pair("10.0.0.6", "170.0.0.4", 0, 1, 2, 3);
+	push_reply_addr_pair("1.1.1.1", "2.2.2.2", 9, 9, 9, 9, NULL, NULL, 32, 0);
+	push_reply_addr_pair("10.0.0.6", "170.0.0.4", 0, 1, 2, 3, NULL, NULL, 32, 0);
 	commit_reply();
 }
 
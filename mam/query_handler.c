@@ -94,6 +94,11 @@ int copy_to_trait_struct_from_array(path_traits* path, char* array, int index) {
 	index = copy_num_from_array  (&path->norm_jitt, array, index);
 	index = copy_num_from_array  (&path->norm_loss, array, index);
 	index = copy_num_from_array  (&path->norm_rate, array, index);
+	int i;
+	for(i = 0; i < NUM_QUANTILES; i++) { index = copy_num_from_array(&path->srtt_q[i], array, index); }
+	for(i = 0; i < NUM_QUANTILES; i++) { index = copy_num_from_array(&path->jitt_q[i], array, index); }
+	index = copy_num_from_array  (&path->prefix_len, array, index);
+	index = copy_num_from_array  (&path->samples, array, index);
 	if(TRACE_QH_FLOW) { trace_log("LEAVING: copy_to_trait_struct_from_array"); }
 	return index;	
 }
@@ -268,9 +273,10 @@ int  reply_index = 0;
 
 void reset_reply() { reply_index = 0; reply_to_send[0] = TERMINATION; }
 
-void push_reply_addr_pair(char* snd_addr, char* rcv_addr, int srtt, int jitt, int loss, int rate) { 
+void push_reply_addr_pair(char* snd_addr, char* rcv_addr, int srtt, int jitt, int loss, int rate, int* srtt_q, int* jitt_q, int prefix_len, int samples) { 
 	if(TRACE_QH_FLOW) { trace_log("ENTERING: push_reply_addr_pair"); }
-	if(reply_index < DATA_LIMIT - 100) {
+	if(reply_index < DATA_LIMIT - 200) {
+		int i;
 		reply_index = copy_addr_to_array(snd_addr, reply_to_send, reply_index);
 		reply_index = copy_addr_to_array(rcv_addr, reply_to_send, reply_index);
 		
@@ -279,6 +285,11 @@ void push_reply_addr_pair(char* snd_addr, char* rcv_addr, int srtt, int jitt, in
 		reply_index = copy_data_to_array(loss/1000, reply_to_send, reply_index);
 		reply_index = copy_data_to_array(rate/1000, reply_to_send, reply_index);
 		
+		for(i = 0; i < NUM_QUANTILES; i++) { reply_index = copy_data_to_array(srtt_q != NULL ? srtt_q[i]/1000 : 0, reply_to_send, reply_index); }
+		for(i = 0; i < NUM_QUANTILES; i++) { reply_index = copy_data_to_array(jitt_q != NULL ? jitt_q[i]/1000 : 0, reply_to_send, reply_index); }
+		reply_index = copy_data_to_array(prefix_len, reply_to_send, reply_index);
+		reply_index = copy_data_to_array(samples, reply_to_send, reply_index);
+		
 		reply_index =  add_list_end(reply_to_send, reply_index);
 	}
 	else if(TRACE_ERRORS) { trace_log("REPLY ENTRY SKIPPED: total reply to big!"); }
@@ -11,7 +11,10 @@ char* get_current_query();
 path_traits* fetch_reply();
 
 //Interface for easy use by sniffer
-void push_reply_addr_pair(char* snd_addr, char* rcv_addr, int srtt, int jitt, int loss, int rate);
+//srtt_q and jitt_q hold the QUANTILES of srtt and jitt, or are NULL if unknown
+//prefix_len is the length of the destination prefix the values are aggregated over (full length for the pair itself, 0 for buckets),
+//samples the number of rtt samples behind them
+void push_reply_addr_pair(char* snd_addr, char* rcv_addr, int srtt, int jitt, int loss, int rate, int* srtt_q, int* jitt_q, int prefix_len, int samples);
 void commit_reply();
 char* get_current_reply();
 query_addrs* fetch_query();
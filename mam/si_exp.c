@@ -94,6 +94,11 @@ void print_path_trait(path_traits* p) {
 	print_num_and_fill_chars    (p->norm_jitt, 6,  ' ');
 	print_num_and_fill_chars    (p->norm_loss, 6,  ' ');
 	print_num_and_fill_chars    (p->norm_rate, 6,  ' ');
+	int i;
+	for(i = 0; i < NUM_QUANTILES; i++) { print_num_and_fill_chars(p->srtt_q[i], 6, ' '); }
+	for(i = 0; i < NUM_QUANTILES; i++) { print_num_and_fill_chars(p->jitt_q[i], 6, ' '); }
+	print_num_and_fill_chars    (p->prefix_len, 6, ' ');
+	print_num_and_fill_chars    (p->samples,   8,  ' ');
 }
 
 void print_struct_reply(path_traits* path) {
@@ -104,6 +109,10 @@ void print_struct_reply(path_traits* path) {
 	print_string_and_fill_chars ("Jitt",         6,  ' ');
 	print_string_and_fill_chars ("Loss",         6,  ' ');
 	print_string_and_fill_chars ("Rate",         6,  ' ');
+	print_string_and_fill_chars ("Srtt p50/p90/p99", 18, ' ');
+	print_string_and_fill_chars ("Jitt p50/p90/p99", 18, ' ');
+	print_string_and_fill_chars ("Len",          6,  ' ');
+	print_string_and_fill_chars ("Samples",      8,  ' ');
 	print_std_panel("Path traits");
 	while(path != NULL) {
 		print_path_trait(path);
@@ -20,6 +20,10 @@ static const char LIST_DELIMITER = '#' ;
 static const char ITEM_DELIMITER = '-' ;
 static const char NULL_CHAR      = '\0';
 
+//Quantiles of srtt and jitt reported for each path
+#define NUM_QUANTILES 3
+static const double QUANTILES[NUM_QUANTILES] = { 0.5, 0.9, 0.99 };
+
 typedef struct path_traits {
 	char snd_addr[FIELD_LIMIT];
 	char rcv_addr[FIELD_LIMIT];
@@ -27,6 +31,10 @@ typedef struct path_traits {
 	int norm_jitt;
 	int norm_loss;
 	int norm_rate;
+	int srtt_q[NUM_QUANTILES];
+	int jitt_q[NUM_QUANTILES];
+	int prefix_len;      // length of the destination prefix aggregated over, full length for the pair itself, 0 for buckets
+	int samples;         // number of rtt samples, i.e. confidence of the values
 	struct path_traits* next;
 } path_traits; 
 
@@ -0,0 +1,335 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+
+/**********************************************************************/
+/*                                                                    */
+/* - REPLAY BENCHMARK FOR THE SNIFFER -                               */
+/*                                                                    */
+/**********************************************************************/
+// Feeds a pcap/pcapng trace or synthetic TCP traffic through the stages of mam_sniffer.c
+// (parse_frame, pair_of_packet, process_in_pair, enforce_memory_budget) without a raw socket
+// and reports packets/s, ns per packet and stage and allocations per packet.
+// Built by build_sniffer_bench, which links mam_sniffer.c with -DSNIFFER_BENCH and wraps malloc/free.
+
+typedef struct packet_list  packet_list;
+typedef struct snd_rcv_pair snd_rcv_pair;
+
+packet_list*  parse_frame(char* buffer, unsigned int size, long long time_stamp);
+snd_rcv_pair* pair_of_packet(packet_list* pkt);
+void          process_in_pair(snd_rcv_pair* pair, packet_list* pkt);
+void          enforce_memory_budget();
+void          print_statistics();
+int           load_bucket_table(char* file_name);
+
+extern int       pairs;
+extern int       packets;
+extern int       aggregates;
+extern long long memory_used;
+extern long long memory_budget;
+extern int       max_pkts_per_pair;
+extern int       evicted_pairs;
+extern int       dropped_pkts;
+
+#define LINKTYPE_ETHERNET 1
+#define MAX_INTERFACES    16
+#define ETH_HEADER        14
+#define TCP_FRAME_SIZE    (ETH_HEADER + 20 + 20)
+
+typedef struct frame {
+	char*        data;
+	unsigned int size;
+	long long    time_stamp;        // micro seconds
+} frame;
+
+static frame*    frames     = NULL;
+static int       num_frames = 0;
+static int       max_frames = 0;
+static int       skipped    = 0;    // frames that are not ethernet or are cut off
+static char*     trace      = NULL; // the whole trace file, frames point into it
+
+/**********************************************************************/
+/* - Allocation counting (-Wl,--wrap=malloc,--wrap=free) -            */
+/**********************************************************************/
+
+static long long allocs = 0;
+static long long frees  = 0;
+
+void* __real_malloc(size_t size);
+void  __real_free(void* ptr);
+void* __wrap_malloc(size_t size);
+void  __wrap_free(void* ptr);
+void* __wrap_malloc(size_t size) { allocs++; return __real_malloc(size); }
+void  __wrap_free(void* ptr)     { if(ptr != NULL) { frees++; } __real_free(ptr); }
+
+/**********************************************************************/
+/* - Helpers -                                                        */
+/**********************************************************************/
+
+static long long now_ns()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return 1000000000LL * ts.tv_sec + ts.tv_nsec;
+}
+
+static unsigned int read_u32(unsigned char* p, int swap) { return swap ? (p[0] << 24 | p[1] << 16 | p[2] << 8 | p[3]) : (p[3] << 24 | p[2] << 16 | p[1] << 8 | p[0]); }
+static unsigned int read_u16(unsigned char* p, int swap) { return swap ? (p[0] << 8 | p[1]) : (p[1] << 8 | p[0]); }
+
+static void put_u16(char* p, unsigned int v) { p[0] = v >> 8;  p[1] = v; }
+static void put_u32(char* p, unsigned int v) { p[0] = v >> 24; p[1] = v >> 16; p[2] = v >> 8; p[3] = v; }
+
+static void add_frame(char* data, unsigned int size, long long time_stamp)
+{
+	if(num_frames == max_frames)
+	{
+		max_frames = max_frames ? 2 * max_frames : 1024;
+		frames = realloc(frames, max_frames * sizeof(frame));
+	}
+	frames[num_frames].data       = data;
+	frames[num_frames].size       = size;
+	frames[num_frames].time_stamp = time_stamp;
+	num_frames++;
+}
+
+/**********************************************************************/
+/* - Reading pcap -                                                   */
+/**********************************************************************/
+
+static int read_pcap(unsigned char* buf, long len)
+{
+	unsigned int magic = read_u32(buf, 0);
+	int swap  = (magic == 0xd4c3b2a1 || magic == 0x4d3cb2a1);
+	int nano  = (magic == 0xa1b23c4d || magic == 0x4d3cb2a1);
+	long pos  = 24;
+	if(read_u32(buf + 20, swap) != LINKTYPE_ETHERNET) { fprintf(stderr, "Only ethernet traces are supported\n"); return -1; }
+	while(pos + 16 <= len)
+	{
+		long long sec   = read_u32(buf + pos,      swap);
+		long long frac  = read_u32(buf + pos + 4,  swap);
+		unsigned int caplen = read_u32(buf + pos + 8, swap);
+		pos += 16;
+		if(pos + caplen > len) { skipped++; break; }
+		add_frame((char*)buf + pos, caplen, 1000000LL * sec + (nano ? frac / 1000 : frac));
+		pos += caplen;
+	}
+	return 0;
+}
+
+/**********************************************************************/
+/* - Reading pcapng -                                                 */
+/**********************************************************************/
+
+static int read_pcapng(unsigned char* buf, long len)
+{
+	int link_type[MAX_INTERFACES];
+	long long units_per_sec[MAX_INTERFACES];   // time stamp resolution of the interfaces
+	int interfaces = 0;
+	int swap = 0;
+	long long last_time_stamp = 0;
+	long pos = 0;
+	while(pos + 12 <= len)
+	{
+		unsigned int type = read_u32(buf + pos, swap);
+		if(type == 0x0A0D0D0A) { swap = (read_u32(buf + pos + 8, 0) == 0x4D3C2B1A); interfaces = 0; } // section starts over
+		unsigned int block_len = read_u32(buf + pos + 4, swap);
+		if(block_len < 12 || pos + block_len > len) { fprintf(stderr, "Truncated pcapng block at %ld\n", pos); break; }
+		unsigned char* body = buf + pos + 8;
+		unsigned int body_len = block_len - 12;
+		if(type == 1 && interfaces < MAX_INTERFACES && body_len >= 8) // interface description
+		{
+			int resol = 6;
+			unsigned int opt = 8;
+			while(opt + 4 <= body_len)
+			{
+				unsigned int code = read_u16(body + opt, swap), opt_len = read_u16(body + opt + 2, swap);
+				if(code == 0) { break; }
+				if(code == 9 && opt_len >= 1) { resol = body[opt + 4]; }
+				opt += 4 + ((opt_len + 3) & ~3);
+			}
+			link_type[interfaces] = read_u16(body, swap);
+			units_per_sec[interfaces] = 1;
+			if(resol & 0x80) { resol &= 0x7f; while(resol-- > 0) { units_per_sec[interfaces] *= 2;  } } // negative power of two
+			else             {                while(resol-- > 0) { units_per_sec[interfaces] *= 10; } } // negative power of ten
+			interfaces++;
+		}
+		else if(type == 6 && body_len >= 20) // enhanced packet
+		{
+			unsigned int id = read_u32(body, swap);
+			unsigned long long units = ((unsigned long long)read_u32(body + 4, swap) << 32) | read_u32(body + 8, swap);
+			unsigned int caplen = read_u32(body + 12, swap);
+			if(id >= interfaces || caplen > body_len - 20 || link_type[id] != LINKTYPE_ETHERNET) { skipped++; }
+			else
+			{
+				last_time_stamp = 1000000LL * (units / units_per_sec[id]) + 1000000LL * (units % units_per_sec[id]) / units_per_sec[id];
+				add_frame((char*)body + 20, caplen, last_time_stamp);
+			}
+		}
+		else if(type == 3 && body_len >= 4) // simple packet, no time stamp
+		{
+			unsigned int caplen = read_u32(body, swap);
+			if(caplen > body_len - 4) { caplen = body_len - 4; }
+			if(interfaces == 0 || link_type[0] != LINKTYPE_ETHERNET) { skipped++; }
+			else { add_frame((char*)body + 4, caplen, last_time_stamp); }
+		}
+		pos += block_len;
+	}
+	return 0;
+}
+
+static int read_trace(char* file_name)
+{
+	FILE* file = fopen(file_name, "rb");
+	if(file == NULL) { perror(file_name); return -1; }
+	fseek(file, 0, SEEK_END);
+	long len = ftell(file);
+	fseek(file, 0, SEEK_SET);
+	trace = malloc(len > 0 ? len : 1);
+	if(len < 24 || fread(trace, 1, len, file) != len) { fprintf(stderr, "Cannot read %s\n", file_name); fclose(file); return -1; }
+	fclose(file);
+	unsigned int magic = read_u32((unsigned char*)trace, 0);
+	if(magic == 0x0A0D0D0A) { return read_pcapng((unsigned char*)trace, len); }
+	if(magic == 0xa1b2c3d4 || magic == 0xd4c3b2a1 || magic == 0xa1b23c4d || magic == 0x4d3cb2a1) { return read_pcap((unsigned char*)trace, len); }
+	fprintf(stderr, "%s is neither pcap nor pcapng\n", file_name);
+	return -1;
+}
+
+/**********************************************************************/
+/* - Synthetic traffic -                                              */
+/**********************************************************************/
+// One data segment every step, round robin over the pairs, each acked rtt micro seconds later.
+// Frames carry headers only, the payload size is taken from the IP total length as with a snap length.
+
+static void build_tcp_frame(char* buf, int pair, int is_ack, unsigned int seq, unsigned int ack)
+{
+	unsigned char client[4] = { 10, 0, (pair / 250) & 0xff, pair % 250 + 1 };
+	unsigned char server[4] = { 192, 0, 2, pair % 16 + 1 };
+	memset(buf, 0, TCP_FRAME_SIZE);
+	put_u16(buf + 12, 0x0800);
+	char* ip = buf + ETH_HEADER;
+	ip[0] = 0x45;
+	put_u16(ip + 2, is_ack ? 40 : 40 + 1000);
+	ip[8] = 64;
+	ip[9] = 6;
+	memcpy(ip + 12, is_ack ? server : client, 4);
+	memcpy(ip + 16, is_ack ? client : server, 4);
+	char* tcp = ip + 20;
+	put_u16(tcp,     is_ack ? 443 : 40000 + pair);
+	put_u16(tcp + 2, is_ack ? 40000 + pair : 443);
+	put_u32(tcp + 4, seq);
+	put_u32(tcp + 8, ack);
+	tcp[12] = 0x50;
+	tcp[13] = is_ack ? 0x10 : 0x18;
+}
+
+static void generate(int steps, int num_pairs, int rtt)
+{
+	int step_time = 10;                       // micro seconds between data segments
+	int lag = rtt / step_time;
+	trace = malloc((long)2 * steps * TCP_FRAME_SIZE);
+	char* buf = trace;
+	int n;
+	for(n = 0; n < steps + lag; n++)
+	{
+		long long now = (long long)n * step_time;
+		if(n < steps)
+		{
+			build_tcp_frame(buf, n % num_pairs, 0, (n / num_pairs) * 1000, 0);
+			add_frame(buf, TCP_FRAME_SIZE, now);
+			buf += TCP_FRAME_SIZE;
+		}
+		if(n >= lag)
+		{
+			int m = n - lag;
+			build_tcp_frame(buf, m % num_pairs, 1, 0, (m / num_pairs) * 1000 + 1000);
+			add_frame(buf, TCP_FRAME_SIZE, now);
+			buf += TCP_FRAME_SIZE;
+		}
+	}
+}
+
+/**********************************************************************/
+/* - Replay -                                                         */
+/**********************************************************************/
+
+static void usage(char* name)
+{
+	fprintf(stderr, "Usage: %s [-r file.pcap|file.pcapng] [-s packets] [-p pairs] [-t rtt_us] [-m memory_budget] [-q max_pkts_per_pair] [-b bucket_table] [-l loops] [-n]\n", name);
+	fprintf(stderr, "  -r  replay a pcap or pcapng trace (ethernet), otherwise synthetic TCP traffic is generated\n");
+	fprintf(stderr, "  -s  data segments to generate (default 1000000), each is acked\n");
+	fprintf(stderr, "  -p  pairs of synthetic traffic (default 64), -t their rtt in micro seconds (default 20000)\n");
+	fprintf(stderr, "  -b  aggregate destinations by the buckets of this table, as the sniffer does\n");
+	fprintf(stderr, "  -l  replay the frames this often\n");
+	fprintf(stderr, "  -n  do not print the pair statistics of the sniffer\n");
+	exit(1);
+}
+
+int main(int argc, char** argv)
+{
+	char* file_name = NULL;
+	int steps = 1000000, num_pairs = 64, rtt = 20000, loops = 1, quiet = 0;
+	int opt, i, loop;
+	while((opt = getopt(argc, argv, "r:s:p:t:m:q:b:l:n")) != -1)
+	{
+		if     (opt == 'r') { file_name = optarg;                   }
+		else if(opt == 's') { steps = atoi(optarg);                 }
+		else if(opt == 'p') { num_pairs = atoi(optarg);             }
+		else if(opt == 't') { rtt = atoi(optarg);                   }
+		else if(opt == 'm') { memory_budget = atoll(optarg);        }
+		else if(opt == 'q') { max_pkts_per_pair = atoi(optarg);     }
+		else if(opt == 'b') { if(load_bucket_table(optarg) < 0) { fprintf(stderr, "Cannot read bucket table %s\n", optarg); return 1; } }
+		else if(opt == 'l') { loops = atoi(optarg);                 }
+		else if(opt == 'n') { quiet = 1;                            }
+		else                { usage(argv[0]);                       }
+	}
+	if(steps <= 0 || num_pairs <= 0 || rtt < 0 || loops <= 0) { usage(argv[0]); }
+
+	if(file_name != NULL) { if(read_trace(file_name) != 0) { return 1; } }
+	else                  { generate(steps, num_pairs, rtt); }
+	if(num_frames == 0) { fprintf(stderr, "No frames to replay\n"); return 1; }
+
+	long long t_parse = 0, t_flow = 0, t_rtt = 0, t_budget = 0, fed = 0, invalid = 0;
+	long long start_allocs = allocs, start_frees = frees;
+	long long start = now_ns();
+	for(loop = 0; loop < loops; loop++)
+	{
+		long long offset = (long long)loop * (frames[num_frames - 1].time_stamp - frames[0].time_stamp + 1000000); // later loops continue in time
+		for(i = 0; i < num_frames; i++)
+		{
+			long long t0 = now_ns();
+			packet_list* pkt = parse_frame(frames[i].data, frames[i].size, frames[i].time_stamp + offset);
+			long long t1 = now_ns();
+			t_parse += t1 - t0;
+			fed++;
+			if(pkt == NULL) { invalid++; continue; }
+			snd_rcv_pair* pair = pair_of_packet(pkt);
+			long long t2 = now_ns();
+			process_in_pair(pair, pkt);
+			long long t3 = now_ns();
+			enforce_memory_budget();
+			long long t4 = now_ns();
+			t_flow += t2 - t1; t_rtt += t3 - t2; t_budget += t4 - t3;
+		}
+	}
+	long long elapsed = now_ns() - start;
+	long long used_allocs = allocs - start_allocs, used_frees = frees - start_frees;
+
+	printf("Replayed %lld frames (%lld not TCP/SCTP over IP, %d skipped) from %s in %.3f s\n", fed, invalid, skipped, file_name ? file_name : "synthetic traffic", elapsed / 1e9);
+	printf("  %12.0f packets/s (wall clock, includes 5 clock reads per packet)\n", fed / (elapsed / 1e9));
+	printf("  %12.1f ns/packet parse\n",        (double)t_parse  / fed);
+	printf("  %12.1f ns/packet flow table\n",   (double)t_flow   / fed);
+	printf("  %12.1f ns/packet rtt/loss/rate\n",(double)t_rtt    / fed);
+	printf("  %12.1f ns/packet memory budget\n",(double)t_budget / fed);
+	printf("  %12.2f allocations/packet, %.2f frees/packet\n", (double)used_allocs / fed, (double)used_frees / fed);
+	printf("  %d pairs, %d queued packets, %d aggregates, %lld bytes used, %d pairs evicted, %d packets dropped\n", pairs, packets, aggregates, memory_used, evicted_pairs, dropped_pkts);
+	// one line for scripts and CI to compare runs
+	printf("BENCH frames=%lld pps=%.0f parse_ns=%.1f flow_ns=%.1f rtt_ns=%.1f budget_ns=%.1f allocs=%.2f pairs=%d memory=%lld\n", fed, fed / (elapsed / 1e9), (double)t_parse / fed, (double)t_flow / fed, (double)t_rtt / fed, (double)t_budget / fed, (double)used_allocs / fed, pairs, memory_used);
+	if(!quiet) { print_statistics(); printf("\n"); }
+	return 0;
+}
+
+/**********************************************************************/
+/* - End -                                                            */
+/**********************************************************************/
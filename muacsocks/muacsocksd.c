@@ -7,23 +7,71 @@
 #include <assert.h>
 #include <errno.h>
 #include <fcntl.h>
+#include <net/if.h>
 #include <netdb.h>
 #include <netinet/in.h>
+#include <pthread.h>
+#include <signal.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <strings.h>
 #include <sys/socket.h>
+#include <sys/time.h>
 #include <sys/types.h>
+#include <sys/un.h>
+#include <arpa/inet.h>
+#include <time.h>
 #include <unistd.h>
 
-#include "clib/muacc_client.h"
+#include <event2/event.h>
+#include <event2/buffer.h>
+#include <event2/bufferevent.h>
+#include <event2/dns.h>
+#include <event2/listener.h>
+
+#include "clib/muacc.h"
+#include "clib/muacc_util.h"
+#include "lib/muacc_ctx.h"
+#include "lib/muacc_tlv.h"
+#include "lib/intents.h"
 #include "config.h"
 
 #undef SOCKSD_NOISY_DEBUG
 
+/* daemon tuning */
+#define SOCKSD_BACKLOG				128
+#define SOCKSD_HANDSHAKE_TIMEOUT	30		/**< seconds a client may take for the negotiation */
+#define SOCKSD_CONNECT_TIMEOUT		30		/**< seconds to wait for the remote host to accept */
+#define SOCKSD_IDLE_TIMEOUT			300		/**< seconds without traffic before a relayed connection is closed */
+#define SOCKSD_MAX_BUFFERED			(256*1024)	/**< bytes queued towards one side before reading from the other one pauses */
+#define SOCKSD_COPY_CHUNK			(128*1024)	/**< bytes read or written at once when relaying through buffers */
+#define SOCKSD_SPLICE_MIN_CHUNK		(16*1024)	/**< smallest amount of data spliced at once */
+#define SOCKSD_SPLICE_PIPE_SIZE		(1024*1024)	/**< requested capacity of the pipes, also the largest chunk */
+#define SOCKSD_MAM_RETRY			5		/**< seconds to resolve without the MAM after losing the connection to it */
+#define SOCKSD_MAM_TIMEOUT			3		/**< seconds to wait for a decision before resolving without the MAM */
+#define SOCKSD_DECISION_TTL			30		/**< seconds a decision of the MAM is reused for the same destination */
+#define SOCKSD_DECISION_BUCKETS		256		/**< hash buckets of the decision cache of a worker */
+#define SOCKSD_DECISION_MAX			1024	/**< decisions cached by a worker */
+#define SOCKSD_STRIPE_PORT			"80"	/**< only plain HTTP downloads are striped */
+#define SOCKSD_STRIPE_PATHS			4		/**< connections a striped download uses at most */
+#define SOCKSD_SRCADDRS_MAX			16		/**< source addresses taken from one srcaddrs response of the MAM */
+#define SOCKSD_STRIPE_MIN_SIZE		(4*1024*1024)	/**< smallest resource fetched over more than one connection */
+#define SOCKSD_STRIPE_MIN_CHUNK		(256*1024)	/**< smallest range requested at once */
+#define SOCKSD_STRIPE_MAX_CHUNK		(8*1024*1024)	/**< largest range requested at once */
+#define SOCKSD_STRIPE_CHUNK_TIME	0.5		/**< seconds a path should need for one range at its measured rate */
+#define SOCKSD_STRIPE_WINDOW		(32*1024*1024)	/**< bytes requested ahead of what the client has got */
+#define SOCKSD_STRIPE_MAX_HEADER	(16*1024)	/**< largest HTTP header we look at */
+
+/* relay without copying through user space where the kernel supports it */
+#if defined(__linux__) && defined(SPLICE_F_MOVE) && !defined(SOCKSD_NO_SPLICE)
+#define SOCKSD_SPLICE
+#endif
+
 /* socks 5 protocol stuff */
 #define SOCKS5_AUTHDONE	0x1000
 #define SOCKS5_NOAUTH	0x00
+#define SOCKS5_NOMETHOD	0xFF
 #define SOCKS5_IPV4		0x01
 #define SOCKS5_DOMAIN	0x03
 #define SOCKS5_IPV6		0x04
@@ -73,11 +121,178 @@ union s5_inputbuffer
 } __attribute__((__packed__));
 
 
-static int s5_replay(int fd, u_int8_t response, const struct sockaddr *addr)
+struct socks_session;
+
+/** Decision of the MAM for a destination, reused until it expires
+ *  While the request is in flight, the sessions connecting to the same destination wait for it
+ */
+struct socks_decision {
+	char					*key;			/**< Destination as "host port" */
+	struct socks_decision	*next;			/**< Next entry in the hash bucket */
+	struct socks_decision	*next_pending;	/**< Next entry waiting for the MAM */
+	int						pending;		/**< The request is still in flight */
+	muacc_ctxino_t			tag;			/**< Identifies the request on the MAM connection */
+	time_t					expires;		/**< Time the decision has to be renewed */
+	int						protocol;		/**< Protocol of the socket */
+	struct sockaddr_storage	remote_sa;		/**< Address to connect to */
+	socklen_t				remote_sa_len;	/**< Length of remote_sa */
+	struct sockaddr_storage	bind_sa;		/**< Source address to bind to */
+	socklen_t				bind_sa_len;	/**< Length of bind_sa, 0 if the MAM did not suggest one */
+	struct socketopt		*sockopts;		/**< Socket options suggested by the MAM */
+	struct socks_session	*waiters;		/**< Sessions waiting for the request */
+	struct socks_worker		*worker;		/**< Worker owning the cache entry */
+	struct event			*timeout;		/**< Gives up on the MAM while the request is in flight */
+};
+
+/** Per-thread event loop serving a share of the SOCKS connections */
+struct socks_worker {
+	int						id;			/**< Number of the worker */
+	pthread_t				thread;		/**< Thread running the event loop */
+	struct event_base		*base;		/**< Event base of this worker */
+	struct evconnlistener	*listener;	/**< Accepts connections on the shared listening socket */
+	struct evdns_base		*dns_base;	/**< Resolver used while the MAM cannot be reached */
+	struct bufferevent		*mam;		/**< Connection to the MAM shared by all sessions, NULL if there is none */
+	time_t					mam_retry;	/**< Time to try connecting to the MAM again */
+	struct _muacc_ctx		*mam_response;	/**< Response of the MAM that is being read */
+	muacc_mam_action_t		mam_action;	/**< Action of the response that is being read */
+	muacc_ctxino_t			next_tag;	/**< Tag of the last request sent to the MAM */
+	struct socks_decision	*decisions[SOCKSD_DECISION_BUCKETS];	/**< Decision cache */
+	int						num_decisions;	/**< Entries in the decision cache */
+	struct socks_decision	*pending;	/**< Decisions waiting for the MAM */
+	struct stripe			*stripes_waiting;	/**< Striped downloads waiting for source addresses from the MAM */
+	struct sockaddr_storage	srcaddrs[SOCKSD_SRCADDRS_MAX];	/**< Source addresses of the srcaddrs response that is being read */
+	int						num_srcaddrs;	/**< Entries used in srcaddrs */
+};
+
+/** States of a SOCKS connection */
+enum socks_state {
+	SOCKS_AUTH,			/**< waiting for the method selection */
+	SOCKS_REQUEST,		/**< waiting for the request */
+	SOCKS_RESOLVING,	/**< waiting for the MAM or the resolver */
+	SOCKS_CONNECTING,	/**< waiting for the connection to the remote host */
+	SOCKS_RELAY,		/**< forwarding data */
+	SOCKS_STRIPING,		/**< fetching a download in ranges over several connections */
+	SOCKS_CLOSING		/**< flushing the last data to one side */
+};
+
+/** Directions data is relayed in - also used by the bufferevent relay */
+#define SPLICE_UP	0	/**< from the SOCKS client to the remote host */
+#define SPLICE_DOWN	1	/**< from the remote host to the SOCKS client */
+
+/** Pipe that moves the data of one direction from socket to socket */
+struct splice_pipe {
+	struct socks_session	*session;		/**< Connection this pipe belongs to */
+	int						src;			/**< Socket data is read from */
+	int						dst;			/**< Socket data is written to */
+	int						fds[2];			/**< Read and write end of the pipe */
+	size_t					capacity;		/**< Capacity of the pipe */
+	size_t					chunk;			/**< Bytes to splice in with the next read */
+	size_t					pending;		/**< Bytes in the pipe not yet written to dst */
+	uint64_t				*counter;		/**< Byte counter of this direction */
+	struct event			*read_event;	/**< Waits for data on src */
+	struct event			*write_event;	/**< Waits for room on dst while the pipe is not empty */
+};
+
+/** Range of a striped download, kept until it has been handed to the client */
+struct stripe_chunk {
+	uint64_t				start;			/**< Offset of the range in the resource */
+	uint64_t				len;			/**< Length of the range */
+	uint64_t				got;			/**< Bytes of the range received so far */
+	struct evbuffer			*data;			/**< Received bytes not yet handed to the client */
+	struct stripe_path		*path;			/**< Path fetching the rest of the range, NULL if none */
+	struct stripe_chunk		*next;			/**< Next range of the resource */
+};
+
+/** States of a connection of a striped download */
+enum stripe_path_state {
+	PATH_CONNECTING,	/**< waiting for the connection to the server */
+	PATH_IDLE,			/**< ready to request a range */
+	PATH_HEADER,		/**< waiting for the header of the response */
+	PATH_BODY,			/**< receiving the requested range */
+	PATH_DEAD			/**< failed, no longer used */
+};
+
+/** Connection of a striped download over one interface */
+struct stripe_path {
+	struct stripe			*stripe;		/**< Download this path belongs to */
+	struct bufferevent		*bev;			/**< Connection to the server - the one of the session for the first path */
+	enum stripe_path_state	state;			/**< What the path is doing */
+	struct stripe_chunk		*chunk;			/**< Range being fetched */
+	uint64_t				body_left;		/**< Bytes of the response body still to come */
+	struct timeval			requested;		/**< Time the range was requested */
+	uint64_t				requested_from;	/**< First byte requested */
+	uint64_t				requested_len;	/**< Bytes requested */
+	double					rate;			/**< Measured rate of this path in bytes/s, 0 before the first range */
+};
+
+/** Download fetched in ranges over several connections and reassembled for the client */
+struct stripe {
+	struct socks_session	*session;		/**< Connection the download is made for */
+	char					*request;		/**< Header of the client's request without the final empty line */
+	uint64_t				total;			/**< Size of the resource, 0 until the first response */
+	uint64_t				next_offset;	/**< First byte not yet assigned to a range */
+	uint64_t				delivered;		/**< Bytes handed to the client */
+	struct stripe_chunk		*chunks;		/**< Ranges not yet handed to the client completely, in order */
+	struct stripe_chunk		*last_chunk;	/**< Last entry of chunks */
+	struct stripe_path		paths[SOCKSD_STRIPE_PATHS];	/**< Connections to the server */
+	int						num_paths;		/**< Entries used in paths */
+	char					*validator;		/**< Strong ETag or Last-Modified of the first response, sent as If-Range */
+	muacc_ctxino_t			srcaddrs_tag;	/**< Tag of the srcaddrs request to the MAM, 0 if none is in flight */
+	struct stripe			*next_waiting;	/**< Next download waiting for source addresses */
+};
+
+/** State of one proxied connection */
+struct socks_session {
+	struct socks_worker		*worker;		/**< Worker serving this connection */
+	enum socks_state		state;			/**< Where we are in the protocol */
+	struct bufferevent		*local;			/**< Connection to the SOCKS client */
+	struct bufferevent		*remote;		/**< Connection to the remote host */
+	int						fd2;			/**< Socket to the remote host, -1 if none */
+	struct event			*connect_event;	/**< Waits for the destination to be resolved or the non-blocking connect to finish */
+	char					host[NI_MAXHOST];	/**< Host to connect to, numeric for address requests */
+	char					service[NI_MAXSERV];	/**< Port to connect to */
+	struct socks_decision	*decision;		/**< Decision the session is waiting for */
+	struct socks_session	*next_waiter;	/**< Next session waiting for the same decision */
+	int						decided;		/**< Connecting as a decision of the MAM suggested */
+	struct evdns_getaddrinfo_request *dns_req;	/**< Lookup in flight while the MAM cannot be reached */
+	struct sockaddr_storage	local_out;		/**< Source address of the connection to the remote host */
+	socklen_t				local_out_len;	/**< Length of local_out, 0 before connecting */
+	time_t					last_active;	/**< Time data was last relayed */
+	uint64_t				bytes_sent;		/**< Bytes relayed from the client to the remote host */
+	uint64_t				bytes_received;	/**< Bytes relayed from the remote host to the client */
+	int						eof[2];			/**< The source of SPLICE_UP / SPLICE_DOWN has closed its side */
+	int						fin_sent[2];	/**< The close has been passed on to the destination of the direction */
+	int						splice_tried;	/**< Switching to the splice relay has been attempted */
+	int						splicing;		/**< Data is relayed through the pipes instead of the bufferevents */
+	struct splice_pipe		pipes[2];		/**< Pipes for SPLICE_UP and SPLICE_DOWN */
+	struct stripe			*stripe;		/**< Striped download in progress, NULL if none */
+};
+
+/** Worker running on this thread, for log messages */
+static __thread int log_worker = 0;
+
+/** Split large HTTP downloads over the source addresses of all prefixes the MAM enabled */
+static int stripe_enabled = 0;
+
+static void local_readcb(struct bufferevent *bev, void *arg);
+static void relay_readcb(struct bufferevent *bev, void *arg);
+static void relay_eventcb(struct bufferevent *bev, short what, void *arg);
+static void relay_drained_writecb(struct bufferevent *bev, void *arg);
+static void relay_writecb(struct bufferevent *bev, void *arg);
+static void session_finish(struct socks_session *s, struct bufferevent *bev);
+static void start_relay(struct socks_session *s);
+static void fallback_resolve(struct socks_session *s);
+static void connect_cb(evutil_socket_t fd, short what, void *arg);
+static void stripe_peek_readcb(struct bufferevent *bev, void *arg);
+static void stripe_readcb(struct bufferevent *bev, void *arg);
+static void stripe_eventcb(struct bufferevent *bev, short what, void *arg);
+static void stripe_free(struct socks_session *s);
+static void stripe_srcaddrs_dispatch(struct socks_worker *w, muacc_ctxino_t tag);
+
+static int s5_replay(struct bufferevent *bev, u_int8_t response, const struct sockaddr *addr)
 {
 	union s5_inputbuffer s5_iobuffer = {{0}};
 	int rlen = sizeof(s5_iobuffer);
-	int resp = 0;
 	
 	s5_iobuffer.cmd.version = 0x05;
 	s5_iobuffer.cmd.command = response;
@@ -89,8 +304,7 @@ static int s5_replay(int fd, u_int8_t response, const struct sockaddr *addr)
 	}
 	else if (addr->sa_family == AF_INET)
 	{
-        struct sockaddr_in *sin = (struct sockaddr_in *) addr;
-		sin->sin_family = AF_INET;
+        const struct sockaddr_in *sin = (const struct sockaddr_in *) addr;
 		s5_iobuffer.cmd.atyp = SOCKS5_IPV4;
         memcpy(&s5_iobuffer.cmd.addr.ipv4.sin_addr, &(sin->sin_addr), sizeof(struct in_addr));
         s5_iobuffer.cmd.addr.ipv4.port = sin->sin_port;
@@ -98,9 +312,8 @@ static int s5_replay(int fd, u_int8_t response, const struct sockaddr *addr)
 	} 
 	else if (addr->sa_family == AF_INET6)
 	{
-        struct sockaddr_in6 *sin = (struct sockaddr_in6 *) addr;
-        sin->sin6_family = AF_INET6;
-		s5_iobuffer.cmd.atyp = SOCKS5_IPV4;
+        const struct sockaddr_in6 *sin = (const struct sockaddr_in6 *) addr;
+		s5_iobuffer.cmd.atyp = SOCKS5_IPV6;
         memcpy(&s5_iobuffer.cmd.addr.ipv6.sin6_addr, &(sin->sin6_addr), sizeof(struct in6_addr));
         s5_iobuffer.cmd.addr.ipv6.port = sin->sin6_port;
 		rlen = 22;	
@@ -110,470 +323,2369 @@ static int s5_replay(int fd, u_int8_t response, const struct sockaddr *addr)
 		rlen = 4;
 	}
 	
-	resp = send(fd, &s5_iobuffer, rlen, 0);
-	
-	if(rlen != resp) 
+	if (bufferevent_write(bev, &s5_iobuffer, rlen) != 0)
 	{
-		fprintf(stderr, "%6d: sending reply failed: ", (int) getpid());
-		perror(NULL);
+		fprintf(stderr, "worker %d: sending reply failed\n", log_worker);
+		return -1;
 	}
-  return resp;
+	return rlen;
 }
 
-static int s2s_forward(int fda, int fdb)
+static void session_free(struct socks_session *s);
+
+/** Pass on the close of one direction once all its data has been written to fd
+ *  The other direction keeps going - the session is freed once both are closed
+ *
+ *  \return 1 if the session has been freed, 0 otherwise
+ */
+static int session_forward_fin(struct socks_session *s, int dir, int fd)
 {
-	int ret;
-	fd_set read_fds;
-	char ab_buf[1500];
-	char ba_buf[1500];
-	size_t ab_size;
-	size_t ba_size;
-	struct timeval tv;
-	
-    tv.tv_sec = 5;       /* timeout (secs.) */
-    tv.tv_usec = 0;      /* 0 microseconds */
-	
+	if (s->fin_sent[dir])
+		return 0;
+
 	#ifdef SOCKSD_NOISY_DEBUG
-	fprintf(stderr, "%6d: entering io loop: ", (int) getpid());
+	fprintf(stderr, "worker %d: %s closed its side - passing it on\n", log_worker, (dir == SPLICE_UP ? "local" : "remote"));
 	#endif
-	
-	for(;;)
+	s->fin_sent[dir] = 1;
+	if (shutdown(fd, SHUT_WR) != 0 || (s->fin_sent[SPLICE_UP] && s->fin_sent[SPLICE_DOWN]))
+	{
+		session_free(s);
+		return 1;
+	}
+	return 0;
+}
+
+#ifdef SOCKSD_SPLICE
+
+/** Release the pipes and their events - the bufferevents are left alone */
+static void splice_stop(struct socks_session *s)
+{
+	int i;
+
+	if (!s->splicing)
+		return;
+
+	for (i = SPLICE_UP; i <= SPLICE_DOWN; i++)
+	{
+		struct splice_pipe *p = &(s->pipes[i]);
+
+		if (p->read_event != NULL)
+			event_free(p->read_event);
+		if (p->write_event != NULL)
+			event_free(p->write_event);
+		if (p->fds[0] >= 0)
+			close(p->fds[0]);
+		if (p->fds[1] >= 0)
+			close(p->fds[1]);
+		memset(p, 0x00, sizeof(struct splice_pipe));
+	}
+	s->splicing = 0;
+}
+
+/** Move the data of the pipe to its destination
+ *  Stops reading from the source while the destination cannot take everything
+ */
+static void splice_drain(struct splice_pipe *p)
+{
+	struct socks_session *s = p->session;
+	struct timeval idle = { SOCKSD_IDLE_TIMEOUT, 0 };
+	ssize_t n;
+
+	while (p->pending > 0)
 	{
-		FD_ZERO(&read_fds);
-		FD_SET(fda, &read_fds);
-		FD_SET(fdb, &read_fds);
-		
-		ret = select((fda>fdb?fda:fdb)+1, &read_fds, NULL, NULL, &tv);
-				
-		if ( ret < 0 ) 
+		n = splice(p->fds[0], NULL, p->dst, NULL, p->pending, SPLICE_F_MOVE|SPLICE_F_NONBLOCK);
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n < 0 && errno == EAGAIN)
+			break;
+		if (n <= 0)
 		{
-			fprintf(stderr, "%6d: error in select: ", (int) getpid());
-			perror(NULL);
-			return(-1);
+			fprintf(stderr, "worker %d: error while relaying: %s\n", log_worker, strerror(errno));
+			session_free(s);
+			return;
 		}
-		else if (ret == 0)
+		p->pending -= n;
+		*(p->counter) += n;
+	}
+
+	if (p->pending > 0)
+	{
+		event_del(p->read_event);
+		if (!event_pending(p->write_event, EV_WRITE, NULL))
+			event_add(p->write_event, &idle);
+		return;
+	}
+
+	event_del(p->write_event);
+	if (s->eof[p - s->pipes])
+	{
+		/* source is gone and everything has been passed on */
+		session_forward_fin(s, p - s->pipes, p->dst);
+	}
+	else if (!event_pending(p->read_event, EV_READ, NULL))
+	{
+		event_add(p->read_event, &idle);
+	}
+}
+
+/** Data or EOF on the source of a pipe */
+static void splice_readcb(evutil_socket_t fd, short what, void *arg)
+{
+	struct splice_pipe *p = arg;
+	struct socks_session *s = p->session;
+	ssize_t n;
+
+	if (what & EV_TIMEOUT)
+	{
+		/* persistent event - it is re-armed unless we close */
+		if (time(NULL) - s->last_active < SOCKSD_IDLE_TIMEOUT)
+			return;
+		#ifdef SOCKSD_NOISY_DEBUG
+		fprintf(stderr, "worker %d: connection idle - closing\n", log_worker);
+		#endif
+		session_free(s);
+		return;
+	}
+
+	n = splice(p->src, NULL, p->fds[1], NULL, p->chunk, SPLICE_F_MOVE|SPLICE_F_NONBLOCK);
+	if (n < 0)
+	{
+		if (errno == EAGAIN || errno == EINTR)
+			return;
+
+		if ((errno == EINVAL || errno == ENOSYS) && s->pipes[SPLICE_UP].pending == 0 && s->pipes[SPLICE_DOWN].pending == 0)
 		{
+			/* these sockets cannot be spliced - nothing is stuck in the pipes, so just go on copying */
 			#ifdef SOCKSD_NOISY_DEBUG
-			fprintf(stderr, ".");
+			fprintf(stderr, "worker %d: splice not supported - relaying through buffers\n", log_worker);
 			#endif
+			splice_stop(s);
+			bufferevent_enable(s->local, EV_READ|EV_WRITE);
+			bufferevent_enable(s->remote, EV_READ|EV_WRITE);
+			return;
 		}
-		else
-		{			
-			if(FD_ISSET(fda, &read_fds))
-			{
-				ab_size = read(fda, ab_buf, sizeof(ab_buf));
-				if (ab_size == 0)
-				{
-					/* socket closed by local */
-					#ifdef SOCKSD_NOISY_DEBUG
-					fprintf(stderr, "%6d: connection closed by local\n", (int) getpid());
-					#endif
-					return(fda);
-				}
-				#ifdef SOCKSD_NOISY_DEBUG				
-				fprintf(stderr, ">");
-				#endif
-				write(fdb, ab_buf, ab_size);
-			}
-			if(FD_ISSET(fdb, &read_fds))
-			{
-				ba_size = read(fdb, ba_buf, sizeof(ba_buf));
-				if (ba_size == 0)
-				{
-					/* socket closed by remote */
-					#ifdef SOCKSD_NOISY_DEBUG
-					fprintf(stderr, "%6d: connection closed by remote\n", (int) getpid());
-					#endif
-					return(fdb);
-				}
-				#ifdef SOCKSD_NOISY_DEBUG
-				fprintf(stderr, "<");
-				#endif
-				write(fda, ba_buf, ba_size);
-			}
-		}
-				
+
+		fprintf(stderr, "worker %d: error while relaying: %s\n", log_worker, strerror(errno));
+		session_free(s);
+		return;
 	}
-	
-	return(-1);
-	
+
+	if (n == 0)
+	{
+		#ifdef SOCKSD_NOISY_DEBUG
+		fprintf(stderr, "worker %d: connection closed by %s\n", log_worker, (p == &(s->pipes[SPLICE_UP]) ? "local" : "remote"));
+		#endif
+		/* half-close - the other direction goes on */
+		s->eof[p - s->pipes] = 1;
+		event_del(p->read_event);
+		if (p->pending == 0)
+			session_forward_fin(s, p - s->pipes, p->dst);
+		return;
+	}
+
+	s->last_active = time(NULL);
+	p->pending += n;
+
+	/* bulk transfers get larger chunks, interactive ones smaller */
+	if ((size_t) n == p->chunk && p->chunk * 2 <= p->capacity)
+		p->chunk *= 2;
+	else if ((size_t) n < p->chunk / 4 && p->chunk / 2 >= SOCKSD_SPLICE_MIN_CHUNK)
+		p->chunk /= 2;
+
+	splice_drain(p);
 }
 
-static void do_socks( int fd, struct sockaddr *remote_in, socklen_t remote_in_len, struct sockaddr *local_in, socklen_t local_in_len)
+/** Room on the destination of a pipe that still holds data */
+static void splice_writecb(evutil_socket_t fd, short what, void *arg)
 {
-	int fd2;
-    int flags = 0;
-	int rlen = 0;
-	int ret = -1;
-    int i = 0;
-    struct sockaddr_storage local_out;
-	struct sockaddr_storage remote_out;
-    socklen_t local_out_len = sizeof(struct sockaddr_storage); 
-	socklen_t remote_out_len = sizeof(struct sockaddr_storage);
-	
-    char abuf[INET6_ADDRSTRLEN];
-	char pbuf[NI_MAXSERV];
-    char nbuf[NI_MAXHOST];
-	struct addrinfo ai_hints = {0};
-	struct addrinfo *ai_res = NULL;
-	union s5_inputbuffer s5_iobuffer;
-	
-	struct muacc_context fd2_ctx;
-	memset(&fd2_ctx, 0, sizeof(struct muacc_context)); 
+	struct splice_pipe *p = arg;
 
+	if (what & EV_TIMEOUT)
+	{
+		#ifdef SOCKSD_NOISY_DEBUG
+		fprintf(stderr, "worker %d: peer does not take any data - closing\n", log_worker);
+		#endif
+		session_free(p->session);
+		return;
+	}
 
-	memset(&s5_iobuffer, 0x0, sizeof(s5_iobuffer));
-	
-	/* handle authentication */
-	#ifdef SOCKSD_NOISY_DEBUG	
-	fprintf(stderr, "%6d: waiting for authentication\n", (int) getpid());
-	#endif
-	while( (flags & SOCKS5_AUTHDONE) == 0 )
-	{
-        /* read request */
-		memset(&s5_iobuffer, 0x0, sizeof(s5_iobuffer));
-		rlen = read(fd, &s5_iobuffer, sizeof(s5_iobuffer));
-		if (rlen == 0) 
-			goto do_socks_closed;
-		else if ( rlen < 0 )
-			goto do_socks_error;
-        else if ( rlen < 3 )
-        {
-            fprintf(stderr, "%6d: error while handling authentication: request too small\n", (int) getpid());
-            goto do_socks_closed;
-        }
-        else if ( s5_iobuffer.auth_req.version != 0x05 )
-        {
-            fprintf(stderr, "%6d: error while handling authentication: wrong protocol version\n", (int) getpid());
-            goto do_socks_closed;
-        }
-        else if ( rlen < s5_iobuffer.auth_req.nmethods+2 )
-        {
-            fprintf(stderr, "%6d: error while handling authentication: packet too small\n", (int) getpid());
-            goto do_socks_closed;
-        }
-        
-        for (i = 0; i < s5_iobuffer.auth_req.nmethods; i++)
-        {
-            if (s5_iobuffer.auth_req.method[i] == SOCKS5_NOAUTH)
-            {
-                flags |= SOCKS5_AUTHDONE;
-                s5_iobuffer.auth_resp.method = SOCKS5_NOAUTH;
-                send(fd, &s5_iobuffer, 2, 0);
-                break;
-            }
-        }
-	}
-	#ifdef SOCKSD_NOISY_DEBUG	
-    fprintf(stderr, "%6d: authentication done\n", (int) getpid());
-	#endif
-	
-    /* parse request */
-	memset(&s5_iobuffer, 0x0, sizeof(s5_iobuffer));
-    rlen = read(fd, &s5_iobuffer, sizeof(s5_iobuffer));
-    if (rlen == 0)
-        goto do_socks_closed;
-    else if ( rlen < 0 )
-        goto do_socks_error;
-    else if ( rlen < 10 )
-    {
-        fprintf(stderr, "%6d: error while handling request: request too small\n", (int) getpid());
-        goto do_socks_closed;
-    }
-    else if ( s5_iobuffer.cmd.version != 0x05 )
-    {
-        fprintf(stderr, "%6d: error while handling request: wrong protocol version\n", (int) getpid());
-        goto do_socks_closed;
-    }
-    
-    /* handle commands */
-    if (s5_iobuffer.cmd.command == SOCKS5_CONNECT)
-    {
-        /* TCP connect request - check address and resolve if needed */
-        if (s5_iobuffer.cmd.atyp == SOCKS5_IPV4 &&
-			rlen >= 10 )
-        {
-            /* ipv4 */
-            struct sockaddr_in *sin = (struct sockaddr_in *) &remote_out;
-			sin->sin_family = AF_INET;
-			remote_out_len = sizeof(struct sockaddr_in);
-			#ifdef HAVE_SOCKADDR_LEN
-			sin->sin_len = remote_out_len; 
-			#endif
-			
-			
-            memcpy(&(sin->sin_addr), &s5_iobuffer.cmd.addr.ipv4.sin_addr, sizeof(struct in_addr));
-            
-			sin->sin_port = s5_iobuffer.cmd.addr.ipv4.port;
-			
-			#ifdef SOCKSD_NOISY_DEBUG
-			getnameinfo( (struct sockaddr*) sin, sizeof(struct sockaddr_in),
-					 	 abuf, sizeof(abuf)-1, NULL, 0,
-					     NI_NUMERICHOST|NI_NUMERICSERV);
-	        fprintf(stderr, "%6d: got connect request (v4) to %s port %d\n", (int) getpid(), abuf, ntohs(sin->sin_port));
-			#endif
-			
-        }
-        else if (s5_iobuffer.cmd.atyp == SOCKS5_IPV6 &&
-				 rlen >= 22)
-        {
-			/* ipv6 */
-            struct sockaddr_in6 *sin = (struct sockaddr_in6 *) &remote_out;
-            sin->sin6_family = AF_INET6;
-			remote_out_len = sizeof(struct sockaddr_in6);
-			#ifdef HAVE_SOCKADDR_LEN
-			sin->sin6_len = remote_out_len; 
-			#endif
-			
-            memcpy(&(sin->sin6_addr), &s5_iobuffer.cmd.addr.ipv6.sin6_addr, sizeof(struct in6_addr));
-            
-			sin->sin6_port = s5_iobuffer.cmd.addr.ipv6.port;
-			
-			#ifdef SOCKSD_NOISY_DEBUG
-			getnameinfo( (struct sockaddr*) sin, sizeof(struct sockaddr_in6),
-					     abuf, sizeof(abuf)-1, NULL, 0,
-						 NI_NUMERICHOST|NI_NUMERICSERV);
-	        fprintf(stderr, "%6d: got connect request (v6) to %s port %d\n", (int) getpid(), abuf, ntohs(sin->sin6_port));
-			#endif
-        }
-        else if (s5_iobuffer.cmd.atyp == SOCKS5_DOMAIN &&
-				 rlen >= (4+1+s5_iobuffer.cmd.addr.domain_name.len+2))
-		{
-			/* fqdn */
-			struct sockaddr_in6 *sin;
-			memset(&nbuf, 0x0, sizeof(nbuf));
-			in_port_t port;
-			
-			/* safely copy over fqdn from request packet */
-			assert(NI_MAXHOST > sizeof(s5_iobuffer.cmd.addr.domain_name.fqdn) &&
-				   sizeof(s5_iobuffer.cmd.addr.domain_name.fqdn) == 255);
-			memcpy(nbuf, 
-				   s5_iobuffer.cmd.addr.domain_name.fqdn,
-				   s5_iobuffer.cmd.addr.domain_name.len);
-			assert(nbuf[s5_iobuffer.cmd.addr.domain_name.len] == 0x00);			
-            
-			/* peel out port */
-            memcpy( &(port), 
-				    s5_iobuffer.cmd.addr.domain_name.fqdn+s5_iobuffer.cmd.addr.domain_name.len,
-				    sizeof(uint16_t));
-			
-			#ifdef SOCKSD_NOISY_DEBUG
-	     	fprintf(stderr, "%6d: got connect request (name) to %s port %d\n", (int) getpid(), nbuf, ntohs(port));
-			#endif
-			
-			/* resolve */
-			ai_hints.ai_family = PF_UNSPEC;
-			ai_hints.ai_socktype = SOCK_STREAM;
-			ret = muacc_getaddrinfo(&fd2_ctx, nbuf, NULL, &ai_hints, &ai_res);
-		    if (ret) {
-		        fprintf(stderr, "%6d: resolve error: %s\n", (int) getpid(), gai_strerror(ret));
-		        s5_iobuffer.cmd.command = SOCKS5_HOSTUNREACH;
-		        s5_iobuffer.cmd.reserved = 0x00;
-		        send(fd, &s5_iobuffer, rlen, 0);
-		        goto do_socks_closed;
-		    }
-			
-			/* put result together */
-			memcpy(&remote_out, ai_res->ai_addr, ai_res->ai_addrlen);
-			remote_out_len = ai_res->ai_addrlen;
-			sin = (struct sockaddr_in6 *) &remote_out;			
-			memcpy(&(sin->sin6_port), &port, sizeof(in_port_t));
-			
-			#ifdef SOCKSD_NOISY_DEBUG
-			getnameinfo( (struct sockaddr*) &remote_out, remote_out_len,
-					     abuf, sizeof(abuf)-1, pbuf, sizeof(pbuf),
-						 NI_NUMERICHOST|NI_NUMERICSERV);
-			fprintf(stderr, "%6d: resolved %s to %s port %s\n",(int) getpid(), nbuf, abuf, pbuf);
-			#endif
-			
-		}
-		else
-		{
-	        fprintf(stderr, "%6d: error while handling request: request too small for given address type\n", (int) getpid());
-	        goto do_socks_closed;	
-		}
-		
-		/* create socket */
-		fd2 = muacc_socket(&fd2_ctx, remote_out.ss_family, SOCK_STREAM, 0);
-		if (fd2 <= 0)
+	splice_drain(p);
+}
+
+/** Switch a relayed connection from the bufferevents to a pair of pipes
+ *
+ *  \return 0 on success, -1 if the connection has to stay with the bufferevents
+ */
+static int splice_start(struct socks_session *s)
+{
+	struct timeval idle = { SOCKSD_IDLE_TIMEOUT, 0 };
+	int local_fd = bufferevent_getfd(s->local);
+	int size;
+	int i;
+
+	for (i = SPLICE_UP; i <= SPLICE_DOWN; i++)
+	{
+		s->pipes[i].fds[0] = -1;
+		s->pipes[i].fds[1] = -1;
+	}
+	s->splicing = 1;
+
+	for (i = SPLICE_UP; i <= SPLICE_DOWN; i++)
+	{
+		struct splice_pipe *p = &(s->pipes[i]);
+
+		p->session = s;
+		p->src = (i == SPLICE_UP) ? local_fd : s->fd2;
+		p->dst = (i == SPLICE_UP) ? s->fd2 : local_fd;
+		p->counter = (i == SPLICE_UP) ? &(s->bytes_sent) : &(s->bytes_received);
+
+		if (pipe2(p->fds, O_NONBLOCK|O_CLOEXEC) != 0)
+			goto splice_start_err;
+
+		/* larger pipes allow larger chunks - the kernel may refuse, which is fine */
+		size = -1;
+		#ifdef F_SETPIPE_SZ
+		size = fcntl(p->fds[1], F_SETPIPE_SZ, SOCKSD_SPLICE_PIPE_SIZE);
+		if (size < 0)
+			size = fcntl(p->fds[1], F_GETPIPE_SZ);
+		#endif
+		p->capacity = (size > 0) ? (size_t) size : 64*1024;
+		p->chunk = SOCKSD_SPLICE_MIN_CHUNK;
+
+		p->read_event = event_new(s->worker->base, p->src, EV_READ|EV_PERSIST, splice_readcb, p);
+		p->write_event = event_new(s->worker->base, p->dst, EV_WRITE|EV_PERSIST, splice_writecb, p);
+		if (p->read_event == NULL || p->write_event == NULL)
+			goto splice_start_err;
+	}
+
+	bufferevent_disable(s->local, EV_READ|EV_WRITE);
+	bufferevent_disable(s->remote, EV_READ|EV_WRITE);
+	event_add(s->pipes[SPLICE_UP].read_event, &idle);
+	event_add(s->pipes[SPLICE_DOWN].read_event, &idle);
+
+	return 0;
+
+	splice_start_err:
+	fprintf(stderr, "worker %d: setting up splice failed: %s - relaying through buffers\n", log_worker, strerror(errno));
+	splice_stop(s);
+	return -1;
+}
+#endif
+
+/** Hash of a destination key */
+static unsigned int decision_hash(const char *key)
+{
+	unsigned int h = 5381;
+
+	while (*key != '\0')
+		h = h * 33 + (unsigned char) *(key++);
+
+	return h % SOCKSD_DECISION_BUCKETS;
+}
+
+static void decision_free(struct socks_decision *d)
+{
+	if (d->timeout != NULL)
+		event_free(d->timeout);
+	if (d->sockopts != NULL)
+		_muacc_free_socketopts(d->sockopts);
+	free(d->key);
+	free(d);
+}
+
+/** Unlink a decision from the cache of its worker and free it - it must not have waiters */
+static void decision_remove(struct socks_worker *w, struct socks_decision *d)
+{
+	struct socks_decision **pd;
+
+	for (pd = &(w->decisions[decision_hash(d->key)]); *pd != NULL; pd = &((*pd)->next))
+	{
+		if (*pd == d)
 		{
-			fprintf(stderr, "%6d: error creating socket: ", (int) getpid());
-			perror(NULL);
-			s5_replay(fd, SOCKS5_GFAIL, NULL);
-	        goto do_socks_closed;
+			*pd = d->next;
+			w->num_decisions--;
+			break;
 		}
-		else
+	}
+	decision_free(d);
+}
+
+/** Drop decisions that are not in flight - all of them if evict_all is set, else only the expired ones */
+static void decision_purge(struct socks_worker *w, time_t now, int evict_all)
+{
+	struct socks_decision **pd;
+	struct socks_decision *d;
+	int i;
+
+	for (i = 0; i < SOCKSD_DECISION_BUCKETS; i++)
+	{
+		pd = &(w->decisions[i]);
+		while ((d = *pd) != NULL)
 		{
-			#ifdef SOCKSD_NOISY_DEBUG
-			fprintf(stderr, "%6d: remote socket created successfully\n", (int) getpid());
-			#endif
+			if (!d->pending && (evict_all || now >= d->expires))
+			{
+				*pd = d->next;
+				w->num_decisions--;
+				decision_free(d);
+			}
+			else
+			{
+				pd = &(d->next);
+			}
 		}
-		
-		/* go ahead an connect */
-		ret = muacc_connect(&fd2_ctx, fd2, (struct sockaddr *) &remote_out, remote_out_len);
-	 	if (ret == 0) 
+	}
+}
+
+/** Give up waiting for the MAM to answer the request of a decision
+ *  The waiting sessions are resolved without the MAM
+ */
+static void decision_abandon(struct socks_worker *w, struct socks_decision *d)
+{
+	struct socks_decision **pd;
+	struct socks_session *waiter;
+
+	for (pd = &(w->pending); *pd != NULL; pd = &((*pd)->next_pending))
+	{
+		if (*pd == d)
 		{
-			#ifdef SOCKSD_NOISY_DEBUG
-			getnameinfo( (struct sockaddr*) &remote_out, sizeof(remote_out),
-					     abuf, sizeof(abuf)-1, pbuf, sizeof(pbuf)-1, 
-						 NI_NUMERICHOST|NI_NUMERICSERV);
-			fprintf(stderr, "%6d: connect successful - remote host af %d host %s port %s\n", (int) getpid(), remote_out.ss_family, abuf, pbuf);	
-			#endif
+			*pd = d->next_pending;
+			break;
 		}
-		else
-		{
-			getnameinfo( (struct sockaddr*) &remote_out, sizeof(remote_out),
-					     abuf, sizeof(abuf)-1, pbuf, sizeof(pbuf)-1, 
-						 NI_NUMERICHOST|NI_NUMERICSERV);
-			fprintf(stderr, "%6d: error while connecting to remote host af %d host %s port %s: ", (int) getpid(), remote_out.ss_family, abuf, pbuf); 
-			perror(NULL);
-			s5_replay(fd, SOCKS5_HOSTUNREACH, NULL);
-	        goto do_socks_closed;
-		}
-		
-		/* get local end */
-		memset(&local_out, 0x00, sizeof(local_out));
-		ret = getsockname(fd2, (struct sockaddr *) &local_out, &local_out_len);
-	  	if ( ret != 0 ) 
-		{
-			fprintf(stderr, "%6d: error getting local address while connecting to remote host: ", (int) getpid()); 
-			perror(NULL);
-			s5_replay(fd, SOCKS5_GFAIL, NULL);
-	        goto do_socks_closed;
-		}
-		
-		/* print debug info */
-		#ifdef SOCKSD_NOISY_DEBUG
-		ret = getnameinfo( (struct sockaddr*) &local_out, sizeof(local_out),
-				     abuf, sizeof(abuf)-1, pbuf, sizeof(pbuf)-1, 
-					 NI_NUMERICHOST|NI_NUMERICSERV);
-		if (ret == 0) 
-		{
-    		fprintf(stderr, "%6d: connect successful - local end is %s port %s\n", (int) getpid(), abuf, pbuf);
-		} 
-		else
+	}
+
+	while ((waiter = d->waiters) != NULL)
+	{
+		d->waiters = waiter->next_waiter;
+		waiter->decision = NULL;
+		waiter->next_waiter = NULL;
+		fallback_resolve(waiter);
+	}
+	decision_remove(w, d);
+}
+
+/** The MAM did not answer in time - resolve the waiting sessions without it */
+static void decision_timeout_cb(evutil_socket_t fd, short what, void *arg)
+{
+	struct socks_decision *d = arg;
+
+	fprintf(stderr, "worker %d: no decision for %s from MAM after %d seconds - resolving without it\n", d->worker->id, d->key, SOCKSD_MAM_TIMEOUT);
+	decision_abandon(d->worker, d);
+}
+
+/** Find the decision for a destination, dropping it if it has expired
+ *  or the MAM did not answer its request in time
+ */
+static struct socks_decision *decision_find(struct socks_worker *w, const char *key, time_t now)
+{
+	struct socks_decision *d;
+
+	for (d = w->decisions[decision_hash(key)]; d != NULL; d = d->next)
+	{
+		if (strcmp(d->key, key) != 0)
+			continue;
+		if (now >= d->expires)
 		{
-			fprintf(stderr, "%6d: connect ambiguous - failed to get local address: %s af %d\n", (int) getpid(), gai_strerror(ret), local_out.ss_family);
-			exit(1);
+			if (d->pending)
+				decision_abandon(w, d);
+			else
+				decision_remove(w, d);
+			return NULL;
 		}
-		#endif
-		
-		/* send ok */
-		s5_replay(fd, SOCKS5_SUCCESS, (struct sockaddr *) &local_out);
-
-		/* forward stuff */
-		s2s_forward(fd, fd2);
-		muacc_close(&fd2_ctx, fd2);
-        goto do_socks_closed;
-        
-    }
-    else
-    {
-        /* unsupported command */
-        fprintf(stderr, "%6d: error while handling s5 request: unsupported command %x\n", (int) getpid(), s5_iobuffer.cmd.command);
-        s5_iobuffer.cmd.command = SOCKS5_CUNSUPPORTED;
-        s5_iobuffer.cmd.reserved = 0x00;
-        send(fd, &s5_iobuffer, rlen, 0);
-        goto do_socks_closed;
-    }
+		return d;
+	}
 
-    fprintf(stderr, "%6d: this never happens: fell out of the stocks state machine\n", (int) getpid());
-    goto do_socks_closed;
-    
-do_socks_error:
-	fprintf(stderr, "%6d: i/o error while handling s5 request:\n", (int) getpid());
-	perror(NULL);
-	
-do_socks_closed:
-	#ifdef SOCKSD_NOISY_DEBUG		
-	fprintf(stderr, "%6d: connection closed\n", (int) getpid());
-	#endif
-	close(fd);
+	return NULL;
 }
 
-static int do_accept(int listener)
+/** Add an empty decision for a destination to the cache */
+static struct socks_decision *decision_new(struct socks_worker *w, const char *key, time_t now)
 {
-    struct sockaddr_storage sa = {0};
-	socklen_t salen = sizeof(sa);	
-	struct sockaddr_storage	 la = {0};
-	socklen_t lalen = sizeof(la); 
-    int fd = -1, pid= -1;
-    
-	/* accept connection */
-    if ( (fd = accept(listener, (struct sockaddr*)&sa, &salen)) < 0 ) 
+	struct socks_decision *d;
+	unsigned int h = decision_hash(key);
+
+	if (w->num_decisions >= SOCKSD_DECISION_MAX)
+		decision_purge(w, now, 0);
+	if (w->num_decisions >= SOCKSD_DECISION_MAX)
+		decision_purge(w, now, 1);
+
+	if ((d = malloc(sizeof(struct socks_decision))) == NULL)
+		return NULL;
+	memset(d, 0x00, sizeof(struct socks_decision));
+	d->worker = w;
+	if ((d->key = _muacc_clone_string(key)) == NULL)
 	{
-        perror("master: accept error");
-		return(-1);
-    }
-	
-	if (getsockname(fd, (struct sockaddr*) &la, &lalen) <0 ) 
+		free(d);
+		return NULL;
+	}
+
+	d->next = w->decisions[h];
+	w->decisions[h] = d;
+	w->num_decisions++;
+
+	return d;
+}
+
+/** Stop a session from waiting for its decision */
+static void decision_forget_waiter(struct socks_session *s)
+{
+	struct socks_session **ps;
+
+	for (ps = &(s->decision->waiters); *ps != NULL; ps = &((*ps)->next_waiter))
 	{
-        perror("master: getsockname error");
-		return(-1);
-	};
-	
-	/* fork child */
-	if ( (pid = fork()) < 0 )
+		if (*ps == s)
+		{
+			*ps = s->next_waiter;
+			break;
+		}
+	}
+	s->decision = NULL;
+	s->next_waiter = NULL;
+}
+
+/** Take over the answer of the MAM - returns 0 if it contains an address to connect to */
+static int decision_fill(struct socks_decision *d, muacc_mam_action_t reason, struct _muacc_ctx *resp)
+{
+	if (reason == muacc_error_unknown_request)
+		return -1;
+
+	if (resp->remote_sa != NULL && resp->remote_sa_len <= sizeof(struct sockaddr_storage))
 	{
-	    perror("fork error");
-		return(-1);
-    }
-	else if (pid == 0) 
+		memcpy(&(d->remote_sa), resp->remote_sa, resp->remote_sa_len);
+		d->remote_sa_len = resp->remote_sa_len;
+	}
+	else if (resp->remote_addrinfo_res != NULL && resp->remote_addrinfo_res->ai_addrlen <= sizeof(struct sockaddr_storage))
 	{
-		/* handle socks in child */
-        close(listener);
-        do_socks(fd, (struct sockaddr*) &sa, salen, (struct sockaddr*) &la, lalen );
-        exit(0);
-    }
+		memcpy(&(d->remote_sa), resp->remote_addrinfo_res->ai_addr, resp->remote_addrinfo_res->ai_addrlen);
+		d->remote_sa_len = resp->remote_addrinfo_res->ai_addrlen;
+	}
 	else
 	{
-		/* some debug output in master */
-        #ifdef SOCKSD_NOISY_DEBUG
-	    char abuf[INET6_ADDRSTRLEN];
-		char pbuf[NI_MAXSERV];	
-        #endif
-		
-		#ifdef SOCKSD_NOISY_DEBUG
-	    getnameinfo( (struct sockaddr*) &sa, salen, abuf, sizeof(abuf)-1, pbuf, sizeof(pbuf)-1, NI_NUMERICHOST|NI_NUMERICSERV);
-	    fprintf(stderr, "master: forked %d to handle connection from %s port %s\n", pid, abuf, pbuf);
-		#endif
-		
-		/* close client fd */
-        close(fd);
-    }
-	
-	return(0);
-}
+		return -1;
+	}
+
+	if (resp->bind_sa_suggested != NULL && resp->bind_sa_suggested_len <= sizeof(struct sockaddr_storage))
+	{
+		memcpy(&(d->bind_sa), resp->bind_sa_suggested, resp->bind_sa_suggested_len);
+		d->bind_sa_len = resp->bind_sa_suggested_len;
+	}
 
+	d->protocol = resp->protocol;
+	d->sockopts = resp->sockopts_suggested;
+	resp->sockopts_suggested = NULL;
 
-int
-main(int c, char **v)
+	return 0;
+}
+
+/** Connecting as the cached decision suggested failed - ask the MAM again next time
+ *  The entry is only marked as expired, as the sessions waiting for it may still be handed it
+ */
+static void decision_drop_failed(struct socks_session *s)
 {
-    struct sockaddr_in6	sin = {0};
-    int listener = -1;
-    int one  = 1;
-    int zero = 0;
-	int ret = 0;
+	struct socks_decision *d;
+	char key[NI_MAXHOST + NI_MAXSERV + 1];
 
-    /* some debug output in master */
-    #ifdef SOCKSD_NOISY_DEBUG
-    char hbuf[NI_MAXHOST];
-    char abuf[INET6_ADDRSTRLEN];
-    #endif
-    
-    setvbuf(stderr, NULL, _IONBF, 0);
-    
-	/* set up v6 socket */
-    sin.sin6_family = AF_INET6;
-	#ifdef HAVE_SOCKADDR_LEN
-	sin.sin6_len = sizeof(sin);
-	#endif
-    sin.sin6_addr = in6addr_any;
-    sin.sin6_port = htons(9050);
+	if (!s->decided)
+		return;
+	s->decided = 0;
 
-    listener = socket(AF_INET6, SOCK_STREAM, 0);
-    
-    setsockopt(listener, IPPROTO_IPV6, IPV6_V6ONLY, &zero, sizeof(zero));
+	snprintf(key, sizeof(key), "%s %s", s->host, s->service);
+	for (d = s->worker->decisions[decision_hash(key)]; d != NULL; d = d->next)
+	{
+		if (!d->pending && strcmp(d->key, key) == 0)
+		{
+			d->expires = 0;
+			break;
+		}
+	}
+}
+
+/** Connect to the remote host without blocking the worker */
+static void connect_remote(struct socks_session *s, const struct sockaddr *addr, socklen_t addr_len)
+{
+	struct timeval tv = { SOCKSD_CONNECT_TIMEOUT, 0 };
+	char abuf[INET6_ADDRSTRLEN];
+	char pbuf[NI_MAXSERV];
+
+	if (connect(s->fd2, addr, addr_len) == 0)
+	{
+		start_relay(s);
+	}
+	else if (errno == EINPROGRESS)
+	{
+		s->state = SOCKS_CONNECTING;
+		s->connect_event = event_new(s->worker->base, s->fd2, EV_WRITE, connect_cb, s);
+		event_add(s->connect_event, &tv);
+	}
+	else
+	{
+		getnameinfo(addr, addr_len, abuf, sizeof(abuf)-1, pbuf, sizeof(pbuf)-1, NI_NUMERICHOST|NI_NUMERICSERV);
+		fprintf(stderr, "worker %d: error while connecting to remote host af %d host %s port %s: ", log_worker, addr->sa_family, abuf, pbuf);
+		perror(NULL);
+		decision_drop_failed(s);
+		s5_replay(s->local, SOCKS5_HOSTUNREACH, NULL);
+		session_finish(s, s->local);
+	}
+}
+
+/** Stop waiting for the destination to be resolved */
+static void session_resolved(struct socks_session *s)
+{
+	if (s->connect_event != NULL)
+	{
+		event_free(s->connect_event);
+		s->connect_event = NULL;
+	}
+}
+
+/** Set up the socket to the remote host as the MAM suggested and connect it */
+static void session_connect(struct socks_session *s, const struct socks_decision *d)
+{
+	const struct socketopt *so;
+
+	session_resolved(s);
+	s->decided = 1;
+
+	if ((s->fd2 = socket(d->remote_sa.ss_family, SOCK_STREAM, d->protocol)) < 0)
+	{
+		fprintf(stderr, "worker %d: error creating socket: %s\n", log_worker, strerror(errno));
+		goto session_connect_err;
+	}
+	evutil_make_socket_nonblocking(s->fd2);
+
+	for (so = d->sockopts; so != NULL; so = so->next)
+	{
+		/* intents are meant for the MAM, which already took them into account */
+		if (so->level == SOL_INTENTS)
+			continue;
+
+		if (setsockopt(s->fd2, so->level, so->optname, so->optval, so->optlen) != 0 && (so->flags & SOCKOPT_OPTIONAL) == 0)
+		{
+			fprintf(stderr, "worker %d: error setting suggested socket option %d: %s\n", log_worker, so->optname, strerror(errno));
+			goto session_connect_err;
+		}
+	}
+
+	if (d->bind_sa_len > 0 && bind(s->fd2, (const struct sockaddr *) &(d->bind_sa), d->bind_sa_len) != 0)
+	{
+		fprintf(stderr, "worker %d: error binding to suggested source address: %s\n", log_worker, strerror(errno));
+		goto session_connect_err;
+	}
+
+	connect_remote(s, (const struct sockaddr *) &(d->remote_sa), d->remote_sa_len);
+	return;
+
+	session_connect_err:
+	decision_drop_failed(s);
+	s5_replay(s->local, SOCKS5_GFAIL, NULL);
+	session_finish(s, s->local);
+}
+
+/** Give up on all requests in flight and drop the connection to the MAM
+ *  The waiting sessions are resolved without the MAM
+ */
+static void mam_channel_fail(struct socks_worker *w)
+{
+	struct socks_decision *d;
+	struct stripe *st;
+
+	fprintf(stderr, "worker %d: lost connection to MAM - resolving without it for %d seconds\n", w->id, SOCKSD_MAM_RETRY);
+
+	bufferevent_free(w->mam);
+	w->mam = NULL;
+	w->mam_retry = time(NULL) + SOCKSD_MAM_RETRY;
+	if (w->mam_response != NULL)
+	{
+		_muacc_free_ctx(w->mam_response);
+		w->mam_response = NULL;
+	}
+
+	while ((d = w->pending) != NULL)
+		decision_abandon(w, d);
+
+	/* striped downloads go on over the paths they have */
+	while ((st = w->stripes_waiting) != NULL)
+	{
+		w->stripes_waiting = st->next_waiting;
+		st->next_waiting = NULL;
+		st->srcaddrs_tag = 0;
+	}
+	w->num_srcaddrs = 0;
+}
+
+/** Hand a complete response of the MAM to the sessions waiting for it */
+static void mam_dispatch(struct socks_worker *w)
+{
+	struct _muacc_ctx *resp = w->mam_response;
+	struct socks_decision **pd;
+	struct socks_decision *d = NULL;
+	struct socks_session *waiter;
+	int ret;
+
+	w->mam_response = NULL;
+
+	if (w->mam_action == muacc_act_srcaddrs_resp)
+	{
+		stripe_srcaddrs_dispatch(w, resp->ctxino);
+		w->num_srcaddrs = 0;
+		_muacc_free_ctx(resp);
+		return;
+	}
+
+	for (pd = &(w->pending); *pd != NULL; pd = &((*pd)->next_pending))
+	{
+		if ((*pd)->tag == resp->ctxino)
+		{
+			d = *pd;
+			*pd = d->next_pending;
+			break;
+		}
+	}
+
+	if (d != NULL && d->timeout != NULL)
+	{
+		event_free(d->timeout);
+		d->timeout = NULL;
+	}
+
+	if (d == NULL)
+	{
+		#ifdef SOCKSD_NOISY_DEBUG
+		fprintf(stderr, "worker %d: dropping unexpected response from MAM\n", w->id);
+		#endif
+		_muacc_free_ctx(resp);
+		return;
+	}
+
+	ret = decision_fill(d, w->mam_action, resp);
+	_muacc_free_ctx(resp);
+
+	d->pending = 0;
+	d->expires = time(NULL) + SOCKSD_DECISION_TTL;
+
+	while ((waiter = d->waiters) != NULL)
+	{
+		d->waiters = waiter->next_waiter;
+		waiter->decision = NULL;
+		waiter->next_waiter = NULL;
+
+		if (ret == 0)
+		{
+			session_connect(waiter, d);
+		}
+		else
+		{
+			fprintf(stderr, "worker %d: MAM could not resolve %s\n", log_worker, d->key);
+			session_resolved(waiter);
+			s5_replay(waiter->local, SOCKS5_HOSTUNREACH, NULL);
+			session_finish(waiter, waiter->local);
+		}
+	}
+
+	/* failures are not cached */
+	if (ret != 0)
+		decision_remove(w, d);
+}
+
+/** Read the responses of the MAM, which may arrive in any order */
+static void mam_readcb(struct bufferevent *bev, void *arg)
+{
+	struct socks_worker *w = arg;
+	struct evbuffer *in = bufferevent_get_input(bev);
+	const size_t hdr_len = sizeof(muacc_tlv_t) + sizeof(ssize_t);
+	unsigned char *buf;
+	muacc_tlv_t tag;
+	ssize_t data_len;
+
+	while (evbuffer_get_length(in) >= hdr_len)
+	{
+		buf = evbuffer_pullup(in, hdr_len);
+		tag = *((muacc_tlv_t *) buf);
+		data_len = *((ssize_t *) (buf + sizeof(muacc_tlv_t)));
+
+		if (data_len < 0 || data_len > MUACC_TLV_MAXLEN)
+		{
+			fprintf(stderr, "worker %d: invalid TLV from MAM\n", w->id);
+			mam_channel_fail(w);
+			return;
+		}
+		if (evbuffer_get_length(in) < hdr_len + data_len)
+			return;
+		buf = evbuffer_pullup(in, hdr_len + data_len);
+
+		if (w->mam_response == NULL && (w->mam_response = _muacc_create_ctx()) == NULL)
+		{
+			mam_channel_fail(w);
+			return;
+		}
+
+		if (tag == eof)
+			mam_dispatch(w);
+		else if (tag == action && data_len == sizeof(muacc_mam_action_t))
+			w->mam_action = *((muacc_mam_action_t *) (buf + hdr_len));
+		else if (tag == bind_sa_res && w->mam_action == muacc_act_srcaddrs_resp)
+		{
+			/* a list of addresses, one TLV each */
+			if (w->num_srcaddrs < SOCKSD_SRCADDRS_MAX && data_len <= (ssize_t) sizeof(struct sockaddr_storage))
+			{
+				memcpy(&(w->srcaddrs[w->num_srcaddrs++]), buf + hdr_len, data_len);
+			}
+		}
+		else if (_muacc_unpack_ctx(tag, buf + hdr_len, data_len, w->mam_response) != 0)
+			fprintf(stderr, "worker %d: cannot parse TLV %d from MAM\n", w->id, (int) tag);
+
+		evbuffer_drain(in, hdr_len + data_len);
+	}
+}
+
+static void mam_eventcb(struct bufferevent *bev, short what, void *arg)
+{
+	if (what & (BEV_EVENT_EOF|BEV_EVENT_ERROR))
+		mam_channel_fail(arg);
+}
+
+/** Make sure the worker is connected to the MAM
+ *
+ *  \return 0 if it is, -1 if the MAM cannot be reached
+ */
+static int mam_channel_connect(struct socks_worker *w)
+{
+	struct sockaddr_un mams;
+	int fd;
+
+	if (w->mam != NULL)
+		return 0;
+	if (time(NULL) < w->mam_retry)
+		return -1;
+
+	memset(&mams, 0x00, sizeof(mams));
+	mams.sun_family = AF_UNIX;
+	#ifdef HAVE_SOCKADDR_LEN
+	mams.sun_len = sizeof(struct sockaddr_un);
+	#endif
+	strncpy(mams.sun_path, MUACC_SOCKET, sizeof(mams.sun_path) - 1);
+
+	/* connecting to a local socket does not block */
+	if ((fd = socket(AF_UNIX, SOCK_STREAM, 0)) < 0)
+		goto mam_channel_connect_err;
+	if (connect(fd, (struct sockaddr *) &mams, sizeof(mams)) != 0)
+	{
+		close(fd);
+		goto mam_channel_connect_err;
+	}
+	evutil_make_socket_nonblocking(fd);
+
+	if ((w->mam = bufferevent_socket_new(w->base, fd, BEV_OPT_CLOSE_ON_FREE)) == NULL)
+	{
+		close(fd);
+		goto mam_channel_connect_err;
+	}
+	bufferevent_setcb(w->mam, mam_readcb, NULL, mam_eventcb, w);
+	bufferevent_enable(w->mam, EV_READ|EV_WRITE);
+
+	#ifdef SOCKSD_NOISY_DEBUG
+	fprintf(stderr, "worker %d: connected to MAM\n", w->id);
+	#endif
+	return 0;
+
+	mam_channel_connect_err:
+	fprintf(stderr, "worker %d: cannot connect to MAM via %s: %s\n", w->id, MUACC_SOCKET, strerror(errno));
+	w->mam_retry = time(NULL) + SOCKSD_MAM_RETRY;
+	return -1;
+}
+
+/** Ask the MAM for a decision on a destination - a socketconnect request, answered asynchronously
+ *
+ *  \return 0 if the request has been sent, -1 otherwise
+ */
+static int mam_request(struct socks_worker *w, struct socks_decision *d, const char *host, const char *service)
+{
+	char buf[MUACC_TLV_MAXLEN];
+	ssize_t pos = 0;
+	muacc_mam_action_t reason = muacc_act_socketconnect_req;
+	struct _muacc_ctx req;
+	struct addrinfo hints;
+	struct timeval tv = { SOCKSD_MAM_TIMEOUT, 0 };
+
+	if (mam_channel_connect(w) != 0)
+		return -1;
+
+	memset(&hints, 0x00, sizeof(hints));
+	hints.ai_family = AF_UNSPEC;
+	hints.ai_socktype = SOCK_STREAM;
+
+	/* the MAM echoes the inode, so it tells the responses on the shared connection apart */
+	memset(&req, 0x00, sizeof(req));
+	req.ctxino = d->tag = ++(w->next_tag);
+	req.domain = AF_UNSPEC;
+	req.type = SOCK_STREAM;
+	req.remote_hostname = (char *) host;
+	req.remote_service = (char *) service;
+	req.remote_addrinfo_hint = &hints;
+
+	if (0 > _muacc_push_tlv(buf, &pos, sizeof(buf), action, &reason, sizeof(muacc_mam_action_t)) ||
+		0 > _muacc_pack_ctx(buf, &pos, sizeof(buf), &req) ||
+		0 > _muacc_push_tlv_tag(buf, &pos, sizeof(buf), eof) ||
+		0 != bufferevent_write(w->mam, buf, pos))
+		return -1;
+
+	d->pending = 1;
+	d->expires = time(NULL) + SOCKSD_MAM_TIMEOUT;
+	d->next_pending = w->pending;
+	w->pending = d;
+
+	/* the sessions fall back to evdns long before their own timeout if the MAM is slow */
+	if ((d->timeout = evtimer_new(w->base, decision_timeout_cb, d)) != NULL)
+		evtimer_add(d->timeout, &tv);
+
+	return 0;
+}
+
+/** Ask the MAM for the source addresses of its enabled prefixes of a family, answered asynchronously
+ *
+ *  \return the tag of the request if it has been sent, 0 otherwise
+ */
+static muacc_ctxino_t mam_request_srcaddrs(struct socks_worker *w, int family)
+{
+	char buf[MUACC_TLV_MAXLEN];
+	ssize_t pos = 0;
+	muacc_mam_action_t reason = muacc_act_srcaddrs_req;
+	struct _muacc_ctx req;
+
+	if (mam_channel_connect(w) != 0)
+		return 0;
+
+	memset(&req, 0x00, sizeof(req));
+	req.ctxino = ++(w->next_tag);
+	req.domain = family;
+	req.type = SOCK_STREAM;
+
+	if (0 > _muacc_push_tlv(buf, &pos, sizeof(buf), action, &reason, sizeof(muacc_mam_action_t)) ||
+		0 > _muacc_pack_ctx(buf, &pos, sizeof(buf), &req) ||
+		0 > _muacc_push_tlv_tag(buf, &pos, sizeof(buf), eof) ||
+		0 != bufferevent_write(w->mam, buf, pos))
+		return 0;
+
+	return req.ctxino;
+}
+
+/** Report the byte counters of a finished connection to the MAM, if it can be reached */
+static void mam_report_flow(struct socks_session *s)
+{
+	char buf[MUACC_TLV_MAXLEN];
+	ssize_t pos = 0;
+	muacc_mam_action_t reason = muacc_act_flowstats_report;
+	struct _muacc_ctx report;
+	struct _muacc_flowstats stats;
+
+	if (s->local_out_len == 0 || mam_channel_connect(s->worker) != 0)
+		return;
+
+	memset(&report, 0x00, sizeof(report));
+	report.type = SOCK_STREAM;
+	report.bind_sa_suggested = (struct sockaddr *) &(s->local_out);
+	report.bind_sa_suggested_len = s->local_out_len;
+	memset(&stats, 0x00, sizeof(stats));
+	stats.bytes_sent = s->bytes_sent;
+	stats.bytes_received = s->bytes_received;
+	stats.flags = MUACC_FLOWSTATS_FINAL;
+
+	if (0 > _muacc_push_tlv(buf, &pos, sizeof(buf), action, &reason, sizeof(muacc_mam_action_t)) ||
+		0 > _muacc_pack_ctx(buf, &pos, sizeof(buf), &report) ||
+		0 > _muacc_push_tlv(buf, &pos, sizeof(buf), flowstats, &stats, sizeof(struct _muacc_flowstats)) ||
+		0 > _muacc_push_tlv_tag(buf, &pos, sizeof(buf), eof))
+		return;
+
+	bufferevent_write(s->worker->mam, buf, pos);
+}
+
+/** Result of a lookup done without the MAM */
+static void fallback_resolved_cb(int errcode, struct evutil_addrinfo *res, void *arg)
+{
+	struct socks_session *s = arg;
+
+	if (errcode == EVUTIL_EAI_CANCEL)
+	{
+		/* the session is being freed */
+		if (res != NULL)
+			evutil_freeaddrinfo(res);
+		return;
+	}
+
+	s->dns_req = NULL;
+	session_resolved(s);
+
+	if (errcode != 0 || res == NULL)
+	{
+		fprintf(stderr, "worker %d: resolve error for %s: %s\n", log_worker, s->host, evutil_gai_strerror(errcode));
+		s5_replay(s->local, SOCKS5_HOSTUNREACH, NULL);
+		session_finish(s, s->local);
+		return;
+	}
+
+	if ((s->fd2 = socket(res->ai_family, SOCK_STREAM, 0)) < 0)
+	{
+		fprintf(stderr, "worker %d: error creating socket: %s\n", log_worker, strerror(errno));
+		evutil_freeaddrinfo(res);
+		s5_replay(s->local, SOCKS5_GFAIL, NULL);
+		session_finish(s, s->local);
+		return;
+	}
+	evutil_make_socket_nonblocking(s->fd2);
+
+	connect_remote(s, res->ai_addr, res->ai_addrlen);
+	evutil_freeaddrinfo(res);
+}
+
+/** Resolve the destination with the resolver of the worker */
+static void fallback_resolve(struct socks_session *s)
+{
+	struct evutil_addrinfo hints;
+	struct evdns_getaddrinfo_request *req;
+
+	memset(&hints, 0x00, sizeof(hints));
+	hints.ai_family = AF_UNSPEC;
+	hints.ai_socktype = SOCK_STREAM;
+
+	/* returns NULL if it already called back - the session may be gone then */
+	req = evdns_getaddrinfo(s->worker->dns_base, s->host, s->service, &hints, fallback_resolved_cb, s);
+	if (req != NULL)
+		s->dns_req = req;
+}
+
+/** The destination has not been resolved in time */
+static void resolve_timeout_cb(evutil_socket_t fd, short what, void *arg)
+{
+	struct socks_session *s = arg;
+
+	fprintf(stderr, "worker %d: timeout while resolving %s\n", log_worker, s->host);
+
+	event_free(s->connect_event);
+	s->connect_event = NULL;
+	if (s->decision != NULL)
+		decision_forget_waiter(s);
+	if (s->dns_req != NULL)
+	{
+		struct evdns_getaddrinfo_request *req = s->dns_req;
+
+		s->dns_req = NULL;
+		evdns_getaddrinfo_cancel(req);
+	}
+	if (s->stripe != NULL)
+		stripe_free(s);
+
+	s5_replay(s->local, SOCKS5_HOSTUNREACH, NULL);
+	session_finish(s, s->local);
+}
+
+/** Find out where to connect to - from the decision cache, the MAM, or without it */
+static void session_resolve(struct socks_session *s)
+{
+	struct socks_worker *w = s->worker;
+	struct socks_decision *d;
+	struct timeval tv = { SOCKSD_CONNECT_TIMEOUT, 0 };
+	char key[NI_MAXHOST + NI_MAXSERV + 1];
+	time_t now = time(NULL);
+
+	s->state = SOCKS_RESOLVING;
+	bufferevent_disable(s->local, EV_READ);
+	s->connect_event = evtimer_new(w->base, resolve_timeout_cb, s);
+	evtimer_add(s->connect_event, &tv);
+
+	snprintf(key, sizeof(key), "%s %s", s->host, s->service);
+
+	if ((d = decision_find(w, key, now)) != NULL && !d->pending)
+	{
+		#ifdef SOCKSD_NOISY_DEBUG
+		fprintf(stderr, "worker %d: using cached decision for %s\n", log_worker, key);
+		#endif
+		session_connect(s, d);
+		return;
+	}
+
+	if (d == NULL)
+	{
+		if ((d = decision_new(w, key, now)) == NULL || mam_request(w, d, s->host, s->service) != 0)
+		{
+			if (d != NULL)
+				decision_remove(w, d);
+			fallback_resolve(s);
+			return;
+		}
+	}
+
+	/* wait for the request in flight */
+	s->decision = d;
+	s->next_waiter = d->waiters;
+	d->waiters = s;
+}
+
+/** Tear down a connection and everything that belongs to it */
+static void session_free(struct socks_session *s)
+{
+	#ifdef SOCKSD_NOISY_DEBUG
+	fprintf(stderr, "worker %d: connection closed\n", log_worker);
+	#endif
+
+	#ifdef SOCKSD_SPLICE
+	splice_stop(s);
+	#endif
+
+	if (s->connect_event != NULL)
+		event_free(s->connect_event);
+	if (s->decision != NULL)
+		decision_forget_waiter(s);
+	if (s->dns_req != NULL)
+	{
+		struct evdns_getaddrinfo_request *req = s->dns_req;
+
+		s->dns_req = NULL;
+		evdns_getaddrinfo_cancel(req);
+	}
+	if (s->stripe != NULL)
+		stripe_free(s);
+
+	/* tell the MAM how much went over the interface it chose */
+	if (s->remote != NULL)
+		mam_report_flow(s);
+
+	if (s->local != NULL)
+		bufferevent_free(s->local);
+	if (s->remote != NULL)
+		bufferevent_free(s->remote);
+
+	if (s->fd2 >= 0)
+		close(s->fd2);
+
+	free(s);
+}
+
+/** Close the connection once the last reply has been sent to the client */
+static void close_on_finished_writecb(struct bufferevent *bev, void *arg)
+{
+	struct socks_session *s = arg;
+
+	if (evbuffer_get_length(bufferevent_get_output(bev)) == 0)
+		session_free(s);
+}
+
+/** Stop reading from the client and close once everything queued has been written */
+static void session_finish(struct socks_session *s, struct bufferevent *bev)
+{
+	s->state = SOCKS_CLOSING;
+
+	if (bev == NULL || evbuffer_get_length(bufferevent_get_output(bev)) == 0)
+	{
+		session_free(s);
+		return;
+	}
+
+	bufferevent_setcb(bev, NULL, close_on_finished_writecb, relay_eventcb, s);
+	bufferevent_disable(bev, EV_READ);
+}
+
+/** Connection to the remote host is established - tell the client and start relaying */
+static void start_relay(struct socks_session *s)
+{
+	struct timeval idle = { SOCKSD_IDLE_TIMEOUT, 0 };
+	socklen_t local_out_len = sizeof(struct sockaddr_storage);
+
+	/* get local end */
+	memset(&(s->local_out), 0x00, sizeof(s->local_out));
+	if (getsockname(s->fd2, (struct sockaddr *) &(s->local_out), &local_out_len) != 0)
+	{
+		fprintf(stderr, "worker %d: error getting local address while connecting to remote host: ", log_worker);
+		perror(NULL);
+		s5_replay(s->local, SOCKS5_GFAIL, NULL);
+		session_finish(s, s->local);
+		return;
+	}
+
+	#ifdef SOCKSD_NOISY_DEBUG
+	char abuf[INET6_ADDRSTRLEN];
+	char pbuf[NI_MAXSERV];
+	if (getnameinfo( (struct sockaddr*) &(s->local_out), local_out_len,
+			     abuf, sizeof(abuf)-1, pbuf, sizeof(pbuf)-1,
+				 NI_NUMERICHOST|NI_NUMERICSERV) == 0)
+	{
+		fprintf(stderr, "worker %d: connect successful - local end is %s port %s\n", log_worker, abuf, pbuf);
+	}
+	#endif
+
+	if ((s->remote = bufferevent_socket_new(s->worker->base, s->fd2, 0)) == NULL)
+	{
+		s->local_out_len = 0;
+		s5_replay(s->local, SOCKS5_GFAIL, NULL);
+		session_finish(s, s->local);
+		return;
+	}
+
+	s->local_out_len = local_out_len;
+
+	/* send ok */
+	s5_replay(s->local, SOCKS5_SUCCESS, (struct sockaddr *) &(s->local_out));
+
+	/* forward stuff */
+	s->state = SOCKS_RELAY;
+	s->last_active = time(NULL);
+	bufferevent_setcb(s->local, relay_readcb, relay_writecb, relay_eventcb, s);
+	bufferevent_setcb(s->remote, relay_readcb, relay_writecb, relay_eventcb, s);
+	#if LIBEVENT_VERSION_NUMBER >= 0x02010000
+	bufferevent_set_max_single_read(s->local, SOCKSD_COPY_CHUNK);
+	bufferevent_set_max_single_read(s->remote, SOCKSD_COPY_CHUNK);
+	bufferevent_set_max_single_write(s->local, SOCKSD_COPY_CHUNK);
+	bufferevent_set_max_single_write(s->remote, SOCKSD_COPY_CHUNK);
+	#endif
+	bufferevent_set_timeouts(s->local, &idle, &idle);
+	bufferevent_set_timeouts(s->remote, &idle, &idle);
+	bufferevent_enable(s->local, EV_READ|EV_WRITE);
+	bufferevent_enable(s->remote, EV_READ|EV_WRITE);
+
+	/* look at the request of the client before deciding how to relay */
+	if (stripe_enabled && strcmp(s->service, SOCKSD_STRIPE_PORT) == 0)
+	{
+		s->splice_tried = 1;
+		bufferevent_setcb(s->local, stripe_peek_readcb, relay_writecb, relay_eventcb, s);
+		if (evbuffer_get_length(bufferevent_get_input(s->local)) > 0)
+			stripe_peek_readcb(s->local, s);
+		return;
+	}
+
+	/* the client may have sent data along with the request */
+	if (evbuffer_get_length(bufferevent_get_input(s->local)) > 0)
+		relay_readcb(s->local, s);
+}
+
+/** Non-blocking connect to the remote host finished or timed out */
+static void connect_cb(evutil_socket_t fd, short what, void *arg)
+{
+	struct socks_session *s = arg;
+	int err = ETIMEDOUT;
+	socklen_t errlen = sizeof(err);
+
+	event_free(s->connect_event);
+	s->connect_event = NULL;
+
+	if ((what & EV_WRITE) && getsockopt(fd, SOL_SOCKET, SO_ERROR, &err, &errlen) != 0)
+		err = errno;
+
+	if (err != 0)
+	{
+		fprintf(stderr, "worker %d: error while connecting to remote host: %s\n", log_worker, strerror(err));
+		decision_drop_failed(s);
+		s5_replay(s->local, SOCKS5_HOSTUNREACH, NULL);
+		session_finish(s, s->local);
+		return;
+	}
+
+	start_relay(s);
+}
+
+/** Handle a complete connect request */
+static void do_connect(struct socks_session *s, union s5_inputbuffer *s5_iobuffer)
+{
+	in_port_t port;
+
+	/* TCP connect request - keep the destination as host and port for the MAM */
+	if (s5_iobuffer->cmd.atyp == SOCKS5_IPV4)
+	{
+		/* ipv4 */
+		inet_ntop(AF_INET, &(s5_iobuffer->cmd.addr.ipv4.sin_addr), s->host, sizeof(s->host));
+		port = s5_iobuffer->cmd.addr.ipv4.port;
+	}
+	else if (s5_iobuffer->cmd.atyp == SOCKS5_IPV6)
+	{
+		/* ipv6 */
+		inet_ntop(AF_INET6, &(s5_iobuffer->cmd.addr.ipv6.sin6_addr), s->host, sizeof(s->host));
+		port = s5_iobuffer->cmd.addr.ipv6.port;
+	}
+	else
+	{
+		/* fqdn - safely copy over fqdn from request packet */
+		assert(NI_MAXHOST > sizeof(s5_iobuffer->cmd.addr.domain_name.fqdn) &&
+			   sizeof(s5_iobuffer->cmd.addr.domain_name.fqdn) == 255);
+		memset(s->host, 0x00, sizeof(s->host));
+		memcpy(s->host,
+			   s5_iobuffer->cmd.addr.domain_name.fqdn,
+			   s5_iobuffer->cmd.addr.domain_name.len);
+
+		/* peel out port */
+		memcpy( &(port),
+			    s5_iobuffer->cmd.addr.domain_name.fqdn+s5_iobuffer->cmd.addr.domain_name.len,
+			    sizeof(uint16_t));
+	}
+	snprintf(s->service, sizeof(s->service), "%d", ntohs(port));
+
+	#ifdef SOCKSD_NOISY_DEBUG
+	fprintf(stderr, "worker %d: got connect request to %s port %s\n", log_worker, s->host, s->service);
+	#endif
+
+	session_resolve(s);
+}
+
+/** Handle the method selection - returns 1 if it is complete, 0 if more data is needed, -1 on errors */
+static int do_auth(struct socks_session *s, struct evbuffer *in)
+{
+	union s5_inputbuffer s5_iobuffer;
+	size_t rlen = evbuffer_get_length(in);
+	unsigned char *buf;
+	int i;
+
+	if (rlen < 2)
+		return 0;
+
+	buf = evbuffer_pullup(in, 2);
+	if (buf[0] != 0x05)
+	{
+		fprintf(stderr, "worker %d: error while handling authentication: wrong protocol version\n", log_worker);
+		return -1;
+	}
+	if (rlen < (size_t) buf[1] + 2)
+		return 0;
+
+	rlen = buf[1] + 2;
+	memset(&s5_iobuffer, 0x0, sizeof(s5_iobuffer));
+	evbuffer_remove(in, &s5_iobuffer, rlen);
+
+	for (i = 0; i < s5_iobuffer.auth_req.nmethods; i++)
+	{
+		if (s5_iobuffer.auth_req.method[i] == SOCKS5_NOAUTH)
+		{
+			s5_iobuffer.auth_resp.method = SOCKS5_NOAUTH;
+			bufferevent_write(s->local, &s5_iobuffer, 2);
+			#ifdef SOCKSD_NOISY_DEBUG
+			fprintf(stderr, "worker %d: authentication done\n", log_worker);
+			#endif
+			return 1;
+		}
+	}
+
+	/* no acceptable method */
+	fprintf(stderr, "worker %d: error while handling authentication: no acceptable method\n", log_worker);
+	s5_iobuffer.auth_resp.method = SOCKS5_NOMETHOD;
+	bufferevent_write(s->local, &s5_iobuffer, 2);
+	return -1;
+}
+
+/** Handle the request - returns 1 if it has been handled, 0 if more data is needed, -1 on errors */
+static int do_request(struct socks_session *s, struct evbuffer *in)
+{
+	union s5_inputbuffer s5_iobuffer;
+	size_t avail = evbuffer_get_length(in);
+	size_t rlen;
+	unsigned char *buf;
+
+	if (avail < 5)
+		return 0;
+
+	buf = evbuffer_pullup(in, 5);
+	if (buf[0] != 0x05)
+	{
+		fprintf(stderr, "worker %d: error while handling request: wrong protocol version\n", log_worker);
+		return -1;
+	}
+
+	/* find out how long the request is */
+	if (buf[3] == SOCKS5_IPV4)
+		rlen = 10;
+	else if (buf[3] == SOCKS5_IPV6)
+		rlen = 22;
+	else if (buf[3] == SOCKS5_DOMAIN)
+		rlen = 4 + 1 + buf[4] + 2;
+	else
+	{
+		fprintf(stderr, "worker %d: error while handling request: unsupported address type %x\n", log_worker, buf[3]);
+		s5_replay(s->local, SOCKS5_AUNSUPPORTED, NULL);
+		return -1;
+	}
+
+	if (avail < rlen)
+		return 0;
+
+	memset(&s5_iobuffer, 0x0, sizeof(s5_iobuffer));
+	evbuffer_remove(in, &s5_iobuffer, rlen);
+
+	/* handle commands */
+	if (s5_iobuffer.cmd.command == SOCKS5_CONNECT)
+	{
+		do_connect(s, &s5_iobuffer);
+		return 1;
+	}
+
+	/* unsupported command */
+	fprintf(stderr, "worker %d: error while handling s5 request: unsupported command %x\n", log_worker, s5_iobuffer.cmd.command);
+	s5_iobuffer.cmd.command = SOCKS5_CUNSUPPORTED;
+	s5_iobuffer.cmd.reserved = 0x00;
+	bufferevent_write(s->local, &s5_iobuffer, rlen);
+	return -1;
+}
+
+/** Read the SOCKS negotiation from the client */
+static void local_readcb(struct bufferevent *bev, void *arg)
+{
+	struct socks_session *s = arg;
+	struct evbuffer *in = bufferevent_get_input(bev);
+	int ret;
+
+	if (s->state == SOCKS_AUTH)
+	{
+		if ((ret = do_auth(s, in)) < 0)
+		{
+			session_finish(s, s->local);
+			return;
+		}
+		else if (ret == 0)
+		{
+			return;
+		}
+		s->state = SOCKS_REQUEST;
+	}
+
+	if (s->state == SOCKS_REQUEST)
+	{
+		/* do_request may free the session when it is done */
+		if (do_request(s, in) < 0)
+			session_finish(s, s->local);
+	}
+}
+
+/** Forward everything that has been read on one side to the other one */
+static void relay_readcb(struct bufferevent *bev, void *arg)
+{
+	struct socks_session *s = arg;
+	struct bufferevent *partner = (bev == s->local) ? s->remote : s->local;
+	struct evbuffer *src = bufferevent_get_input(bev);
+	struct evbuffer *dst;
+
+	s->last_active = time(NULL);
+
+	if (partner == NULL || s->state != SOCKS_RELAY)
+	{
+		evbuffer_drain(src, evbuffer_get_length(src));
+		return;
+	}
+
+	if (bev == s->local)
+		s->bytes_sent += evbuffer_get_length(src);
+	else
+		s->bytes_received += evbuffer_get_length(src);
+
+	dst = bufferevent_get_output(partner);
+	evbuffer_add_buffer(dst, src);
+
+	if (evbuffer_get_length(dst) >= SOCKSD_MAX_BUFFERED)
+	{
+		/* partner cannot keep up - stop reading until it has drained its output */
+		#ifdef SOCKSD_NOISY_DEBUG
+		fprintf(stderr, "worker %d: output full - pausing %s side\n", log_worker, (bev == s->local ? "local" : "remote"));
+		#endif
+		bufferevent_setcb(partner, relay_readcb, relay_drained_writecb, relay_eventcb, s);
+		bufferevent_setwatermark(partner, EV_WRITE, SOCKSD_MAX_BUFFERED / 2, SOCKSD_MAX_BUFFERED);
+		bufferevent_disable(bev, EV_READ);
+	}
+}
+
+/** Output has drained below the low watermark - resume reading from the partner */
+static void relay_drained_writecb(struct bufferevent *bev, void *arg)
+{
+	struct socks_session *s = arg;
+	struct bufferevent *partner = (bev == s->local) ? s->remote : s->local;
+
+	bufferevent_setcb(bev, relay_readcb, relay_writecb, relay_eventcb, s);
+	bufferevent_setwatermark(bev, EV_WRITE, 0, 0);
+	if (partner != NULL && !s->eof[(partner == s->local) ? SPLICE_UP : SPLICE_DOWN])
+		bufferevent_enable(partner, EV_READ);
+}
+
+/** Output of one side has been flushed completely
+ *  Once nothing is buffered anywhere - usually right after the reply to the client - the
+ *  connection moves over to the splice relay
+ */
+static void relay_writecb(struct bufferevent *bev, void *arg)
+{
+	struct socks_session *s = arg;
+	int dir = (bev == s->remote) ? SPLICE_UP : SPLICE_DOWN;
+
+	/* the source of this direction has closed its side and everything has been written */
+	if (s->eof[dir])
+	{
+		session_forward_fin(s, dir, bufferevent_getfd(bev));
+		return;
+	}
+
+	#ifdef SOCKSD_SPLICE
+	if (s->splice_tried || s->state != SOCKS_RELAY || s->eof[SPLICE_UP] || s->eof[SPLICE_DOWN] ||
+		evbuffer_get_length(bufferevent_get_input(s->local)) > 0 ||
+		evbuffer_get_length(bufferevent_get_output(s->local)) > 0 ||
+		evbuffer_get_length(bufferevent_get_input(s->remote)) > 0 ||
+		evbuffer_get_length(bufferevent_get_output(s->remote)) > 0)
+		return;
+
+	s->splice_tried = 1;
+	splice_start(s);
+	#endif
+}
+
+/** Handle closed connections, errors and idle timeouts on either side */
+static void relay_eventcb(struct bufferevent *bev, short what, void *arg)
+{
+	struct socks_session *s = arg;
+	struct bufferevent *partner = (bev == s->local) ? s->remote : s->local;
+
+	if (what & BEV_EVENT_TIMEOUT)
+	{
+		if ((s->state == SOCKS_RELAY || s->state == SOCKS_STRIPING) && time(NULL) - s->last_active < SOCKSD_IDLE_TIMEOUT)
+		{
+			/* the other direction is still active - keep going */
+			bufferevent_enable(bev, (what & BEV_EVENT_READING) ? EV_READ : EV_WRITE);
+			return;
+		}
+		#ifdef SOCKSD_NOISY_DEBUG
+		fprintf(stderr, "worker %d: connection idle - closing\n", log_worker);
+		#endif
+		session_free(s);
+		return;
+	}
+
+	if (what & BEV_EVENT_ERROR)
+	{
+		fprintf(stderr, "worker %d: i/o error while handling s5 request: %s\n", log_worker, strerror(EVUTIL_SOCKET_ERROR()));
+	}
+
+	if (what & (BEV_EVENT_EOF|BEV_EVENT_ERROR))
+	{
+		#ifdef SOCKSD_NOISY_DEBUG
+		fprintf(stderr, "worker %d: connection closed by %s\n", log_worker, (bev == s->local ? "local" : "remote"));
+		#endif
+
+		/* half-close - pass on what is left and the close, the other direction goes on */
+		if ((what & BEV_EVENT_ERROR) == 0 && s->state == SOCKS_RELAY && partner != NULL)
+		{
+			int dir = (bev == s->local) ? SPLICE_UP : SPLICE_DOWN;
+
+			relay_readcb(bev, s);
+			s->eof[dir] = 1;
+			bufferevent_disable(bev, EV_READ);
+			if (evbuffer_get_length(bufferevent_get_output(partner)) == 0)
+				session_forward_fin(s, dir, bufferevent_getfd(partner));
+			return;
+		}
+
+		/* pass on what is left and close once the other side got it */
+		if (s->state == SOCKS_RELAY && partner != NULL)
+		{
+			relay_readcb(bev, s);
+			session_finish(s, partner);
+		}
+		else
+		{
+			session_free(s);
+		}
+	}
+}
+
+/** Length of the HTTP header at the start of the buffer including the empty line
+ *  0 if it is incomplete, -1 if it is too long to be handled
+ */
+static int http_header_end(struct evbuffer *buf)
+{
+	struct evbuffer_ptr end = evbuffer_search(buf, "\r\n\r\n", 4, NULL);
+
+	if (end.pos < 0)
+		return (evbuffer_get_length(buf) > SOCKSD_STRIPE_MAX_HEADER) ? -1 : 0;
+	if (end.pos + 4 > SOCKSD_STRIPE_MAX_HEADER)
+		return -1;
+
+	return end.pos + 4;
+}
+
+/** Check whether a header line carries one of the given header fields */
+static int http_header_is(const char *line, const char *const *names)
+{
+	size_t n;
+
+	for (; *names != NULL; names++)
+	{
+		n = strlen(*names);
+		if (strncasecmp(line, *names, n) == 0 && line[n] == ':')
+			return 1;
+	}
+
+	return 0;
+}
+
+/** Find the value of a header field, NULL if the header does not have it */
+static const char *http_header_value(const char *hdr, const char *name)
+{
+	const char *names[] = { name, NULL };
+	const char *line;
+
+	for (line = strstr(hdr, "\r\n"); line != NULL; line = strstr(line + 2, "\r\n"))
+	{
+		if (http_header_is(line + 2, names))
+		{
+			line += 2 + strlen(name) + 1;
+			while (*line == ' ' || *line == '\t')
+				line++;
+			return line;
+		}
+	}
+
+	return NULL;
+}
+
+/** Turn the request of the client into the template for the range requests
+ *  Returns NULL if the request cannot be split into ranges
+ */
+static char *stripe_build_request(const char *hdr)
+{
+	static const char *const refused[] = { "Range", "If-Range", "Content-Length", "Transfer-Encoding", "Expect", "Upgrade", NULL };
+	static const char *const dropped[] = { "Connection", "Keep-Alive", "Proxy-Connection", NULL };
+	const char *eol = strstr(hdr, "\r\n");
+	const char *line;
+	const char *next;
+	char *request;
+	size_t pos;
+
+	if (strncmp(hdr, "GET ", 4) != 0 || eol == NULL || eol - hdr < 13 || strncmp(eol - 8, "HTTP/1.1", 8) != 0)
+		return NULL;
+
+	if ((request = malloc(strlen(hdr) + 1)) == NULL)
+		return NULL;
+	pos = eol + 2 - hdr;
+	memcpy(request, hdr, pos);
+
+	for (line = eol + 2; strncmp(line, "\r\n", 2) != 0; line = next)
+	{
+		if ((next = strstr(line, "\r\n")) == NULL)
+			break;
+		next += 2;
+
+		if (http_header_is(line, refused))
+		{
+			free(request);
+			return NULL;
+		}
+		if (!http_header_is(line, dropped))
+		{
+			memcpy(request + pos, line, next - line);
+			pos += next - line;
+		}
+	}
+	request[pos] = '\0';
+
+	return request;
+}
+
+/** Release everything the striped download holds except for the connection of the session */
+static void stripe_free(struct socks_session *s)
+{
+	struct stripe *st = s->stripe;
+	struct stripe_chunk *c;
+	struct stripe **pst;
+	int i;
+
+	for (pst = &(s->worker->stripes_waiting); *pst != NULL; pst = &((*pst)->next_waiting))
+	{
+		if (*pst == st)
+		{
+			*pst = st->next_waiting;
+			break;
+		}
+	}
+
+	for (i = 1; i < st->num_paths; i++)
+	{
+		if (st->paths[i].bev != NULL)
+			bufferevent_free(st->paths[i].bev);
+	}
+	while ((c = st->chunks) != NULL)
+	{
+		st->chunks = c->next;
+		evbuffer_free(c->data);
+		free(c);
+	}
+	free(st->request);
+	free(st->validator);
+	free(st);
+	s->stripe = NULL;
+
+	/* the callbacks of the connection of the session point into the stripe */
+	if (s->remote != NULL)
+		bufferevent_setcb(s->remote, NULL, NULL, NULL, NULL);
+}
+
+/** Go on relaying the connection of the session as usual */
+static void stripe_relay(struct socks_session *s)
+{
+	s->state = SOCKS_RELAY;
+	s->splice_tried = 0;
+	bufferevent_setwatermark(s->local, EV_WRITE, 0, 0);
+	bufferevent_setcb(s->local, relay_readcb, relay_writecb, relay_eventcb, s);
+	bufferevent_setcb(s->remote, relay_readcb, relay_writecb, relay_eventcb, s);
+	bufferevent_enable(s->local, EV_READ|EV_WRITE);
+	bufferevent_enable(s->remote, EV_READ|EV_WRITE);
+
+	if (evbuffer_get_length(bufferevent_get_input(s->remote)) > 0)
+		relay_readcb(s->remote, s);
+	if (evbuffer_get_length(bufferevent_get_input(s->local)) > 0)
+		relay_readcb(s->local, s);
+}
+
+/** Ask the server for a range of the resource over a path */
+static void stripe_request(struct stripe_path *path, uint64_t from, uint64_t len)
+{
+	struct evbuffer *out = bufferevent_get_output(path->bev);
+
+	/* a server whose resource changed answers with all of it instead of the range */
+	evbuffer_add_printf(out, "%sRange: bytes=%llu-%llu\r\n",
+			path->stripe->request, (unsigned long long) from, (unsigned long long) (from + len - 1));
+	if (path->stripe->validator != NULL)
+		evbuffer_add_printf(out, "If-Range: %s\r\n", path->stripe->validator);
+	evbuffer_add(out, "\r\n", 2);
+
+	path->state = PATH_HEADER;
+	path->requested_from = from;
+	path->requested_len = len;
+	gettimeofday(&(path->requested), NULL);
+}
+
+/** Append a chunk for the next len bytes of the resource */
+static struct stripe_chunk *stripe_chunk_new(struct stripe *st, uint64_t len)
+{
+	struct stripe_chunk *c;
+
+	if ((c = malloc(sizeof(struct stripe_chunk))) == NULL)
+		return NULL;
+	memset(c, 0x00, sizeof(struct stripe_chunk));
+	if ((c->data = evbuffer_new()) == NULL)
+	{
+		free(c);
+		return NULL;
+	}
+	c->start = st->next_offset;
+	c->len = len;
+	st->next_offset += len;
+
+	if (st->last_chunk != NULL)
+		st->last_chunk->next = c;
+	else
+		st->chunks = c;
+	st->last_chunk = c;
+
+	return c;
+}
+
+/** Give an idle path the next range to fetch
+ *  The rest of a chunk left behind by a failed path comes first - new chunks are sized
+ *  so that the path needs about the same time for them, whatever its rate
+ */
+static void stripe_assign(struct stripe_path *path)
+{
+	struct stripe *st = path->stripe;
+	struct stripe_chunk *c;
+	double len;
+
+	for (c = st->chunks; c != NULL; c = c->next)
+	{
+		if (c->path == NULL && c->got < c->len)
+			break;
+	}
+
+	if (c == NULL)
+	{
+		if (st->next_offset >= st->total || st->next_offset - st->delivered >= SOCKSD_STRIPE_WINDOW)
+			return;
+
+		len = path->rate * SOCKSD_STRIPE_CHUNK_TIME;
+		if (len < SOCKSD_STRIPE_MIN_CHUNK)
+			len = SOCKSD_STRIPE_MIN_CHUNK;
+		if (len > SOCKSD_STRIPE_MAX_CHUNK)
+			len = SOCKSD_STRIPE_MAX_CHUNK;
+		if (len > st->total - st->next_offset)
+			len = st->total - st->next_offset;
+
+		if ((c = stripe_chunk_new(st, (uint64_t) len)) == NULL)
+			return;
+	}
+
+	c->path = path;
+	path->chunk = c;
+	stripe_request(path, c->start + c->got, c->len - c->got);
+}
+
+/** Let all idle paths fetch more */
+static void stripe_kick(struct stripe *st)
+{
+	int i;
+
+	for (i = 0; i < st->num_paths; i++)
+	{
+		if (st->paths[i].state == PATH_IDLE)
+			stripe_assign(&(st->paths[i]));
+	}
+}
+
+/** The download is complete - the connection goes on as a normal relayed one */
+static void stripe_finish(struct socks_session *s)
+{
+	int primary_dead = (s->stripe->paths[0].state == PATH_DEAD);
+
+	#ifdef SOCKSD_NOISY_DEBUG
+	fprintf(stderr, "worker %d: striped download of %llu bytes finished\n", log_worker, (unsigned long long) s->stripe->total);
+	#endif
+
+	stripe_free(s);
+
+	if (primary_dead)
+	{
+		s->state = SOCKS_RELAY;
+		session_finish(s, s->local);
+		return;
+	}
+
+	stripe_relay(s);
+}
+
+/** Hand the received data to the client in order
+ *
+ *  \return 1 if the download is complete, 0 otherwise
+ */
+static int stripe_deliver(struct stripe *st)
+{
+	struct socks_session *s = st->session;
+	struct evbuffer *out = bufferevent_get_output(s->local);
+	struct stripe_chunk *c;
+	size_t avail;
+
+	while ((c = st->chunks) != NULL)
+	{
+		if ((avail = evbuffer_get_length(c->data)) > 0)
+		{
+			/* wait for the client to take what it already has */
+			if (evbuffer_get_length(out) >= SOCKSD_MAX_BUFFERED)
+				return 0;
+			evbuffer_add_buffer(out, c->data);
+			st->delivered += avail;
+			s->bytes_received += avail;
+		}
+		if (c->got < c->len)
+			break;
+
+		st->chunks = c->next;
+		if (st->last_chunk == c)
+			st->last_chunk = NULL;
+		evbuffer_free(c->data);
+		free(c);
+	}
+
+	if (st->total > 0 && st->delivered >= st->total)
+	{
+		stripe_finish(s);
+		return 1;
+	}
+
+	/* delivering may have opened the window */
+	stripe_kick(st);
+	return 0;
+}
+
+/** Give up on a path - its chunk goes to the next idle path
+ *
+ *  \return 1 if the session has been closed because no path is left, 0 otherwise
+ */
+static int stripe_path_fail(struct stripe_path *path)
+{
+	struct stripe *st = path->stripe;
+	struct socks_session *s = st->session;
+	int i;
+
+	#ifdef SOCKSD_NOISY_DEBUG
+	fprintf(stderr, "worker %d: striping path %d failed\n", log_worker, (int) (path - st->paths));
+	#endif
+
+	if (path->chunk != NULL)
+	{
+		path->chunk->path = NULL;
+		path->chunk = NULL;
+	}
+	path->state = PATH_DEAD;
+
+	/* the connection of the session is closed with it */
+	if (path == &(st->paths[0]))
+		bufferevent_disable(path->bev, EV_READ|EV_WRITE);
+	else
+	{
+		bufferevent_free(path->bev);
+		path->bev = NULL;
+	}
+
+	for (i = 0; i < st->num_paths; i++)
+	{
+		if (st->paths[i].state != PATH_DEAD)
+		{
+			stripe_kick(st);
+			return 0;
+		}
+	}
+
+	fprintf(stderr, "worker %d: all striping paths failed\n", log_worker);
+	session_free(s);
+	return 1;
+}
+
+/** Open a connection to the server from one more source address */
+static void stripe_path_connect(struct stripe *st, const struct sockaddr *src, const struct sockaddr *remote, socklen_t remote_len)
+{
+	struct socks_session *s = st->session;
+	struct stripe_path *path = &(st->paths[st->num_paths]);
+	struct timeval idle = { SOCKSD_IDLE_TIMEOUT, 0 };
+	socklen_t src_len = (src->sa_family == AF_INET) ? sizeof(struct sockaddr_in) : sizeof(struct sockaddr_in6);
+	int fd;
+
+	if ((fd = socket(src->sa_family, SOCK_STREAM, 0)) < 0)
+		return;
+	evutil_make_socket_nonblocking(fd);
+	if (bind(fd, src, src_len) != 0)
+	{
+		close(fd);
+		return;
+	}
+
+	memset(path, 0x00, sizeof(struct stripe_path));
+	path->stripe = st;
+	path->state = PATH_CONNECTING;
+	if ((path->bev = bufferevent_socket_new(s->worker->base, fd, BEV_OPT_CLOSE_ON_FREE)) == NULL)
+	{
+		close(fd);
+		return;
+	}
+	bufferevent_setcb(path->bev, stripe_readcb, NULL, stripe_eventcb, path);
+	bufferevent_set_timeouts(path->bev, &idle, &idle);
+	bufferevent_enable(path->bev, EV_READ|EV_WRITE);
+
+	if (bufferevent_socket_connect(path->bev, (struct sockaddr *) remote, remote_len) != 0)
+	{
+		bufferevent_free(path->bev);
+		path->bev = NULL;
+		return;
+	}
+
+	st->num_paths++;
+}
+
+/** Check whether two socket addresses carry the same IP address */
+static int same_address(const struct sockaddr *a, const struct sockaddr *b)
+{
+	if (a->sa_family != b->sa_family)
+		return 0;
+	if (a->sa_family == AF_INET)
+		return memcmp(&(((const struct sockaddr_in *) a)->sin_addr), &(((const struct sockaddr_in *) b)->sin_addr), sizeof(struct in_addr)) == 0;
+	if (a->sa_family == AF_INET6)
+		return memcmp(&(((const struct sockaddr_in6 *) a)->sin6_addr), &(((const struct sockaddr_in6 *) b)->sin6_addr), sizeof(struct in6_addr)) == 0;
+
+	return 0;
+}
+
+/** Open additional connections to the server, one from each source address the MAM listed
+ *  except for the one the session already uses
+ */
+static void stripe_add_paths(struct stripe *st, const struct sockaddr_storage *addrs, int num_addrs)
+{
+	struct socks_session *s = st->session;
+	struct sockaddr_storage remote;
+	socklen_t remote_len = sizeof(remote);
+	int i;
+
+	if (getpeername(s->fd2, (struct sockaddr *) &remote, &remote_len) != 0)
+		return;
+
+	for (i = 0; i < num_addrs && st->num_paths < SOCKSD_STRIPE_PATHS; i++)
+	{
+		const struct sockaddr *src = (const struct sockaddr *) &(addrs[i]);
+
+		if (src->sa_family != remote.ss_family || same_address(src, (struct sockaddr *) &(s->local_out)))
+			continue;
+		if (src->sa_family == AF_INET6 && IN6_IS_ADDR_LINKLOCAL(&(((const struct sockaddr_in6 *) src)->sin6_addr)))
+			continue;
+
+		#ifdef SOCKSD_NOISY_DEBUG
+		fprintf(stderr, "worker %d: adding striping path %d\n", log_worker, st->num_paths);
+		#endif
+		stripe_path_connect(st, src, (struct sockaddr *) &remote, remote_len);
+	}
+}
+
+/** Ask the MAM which source addresses the download may be spread over */
+static void stripe_open_paths(struct stripe *st)
+{
+	struct socks_worker *w = st->session->worker;
+
+	if ((st->srcaddrs_tag = mam_request_srcaddrs(w, st->session->local_out.ss_family)) == 0)
+	{
+		#ifdef SOCKSD_NOISY_DEBUG
+		fprintf(stderr, "worker %d: MAM cannot be reached - not adding striping paths\n", log_worker);
+		#endif
+		return;
+	}
+
+	st->next_waiting = w->stripes_waiting;
+	w->stripes_waiting = st;
+}
+
+/** Hand the source addresses of a srcaddrs response to the download that asked for them */
+static void stripe_srcaddrs_dispatch(struct socks_worker *w, muacc_ctxino_t tag)
+{
+	struct stripe **pst;
+	struct stripe *st;
+
+	for (pst = &(w->stripes_waiting); (st = *pst) != NULL; pst = &(st->next_waiting))
+	{
+		if (st->srcaddrs_tag == tag)
+		{
+			*pst = st->next_waiting;
+			st->next_waiting = NULL;
+			st->srcaddrs_tag = 0;
+			stripe_add_paths(st, w->srcaddrs, w->num_srcaddrs);
+			return;
+		}
+	}
+}
+
+/** Send the client the header it would have got for its request without the range */
+static void stripe_client_header(struct stripe *st, const char *hdr)
+{
+	static const char *const replaced[] = { "Content-Range", "Content-Length", NULL };
+	struct evbuffer *out = bufferevent_get_output(st->session->local);
+	const char *line;
+	const char *next;
+
+	evbuffer_add_printf(out, "HTTP/1.1 200 OK\r\n");
+	for (line = strstr(hdr, "\r\n") + 2; strncmp(line, "\r\n", 2) != 0; line = next)
+	{
+		if ((next = strstr(line, "\r\n")) == NULL)
+			break;
+		next += 2;
+		if (!http_header_is(line, replaced))
+			evbuffer_add(out, line, next - line);
+	}
+	evbuffer_add_printf(out, "Content-Length: %llu\r\n\r\n", (unsigned long long) st->total);
+}
+
+/** Extract what identifies the version of the resource from the header of a response:
+ *  its ETag if it is a strong one, else its Last-Modified date
+ *
+ *  \return the validator, to be freed by the caller, or NULL if the response has none
+ */
+static char *stripe_validator(const char *hdr)
+{
+	const char *value;
+	const char *end;
+	char *v;
+
+	if ((value = http_header_value(hdr, "ETag")) == NULL || strncmp(value, "W/", 2) == 0)
+		value = http_header_value(hdr, "Last-Modified");
+	if (value == NULL || (end = strstr(value, "\r\n")) == NULL || end == value)
+		return NULL;
+
+	if ((v = malloc(end - value + 1)) == NULL)
+		return NULL;
+	memcpy(v, value, end - value);
+	v[end - value] = '\0';
+	return v;
+}
+
+/** Handle the header of the response to a range request
+ *
+ *  \return 0 if the body follows, 1 if the session is relayed as usual now, -1 if the path failed
+ */
+static int stripe_response(struct stripe_path *path, struct evbuffer *in, int len)
+{
+	struct stripe *st = path->stripe;
+	unsigned long long first, last, total;
+	const char *range;
+	const char *length;
+	char *hdr;
+	char *validator;
+	int ok = 0;
+
+	if ((hdr = malloc(len + 1)) == NULL)
+		return -1;
+	evbuffer_copyout(in, hdr, len);
+	hdr[len] = '\0';
+
+	validator = stripe_validator(hdr);
+	range = http_header_value(hdr, "Content-Range");
+	length = http_header_value(hdr, "Content-Length");
+	if (strncmp(hdr, "HTTP/1.", 7) == 0 && atoi(hdr + 9) == 206 &&
+		range != NULL && length != NULL && http_header_value(hdr, "Transfer-Encoding") == NULL &&
+		sscanf(range, "bytes %llu-%llu/%llu", &first, &last, &total) == 3 &&
+		first == path->requested_from && first <= last && last < total &&
+		strtoull(length, NULL, 10) == last - first + 1 &&
+		(st->total == 0 || (total == st->total && last - first + 1 == path->requested_len)))
+		ok = 1;
+
+	/* ranges of different versions of the resource must not be mixed */
+	if (ok && st->total != 0 && (st->validator == NULL) != (validator == NULL))
+		ok = 0;
+	if (ok && st->validator != NULL && strcmp(st->validator, validator) != 0)
+		ok = 0;
+
+	if (!ok)
+	{
+		free(validator);
+		free(hdr);
+		if (st->total == 0)
+		{
+			/* the server did not split the resource - hand its response to the client as it is */
+			#ifdef SOCKSD_NOISY_DEBUG
+			fprintf(stderr, "worker %d: server does not serve ranges - not striping\n", log_worker);
+			#endif
+			struct socks_session *s = st->session;
+
+			stripe_free(s);
+			stripe_relay(s);
+			return 1;
+		}
+		return -1;
+	}
+
+	if (st->total == 0)
+	{
+		/* first response - now we know how large the resource is */
+		st->total = total;
+		path->chunk->len = last + 1;
+		st->next_offset = path->chunk->len;
+		stripe_client_header(st, hdr);
+		st->validator = validator;
+		validator = NULL;
+
+		#ifdef SOCKSD_NOISY_DEBUG
+		fprintf(stderr, "worker %d: striping download of %llu bytes\n", log_worker, total);
+		#endif
+		/* without a validator, the other paths might fetch another version of the resource */
+		if (total >= SOCKSD_STRIPE_MIN_SIZE && st->validator != NULL)
+			stripe_open_paths(st);
+	}
+	free(validator);
+	free(hdr);
+
+	evbuffer_drain(in, len);
+	path->body_left = last - first + 1;
+	path->state = PATH_BODY;
+	return 0;
+}
+
+/** A path got all bytes it asked for - update its rate with what this range took */
+static void stripe_chunk_done(struct stripe_path *path)
+{
+	struct timeval now;
+	double elapsed;
+	double sample;
+
+	gettimeofday(&now, NULL);
+	elapsed = (now.tv_sec - path->requested.tv_sec) + (now.tv_usec - path->requested.tv_usec) / 1000000.0;
+	if (elapsed < 0.001)
+		elapsed = 0.001;
+	sample = path->requested_len / elapsed;
+
+	path->rate = (path->rate == 0) ? sample : 0.7 * path->rate + 0.3 * sample;
+
+	#ifdef SOCKSD_NOISY_DEBUG
+	fprintf(stderr, "worker %d: striping path %d got %llu bytes - rate now %.0f bytes/s\n", log_worker,
+			(int) (path - path->stripe->paths), (unsigned long long) path->requested_len, path->rate);
+	#endif
+
+	path->chunk->path = NULL;
+	path->chunk = NULL;
+	path->state = PATH_IDLE;
+}
+
+/** Read responses to the range requests of a path */
+static void stripe_readcb(struct bufferevent *bev, void *arg)
+{
+	struct stripe_path *path = arg;
+	struct stripe *st = path->stripe;
+	struct evbuffer *in = bufferevent_get_input(bev);
+	size_t avail;
+	int len;
+	int ret;
+
+	st->session->last_active = time(NULL);
+
+	while ((avail = evbuffer_get_length(in)) > 0)
+	{
+		if (path->state == PATH_HEADER)
+		{
+			if ((len = http_header_end(in)) == 0)
+				return;
+			if (len < 0 || (ret = stripe_response(path, in, len)) < 0)
+			{
+				stripe_path_fail(path);
+				return;
+			}
+			if (ret > 0)
+				return;
+			continue;
+		}
+
+		if (path->state != PATH_BODY)
+		{
+			/* the server sent something nobody asked for */
+			stripe_path_fail(path);
+			return;
+		}
+
+		if (avail > path->body_left)
+			avail = path->body_left;
+		evbuffer_remove_buffer(in, path->chunk->data, avail);
+		path->chunk->got += avail;
+		path->body_left -= avail;
+
+		if (path->body_left == 0)
+			stripe_chunk_done(path);
+
+		if (stripe_deliver(st))
+			return;
+	}
+}
+
+/** Handle connects, closed connections, errors and timeouts of a path */
+static void stripe_eventcb(struct bufferevent *bev, short what, void *arg)
+{
+	struct stripe_path *path = arg;
+	struct timeval idle = { SOCKSD_IDLE_TIMEOUT, 0 };
+
+	if (what & BEV_EVENT_CONNECTED)
+	{
+		path->state = PATH_IDLE;
+		bufferevent_set_timeouts(bev, &idle, &idle);
+		stripe_kick(path->stripe);
+		return;
+	}
+
+	if ((what & BEV_EVENT_TIMEOUT) && path->state == PATH_IDLE)
+	{
+		/* nothing to fetch for this path right now */
+		bufferevent_enable(bev, (what & BEV_EVENT_READING) ? EV_READ : EV_WRITE);
+		return;
+	}
+
+	if (what & BEV_EVENT_ERROR)
+	{
+		fprintf(stderr, "worker %d: i/o error on striping path: %s\n", log_worker, strerror(EVUTIL_SOCKET_ERROR()));
+	}
+
+	if (what & (BEV_EVENT_EOF|BEV_EVENT_ERROR|BEV_EVENT_TIMEOUT))
+		stripe_path_fail(path);
+}
+
+/** The client took some of the data - hand it more */
+static void stripe_writecb(struct bufferevent *bev, void *arg)
+{
+	struct socks_session *s = arg;
+
+	if (s->stripe != NULL)
+		stripe_deliver(s->stripe);
+}
+
+/** Fetch the resource requested by the client in ranges
+ *  Starts with a small range over the connection the MAM chose - its response tells
+ *  whether the server supports ranges and how large the resource is
+ *
+ *  \return 0 on success, -1 otherwise - request is released in any case
+ */
+static int stripe_start(struct socks_session *s, char *request)
+{
+	struct stripe *st;
+	struct stripe_path *path;
+	struct stripe_chunk *c;
+
+	if ((st = malloc(sizeof(struct stripe))) == NULL)
+	{
+		free(request);
+		return -1;
+	}
+	memset(st, 0x00, sizeof(struct stripe));
+	st->session = s;
+	st->request = request;
+
+	if ((c = stripe_chunk_new(st, SOCKSD_STRIPE_MIN_CHUNK)) == NULL)
+	{
+		free(request);
+		free(st);
+		return -1;
+	}
+
+	path = &(st->paths[0]);
+	path->stripe = st;
+	path->bev = s->remote;
+	path->chunk = c;
+	c->path = path;
+	st->num_paths = 1;
+
+	#ifdef SOCKSD_NOISY_DEBUG
+	fprintf(stderr, "worker %d: trying to stripe download from %s\n", log_worker, s->host);
+	#endif
+
+	s->stripe = st;
+	s->state = SOCKS_STRIPING;
+	bufferevent_disable(s->local, EV_READ);
+	bufferevent_setcb(s->local, NULL, stripe_writecb, relay_eventcb, s);
+	bufferevent_setwatermark(s->local, EV_WRITE, SOCKSD_MAX_BUFFERED / 2, 0);
+	bufferevent_setcb(s->remote, stripe_readcb, NULL, stripe_eventcb, path);
+	bufferevent_setwatermark(s->remote, EV_WRITE, 0, 0);
+
+	stripe_request(path, 0, c->len);
+	return 0;
+}
+
+/** Wait for the first request of the client to decide whether to stripe the download
+ *  Only a lone plain GET can be split into range requests
+ */
+static void stripe_peek_readcb(struct bufferevent *bev, void *arg)
+{
+	struct socks_session *s = arg;
+	struct evbuffer *in = bufferevent_get_input(bev);
+	char *hdr;
+	char *request = NULL;
+	int len;
+
+	if ((len = http_header_end(in)) == 0)
+		return;
+
+	if (len > 0 && (size_t) len == evbuffer_get_length(in) && (hdr = malloc(len + 1)) != NULL)
+	{
+		evbuffer_copyout(in, hdr, len);
+		hdr[len] = '\0';
+		request = stripe_build_request(hdr);
+		free(hdr);
+	}
+
+	if (request != NULL && stripe_start(s, request) == 0)
+	{
+		s->bytes_sent += len;
+		evbuffer_drain(in, len);
+		return;
+	}
+
+	/* relay the request as it is */
+	s->splice_tried = 0;
+	bufferevent_setcb(s->local, relay_readcb, relay_writecb, relay_eventcb, s);
+	relay_readcb(s->local, s);
+}
+
+/** Hand a new client connection to the SOCKS state machine */
+static void do_accept(struct evconnlistener *listener, evutil_socket_t fd, struct sockaddr *sa, int salen, void *arg)
+{
+	struct socks_worker *worker = arg;
+	struct socks_session *s;
+	struct timeval handshake = { SOCKSD_HANDSHAKE_TIMEOUT, 0 };
+
+	#ifdef SOCKSD_NOISY_DEBUG
+    char abuf[INET6_ADDRSTRLEN];
+	char pbuf[NI_MAXSERV];
+    getnameinfo( sa, salen, abuf, sizeof(abuf)-1, pbuf, sizeof(pbuf)-1, NI_NUMERICHOST|NI_NUMERICSERV);
+    fprintf(stderr, "worker %d: handling connection from %s port %s\n", worker->id, abuf, pbuf);
+	#endif
+
+	if ((s = malloc(sizeof(struct socks_session))) == NULL)
+	{
+		perror("master: session malloc error");
+		evutil_closesocket(fd);
+		return;
+	}
+	memset(s, 0x00, sizeof(struct socks_session));
+	s->worker = worker;
+	s->state = SOCKS_AUTH;
+	s->fd2 = -1;
+
+	if ((s->local = bufferevent_socket_new(worker->base, fd, BEV_OPT_CLOSE_ON_FREE)) == NULL)
+	{
+		evutil_closesocket(fd);
+		free(s);
+		return;
+	}
+	bufferevent_setcb(s->local, local_readcb, NULL, relay_eventcb, s);
+	bufferevent_set_timeouts(s->local, &handshake, &handshake);
+	bufferevent_enable(s->local, EV_READ|EV_WRITE);
+}
+
+/** event loop of a worker thread */
+static void *worker_main(void *arg)
+{
+	struct socks_worker *worker = arg;
+
+	log_worker = worker->id;
+	event_base_dispatch(worker->base);
+
+	return NULL;
+}
+
+static void usage(const char *name)
+{
+	fprintf(stderr, "usage: %s [-w workers] [-p port] [-s]\n", name);
+}
+
+int
+main(int c, char **v)
+{
+    struct sockaddr_in6	sin = {0};
+    int listener = -1;
+    int one  = 1;
+    int zero = 0;
+	int port = 9050;
+	int num_workers = 0;
+	int opt;
+	int i;
+	struct socks_worker *workers = NULL;
+
+    /* some debug output in master */
+    #ifdef SOCKSD_NOISY_DEBUG
+    char hbuf[NI_MAXHOST];
+    char abuf[INET6_ADDRSTRLEN];
+    #endif
+    
+    setvbuf(stderr, NULL, _IONBF, 0);
+
+	while ((opt = getopt(c, v, "w:p:s")) != -1)
+	{
+		switch (opt)
+		{
+			case 'w':
+				num_workers = atoi(optarg);
+				break;
+			case 'p':
+				port = atoi(optarg);
+				break;
+			case 's':
+				stripe_enabled = 1;
+				break;
+			default:
+				usage(v[0]);
+				exit(1);
+		}
+	}
+
+	/* one event loop per core by default */
+	if (num_workers <= 0)
+		num_workers = sysconf(_SC_NPROCESSORS_ONLN);
+	if (num_workers <= 0)
+		num_workers = 1;
+
+	/* peers closing their connection must not kill us */
+	signal(SIGPIPE, SIG_IGN);
+    
+	/* set up v6 socket */
+    sin.sin6_family = AF_INET6;
+	#ifdef HAVE_SOCKADDR_LEN
+	sin.sin6_len = sizeof(sin);
+	#endif
+    sin.sin6_addr = in6addr_any;
+    sin.sin6_port = htons(port);
+
+    listener = socket(AF_INET6, SOCK_STREAM, 0);
+    
+    setsockopt(listener, IPPROTO_IPV6, IPV6_V6ONLY, &zero, sizeof(zero));
     setsockopt(listener, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
 	
 	#ifdef SOCKSD_NOISY_DEBUG
@@ -595,7 +2707,7 @@ main(int c, char **v)
 	#ifdef SOCKSD_NOISY_DEBUG
 	fprintf(stderr, "master: trying to listen: ");
 	#endif
-	if( listen(listener, 16) == 0 ) {
+	if( listen(listener, SOCKSD_BACKLOG) == 0 ) {
 		#ifdef SOCKSD_NOISY_DEBUG
         fprintf(stderr, "ok\n");
 		#endif
@@ -603,12 +2715,43 @@ main(int c, char **v)
         perror("failed to listen");
         exit(1);
     }
+	evutil_make_socket_nonblocking(listener);
+
+	/* every worker accepts from the shared listening socket */
+	if ((workers = calloc(num_workers, sizeof(struct socks_worker))) == NULL)
+	{
+		perror("master: worker calloc error");
+		exit(1);
+	}
+	for (i = 0; i < num_workers; i++)
+	{
+		workers[i].id = i;
+		if ((workers[i].base = event_base_new()) == NULL ||
+			(workers[i].dns_base = evdns_base_new(workers[i].base, 1)) == NULL ||
+			(workers[i].listener = evconnlistener_new(workers[i].base, do_accept, &workers[i], LEV_OPT_CLOSE_ON_EXEC, 0, listener)) == NULL)
+		{
+			fprintf(stderr, "master: setting up worker %d failed\n", i);
+			exit(1);
+		}
+	}
     
 	#ifdef SOCKSD_NOISY_DEBUG
-    fprintf(stderr, "master: start accepting clients...\n");
+    fprintf(stderr, "master: start accepting clients with %d workers...\n", num_workers);
 	#endif
-    while( (ret = do_accept(listener)) == 0 )
-       ;;
-    
-	return(ret);
+	for (i = 1; i < num_workers; i++)
+	{
+		if (pthread_create(&(workers[i].thread), NULL, worker_main, &workers[i]) != 0)
+		{
+			fprintf(stderr, "master: starting worker %d failed\n", i);
+			exit(1);
+		}
+	}
+
+	/* the main thread serves as worker 0 */
+	worker_main(&workers[0]);
+
+	for (i = 1; i < num_workers; i++)
+		pthread_join(workers[i].thread, NULL);
+
+	return(0);
 }
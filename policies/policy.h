@@ -24,3 +24,24 @@ int on_resolve_request(request_context_t *rctx, struct event_base *base);
 int on_connect_request(request_context_t *rctx, struct event_base *base);
 int on_socketconnect_request(request_context_t *rctx, struct event_base *base);
 int on_socketchoose_request(request_context_t *rctx, struct event_base *base);
+
+/** Optional: set to a non-zero value if the callbacks above may be invoked
+ *  from several worker threads at once (mamma -w). Otherwise new clients are
+ *  served from the main event loop and policy calls are serialized.
+ */
+extern int policy_threadsafe;
+
+/** Optional: set up / tear down the per-worker policy context (worker->policy_data)
+ *  Called for each worker after init() and before cleanup()
+ */
+int init_worker(mam_context_t *mctx, mam_worker_t *worker);
+int cleanup_worker(mam_context_t *mctx, mam_worker_t *worker);
+
+/** Optional: follow changes of the prefix list (see MAM_PREFIX_* in mam.h)
+ *  Invoked with the prefix for MAM_PREFIX_ADDED, _REMOVED and _CHANGED, and with
+ *  NULL when a batch of changes starts or is done. New prefixes are reported
+ *  configured, right before MAM_PREFIX_UPDATE_DONE. The policy_info of the other
+ *  prefixes is kept. Policies without it are cleaned up and initialized again
+ *  around each batch of changes.
+ */
+int on_prefix_change(mam_context_t *mctx, struct src_prefix_list *pfx, int event);
@@ -6,108 +6,40 @@
 
 #include "policy.h"
 #include "policy_util.h"
-
-/* Per-prefix info about filesize range */
-struct filesize_info {
-	int 		minfilesize;
-	int			maxfilesize;
-	int			is_default;
-};
-
-GSList *in4_enabled = NULL;
-GSList *in6_enabled = NULL;
-
-char addr_str[INET6_ADDRSTRLEN];	/** string for debug / error printing */
-
-void print_policy_info(void *policy_info)
-{
-	struct filesize_info *info = policy_info;
-	printf("\t(for filesize %6d =< n =< %6d)", info->minfilesize, info->maxfilesize);
-	if (info->is_default)
-		printf(" (default)");
-}
-
-void set_policy_info(gpointer elem, gpointer data)
-{
-	struct src_prefix_list *spl = elem;
-
-	struct filesize_info *new = malloc(sizeof(struct filesize_info));
-	memset(new, 0, sizeof(struct filesize_info));
-	new->maxfilesize = INT_MAX;
-
-	if (spl->policy_set_dict != NULL)
-	{
-		/* Set filesize from config file */
-		gpointer value = NULL;
-		if ((value = g_hash_table_lookup(spl->policy_set_dict, "minfilesize")) != NULL)
-			new->minfilesize = atoi(value);
-		if ((value = g_hash_table_lookup(spl->policy_set_dict, "maxfilesize")) != NULL)
-			new->maxfilesize = atoi(value);
-		if (((value = g_hash_table_lookup(spl->policy_set_dict, "default")) != NULL) && value)
-            new->is_default = 1;
-	}
-
-	spl->policy_info = (void *) new;
-}
-
-void freepolicyinfo(gpointer elem, gpointer data)
-{
-	struct src_prefix_list *spl = elem;
-
-	if(spl->policy_info != NULL)
-		free(spl->policy_info);
-}
+#include "policy_table.h"
 
 static void set_sa_for_filesize(request_context_t *rctx, int filesize, strbuf_t sb)
 {
-	GSList *elem = NULL;
-	struct src_prefix_list *spl = NULL;
-	struct src_prefix_list *defaultaddr = NULL;
+	policy_table_t *table = policy_table_get();
+	const struct policy_table_family *fam = policy_table_family(table, rctx->ctx->domain);
+	int choice;
 
-	if (rctx->ctx->domain == AF_INET)
-		elem = in4_enabled;
-	else if (rctx->ctx->domain == AF_INET6)
-		elem = in6_enabled;
-
-	while (elem != NULL)
+	if ((choice = policy_table_filesize(fam, filesize)) >= 0)
 	{
-		spl = elem->data;
-		struct filesize_info *info = spl->policy_info;
-
-		if (info->minfilesize <= filesize && info->maxfilesize >= filesize)
-		{
-			/* Filesizes falls within this prefixes' configuration: Set source address */
-			set_bind_sa(rctx, spl, &sb);
-			strbuf_printf(&sb, " for filesize %d", filesize);
-			break;
-		}
-		if (info->is_default)
-		{
-			/* This prefix is default. Store it for eventual fallback. */
-			defaultaddr = spl;
-		}
-		elem = elem->next;
+		/* Filesizes falls within this prefixes' configuration: Set source address */
+		policy_table_set_bind_sa(rctx, table, choice, &sb);
+		strbuf_printf(&sb, " for filesize %d", filesize);
 	}
-
-	if (elem == NULL)
+	else
 	{
 		if (filesize > 0)
 			strbuf_printf(&sb, "\n\tCould not find suitable address for filesize %d", filesize);
-		if (defaultaddr != NULL)
+		if (fam != NULL && fam->default_choice >= 0)
 		{
-			set_bind_sa(rctx, defaultaddr, &sb);
+			policy_table_set_bind_sa(rctx, table, fam->default_choice, &sb);
 			strbuf_printf(&sb, " (default)");
 		}
 	}
+
+	policy_table_put(table);
 }
 
 int init(mam_context_t *mctx)
 {
 	printf("\nPolicy module \"filesize\" is loading.\n");
 
-	g_slist_foreach(mctx->prefixes, &set_policy_info, NULL);
-
-	make_v4v6_enabled_lists (mctx->prefixes, &in4_enabled, &in6_enabled);
+	if (policy_table_load(mctx) != 0)
+		return -1;
 
 	printf("\nPolicy module \"filesize\" has been loaded.\n");
 
@@ -116,9 +48,7 @@ int init(mam_context_t *mctx)
 
 int cleanup(mam_context_t *mctx)
 {
-	g_slist_free(in4_enabled);
-	g_slist_free(in6_enabled);
-	g_slist_foreach(mctx->prefixes, &freepolicyinfo, NULL);
+	policy_table_unload();
 	printf("\nPolicy module \"filesize\" cleaned up.\n");
 	return 0;
 }
@@ -41,7 +41,7 @@ int init(mam_context_t *mctx)
 {
 	printf("\nPolicy module \"naive round robin\" is loading.\n");
 
-	make_v4v6_enabled_lists (mctx->prefixes, &in4_enabled, &in6_enabled);
+	make_v4v6_enabled_lists (mctx, &in4_enabled, &in6_enabled);
 
 	// Let last element point to first element again to form a circular list
 	if (in4_enabled != NULL)
@@ -43,7 +43,7 @@ int init(mam_context_t *mctx)
 {
 	printf("\nPolicy module \"pipelining round robin\" is loading.\n");
 
-	make_v4v6_enabled_lists (mctx->prefixes, &in4_enabled, &in6_enabled);
+	make_v4v6_enabled_lists (mctx, &in4_enabled, &in6_enabled);
 
 	// Let last element point to first element again to form a circular list
 	if (in4_enabled != NULL)
@@ -103,7 +103,7 @@ static void resolve_request_result_connect(int errcode, struct evutil_addrinfo *
 	 
 		assert(addr != NULL);   
 		assert(rctx->ctx->remote_addrinfo_res == NULL);
-		rctx->ctx->remote_addrinfo_res = _muacc_clone_addrinfo(addr);
+		rctx->ctx->remote_addrinfo_res = addr;
 		print_addrinfo_response (rctx->ctx->remote_addrinfo_res);
 
 		// Choose first result as the remote address
@@ -113,9 +113,6 @@ static void resolve_request_result_connect(int errcode, struct evutil_addrinfo *
 		rctx->ctx->remote_sa_len = addr->ai_addrlen;
 		rctx->ctx->remote_sa = _muacc_clone_sockaddr(addr->ai_addr, addr->ai_addrlen);
 
-		// free libevent addrinfo
-		evutil_freeaddrinfo(addr);
-
 		// Find local address for destination
 		strbuf_printf(&sb, "\tDestination address =");
 		_muacc_print_sockaddr(&sb, rctx->ctx->remote_sa, rctx->ctx->remote_sa_len);
@@ -158,21 +155,12 @@ static void resolve_request_result_connect(int errcode, struct evutil_addrinfo *
  */
 int on_socketconnect_request(request_context_t *rctx, struct event_base *base)
 {
-    struct evdns_getaddrinfo_request *req;
-	
 	printf("\tSocketconnect request: %s:%s", (rctx->ctx->remote_hostname == NULL ? "" : rctx->ctx->remote_hostname), (rctx->ctx->remote_service == NULL ? "" : rctx->ctx->remote_service));
 
-	/* Try to resolve this request using asynchronous lookup */
-    req = evdns_getaddrinfo(
-    		rctx->mctx->evdns_default_base, 
-			rctx->ctx->remote_hostname,
-			rctx->ctx->remote_service,
-            rctx->ctx->remote_addrinfo_hint,
-			&resolve_request_result_connect,
-			rctx);
-	printf(" - Sending request to default nameserver\n");
-    if (req == NULL) {
-		/* returned immediately - Send reply to the client */
+	/* Try to resolve this request using the DNS cache of the MAM */
+	printf(" - Resolving using the DNS cache\n");
+	if (resolve_cached(rctx, NULL, &resolve_request_result_connect) != 0) {
+		/* could not resolve - Send reply to the client */
 		_muacc_send_ctx_event(rctx, muacc_act_getaddrinfo_resolve_resp);
 		printf("\tRequest failed.\n");
 	}
@@ -184,8 +172,6 @@ int on_socketconnect_request(request_context_t *rctx, struct event_base *base)
  */
 int on_socketchoose_request(request_context_t *rctx, struct event_base *base)
 {
-    struct evdns_getaddrinfo_request *req;
-
 	printf("\n\tSocketchoose request\n");
 
 	if (rctx->sockets != NULL && rctx->sockets->next != NULL)
@@ -241,17 +227,10 @@ int on_socketchoose_request(request_context_t *rctx, struct event_base *base)
 	{
 		printf("\tSocketchoose with empty or almost empty set - trying to create new socket, resolving %s:%s\n", (rctx->ctx->remote_hostname == NULL ? "" : rctx->ctx->remote_hostname), (rctx->ctx->remote_service == NULL ? "" : rctx->ctx->remote_service));
 
-		/* Try to resolve this request using asynchronous lookup */
-		req = evdns_getaddrinfo(
-    		rctx->mctx->evdns_default_base, 
-			rctx->ctx->remote_hostname,
-			rctx->ctx->remote_service,
-            rctx->ctx->remote_addrinfo_hint,
-			&resolve_request_result_connect,
-			rctx);
-		printf(" - Sending request to default nameserver\n");
-		if (req == NULL) {
-			/* returned immediately - Send reply to the client */
+		/* Try to resolve this request using the DNS cache of the MAM */
+		printf(" - Resolving using the DNS cache\n");
+		if (resolve_cached(rctx, NULL, &resolve_request_result_connect) != 0) {
+			/* could not resolve - Send reply to the client */
 			_muacc_send_ctx_event(rctx, muacc_act_getaddrinfo_resolve_resp);
 			printf("\tRequest failed.\n");
 		}
@@ -4,103 +4,50 @@
  *  \copyright Copyright 2013-2015 Philipp Schmidt, Theresa Enghardt, and Mirko Palmer.
  *  All rights reserved. This project is released under the New BSD License.
  *
- *  Policy_info: Whether interface has been specified as default in the config file
- *               (e.g. set default = 1 in the prefix statement)
+ *  Configuration: Whether interface has been specified as default in the config file
+ *                 (e.g. set default = 1 in the prefix statement), compiled into a policy_table
  *  Behavior:
- *  Getaddrinfo - Resolve names using the default dns_base from the MAM context
+ *  Getaddrinfo - Resolve names using the DNS cache of the MAM context
  *  Connect     - Choose the default interface if available
+ *
+ *  The policy only reads its state after init(), so it is thread-safe.
  */
 
 #include "policy.h"
 #include "policy_util.h"
+#include "policy_table.h"
 
-/** Policy-specific per-prefix data structure that contains additional information */
-struct sample_info {
-	int is_default;
-};
-
-/** List of enabled addresses for each address family */
-GSList *in4_enabled = NULL;
-GSList *in6_enabled = NULL;
-
-/** Helper to set the policy information for each prefix
- *  Here, check if this prefix has been configured as default
- */
-void set_policy_info(gpointer elem, gpointer data)
-{
-	struct src_prefix_list *spl = elem;
-
-	struct sample_info *new = malloc(sizeof(struct sample_info));
-	new->is_default = 0;
-
-	if (spl->policy_set_dict != NULL)
-	{
-		gpointer value = NULL;
-		if (((value = g_hash_table_lookup(spl->policy_set_dict, "default")) != NULL) && value )
-			new->is_default = 1;
-	}
-	spl->policy_info = new;
-}
-
-/** Helper to print additional information given to the policy
- */
-void print_policy_info(void *policy_info)
-{
-	struct sample_info *info = policy_info;
-	if (info->is_default)
-		printf(" (default)");
-}
-
-void freepolicyinfo(gpointer elem, gpointer data)
-{
-	struct src_prefix_list *spl = elem;
-
-	if (spl->policy_info != NULL)
-		free(spl->policy_info);
-
-	spl->policy_info = NULL;
-}
+/** Callbacks may run on several workers at once */
+int policy_threadsafe = 1;
 
 /** Helper to set the source address to the default interface,
  *  if any exists for the requested address family
  */
 static void set_sa_if_default(request_context_t *rctx, strbuf_t sb)
 {
-	GSList *spl = NULL;
-	struct src_prefix_list *cur = NULL;
-	struct sample_info *info = NULL;
-
-	if (rctx->ctx->domain == AF_INET)
-		spl = in4_enabled;
-	else if (rctx->ctx->domain == AF_INET6)
-		spl = in6_enabled;
+	policy_table_t *table = policy_table_get();
+	const struct policy_table_family *fam = policy_table_family(table, rctx->ctx->domain);
 
-	while (spl != NULL)
+	if (fam != NULL && fam->default_choice >= 0)
 	{
-		cur = spl->data;
-		info = (struct sample_info *)cur->policy_info;
-		if (info != NULL && info->is_default)
-		{
-			/* This prefix is configured as default. Set source address */
-			set_bind_sa(rctx, cur, &sb);
-			strbuf_printf(&sb, " (default)");
-			break;
-		}
-		spl = spl->next;
+		/* A prefix is configured as default. Set source address */
+		policy_table_set_bind_sa(rctx, table, fam->default_choice, &sb);
+		strbuf_printf(&sb, " (default)");
 	}
+
+	policy_table_put(table);
 }
 
 /** Initializer function (mandatory)
  *  Is called once the policy is loaded and every time it is reloaded
- *  Typically sets the policy_info and initializes the lists of candidate addresses
+ *  Typically compiles the configuration of the prefixes into a policy_table
  */
 int init(mam_context_t *mctx)
 {
 	printf("Policy module \"sample\" is loading.\n");
 
-	g_slist_foreach(mctx->prefixes, &set_policy_info, NULL);
-
-	make_v4v6_enabled_lists (mctx->prefixes, &in4_enabled, &in6_enabled);
+	if (policy_table_load(mctx) != 0)
+		return -1;
 
 	printf("\nPolicy module \"sample\" has been loaded.\n");
 	return 0;
@@ -108,18 +55,27 @@ int init(mam_context_t *mctx)
 
 /** Cleanup function (mandatory)
  *  Is called once the policy is torn down, e.g. if MAM is terminates
- *  Tear down lists of candidate addresses (no deep free) and policy infos
+ *  Releases the policy_table
  */
 int cleanup(mam_context_t *mctx)
 {
-	g_slist_free(in4_enabled);
-	g_slist_free(in6_enabled);
-	g_slist_foreach(mctx->prefixes, &freepolicyinfo, NULL);
+	policy_table_unload();
 
 	printf("Policy sample library cleaned up.\n");
 	return 0;
 }
 
+/** Prefix change function (optional)
+ *  Is called for changes of the prefix list while the policy is loaded
+ *  Compiles a new policy_table once all changes are applied
+ */
+int on_prefix_change(mam_context_t *mctx, struct src_prefix_list *pfx, int event)
+{
+	if (event == MAM_PREFIX_UPDATE_DONE)
+		return policy_table_load(mctx);
+	return 0;
+}
+
 /** Asynchronous callback function for resolve request
  *  Invoked once a response to the resolver query has been received
  *  Sends back a reply to the client with the received answer
@@ -140,8 +96,7 @@ static void resolve_request_result(int errcode, struct evutil_addrinfo *addr, vo
 		
 		assert(addr != NULL);  
 		assert(rctx->ctx->remote_addrinfo_res == NULL);
-		rctx->ctx->remote_addrinfo_res = _muacc_clone_addrinfo(addr);
-		evutil_freeaddrinfo(addr);
+		rctx->ctx->remote_addrinfo_res = addr;
 		print_addrinfo_response (rctx->ctx->remote_addrinfo_res);
 	}
 
@@ -155,21 +110,12 @@ static void resolve_request_result(int errcode, struct evutil_addrinfo *addr, vo
  */
 int on_resolve_request(request_context_t *rctx, struct event_base *base)
 {
-    struct evdns_getaddrinfo_request *req;
-	
 	printf("\tResolve request: %s:%s", (rctx->ctx->remote_hostname == NULL ? "" : rctx->ctx->remote_hostname), (rctx->ctx->remote_service == NULL ? "" : rctx->ctx->remote_service));
 
-	/* Try to resolve this request using asynchronous lookup */
-    req = evdns_getaddrinfo(
-    		rctx->mctx->evdns_default_base, 
-			rctx->ctx->remote_hostname,
-			rctx->ctx->remote_service,
-            rctx->ctx->remote_addrinfo_hint,
-			&resolve_request_result,
-			rctx);
-	printf(" - Sending request to default nameserver\n");
-    if (req == NULL) {
-		/* returned immediately - Send reply to the client */
+	/* Try to resolve this request using the DNS cache of the MAM */
+	printf(" - Resolving using the DNS cache\n");
+	if (resolve_cached(rctx, NULL, &resolve_request_result) != 0) {
+		/* could not resolve - Send reply to the client */
 		_muacc_send_ctx_event(rctx, muacc_act_socketconnect_resp);
 		printf("\tRequest failed.\n");
 	}
@@ -229,7 +175,7 @@ static void resolve_request_result_connect(int errcode, struct evutil_addrinfo *
 	 
 		assert(addr != NULL);   
 		assert(rctx->ctx->remote_addrinfo_res == NULL);
-		rctx->ctx->remote_addrinfo_res = _muacc_clone_addrinfo(addr);
+		rctx->ctx->remote_addrinfo_res = addr;
 		print_addrinfo_response (rctx->ctx->remote_addrinfo_res);
 
 		// Choose first result as the remote address
@@ -239,9 +185,6 @@ static void resolve_request_result_connect(int errcode, struct evutil_addrinfo *
 		rctx->ctx->remote_sa_len = addr->ai_addrlen;
 		rctx->ctx->remote_sa = _muacc_clone_sockaddr(addr->ai_addr, addr->ai_addrlen);
 
-		// free libevent addrinfo
-		evutil_freeaddrinfo(addr);
-
 		// Find local address for destination
 		strbuf_printf(&sb, "\tDestination address =");
 		_muacc_print_sockaddr(&sb, rctx->ctx->remote_sa, rctx->ctx->remote_sa_len);
@@ -288,21 +231,12 @@ static void resolve_request_result_connect(int errcode, struct evutil_addrinfo *
  */
 int on_socketconnect_request(request_context_t *rctx, struct event_base *base)
 {
-    struct evdns_getaddrinfo_request *req;
-	
 	printf("\tSocketconnect request: %s:%s", (rctx->ctx->remote_hostname == NULL ? "" : rctx->ctx->remote_hostname), (rctx->ctx->remote_service == NULL ? "" : rctx->ctx->remote_service));
 
-	/* Try to resolve this request using asynchronous lookup */
-    req = evdns_getaddrinfo(
-    		rctx->mctx->evdns_default_base, 
-			rctx->ctx->remote_hostname,
-			rctx->ctx->remote_service,
-            rctx->ctx->remote_addrinfo_hint,
-			&resolve_request_result_connect,
-			rctx);
-	printf(" - Sending request to default nameserver\n");
-    if (req == NULL) {
-		/* returned immediately - Send reply to the client */
+	/* Try to resolve this request using the DNS cache of the MAM */
+	printf(" - Resolving using the DNS cache\n");
+	if (resolve_cached(rctx, NULL, &resolve_request_result_connect) != 0) {
+		/* could not resolve - Send reply to the client */
 		_muacc_send_ctx_event(rctx, muacc_act_getaddrinfo_resolve_resp);
 		printf("\tRequest failed.\n");
 	}
@@ -316,8 +250,6 @@ int on_socketconnect_request(request_context_t *rctx, struct event_base *base)
  */
 int on_socketchoose_request(request_context_t *rctx, struct event_base *base)
 {
-    struct evdns_getaddrinfo_request *req;
-	
 	printf("\tSocketchoose request: %s:%s", (rctx->ctx->remote_hostname == NULL ? "" : rctx->ctx->remote_hostname), (rctx->ctx->remote_service == NULL ? "" : rctx->ctx->remote_service));
 
 	if (rctx->sockets != NULL)
@@ -336,17 +268,10 @@ int on_socketchoose_request(request_context_t *rctx, struct event_base *base)
 	{
 		printf("\tSocketchoose with empty set - trying to create new socket, resolving %s\n", (rctx->ctx->remote_hostname == NULL ? "" : rctx->ctx->remote_hostname));
 
-		/* Try to resolve this request using asynchronous lookup */
-		req = evdns_getaddrinfo(
-    		rctx->mctx->evdns_default_base, 
-			rctx->ctx->remote_hostname,
-			rctx->ctx->remote_service,
-            rctx->ctx->remote_addrinfo_hint,
-			&resolve_request_result_connect,
-			rctx);
-		printf(" - Sending request to default nameserver\n");
-		if (req == NULL) {
-			/* returned immediately - Send reply to the client */
+		/* Try to resolve this request using the DNS cache of the MAM */
+		printf(" - Resolving using the DNS cache\n");
+		if (resolve_cached(rctx, NULL, &resolve_request_result_connect) != 0) {
+			/* could not resolve - Send reply to the client */
 			_muacc_send_ctx_event(rctx, muacc_act_getaddrinfo_resolve_resp);
 			printf("\tRequest failed.\n");
 		}
@@ -0,0 +1,406 @@
+/** \file policy_table.c
+ *
+ *  \copyright Copyright 2013-2015 Philipp Schmidt, Theresa Enghardt, and Mirko Palmer.
+ *  All rights reserved. This project is released under the New BSD License.
+ */
+
+#include <limits.h>
+#include <pthread.h>
+
+#include "clib/dlog.h"
+#include "clib/strbuf.h"
+
+#include "policy_table.h"
+#include "policy_util.h"
+
+#ifndef POLICY_TABLE_NOISY_DEBUG
+#define POLICY_TABLE_NOISY_DEBUG 0
+#endif
+
+/** Configured filesize range of a prefix */
+struct filesize_range {
+	int		min;
+	int		max;
+	int		choice;
+};
+
+/** Table currently used by the policy */
+static policy_table_t *current = NULL;
+static pthread_mutex_t current_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/** Map a configuration string to an intent enum value, -1 if it is unknown */
+static int _policy_table_parse(const char *value, const char **names, int num_names)
+{
+	int i;
+
+	for (i = 0; i < num_names; i++)
+		if (strcmp(value, names[i]) == 0)
+			return i;
+
+	return -1;
+}
+
+static const char *category_names[] = { "query", "bulktransfer", "controltraffic", "keepalives", "stream" };
+static const char *timeliness_names[] = { "streaming", "interactive", "transfer", "backgroundtraffic" };
+static const char *resilience_names[] = { "sensitive", "tolerant", "resilient" };
+
+const char *policy_table_category_name(int category)
+{
+	if (category < 0 || category > INTENT_STREAM)
+		return NULL;
+	return category_names[category];
+}
+
+/** Remember the first prefix configured for an intent value */
+static void _policy_table_set_intent(GHashTable *dict, const char *key, const char **names, int num_names, int *entries, int choice)
+{
+	gpointer value;
+	int intent;
+
+	if ((value = g_hash_table_lookup(dict, key)) == NULL)
+		return;
+
+	if ((intent = _policy_table_parse(value, names, num_names)) < 0)
+	{
+		printf("WARNING: Cannot set invalid %s %s\n", key, (char *) value);
+		return;
+	}
+
+	if (entries[intent] < 0)
+		entries[intent] = choice;
+}
+
+static int _policy_table_cmp_int(const void *a, const void *b)
+{
+	int x = *((const int *) a);
+	int y = *((const int *) b);
+
+	return (x > y) - (x < y);
+}
+
+/** Flatten the (possibly overlapping) filesize ranges into sorted, disjoint segments
+ *  Each segment gets the range that comes first in the configuration
+ */
+static int _policy_table_build_segments(struct policy_table_family *fam, struct filesize_range *ranges, int num_ranges)
+{
+	int *bounds;
+	int num_bounds = 0;
+	int i, j;
+
+	if (num_ranges == 0)
+		return 0;
+
+	if ((bounds = malloc(2 * num_ranges * sizeof(int))) == NULL)
+		return -1;
+
+	for (i = 0; i < num_ranges; i++)
+	{
+		if (ranges[i].max < ranges[i].min)
+			continue;
+		bounds[num_bounds++] = ranges[i].min;
+		if (ranges[i].max < INT_MAX)
+			bounds[num_bounds++] = ranges[i].max + 1;
+	}
+	qsort(bounds, num_bounds, sizeof(int), &_policy_table_cmp_int);
+
+	fam->segment_start = malloc(num_bounds * sizeof(int));
+	fam->segment_choice = malloc(num_bounds * sizeof(int));
+	if (num_bounds > 0 && (fam->segment_start == NULL || fam->segment_choice == NULL))
+	{
+		free(bounds);
+		return -1;
+	}
+
+	for (i = 0; i < num_bounds; i++)
+	{
+		int choice = -1;
+
+		if (i > 0 && bounds[i] == bounds[i-1])
+			continue;
+
+		for (j = 0; j < num_ranges; j++)
+		{
+			if (ranges[j].min <= bounds[i] && bounds[i] <= ranges[j].max)
+			{
+				choice = ranges[j].choice;
+				break;
+			}
+		}
+
+		/* merge with the previous segment if the decision does not change */
+		if (fam->num_segments > 0 && fam->segment_choice[fam->num_segments - 1] == choice)
+			continue;
+
+		fam->segment_start[fam->num_segments] = bounds[i];
+		fam->segment_choice[fam->num_segments] = choice;
+		fam->num_segments++;
+	}
+
+	free(bounds);
+	return 0;
+}
+
+/** Print the addresses of one address family of the table */
+static void _policy_table_print_family(const policy_table_t *table, const struct policy_table_family *fam, int family)
+{
+	char addr_str[INET6_ADDRSTRLEN];
+	int i, found = 0;
+
+	for (i = 0; i < table->num_choices; i++)
+	{
+		const struct policy_table_choice *c = &(table->choices[i]);
+
+		if (c->addr->sa_family != family)
+			continue;
+
+		if (family == AF_INET)
+			inet_ntop(AF_INET, &(((struct sockaddr_in *) c->addr)->sin_addr), addr_str, sizeof(addr_str));
+		else
+			inet_ntop(AF_INET6, &(((struct sockaddr_in6 *) c->addr)->sin6_addr), addr_str, sizeof(addr_str));
+		printf("\n\t\t%s (%s)%s", addr_str, c->if_name, (i == fam->default_choice) ? " (default)" : "");
+		found = 1;
+	}
+
+	if (!found)
+		printf("\n\t\t(none)");
+}
+
+/** Print the addresses the table chooses from, like make_v4v6_enabled_lists() */
+static void _policy_table_print(const policy_table_t *table)
+{
+	printf("Configured addresses:");
+	printf("\n\tAF_INET: ");
+	_policy_table_print_family(table, &(table->in4), AF_INET);
+	printf("\n\tAF_INET6: ");
+	_policy_table_print_family(table, &(table->in6), AF_INET6);
+	printf("\n");
+}
+
+/** Compile the decisions for all enabled prefixes of one address family */
+static int _policy_table_compile_family(policy_table_t *table, struct policy_table_family *fam, mam_context_t *mctx, int family)
+{
+	GSList *enabled = mam_enabled_prefixes(mctx, family);
+	GSList *elem;
+	struct filesize_range *ranges;
+	int num_ranges = 0;
+	int ret;
+
+	fam->default_choice = -1;
+	memset(fam->category, 0xff, sizeof(fam->category));
+	memset(fam->timeliness, 0xff, sizeof(fam->timeliness));
+	memset(fam->resilience, 0xff, sizeof(fam->resilience));
+
+	if ((ranges = malloc((g_slist_length(enabled) + 1) * sizeof(struct filesize_range))) == NULL)
+		return -1;
+
+	for (elem = enabled; elem != NULL; elem = elem->next)
+	{
+		struct src_prefix_list *spl = elem->data;
+		struct policy_table_choice *c = &(table->choices[table->num_choices]);
+		gpointer value;
+
+		if (spl->if_addrs == NULL)
+			continue;
+
+		c->if_name = _muacc_clone_string(spl->if_name);
+		c->addr = _muacc_clone_sockaddr(spl->if_addrs->addr, spl->if_addrs->addr_len);
+		c->addr_len = spl->if_addrs->addr_len;
+
+		ranges[num_ranges].min = 0;
+		ranges[num_ranges].max = INT_MAX;
+		ranges[num_ranges].choice = table->num_choices;
+
+		if (spl->policy_set_dict != NULL)
+		{
+			if ((value = g_hash_table_lookup(spl->policy_set_dict, "minfilesize")) != NULL)
+				ranges[num_ranges].min = atoi(value);
+			if ((value = g_hash_table_lookup(spl->policy_set_dict, "maxfilesize")) != NULL)
+				ranges[num_ranges].max = atoi(value);
+
+			_policy_table_set_intent(spl->policy_set_dict, "category", category_names, INTENT_STREAM + 1, fam->category, table->num_choices);
+			_policy_table_set_intent(spl->policy_set_dict, "timeliness", timeliness_names, INTENT_BACKGROUNDTRAFFIC + 1, fam->timeliness, table->num_choices);
+			_policy_table_set_intent(spl->policy_set_dict, "resilience", resilience_names, INTENT_RESILIENT + 1, fam->resilience, table->num_choices);
+
+			/* the first prefix configured as default wins */
+			if (fam->default_choice < 0 && g_hash_table_lookup(spl->policy_set_dict, "default") != NULL)
+				fam->default_choice = table->num_choices;
+		}
+
+		num_ranges++;
+		table->num_choices++;
+	}
+
+	ret = _policy_table_build_segments(fam, ranges, num_ranges);
+
+	free(ranges);
+	return ret;
+}
+
+static void _policy_table_free(policy_table_t *table)
+{
+	int i;
+
+	for (i = 0; i < table->num_choices; i++)
+	{
+		free(table->choices[i].if_name);
+		free(table->choices[i].addr);
+	}
+	free(table->choices);
+	free(table->in4.segment_start);
+	free(table->in4.segment_choice);
+	free(table->in6.segment_start);
+	free(table->in6.segment_choice);
+	free(table);
+}
+
+int policy_table_load(mam_context_t *mctx)
+{
+	policy_table_t *table;
+	policy_table_t *old;
+
+	if ((table = malloc(sizeof(policy_table_t))) == NULL)
+		return -1;
+	memset(table, 0x00, sizeof(policy_table_t));
+	table->usage = 1;
+
+	if ((table->choices = malloc((g_slist_length(mctx->prefixes) + 1) * sizeof(struct policy_table_choice))) == NULL)
+		goto policy_table_load_err;
+
+	if (_policy_table_compile_family(table, &(table->in4), mctx, AF_INET) != 0 ||
+		_policy_table_compile_family(table, &(table->in6), mctx, AF_INET6) != 0)
+		goto policy_table_load_err;
+
+	DLOG(POLICY_TABLE_NOISY_DEBUG, "compiled table with %d prefixes, %d/%d filesize segments\n", table->num_choices, table->in4.num_segments, table->in6.num_segments);
+	_policy_table_print(table);
+
+	/* publish the new table */
+	pthread_mutex_lock(&current_lock);
+	old = current;
+	current = table;
+	pthread_mutex_unlock(&current_lock);
+
+	if (old != NULL)
+		policy_table_put(old);
+
+	return 0;
+
+	policy_table_load_err:
+	DLOG(1, "compiling policy table failed\n");
+	_policy_table_free(table);
+	return -1;
+}
+
+void policy_table_unload()
+{
+	policy_table_t *old;
+
+	pthread_mutex_lock(&current_lock);
+	old = current;
+	current = NULL;
+	pthread_mutex_unlock(&current_lock);
+
+	if (old != NULL)
+		policy_table_put(old);
+}
+
+policy_table_t *policy_table_get()
+{
+	policy_table_t *table;
+
+	pthread_mutex_lock(&current_lock);
+	if ((table = current) != NULL)
+		table->usage++;
+	pthread_mutex_unlock(&current_lock);
+
+	return table;
+}
+
+void policy_table_put(policy_table_t *table)
+{
+	int usage;
+
+	if (table == NULL)
+		return;
+
+	pthread_mutex_lock(&current_lock);
+	usage = --(table->usage);
+	pthread_mutex_unlock(&current_lock);
+
+	if (usage == 0)
+		_policy_table_free(table);
+}
+
+const struct policy_table_family *policy_table_family(const policy_table_t *table, int family)
+{
+	if (table == NULL)
+		return NULL;
+	if (family == AF_INET)
+		return &(table->in4);
+	if (family == AF_INET6)
+		return &(table->in6);
+
+	return NULL;
+}
+
+int policy_table_filesize(const struct policy_table_family *fam, int filesize)
+{
+	int lo = 0;
+	int hi;
+
+	if (fam == NULL || fam->num_segments == 0 || filesize < fam->segment_start[0])
+		return -1;
+
+	/* find the last segment starting at or below filesize */
+	hi = fam->num_segments - 1;
+	while (lo < hi)
+	{
+		int mid = lo + (hi - lo + 1) / 2;
+
+		if (fam->segment_start[mid] <= filesize)
+			lo = mid;
+		else
+			hi = mid - 1;
+	}
+
+	return fam->segment_choice[lo];
+}
+
+int policy_table_category(const struct policy_table_family *fam, int category)
+{
+	if (fam == NULL || category < 0 || category > INTENT_STREAM)
+		return -1;
+
+	return fam->category[category];
+}
+
+int policy_table_timeliness(const struct policy_table_family *fam, int timeliness)
+{
+	if (fam == NULL || timeliness < 0 || timeliness > INTENT_BACKGROUNDTRAFFIC)
+		return -1;
+
+	return fam->timeliness[timeliness];
+}
+
+int policy_table_resilience(const struct policy_table_family *fam, int resilience)
+{
+	if (fam == NULL || resilience < 0 || resilience > INTENT_RESILIENT)
+		return -1;
+
+	return fam->resilience[resilience];
+}
+
+void policy_table_set_bind_sa(request_context_t *rctx, const policy_table_t *table, int choice, strbuf_t *sb)
+{
+	const struct policy_table_choice *c = &(table->choices[choice]);
+
+	strbuf_printf(sb, "\n\tSet src=");
+	_muacc_print_sockaddr(sb, c->addr, c->addr_len);
+
+	rctx->ctx->bind_sa_suggested = _muacc_clone_sockaddr(c->addr, c->addr_len);
+	rctx->ctx->bind_sa_suggested_len = c->addr_len;
+}
+
+/** Policies built on the table keep no policy_info, so print_pfx_addr() never needs this */
+void print_policy_info(void *policy_info)
+{
+}
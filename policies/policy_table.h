@@ -0,0 +1,97 @@
+/** \file policy_table.h
+ *  \brief Decision tables compiled from the configuration of the enabled prefixes
+ *
+ *  Instead of walking the prefix list and parsing the policy_set_dict strings on
+ *  every request, a policy compiles them once in init() into one table per address
+ *  family. Looking up the source address for a request is then a few indexed loads:
+ *
+ *  - filesize: the configured minfilesize/maxfilesize ranges are flattened into
+ *    sorted, disjoint segments (an interval tree laid out as an array), each one
+ *    holding the prefix that comes first in the configuration among those covering it
+ *  - category, timeliness, resilience: arrays indexed by the intent enum
+ *  - default: the prefix configured with "set default = 1"
+ *
+ *  The table keeps its own copies of the prefix addresses, so it stays valid while
+ *  the prefix list is rebuilt. policy_table_load() publishes a new table atomically -
+ *  requests still holding the old one (e.g. in resolver callbacks) keep using it
+ *  until they put it back.
+ *
+ *  \copyright Copyright 2013-2015 Philipp Schmidt, Theresa Enghardt, and Mirko Palmer.
+ *  All rights reserved. This project is released under the New BSD License.
+ */
+
+#ifndef __POLICY_TABLE_H__
+#define __POLICY_TABLE_H__
+
+#include "mam/mam.h"
+#include "lib/intents.h"
+
+/** Source address a decision can point to */
+struct policy_table_choice {
+	char					*if_name;		/**< Name of the interface of the prefix */
+	struct sockaddr			*addr;			/**< First address of the prefix */
+	socklen_t				addr_len;		/**< Length of addr */
+};
+
+/** Decisions for one address family - all entries are indices into choices, or -1 */
+struct policy_table_family {
+	int						default_choice;	/**< Prefix configured as default */
+	int						category[INTENT_STREAM + 1];
+	int						timeliness[INTENT_BACKGROUNDTRAFFIC + 1];
+	int						resilience[INTENT_RESILIENT + 1];
+	int						num_segments;	/**< Number of filesize segments */
+	int						*segment_start;	/**< Smallest filesize of each segment, ascending */
+	int						*segment_choice;/**< Prefix chosen for each segment */
+};
+
+/** Compiled decision table of a policy */
+typedef struct policy_table {
+	int						usage;			/**< Reference counter */
+	int						num_choices;	/**< Number of entries in choices */
+	struct policy_table_choice *choices;	/**< Source addresses of all enabled prefixes */
+	struct policy_table_family in4;			/**< Decisions for AF_INET */
+	struct policy_table_family in6;			/**< Decisions for AF_INET6 */
+} policy_table_t;
+
+/** Compile the configuration of the enabled prefixes of the MAM context
+ *  and publish the result as the current table, releasing the previous one
+ *
+ *  \return 0 on success, -1 otherwise
+ */
+int policy_table_load(mam_context_t *mctx);
+
+/** Release the current table */
+void policy_table_unload();
+
+/** Get a reference to the current table, or NULL if there is none
+ *  Has to be given back using policy_table_put()
+ */
+policy_table_t *policy_table_get();
+
+/** Give back a reference obtained by policy_table_get() */
+void policy_table_put(policy_table_t *table);
+
+/** Get the decisions for an address family, or NULL if the family is not supported */
+const struct policy_table_family *policy_table_family(const policy_table_t *table, int family);
+
+/** Look up the prefix for a filesize, -1 if none is configured for it */
+int policy_table_filesize(const struct policy_table_family *fam, int filesize);
+
+/** Look up the prefix for a category, -1 if none is configured for it */
+int policy_table_category(const struct policy_table_family *fam, int category);
+
+/** Name of a category as written in the configuration, NULL if the category is invalid */
+const char *policy_table_category_name(int category);
+
+/** Look up the prefix for a timeliness, -1 if none is configured for it */
+int policy_table_timeliness(const struct policy_table_family *fam, int timeliness);
+
+/** Look up the prefix for a resilience, -1 if none is configured for it */
+int policy_table_resilience(const struct policy_table_family *fam, int resilience);
+
+/** Set the suggested binding source address in the request context to a choice of the table
+ *  Like set_bind_sa(), but for table entries
+ */
+void policy_table_set_bind_sa(request_context_t *rctx, const policy_table_t *table, int choice, strbuf_t *sb);
+
+#endif /* __POLICY_TABLE_H__ */
@@ -718,7 +718,7 @@ int on_connect_request(request_context_t *rctx_param, struct event_base *base) {
 int init(mam_context_t *mctx) {
 	if(TRACE_FLOW) { printf("\n\tENTERING: init() for policy_test\n"); fflush(stdout); }
 	g_slist_foreach(mctx->prefixes, &set_policy_info, NULL);
-	make_v4v6_enabled_lists (mctx->prefixes, &in4_enabled, &in6_enabled);
+	make_v4v6_enabled_lists (mctx, &in4_enabled, &in6_enabled);
 	init_array_to_zero();
 	//g_slist_foreach(mctx->prefixes, &print_addresses, NULL);
 	//g_slist_foreach(in4_enabled, &print_addresses, NULL);
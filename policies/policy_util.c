@@ -49,18 +49,18 @@ void print_pfx_addr (gpointer element, gpointer data)
 		print_policy_info((void*) pfx->policy_info);
 }
 
-void make_v4v6_enabled_lists (GSList *baselist, GSList **v4list, GSList **v6list)
+void make_v4v6_enabled_lists (mam_context_t *mctx, GSList **v4list, GSList **v6list)
 {
 	printf("Configured addresses:");
 	printf("\n\tAF_INET: ");
-	filter_prefix_list (baselist, v4list, PFX_ENABLED, NULL, AF_INET, NULL);
+	*v4list = g_slist_concat(*v4list, g_slist_copy(mam_enabled_prefixes(mctx, AF_INET)));
 	if (*v4list != NULL)
 		g_slist_foreach(*v4list, &print_pfx_addr, NULL);
 	else
 		printf("\n\t\t(none)");
 
 	printf("\n\tAF_INET6: ");
-	filter_prefix_list (baselist, v6list, PFX_ENABLED, NULL, AF_INET6, NULL);
+	*v6list = g_slist_concat(*v6list, g_slist_copy(mam_enabled_prefixes(mctx, AF_INET6)));
 	if (*v6list != NULL)
 		g_slist_foreach(*v6list, &print_pfx_addr, NULL);
 	else
@@ -76,6 +76,29 @@ void set_bind_sa(request_context_t *rctx, struct src_prefix_list *chosen, strbuf
 	rctx->ctx->bind_sa_suggested_len = chosen->if_addrs->addr_len;
 }
 
+struct evdns_base *get_default_evdns_base(request_context_t *rctx)
+{
+	if (rctx->worker != NULL && rctx->worker->evdns_base != NULL)
+		return rctx->worker->evdns_base;
+
+	return rctx->mctx->evdns_default_base;
+}
+
+int resolve_cached(request_context_t *rctx, struct src_prefix_list *pfx, evdns_getaddrinfo_cb cb)
+{
+	struct evdns_base *dns_base = (pfx != NULL) ? mam_prefix_dns_base(pfx, rctx->worker) : NULL;
+
+	if (dns_base == NULL)
+		dns_base = get_default_evdns_base(rctx);
+	struct event_base *base = (rctx->worker != NULL) ? rctx->worker->ev_base : rctx->mctx->ev_base;
+
+	return mam_dns_getaddrinfo(rctx->mctx, base, dns_base, pfx,
+			rctx->ctx->remote_hostname,
+			rctx->ctx->remote_service,
+			rctx->ctx->remote_addrinfo_hint,
+			cb, rctx);
+}
+
 void print_addrinfo_response (struct addrinfo *res)
 {
 	strbuf_t sb;
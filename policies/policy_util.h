@@ -27,14 +27,27 @@ void print_policy_info(void *policy_info);
  */
 void print_pfx_addr (gpointer element, gpointer data);
 
-/** Convenience function that builds lists of available IPv4 and IPv6 addresses
- *  and prints them */
-void make_v4v6_enabled_lists (GSList *baselist, GSList **v4list, GSList **v6list);
+/** Convenience function that copies the lists of enabled IPv4 and IPv6 prefixes
+ *  from the prefix index of the MAM and prints them */
+void make_v4v6_enabled_lists (mam_context_t *mctx, GSList **v4list, GSList **v6list);
 
 /** Helper that sets the suggested binding source address in the request context
  *  to the first address of the chosen prefix
  */
 void set_bind_sa(request_context_t *rctx, struct src_prefix_list *chosen, strbuf_t *sb);
 
+/** Helper that resolves the remote host and service of a request through the DNS cache of the MAM
+ *  Uses the DNS base of the given prefix, or the default one if pfx is NULL
+ *  The callback owns the answer and may keep it, e.g. as remote_addrinfo_res
+ *
+ *  \return 0 if the callback will be invoked, -1 otherwise
+ */
+int resolve_cached(request_context_t *rctx, struct src_prefix_list *pfx, evdns_getaddrinfo_cb cb);
+
+/** Helper that returns the default DNS base for a request:
+ *  the one of the worker serving the client, or the MAM's default base
+ */
+struct evdns_base *get_default_evdns_base(request_context_t *rctx);
+
 /** Helper that prints the addresses returned by getaddrinfo */
 void print_addrinfo_response (struct addrinfo *res);
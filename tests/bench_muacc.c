@@ -0,0 +1,466 @@
+/** \file bench_muacc.c
+ *  \brief Micro-benchmarks for the serialization and helper primitives of libmuacc
+ *
+ *  \copyright Copyright 2013-2015 Philipp Schmidt, Theresa Enghardt, and Mirko Palmer.
+ *  All rights reserved. This project is released under the New BSD License.
+ *
+ *	Every client call packs its context, and the MAM unpacks it and packs its answer, so these
+ *	primitives are on the path of every request. Each benchmark runs its operation until
+ *	--min-time has passed, a few times over, and reports the fastest run in ns per operation
+ *	together with the allocations per operation (glibc only, counted by replacing malloc). Frees are
+ *	not counted, as libc frees internally, e.g. in freeaddrinfo, without going through free.
+ *
+ *	The contexts are meant to look like real ones: a small IPv4 context with two intents, and a
+ *	large IPv6 one with all addresses set, a chain of 16 candidate addresses and 24 socket options.
+ */
+
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <stdint.h>
+#include <time.h>
+#include <netdb.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+
+#include "argtable2.h"
+
+#include "clib/muacc.h"
+#include "clib/muacc_util.h"
+#include "lib/muacc_ctx.h"
+#include "lib/muacc_tlv.h"
+#include "lib/intents.h"
+
+#include "clib/dlog.h"
+
+/* - Allocation counting ------------------------------------------------ */
+
+static int counting = 0;
+static uint64_t allocs = 0;
+
+#ifdef __GLIBC__
+#define BENCH_COUNTS_ALLOCATIONS 1
+
+/* glibc lets the program replace malloc for itself and all libraries it uses */
+extern void *__libc_malloc(size_t size);
+extern void *__libc_calloc(size_t nmemb, size_t size);
+extern void *__libc_realloc(void *ptr, size_t size);
+
+void *malloc(size_t size)
+{
+	if (counting) allocs++;
+	return __libc_malloc(size);
+}
+
+void *calloc(size_t nmemb, size_t size)
+{
+	if (counting) allocs++;
+	return __libc_calloc(nmemb, size);
+}
+
+void *realloc(void *ptr, size_t size)
+{
+	if (counting && ptr == NULL) allocs++;
+	return __libc_realloc(ptr, size);
+}
+#else
+#define BENCH_COUNTS_ALLOCATIONS 0
+#endif
+
+/* - Fixtures ----------------------------------------------------------- */
+
+#define BENCH_CHAIN_LEN 16
+#define BENCH_SOCKOPTS 24
+
+static struct _muacc_ctx *ctx_small;
+static struct _muacc_ctx *ctx_large;
+static struct addrinfo *chain_short;	/**< 4 candidates */
+static struct addrinfo *chain_long;		/**< BENCH_CHAIN_LEN candidates, IPv6 and IPv4 mixed */
+
+static char buf_small[MUACC_TLV_MAXLEN];
+static ssize_t len_small;
+static char buf_large[MUACC_TLV_MAXLEN];
+static ssize_t len_large;
+static char buf_chain[MUACC_TLV_MAXLEN];
+static ssize_t len_chain;
+
+static struct sockaddr *make_sa(int family, const char *addr, int port, socklen_t *len)
+{
+	if (family == AF_INET6)
+	{
+		struct sockaddr_in6 *sa = calloc(1, sizeof(struct sockaddr_in6));
+		sa->sin6_family = AF_INET6;
+		sa->sin6_port = htons(port);
+		inet_pton(AF_INET6, addr, &sa->sin6_addr);
+		*len = sizeof(struct sockaddr_in6);
+		return (struct sockaddr *) sa;
+	}
+	else
+	{
+		struct sockaddr_in *sa = calloc(1, sizeof(struct sockaddr_in));
+		sa->sin_family = AF_INET;
+		sa->sin_port = htons(port);
+		inet_pton(AF_INET, addr, &sa->sin_addr);
+		*len = sizeof(struct sockaddr_in);
+		return (struct sockaddr *) sa;
+	}
+}
+
+/** Build an addrinfo chain the way getaddrinfo answers a dual-stacked name */
+static struct addrinfo *make_chain(int n)
+{
+	struct addrinfo *head = NULL, **next = &head;
+	char addr[64];
+
+	for (int i = 0; i < n; i++)
+	{
+		struct addrinfo *ai = calloc(1, sizeof(struct addrinfo));
+		ai->ai_family = (i % 2 == 0) ? AF_INET6 : AF_INET;
+		ai->ai_socktype = SOCK_STREAM;
+		ai->ai_protocol = IPPROTO_TCP;
+		if (ai->ai_family == AF_INET6)
+			snprintf(addr, sizeof(addr), "2001:db8:%x::%x", i, i + 1);
+		else
+			snprintf(addr, sizeof(addr), "192.0.2.%d", i + 1);
+		ai->ai_addr = make_sa(ai->ai_family, addr, 443, &ai->ai_addrlen);
+		if (i == 0)
+			ai->ai_canonname = strdup("www.example-with-a-long-canonical-name.test");
+		*next = ai;
+		next = &ai->ai_next;
+	}
+	return head;
+}
+
+static void free_chain(struct addrinfo *ai)
+{
+	while (ai != NULL)
+	{
+		struct addrinfo *next = ai->ai_next;
+		free(ai->ai_addr);
+		free(ai->ai_canonname);
+		free(ai);
+		ai = next;
+	}
+}
+
+/** Add n socket options - the intents first, then socket and TCP options */
+static void add_sockopts(struct socketopt **opts, int n)
+{
+	intent_category_t category = INTENT_BULKTRANSFER;
+	int value = 1024 * 1024;
+
+	for (int i = 0; i < n; i++)
+	{
+		if (i == 0)
+			_muacc_add_sockopt_to_list(opts, SOL_INTENTS, INTENT_CATEGORY, &category, sizeof(category), 0);
+		else if (i < 7)
+			_muacc_add_sockopt_to_list(opts, SOL_INTENTS, INTENT_CATEGORY + i, &value, sizeof(int), 0);
+		else
+			/* options are told apart by name only, so they get names of their own here */
+			_muacc_add_sockopt_to_list(opts, (i % 2) ? SOL_SOCKET : IPPROTO_TCP, 100 + i, &value, sizeof(int), SOCKOPT_OPTIONAL);
+	}
+}
+
+static void setup_fixtures(void)
+{
+	ctx_small = _muacc_create_ctx();
+	ctx_small->ctxid[0] = 1;
+	ctx_small->domain = AF_INET;
+	ctx_small->type = SOCK_STREAM;
+	ctx_small->calls_performed = MUACC_SOCKET_CALLED;
+	ctx_small->remote_hostname = strdup("www.example.test");
+	ctx_small->remote_service = strdup("80");
+	ctx_small->remote_addrinfo_hint = calloc(1, sizeof(struct addrinfo));
+	ctx_small->remote_addrinfo_hint->ai_family = AF_INET;
+	ctx_small->remote_addrinfo_hint->ai_socktype = SOCK_STREAM;
+	ctx_small->remote_sa = make_sa(AF_INET, "192.0.2.1", 80, &ctx_small->remote_sa_len);
+	add_sockopts(&ctx_small->sockopts_current, 2);
+
+	ctx_large = _muacc_create_ctx();
+	memset(ctx_large->ctxid, 0x5a, sizeof(uuid_t));
+	ctx_large->ctxino = 0x1234567890ULL;
+	ctx_large->sockfd = 42;
+	ctx_large->domain = AF_INET6;
+	ctx_large->type = SOCK_STREAM;
+	ctx_large->protocol = IPPROTO_TCP;
+	ctx_large->calls_performed = MUACC_SOCKET_CALLED | MUACC_GETADDRINFO_CALLED | MUACC_BIND_CALLED;
+	ctx_large->bind_sa_req = make_sa(AF_INET6, "2001:db8:1::2", 0, &ctx_large->bind_sa_req_len);
+	ctx_large->bind_sa_suggested = make_sa(AF_INET6, "2001:db8:2::2", 0, &ctx_large->bind_sa_suggested_len);
+	ctx_large->remote_hostname = strdup("www.example-with-a-long-canonical-name.test");
+	ctx_large->remote_service = strdup("https");
+	ctx_large->remote_addrinfo_hint = calloc(1, sizeof(struct addrinfo));
+	ctx_large->remote_addrinfo_hint->ai_family = AF_UNSPEC;
+	ctx_large->remote_addrinfo_hint->ai_socktype = SOCK_STREAM;
+	ctx_large->remote_addrinfo_hint->ai_flags = AI_ADDRCONFIG;
+	ctx_large->remote_addrinfo_res = make_chain(BENCH_CHAIN_LEN);
+	ctx_large->remote_sa = make_sa(AF_INET6, "2001:db8:0::1", 443, &ctx_large->remote_sa_len);
+	add_sockopts(&ctx_large->sockopts_current, BENCH_SOCKOPTS);
+	add_sockopts(&ctx_large->sockopts_suggested, 8);
+
+	chain_short = make_chain(4);
+	chain_long = make_chain(BENCH_CHAIN_LEN);
+
+	_muacc_pack_ctx(buf_small, &len_small, sizeof(buf_small), ctx_small);
+	_muacc_pack_ctx(buf_large, &len_large, sizeof(buf_large), ctx_large);
+	_muacc_push_addrinfo_tlv(buf_chain, &len_chain, sizeof(buf_chain), remote_addrinfo_res, chain_long);
+}
+
+static void cleanup_fixtures(void)
+{
+	/* the addrinfo members were built here, freeaddrinfo does not know how to free them */
+	free_chain(ctx_large->remote_addrinfo_res);
+	ctx_large->remote_addrinfo_res = NULL;
+	free(ctx_small->remote_addrinfo_hint);
+	ctx_small->remote_addrinfo_hint = NULL;
+	free(ctx_large->remote_addrinfo_hint);
+	ctx_large->remote_addrinfo_hint = NULL;
+	_muacc_free_ctx(ctx_small);
+	_muacc_free_ctx(ctx_large);
+	free_chain(chain_short);
+	free_chain(chain_long);
+}
+
+/* - Benchmarks --------------------------------------------------------- */
+
+/** Unpack all TLVs of a buffer into a new context, as the MAM and the client do when reading */
+static struct _muacc_ctx *unpack_buffer(const char *buf, ssize_t len)
+{
+	struct _muacc_ctx *ctx = _muacc_create_ctx();
+	ssize_t pos = 0;
+
+	while (pos + (ssize_t) (sizeof(muacc_tlv_t) + sizeof(ssize_t)) <= len)
+	{
+		muacc_tlv_t tag = *(muacc_tlv_t *) (buf + pos);
+		ssize_t data_len = *(ssize_t *) (buf + pos + sizeof(muacc_tlv_t));
+		pos += sizeof(muacc_tlv_t) + sizeof(ssize_t);
+		if (tag == eof || pos + data_len > len)
+			break;
+		_muacc_unpack_ctx(tag, buf + pos, data_len, ctx);
+		pos += data_len;
+	}
+	return ctx;
+}
+
+static ssize_t bench_pack_small(void)
+{
+	static char buf[MUACC_TLV_MAXLEN];
+	ssize_t pos = 0;
+	_muacc_pack_ctx(buf, &pos, sizeof(buf), ctx_small);
+	return pos;
+}
+
+static ssize_t bench_pack_large(void)
+{
+	static char buf[MUACC_TLV_MAXLEN];
+	ssize_t pos = 0;
+	_muacc_pack_ctx(buf, &pos, sizeof(buf), ctx_large);
+	return pos;
+}
+
+static ssize_t bench_unpack_small(void)
+{
+	_muacc_free_ctx(unpack_buffer(buf_small, len_small));
+	return len_small;
+}
+
+static ssize_t bench_unpack_large(void)
+{
+	_muacc_free_ctx(unpack_buffer(buf_large, len_large));
+	return len_large;
+}
+
+static ssize_t bench_push_addrinfo_short(void)
+{
+	static char buf[MUACC_TLV_MAXLEN];
+	ssize_t pos = 0;
+	_muacc_push_addrinfo_tlv(buf, &pos, sizeof(buf), remote_addrinfo_res, chain_short);
+	return pos;
+}
+
+static ssize_t bench_push_addrinfo_long(void)
+{
+	static char buf[MUACC_TLV_MAXLEN];
+	ssize_t pos = 0;
+	_muacc_push_addrinfo_tlv(buf, &pos, sizeof(buf), remote_addrinfo_res, chain_long);
+	return pos;
+}
+
+static ssize_t bench_extract_addrinfo_long(void)
+{
+	struct addrinfo *ai = NULL;
+	ssize_t header = sizeof(muacc_tlv_t) + sizeof(ssize_t);
+	_muacc_extract_addrinfo_tlv(buf_chain + header, len_chain - header, &ai);
+	/* free it the way contexts free it */
+	freeaddrinfo(ai);
+	return len_chain;
+}
+
+static ssize_t bench_clone_small(void)
+{
+	_muacc_free_ctx(_muacc_clone_ctx(ctx_small));
+	return 0;
+}
+
+static ssize_t bench_clone_large(void)
+{
+	_muacc_free_ctx(_muacc_clone_ctx(ctx_large));
+	return 0;
+}
+
+static ssize_t bench_add_sockopts(void)
+{
+	struct socketopt *opts = NULL;
+	add_sockopts(&opts, BENCH_SOCKOPTS);
+	_muacc_free_socketopts(opts);
+	return 0;
+}
+
+struct benchmark {
+	const char *name;
+	ssize_t (*run)(void);	/**< one operation, returns the bytes it serialized */
+};
+
+static const struct benchmark benchmarks[] = {
+	{ "pack_ctx/small",				bench_pack_small },
+	{ "pack_ctx/large",				bench_pack_large },
+	{ "unpack_ctx/small",			bench_unpack_small },
+	{ "unpack_ctx/large",			bench_unpack_large },
+	{ "push_addrinfo_tlv/4",		bench_push_addrinfo_short },
+	{ "push_addrinfo_tlv/16",		bench_push_addrinfo_long },
+	{ "extract_addrinfo_tlv/16",	bench_extract_addrinfo_long },
+	{ "clone_ctx/small",			bench_clone_small },
+	{ "clone_ctx/large",			bench_clone_large },
+	{ "add_sockopt_to_list/24",		bench_add_sockopts },
+	{ NULL, NULL }
+};
+
+/* - Runner ------------------------------------------------------------- */
+
+static uint64_t now_ns(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t) ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/** Run a benchmark repeatedly and print its fastest run */
+static void run_benchmark(const struct benchmark *b, double min_time, int repetitions)
+{
+	uint64_t iterations = 1, elapsed = 0;
+	double best = -1;
+	uint64_t best_allocs = 0;
+	ssize_t bytes = 0;
+
+	/* find an iteration count that runs for min_time */
+	while (1)
+	{
+		uint64_t start = now_ns();
+		for (uint64_t i = 0; i < iterations; i++)
+			b->run();
+		elapsed = now_ns() - start;
+		if (elapsed >= min_time * 1e9 || iterations >= (1ULL << 40))
+			break;
+		iterations = (elapsed > 0 && min_time * 1e9 / elapsed < 100) ? (uint64_t) (iterations * 1.2 * min_time * 1e9 / elapsed) + 1 : iterations * 100;
+	}
+
+	for (int r = 0; r < repetitions; r++)
+	{
+		allocs = 0;
+		counting = 1;
+		uint64_t start = now_ns();
+		for (uint64_t i = 0; i < iterations; i++)
+			bytes = b->run();
+		elapsed = now_ns() - start;
+		counting = 0;
+
+		double ns = (double) elapsed / iterations;
+		if (best < 0 || ns < best)
+		{
+			best = ns;
+			best_allocs = allocs;
+		}
+	}
+
+	if (BENCH_COUNTS_ALLOCATIONS)
+		printf("%-26s %12llu %12.1f %10.2f %8zd\n", b->name, (unsigned long long) iterations, best,
+			(double) best_allocs / iterations, bytes);
+	else
+		printf("%-26s %12llu %12.1f %10s %8zd\n", b->name, (unsigned long long) iterations, best, "-", bytes);
+}
+
+static void print_usage(char *argv[], void *args[])
+{
+	printf("\nUsage:\n");
+	printf("\t%s", argv[0]);
+	arg_print_syntaxv(stdout, args, "\n");
+	printf("\n");
+	arg_print_glossary(stdout, args, "\t%-25s %s\n");
+	printf("\n");
+}
+
+int main(int argc, char *argv[])
+{
+	struct arg_str *arg_filter = arg_str0("f", "filter", "<prefix>", "Only run benchmarks whose name starts with this");
+	struct arg_dbl *arg_min_time = arg_dbl0("t", "min-time", "<s>", "Run each benchmark for at least this long (default: 0.2)");
+	struct arg_int *arg_repetitions = arg_int0("r", "repetitions", "<n>", "Runs per benchmark, the fastest is reported (default: 3)");
+	struct arg_lit *arg_help = arg_lit0("h", "help", "Print this help");
+	struct arg_end *end = arg_end(10);
+
+	void *argtable[] = {arg_filter, arg_min_time, arg_repetitions, arg_help, end};
+
+	if (arg_nullcheck(argtable) != 0)
+	{
+		printf("Error creating argument table\n");
+		return -1;
+	}
+
+	*arg_filter->sval = NULL;
+	arg_min_time->dval[0] = 0.2;
+	arg_repetitions->ival[0] = 3;
+
+	if (arg_parse(argc, argv, argtable) != 0 || arg_help->count > 0 || arg_min_time->dval[0] <= 0 || arg_repetitions->ival[0] <= 0)
+	{
+		arg_print_errors(stdout, end, "muaccbench");
+		print_usage(argv, argtable);
+		arg_freetable(argtable, sizeof(argtable)/sizeof(argtable[0]));
+		return (arg_help->count > 0) ? 0 : -1;
+	}
+
+	setup_fixtures();
+
+	/* the large context has to survive a round trip, or the numbers mean nothing
+	 * (the bytes differ, as addrinfo and socketopt structs are copied including their pointers) */
+	struct _muacc_ctx *check = unpack_buffer(buf_large, len_large);
+	char buf[MUACC_TLV_MAXLEN];
+	ssize_t len = 0;
+	int chain_len = 0;
+	_muacc_pack_ctx(buf, &len, sizeof(buf), check);
+	for (struct addrinfo *ai = check->remote_addrinfo_res; ai != NULL; ai = ai->ai_next)
+		chain_len++;
+	_muacc_free_ctx(check);
+	if (len != len_large || chain_len != BENCH_CHAIN_LEN)
+	{
+		printf("Context does not survive packing and unpacking - aborting\n");
+		return 1;
+	}
+
+	printf("%-26s %12s %12s %10s %8s\n", "benchmark", "iterations", "ns/op", "allocs/op", "bytes");
+	for (const struct benchmark *b = benchmarks; b->name != NULL; b++)
+	{
+		if (*arg_filter->sval != NULL && strncmp(b->name, *arg_filter->sval, strlen(*arg_filter->sval)) != 0)
+			continue;
+		run_benchmark(b, arg_min_time->dval[0], arg_repetitions->ival[0]);
+	}
+
+	cleanup_fixtures();
+	arg_freetable(argtable, sizeof(argtable)/sizeof(argtable[0]));
+	return 0;
+}
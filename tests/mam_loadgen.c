@@ -0,0 +1,786 @@
+/** \file mam_loadgen.c
+ *  \brief Load generator and latency benchmark for the request path of the Multi Access Manager
+ *
+ *  \copyright Copyright 2013-2015 Philipp Schmidt, Theresa Enghardt, and Mirko Palmer.
+ *  All rights reserved. This project is released under the New BSD License.
+ *
+ *	This tool opens many client connections to the unix socket of a running MAM and replays a mix
+ *	of resolve, connect, socketconnect and socketchoose requests against its policy, either as fast
+ *	as possible or at a fixed total rate. Requests are scheduled open loop, so the latency of a
+ *	request is counted from the time it was due, not from the time it could be sent.
+ *	Socketchoose requests refer to the contexts of their socket set by reference once the MAM has
+ *	seen them, as the client library does, and resync when asked to.
+ *
+ *	Host names are answered by a DNS stub on 127.0.0.1, so resolving does not depend on the network.
+ *	Point the prefixes of the policy configuration at it, e.g. with
+ *	resolvconf "/tmp/loadgen-resolv.conf"; after running with --resolvconf /tmp/loadgen-resolv.conf.
+ *
+ *	It reports throughput, the p50/p99/p999 latency per request type and the CPU time the MAM
+ *	spent, and a single LOADGEN line to compare policies or MAM versions with.
+ */
+
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <stdint.h>
+#include <errno.h>
+#include <time.h>
+#include <dirent.h>
+#include <pthread.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/time.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#include "argtable2.h"
+
+#include "clib/muacc.h"
+#include "clib/muacc_util.h"
+#include "lib/muacc_ctx.h"
+#include "lib/muacc_tlv.h"
+#include "lib/intents.h"
+
+#include "clib/dlog.h"
+
+#include "clib/muacc_client_util.h"
+
+#ifndef MAM_LOADGEN_NOISY_DEBUG0
+#define MAM_LOADGEN_NOISY_DEBUG0 0
+#endif
+
+#ifndef MAM_LOADGEN_NOISY_DEBUG1
+#define MAM_LOADGEN_NOISY_DEBUG1 1
+#endif
+
+#ifndef MAM_LOADGEN_NOISY_DEBUG2
+#define MAM_LOADGEN_NOISY_DEBUG2 0
+#endif
+
+/** Maximum number of sockets in the socket set of a socketchoose request */
+#define LOADGEN_MAX_SET 16
+
+/** Maximum number of distinct host names */
+#define LOADGEN_MAX_NAMES 4096
+
+#define HOSTNAME_LEN_LIMIT 256
+
+enum loadgen_request {
+	LOADGEN_RESOLVE,
+	LOADGEN_CONNECT,
+	LOADGEN_SOCKETCONNECT,
+	LOADGEN_SOCKETCHOOSE,
+	LOADGEN_REQUEST_TYPES
+};
+
+static const char *loadgen_request_names[LOADGEN_REQUEST_TYPES] = { "resolve", "connect", "socketconnect", "socketchoose" };
+
+static const muacc_mam_action_t loadgen_request_actions[LOADGEN_REQUEST_TYPES] = {
+	muacc_act_getaddrinfo_resolve_req,
+	muacc_act_connect_req,
+	muacc_act_socketconnect_req,
+	muacc_act_socketchoose_req
+};
+
+/** Latencies of one request type in ns */
+struct loadgen_samples {
+	uint64_t *ns;
+	size_t count;
+	size_t size;
+};
+
+struct loadgen_client {
+	int id;
+	pthread_t thread;
+	int mamsock;
+	unsigned int seed;
+	struct _muacc_ctx members[LOADGEN_MAX_SET];		/**< socket set of socketchoose requests */
+	int members_known;								/**< MAM has seen the full contexts of the set */
+	struct loadgen_samples samples[LOADGEN_REQUEST_TYPES];
+	uint64_t errors;
+	uint64_t resyncs;
+};
+
+/* Configuration, set up by main before the clients start */
+static int weights[LOADGEN_REQUEST_TYPES] = { 4, 2, 3, 1 };
+static int weight_sum = 10;
+static int num_clients = 16;
+static double rate = 0;					/**< requests per second for all clients, 0 for as fast as possible */
+static int set_size = 4;
+static int num_names = 16;
+static char (*names)[HOSTNAME_LEN_LIMIT] = NULL;
+static const char *service = "80";
+static struct addrinfo hint;
+static struct sockaddr_in answer_sa;
+static struct socketopt *intents[4];	/**< one list of intents per category */
+
+static uint64_t start_ns = 0;
+static uint64_t measure_ns = 0;			/**< samples of requests due before are warm-up */
+static uint64_t end_ns = 0;
+
+/* DNS stub */
+static int dns_sock = -1;
+static volatile int dns_running = 0;
+static uint64_t dns_queries = 0;
+static struct in_addr dns_answer4;
+static struct in6_addr dns_answer6;
+static uint32_t dns_ttl = 60;
+
+static uint64_t now_ns(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t) ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static void sleep_until_ns(uint64_t t)
+{
+	struct timespec ts;
+	ts.tv_sec = t / 1000000000ULL;
+	ts.tv_nsec = t % 1000000000ULL;
+	while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) == EINTR);
+}
+
+static void add_sample(struct loadgen_samples *s, uint64_t ns)
+{
+	if (s->count == s->size)
+	{
+		s->size = (s->size == 0) ? 4096 : 2 * s->size;
+		s->ns = realloc(s->ns, s->size * sizeof(uint64_t));
+	}
+	s->ns[s->count++] = ns;
+}
+
+static int compare_u64(const void *a, const void *b)
+{
+	uint64_t x = *(const uint64_t *) a, y = *(const uint64_t *) b;
+	return (x > y) - (x < y);
+}
+
+/** Quantile of sorted samples in microseconds */
+static double quantile_us(const struct loadgen_samples *s, double q)
+{
+	if (s->count == 0)
+		return 0;
+	size_t i = (size_t) (q * s->count);
+	if (i >= s->count)
+		i = s->count - 1;
+	return s->ns[i] / 1000.0;
+}
+
+/* - DNS stub ----------------------------------------------------------- */
+
+/** Answer A and AAAA queries for any name with the configured addresses */
+static void *dns_stub(void *arg)
+{
+	unsigned char buf[1500];
+	struct sockaddr_storage peer;
+	socklen_t peer_len;
+	ssize_t len;
+
+	while (dns_running)
+	{
+		peer_len = sizeof(peer);
+		if ((len = recvfrom(dns_sock, buf, sizeof(buf), 0, (struct sockaddr *) &peer, &peer_len)) < 12)
+			continue;
+
+		/* skip the name of the (first) question */
+		size_t pos = 12;
+		while (pos < (size_t) len && buf[pos] != 0)
+			pos += buf[pos] + 1;
+		if (pos + 5 > (size_t) len || buf[4] != 0 || buf[5] != 1)
+			continue;
+		uint16_t qtype = buf[pos + 1] << 8 | buf[pos + 2];
+		pos += 5;
+
+		/* response header: QR, AA, RD copied, RA, no error, no authority and additional records */
+		buf[2] = 0x84 | (buf[2] & 0x01);
+		buf[3] = 0x80;
+		buf[6] = 0; buf[7] = 0;
+		memset(buf + 8, 0, 4);
+
+		size_t rdlen = (qtype == 1) ? 4 : (qtype == 28) ? 16 : 0;
+		if (rdlen > 0 && pos + 12 + rdlen <= sizeof(buf))
+		{
+			unsigned char *rr = buf + pos;
+			buf[7] = 1;
+			rr[0] = 0xc0; rr[1] = 12;		/* name: pointer to the question */
+			rr[2] = qtype >> 8; rr[3] = qtype & 0xff;
+			rr[4] = 0; rr[5] = 1;			/* class IN */
+			rr[6] = dns_ttl >> 24; rr[7] = dns_ttl >> 16; rr[8] = dns_ttl >> 8; rr[9] = dns_ttl;
+			rr[10] = 0; rr[11] = rdlen;
+			memcpy(rr + 12, (qtype == 1) ? (void *) &dns_answer4 : (void *) &dns_answer6, rdlen);
+			pos += 12 + rdlen;
+		}
+		sendto(dns_sock, buf, pos, 0, (struct sockaddr *) &peer, peer_len);
+		__sync_fetch_and_add(&dns_queries, 1);
+	}
+	return NULL;
+}
+
+static int dns_stub_start(int port, pthread_t *thread)
+{
+	struct sockaddr_in sa;
+	struct timeval timeout = { 0, 100000 };
+
+	memset(&sa, 0, sizeof(sa));
+	sa.sin_family = AF_INET;
+	sa.sin_port = htons(port);
+	sa.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+
+	if ((dns_sock = socket(AF_INET, SOCK_DGRAM, 0)) < 0)
+		goto dns_stub_start_err;
+	/* wake up now and then to notice that we are done */
+	setsockopt(dns_sock, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+	if (bind(dns_sock, (struct sockaddr *) &sa, sizeof(sa)) < 0)
+		goto dns_stub_start_err;
+
+	dns_running = 1;
+	if (pthread_create(thread, NULL, dns_stub, NULL) != 0)
+		goto dns_stub_start_err;
+	return 0;
+
+dns_stub_start_err:
+	DLOG(MAM_LOADGEN_NOISY_DEBUG1, "Cannot start DNS stub on 127.0.0.1:%d: %s\n", port, strerror(errno));
+	dns_running = 0;
+	if (dns_sock >= 0)
+		close(dns_sock);
+	dns_sock = -1;
+	return -1;
+}
+
+/* - MAM CPU time ------------------------------------------------------- */
+
+/** Find the pid of a running mamma
+ *
+ *  @return pid, or 0 if there is none
+ */
+static pid_t find_mamma(void)
+{
+	DIR *proc = opendir("/proc");
+	struct dirent *entry;
+	char path[300], comm[32];
+	pid_t pid = 0;
+
+	if (proc == NULL)
+		return 0;
+	while (pid == 0 && (entry = readdir(proc)) != NULL)
+	{
+		FILE *f;
+		if (entry->d_name[0] < '0' || entry->d_name[0] > '9')
+			continue;
+		snprintf(path, sizeof(path), "/proc/%s/comm", entry->d_name);
+		if ((f = fopen(path, "r")) == NULL)
+			continue;
+		if (fgets(comm, sizeof(comm), f) != NULL && strcmp(comm, "mamma\n") == 0)
+			pid = atoi(entry->d_name);
+		fclose(f);
+	}
+	closedir(proc);
+	return pid;
+}
+
+/** CPU time (user and system) of a process in seconds
+ *
+ *  @return CPU time, or -1 if it cannot be read
+ */
+static double process_cpu_time(pid_t pid)
+{
+	char path[64], buf[1024], *end;
+	unsigned long utime, stime;
+	FILE *f;
+	size_t len;
+
+	snprintf(path, sizeof(path), "/proc/%d/stat", (int) pid);
+	if ((f = fopen(path, "r")) == NULL)
+		return -1;
+	len = fread(buf, 1, sizeof(buf) - 1, f);
+	fclose(f);
+	buf[len] = 0;
+
+	/* the command name may contain spaces - fields are counted from its closing parenthesis */
+	if ((end = strrchr(buf, ')')) == NULL ||
+		sscanf(end + 2, "%*c %*d %*d %*d %*d %*d %*u %*u %*u %*u %*u %lu %lu", &utime, &stime) != 2)
+		return -1;
+	return (double) (utime + stime) / sysconf(_SC_CLK_TCK);
+}
+
+/* - Requests ----------------------------------------------------------- */
+
+static int connect_to_mam(void)
+{
+	struct sockaddr_un mams;
+	int s;
+
+	memset(&mams, 0, sizeof(mams));
+	mams.sun_family = AF_UNIX;
+	strncpy(mams.sun_path, MUACC_SOCKET, sizeof(mams.sun_path) - 1);
+
+	if ((s = socket(AF_UNIX, SOCK_STREAM, 0)) < 0)
+		return -1;
+	if (connect(s, (struct sockaddr *) &mams, sizeof(mams)) < 0)
+	{
+		DLOG(MAM_LOADGEN_NOISY_DEBUG1, "Connect to MAM via %s failed: %s\n", mams.sun_path, strerror(errno));
+		close(s);
+		return -1;
+	}
+	return s;
+}
+
+/** Fill in the context of a request - all members point to static data, nothing has to be freed */
+static void fill_ctx(struct loadgen_client *c, struct _muacc_ctx *ctx, enum loadgen_request type)
+{
+	memset(ctx, 0, sizeof(*ctx));
+	ctx->domain = AF_INET;
+	ctx->type = SOCK_STREAM;
+	ctx->remote_hostname = names[rand_r(&c->seed) % num_names];
+	ctx->remote_service = (char *) service;
+	ctx->sockopts_current = intents[rand_r(&c->seed) % 4];
+
+	if (type == LOADGEN_RESOLVE || type == LOADGEN_SOCKETCONNECT || type == LOADGEN_SOCKETCHOOSE)
+	{
+		ctx->remote_addrinfo_hint = &hint;
+		ctx->calls_performed = (type == LOADGEN_RESOLVE) ? MUACC_GETADDRINFO_CALLED : 0;
+	}
+	if (type == LOADGEN_CONNECT)
+	{
+		ctx->remote_sa = (struct sockaddr *) &answer_sa;
+		ctx->remote_sa_len = sizeof(answer_sa);
+		ctx->calls_performed = MUACC_SOCKET_CALLED | MUACC_GETADDRINFO_CALLED;
+	}
+}
+
+/** Set up the socket set of a client: connected sockets to the stub's address, unknown to the MAM */
+static void init_members(struct loadgen_client *c)
+{
+	for (int i = 0; i < set_size; i++)
+	{
+		struct _muacc_ctx *m = &c->members[i];
+		fill_ctx(c, m, LOADGEN_CONNECT);
+		m->remote_hostname = names[c->id % num_names];
+		m->calls_performed = MUACC_SOCKET_CALLED | MUACC_CONNECT_CALLED;
+		m->sockfd = 1000 + i;
+		m->ctxino = ((uint64_t) getpid() << 32) | (c->id << 8) | i;
+		for (int j = 0; j < (int) sizeof(uuid_t); j++)
+			m->ctxid[j] = rand_r(&c->seed);
+	}
+	c->members_known = 0;
+}
+
+/** Send one request and read the response up to eof
+ *
+ *  @return 0 on success, 1 if the MAM asked for a resync, -1 on error
+ */
+static int do_request(struct loadgen_client *c, enum loadgen_request type)
+{
+	char buf[MUACC_TLV_MAXLEN];
+	ssize_t pos = 0;
+	muacc_mam_action_t reason = loadgen_request_actions[type];
+	struct _muacc_ctx ctx;
+	muacc_tlv_t tag;
+	void *data;
+	ssize_t data_len;
+	int ret = 0;
+
+	fill_ctx(c, &ctx, type);
+	if (type == LOADGEN_SOCKETCHOOSE)
+		ctx.remote_hostname = c->members[0].remote_hostname;
+
+	if (0 > _muacc_push_tlv(buf, &pos, sizeof(buf), action, &reason, sizeof(muacc_mam_action_t)) ||
+		0 > _muacc_pack_ctx(buf, &pos, sizeof(buf), &ctx))
+		goto do_request_pack_err;
+
+	if (type == LOADGEN_SOCKETCHOOSE)
+	{
+		for (int i = 0; i < set_size; i++)
+		{
+			struct _muacc_ctxref ref;
+			if (0 > _muacc_push_tlv(buf, &pos, sizeof(buf), socketset_file, &c->members[i].sockfd, sizeof(int)))
+				goto do_request_pack_err;
+			if (c->members_known)
+			{
+				__uuid_copy(ref.ctxid, c->members[i].ctxid);
+				ref.ctxino = c->members[i].ctxino;
+				if (0 > _muacc_push_tlv(buf, &pos, sizeof(buf), socketset_ctxref, &ref, sizeof(ref)))
+					goto do_request_pack_err;
+			}
+			else if (0 > _muacc_pack_ctx(buf, &pos, sizeof(buf), &c->members[i]))
+				goto do_request_pack_err;
+		}
+		c->members_known = 1;
+	}
+	if (0 > _muacc_push_tlv_tag(buf, &pos, sizeof(buf), eof))
+		goto do_request_pack_err;
+
+	if (send(c->mamsock, buf, pos, 0) != pos)
+		goto do_request_io_err;
+
+	pos = 0;
+	while (1)
+	{
+		if (_muacc_read_tlv(c->mamsock, buf, &pos, sizeof(buf), &tag, &data, &data_len) <= 0)
+			goto do_request_io_err;
+		if (tag == eof)
+			break;
+		if (tag == action && data_len == sizeof(muacc_mam_action_t))
+		{
+			muacc_mam_action_t resp = *(muacc_mam_action_t *) data;
+			if (resp == muacc_act_socketchoose_resync)
+			{
+				c->members_known = 0;
+				ret = 1;
+			}
+			else if (resp == muacc_error_unknown_request)
+			{
+				ret = -1;
+			}
+		}
+	}
+	return ret;
+
+do_request_pack_err:
+	DLOG(MAM_LOADGEN_NOISY_DEBUG1, "Failed to serialize %s request\n", loadgen_request_names[type]);
+	return -1;
+
+do_request_io_err:
+	DLOG(MAM_LOADGEN_NOISY_DEBUG1, "Lost connection to MAM during %s request - reconnecting\n", loadgen_request_names[type]);
+	close(c->mamsock);
+	c->mamsock = connect_to_mam();
+	c->members_known = 0;
+	return -1;
+}
+
+static enum loadgen_request pick_request(struct loadgen_client *c)
+{
+	int r = rand_r(&c->seed) % weight_sum;
+	int type;
+	for (type = 0; type < LOADGEN_REQUEST_TYPES - 1; type++)
+	{
+		if (r < weights[type])
+			break;
+		r -= weights[type];
+	}
+	return type;
+}
+
+static void *client_worker(void *arg)
+{
+	struct loadgen_client *c = arg;
+	/* spread the clients over the interval so they do not fire in lockstep */
+	uint64_t interval = (rate > 0) ? (uint64_t) (1e9 * num_clients / rate) : 0;
+	uint64_t due = start_ns + interval * c->id / num_clients;
+
+	init_members(c);
+	while (due < end_ns)
+	{
+		enum loadgen_request type = pick_request(c);
+		int ret;
+
+		if (interval > 0)
+			sleep_until_ns(due);
+		else
+			due = now_ns();
+		if (due >= end_ns)
+			break;
+
+		if (c->mamsock < 0 && (c->mamsock = connect_to_mam()) < 0)
+		{
+			c->errors++;
+			sleep_until_ns(now_ns() + 100000000ULL);
+			due += interval;
+			continue;
+		}
+
+		/* a resync is part of the request, as for the client library */
+		if ((ret = do_request(c, type)) == 1)
+		{
+			c->resyncs++;
+			ret = do_request(c, type);
+		}
+
+		if (ret != 0)
+			c->errors++;
+		else if (due >= measure_ns)
+			add_sample(&c->samples[type], now_ns() - due);
+
+		due += interval;
+	}
+	return NULL;
+}
+
+/* - Setup -------------------------------------------------------------- */
+
+/** Parse a request mix like "resolve:4,connect:2,socketconnect:3,socketchoose:1" */
+static int parse_mix(const char *mix)
+{
+	char *copy = strdup(mix), *saveptr = NULL, *item;
+	int w[LOADGEN_REQUEST_TYPES] = { 0 };
+	int ret = 0;
+
+	for (item = strtok_r(copy, ",", &saveptr); item != NULL; item = strtok_r(NULL, ",", &saveptr))
+	{
+		char *colon = strchr(item, ':');
+		int type;
+		if (colon != NULL)
+			*colon = 0;
+		for (type = 0; type < LOADGEN_REQUEST_TYPES && strcmp(item, loadgen_request_names[type]) != 0; type++);
+		if (type == LOADGEN_REQUEST_TYPES || (colon != NULL && atoi(colon + 1) < 0))
+		{
+			printf("Invalid request type or weight in mix: %s\n", item);
+			ret = -1;
+			break;
+		}
+		w[type] = (colon != NULL) ? atoi(colon + 1) : 1;
+	}
+	free(copy);
+
+	if (ret == 0)
+	{
+		weight_sum = 0;
+		for (int type = 0; type < LOADGEN_REQUEST_TYPES; type++)
+		{
+			weights[type] = w[type];
+			weight_sum += w[type];
+		}
+		if (weight_sum == 0)
+		{
+			printf("Request mix is empty\n");
+			ret = -1;
+		}
+	}
+	return ret;
+}
+
+static int setup_intents(void)
+{
+	intent_category_t categories[4] = { INTENT_QUERY, INTENT_BULKTRANSFER, INTENT_CONTROLTRAFFIC, INTENT_STREAM };
+	int filesizes[4] = { 1024, 10 * 1024 * 1024, 512, 1024 * 1024 };
+
+	for (int i = 0; i < 4; i++)
+	{
+		if (0 != muacc_set_intent(&intents[i], INTENT_CATEGORY, &categories[i], sizeof(intent_category_t), 0) ||
+			0 != muacc_set_intent(&intents[i], INTENT_FILESIZE, &filesizes[i], sizeof(int), 0))
+			return -1;
+	}
+	return 0;
+}
+
+static void print_usage(char *argv[], void *args[])
+{
+	printf("\nUsage:\n");
+	printf("\t%s", argv[0]);
+	arg_print_syntaxv(stdout, args, "\n");
+	printf("\n");
+	arg_print_glossary(stdout, args, "\t%-30s %s\n");
+	printf("\n");
+}
+
+int main(int argc, char *argv[])
+{
+	struct arg_int *arg_clients = arg_int0("c", "clients", "<n>", "Client connections to the MAM (default: 16)");
+	struct arg_dbl *arg_rate = arg_dbl0("r", "rate", "<n>", "Requests per second of all clients together (default: 0, as fast as possible)");
+	struct arg_int *arg_duration = arg_int0("d", "duration", "<s>", "Seconds to measure (default: 10)");
+	struct arg_int *arg_warmup = arg_int0("w", "warmup", "<s>", "Seconds of load before measuring (default: 1)");
+	struct arg_str *arg_mix = arg_str0("m", "mix", "<type:weight,...>", "Request mix of resolve, connect, socketconnect and socketchoose (default: resolve:4,connect:2,socketconnect:3,socketchoose:1)");
+	struct arg_int *arg_names = arg_int0("n", "names", "<n>", "Distinct host names to request (default: 16)");
+	struct arg_str *arg_service = arg_str0("s", "service", "<port>", "Service to request (default: 80)");
+	struct arg_int *arg_setsize = arg_int0(NULL, "socketset", "<n>", "Sockets in the set of socketchoose requests (default: 4)");
+	struct arg_int *arg_dnsport = arg_int0(NULL, "dns-port", "<port>", "Port of the DNS stub on 127.0.0.1, 0 to run without (default: 5354)");
+	struct arg_str *arg_answer = arg_str0(NULL, "dns-answer", "<ipv4>", "Address the DNS stub answers with (default: 192.0.2.1)");
+	struct arg_int *arg_ttl = arg_int0(NULL, "dns-ttl", "<s>", "TTL of the answers of the DNS stub (default: 60)");
+	struct arg_str *arg_resolvconf = arg_str0(NULL, "resolvconf", "<file>", "Write a resolv.conf pointing to the DNS stub, for the resolvconf statement of the prefixes");
+	struct arg_int *arg_pid = arg_int0(NULL, "mam-pid", "<pid>", "Process to account CPU time to (default: the running mamma)");
+	struct arg_lit *arg_help = arg_lit0("h", "help", "Print this help");
+	struct arg_end *end = arg_end(10);
+
+	void *argtable[] = {arg_clients, arg_rate, arg_duration, arg_warmup, arg_mix, arg_names, arg_service, arg_setsize, arg_dnsport, arg_answer, arg_ttl, arg_resolvconf, arg_pid, arg_help, end};
+
+	pthread_t dns_thread;
+	struct loadgen_client *clients;
+	struct loadgen_samples all = { NULL, 0, 0 };
+	uint64_t errors = 0, resyncs = 0;
+	double cpu_start = -1, cpu_end = -1;
+	pid_t mam_pid;
+	int i, type;
+
+	if (arg_nullcheck(argtable) != 0)
+	{
+		printf("Error creating argument table\n");
+		return -1;
+	}
+
+	arg_clients->ival[0] = 16;
+	arg_rate->dval[0] = 0;
+	arg_duration->ival[0] = 10;
+	arg_warmup->ival[0] = 1;
+	*arg_mix->sval = NULL;
+	arg_names->ival[0] = 16;
+	*arg_service->sval = "80";
+	arg_setsize->ival[0] = 4;
+	arg_dnsport->ival[0] = 5354;
+	*arg_answer->sval = "192.0.2.1";
+	arg_ttl->ival[0] = 60;
+	*arg_resolvconf->sval = NULL;
+	arg_pid->ival[0] = 0;
+
+	if (arg_parse(argc, argv, argtable) != 0 || arg_help->count > 0)
+	{
+		arg_print_errors(stdout, end, "mamloadgen");
+		print_usage(argv, argtable);
+		arg_freetable(argtable, sizeof(argtable)/sizeof(argtable[0]));
+		return (arg_help->count > 0) ? 0 : -1;
+	}
+
+	num_clients = arg_clients->ival[0];
+	rate = arg_rate->dval[0];
+	num_names = arg_names->ival[0];
+	service = *arg_service->sval;
+	set_size = arg_setsize->ival[0];
+	dns_ttl = arg_ttl->ival[0];
+
+	if (num_clients <= 0 || rate < 0 || arg_duration->ival[0] <= 0 || arg_warmup->ival[0] < 0 ||
+		num_names <= 0 || num_names > LOADGEN_MAX_NAMES || set_size <= 0 || set_size > LOADGEN_MAX_SET)
+	{
+		printf("Invalid arguments\n");
+		print_usage(argv, argtable);
+		return -1;
+	}
+	if (*arg_mix->sval != NULL && parse_mix(*arg_mix->sval) != 0)
+		return -1;
+	if (inet_pton(AF_INET, *arg_answer->sval, &dns_answer4) != 1)
+	{
+		printf("Invalid DNS answer %s\n", *arg_answer->sval);
+		return -1;
+	}
+	inet_pton(AF_INET6, "2001:db8::1", &dns_answer6);
+
+	/* request templates */
+	names = malloc(num_names * sizeof(*names));
+	for (i = 0; i < num_names; i++)
+		snprintf(names[i], HOSTNAME_LEN_LIMIT, "host%d.loadgen.test", i);
+	memset(&hint, 0, sizeof(hint));
+	hint.ai_family = AF_INET;
+	hint.ai_socktype = SOCK_STREAM;
+	memset(&answer_sa, 0, sizeof(answer_sa));
+	answer_sa.sin_family = AF_INET;
+	answer_sa.sin_port = htons(atoi(service));
+	answer_sa.sin_addr = dns_answer4;
+	if (setup_intents() != 0)
+	{
+		printf("Failed to set up intents\n");
+		return -1;
+	}
+
+	if (arg_dnsport->ival[0] > 0)
+	{
+		if (dns_stub_start(arg_dnsport->ival[0], &dns_thread) != 0)
+			return -1;
+		if (*arg_resolvconf->sval != NULL)
+		{
+			FILE *f = fopen(*arg_resolvconf->sval, "w");
+			if (f == NULL)
+			{
+				printf("Cannot write %s: %s\n", *arg_resolvconf->sval, strerror(errno));
+				return -1;
+			}
+			fprintf(f, "nameserver 127.0.0.1:%d\n", arg_dnsport->ival[0]);
+			fclose(f);
+		}
+	}
+
+	mam_pid = (arg_pid->ival[0] > 0) ? arg_pid->ival[0] : find_mamma();
+
+	printf("Running %d clients %s for %d+%d s against the MAM at %s\n", num_clients,
+		(rate > 0) ? "at a fixed rate" : "as fast as possible", arg_warmup->ival[0], arg_duration->ival[0], MUACC_SOCKET);
+
+	clients = calloc(num_clients, sizeof(struct loadgen_client));
+	for (i = 0; i < num_clients; i++)
+	{
+		clients[i].id = i;
+		clients[i].seed = getpid() ^ (i * 2654435761U);
+		if ((clients[i].mamsock = connect_to_mam()) < 0)
+		{
+			printf("Cannot connect to the MAM - is mamma running?\n");
+			return -1;
+		}
+	}
+
+	start_ns = now_ns();
+	measure_ns = start_ns + arg_warmup->ival[0] * 1000000000ULL;
+	end_ns = measure_ns + arg_duration->ival[0] * 1000000000ULL;
+	for (i = 0; i < num_clients; i++)
+		pthread_create(&clients[i].thread, NULL, client_worker, &clients[i]);
+
+	sleep_until_ns(measure_ns);
+	if (mam_pid > 0)
+		cpu_start = process_cpu_time(mam_pid);
+	sleep_until_ns(end_ns);
+	if (mam_pid > 0)
+		cpu_end = process_cpu_time(mam_pid);
+
+	for (i = 0; i < num_clients; i++)
+	{
+		pthread_join(clients[i].thread, NULL);
+		errors += clients[i].errors;
+		resyncs += clients[i].resyncs;
+		if (clients[i].mamsock >= 0)
+			close(clients[i].mamsock);
+	}
+	dns_running = 0;
+	if (dns_sock >= 0)
+		pthread_join(dns_thread, NULL);
+
+	/* merge and report */
+	double seconds = arg_duration->ival[0];
+	printf("\n%-14s %10s %10s %10s %10s %10s %10s\n", "request", "count", "per s", "p50 us", "p99 us", "p999 us", "max us");
+	for (type = 0; type < LOADGEN_REQUEST_TYPES; type++)
+	{
+		struct loadgen_samples merged = { NULL, 0, 0 };
+		for (i = 0; i < num_clients; i++)
+		{
+			struct loadgen_samples *s = &clients[i].samples[type];
+			for (size_t k = 0; k < s->count; k++)
+			{
+				add_sample(&merged, s->ns[k]);
+				add_sample(&all, s->ns[k]);
+			}
+			free(s->ns);
+		}
+		if (merged.count == 0)
+			continue;
+		qsort(merged.ns, merged.count, sizeof(uint64_t), compare_u64);
+		printf("%-14s %10zu %10.0f %10.0f %10.0f %10.0f %10.0f\n", loadgen_request_names[type], merged.count, merged.count / seconds,
+			quantile_us(&merged, 0.5), quantile_us(&merged, 0.99), quantile_us(&merged, 0.999), quantile_us(&merged, 1));
+		free(merged.ns);
+	}
+	qsort(all.ns, all.count, sizeof(uint64_t), compare_u64);
+	printf("%-14s %10zu %10.0f %10.0f %10.0f %10.0f %10.0f\n", "all", all.count, all.count / seconds,
+		quantile_us(&all, 0.5), quantile_us(&all, 0.99), quantile_us(&all, 0.999), quantile_us(&all, 1));
+
+	printf("\n%llu errors, %llu socketchoose resyncs, %llu DNS queries answered by the stub\n",
+		(unsigned long long) errors, (unsigned long long) resyncs, (unsigned long long) dns_queries);
+	if (cpu_start >= 0 && cpu_end >= 0)
+		printf("MAM (pid %d) used %.2f s CPU, %.1f %% of one core, %.1f us per request\n", (int) mam_pid, cpu_end - cpu_start,
+			100 * (cpu_end - cpu_start) / seconds, (all.count > 0) ? 1e6 * (cpu_end - cpu_start) / all.count : 0);
+	else
+		printf("MAM CPU time not available - pass --mam-pid\n");
+
+	/* one line to compare runs with */
+	printf("LOADGEN clients=%d rate=%.0f requests=%zu rps=%.0f p50_us=%.0f p99_us=%.0f p999_us=%.0f errors=%llu mam_cpu_pct=%.1f\n",
+		num_clients, rate, all.count, all.count / seconds, quantile_us(&all, 0.5), quantile_us(&all, 0.99), quantile_us(&all, 0.999),
+		(unsigned long long) errors, (cpu_start >= 0 && cpu_end >= 0) ? 100 * (cpu_end - cpu_start) / seconds : -1.0);
+
+	free(all.ns);
+	free(clients);
+	free(names);
+	for (i = 0; i < 4; i++)
+		muacc_free_socket_option_list(intents[i]);
+	arg_freetable(argtable, sizeof(argtable)/sizeof(argtable[0]));
+	return (errors > 0) ? 1 : 0;
+}
@@ -0,0 +1,61 @@
+#!/bin/sh
+# Compare policies (or mamma builds) under the same load from mamloadgen
+# Usage: mam_loadgen.sh <policy.conf>... [-- <mamloadgen arguments>]
+# The prefixes of each configuration should contain
+#	resolvconf "/tmp/loadgen-resolv.conf";
+# so that names are resolved by the DNS stub of mamloadgen
+#
+### Copyright 2013-2015 Philipp Schmidt, Theresa Enghardt, and Mirko Palmer.
+### All rights reserved. This project is released under the New BSD License.
+
+MAMMA=${MAMMA:-`which mamma`}
+testdir=${0%/*}
+LOADGEN=${LOADGEN:-$testdir/mamloadgen}
+resolvconf=/tmp/loadgen-resolv.conf
+
+if [ "$MAMMA" = "" ]
+then
+	echo "Mamma does not seem to be installed. Please invoke \"make install\" or set MAMMA."
+	exit 127
+fi
+
+if [ ! -x "$LOADGEN" ]
+then
+	echo "$LOADGEN not found - build it with \"make mamloadgen\" or set LOADGEN."
+	exit 127
+fi
+
+pgrep mamma > /dev/null
+if [ $? = '0' ]
+then
+	echo "Multi Access Manager is already running - stop it before running this benchmark."
+	exit 1
+fi
+
+configs=""
+while [ $# -gt 0 ] && [ "$1" != "--" ]
+do
+	configs="$configs $1"
+	shift
+done
+[ "$1" = "--" ] && shift
+
+if [ "$configs" = "" ]
+then
+	echo "Usage: $0 <policy.conf>... [-- <mamloadgen arguments>]"
+	exit 1
+fi
+
+# the stub has to be known before mamma reads the configuration
+echo "nameserver 127.0.0.1:5354" > $resolvconf
+
+for config in $configs
+do
+	$MAMMA "$config" > /dev/null 2>&1 &
+	mamma_pid=$!
+	sleep 1
+	echo "$config:"
+	$LOADGEN --mam-pid $mamma_pid --resolvconf $resolvconf "$@" | grep LOADGEN
+	kill $mamma_pid
+	wait $mamma_pid 2> /dev/null
+done
@@ -0,0 +1,89 @@
+#!/bin/sh
+# Test the active prober of the Multi Access Manager against an echo stand-in in a network namespace
+# Needs root, iproute2, socat and an installed mamma with the sample policy
+#
+### Copyright 2013-2015 Philipp Schmidt, Theresa Enghardt, and Mirko Palmer.
+### All rights reserved. This project is released under the New BSD License.
+
+ns=mam_probe_peer
+local_if=mamprobe0
+peer_if=mamprobe1
+workdir=`mktemp -d`
+MAMMA=`which mamma`
+
+if [ "$MAMMA" = "" ]
+then
+	echo "Mamma does not seem to be installed. Please invoke \"make install\"."
+	exit 127
+fi
+
+if [ "`id -u`" != "0" ]
+then
+	echo "This test sets up a network namespace and has to be run as root."
+	exit 77
+fi
+
+pgrep mamma > /dev/null
+if [ $? = '0' ]
+then
+	echo "Multi Access Manager is already running - stop it before running this test."
+	exit 1
+fi
+
+cleanup() {
+	[ "$mamma_pid" != "" ] && kill $mamma_pid 2> /dev/null
+	ip netns pids $ns 2> /dev/null | xargs -r kill 2> /dev/null
+	ip link del $local_if 2> /dev/null
+	ip netns del $ns 2> /dev/null
+	rm -rf "$workdir"
+}
+trap cleanup EXIT
+
+# peer with UDP and TCP echo stand-ins, reachable through a veth pair
+ip netns add $ns
+ip link add $local_if type veth peer name $peer_if
+ip link set $peer_if netns $ns
+ip addr add 10.77.0.1/24 dev $local_if
+ip link set $local_if up
+ip netns exec $ns ip addr add 10.77.0.2/24 dev $peer_if
+ip netns exec $ns ip link set $peer_if up
+ip netns exec $ns ip link set lo up
+ip netns exec $ns socat UDP4-RECVFROM:7,fork EXEC:cat &
+ip netns exec $ns socat TCP4-LISTEN:7,fork,reuseaddr EXEC:cat &
+
+for mode in udp tcp
+do
+	cat > "$workdir/probe.conf" << EOF
+policy "policy_sample.so" {
+	set probe_targets "10.77.0.2:7";
+	set probe_mode $mode;
+	set probe_interval 1;
+	set probe_rate 60;
+};
+
+prefix 10.77.0.1/24 {
+	enabled 1;
+}
+EOF
+
+	echo "Probing the stand-in using $mode..."
+	$MAMMA "$workdir/probe.conf" > "$workdir/mamma.log" 2>&1 &
+	mamma_pid=$!
+	sleep 8
+	kill -USR1 $mamma_pid
+	sleep 1
+	kill $mamma_pid
+	wait $mamma_pid
+	mamma_pid=""
+
+	grep -q "probe_samples -> [1-9]" "$workdir/mamma.log"
+	if [ $? != '0' ]
+	then
+		echo "No answered $mode probes - mamma's output was:"
+		cat "$workdir/mamma.log"
+		exit 1
+	fi
+done
+
+echo "Test finished successfully"
+exit 0
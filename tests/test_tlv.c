@@ -0,0 +1,128 @@
+/** \file test_tlv.c
+ *  \brief Regression tests for the TLV encoding of libmuacc
+ *
+ *  \copyright Copyright 2013-2015 Philipp Schmidt, Theresa Enghardt, and Mirko Palmer.
+ *  All rights reserved. This project is released under the New BSD License.
+ *
+ *	Encodes a chain of addrinfos whose first element carries a canonical name and checks
+ *	that the size reported for it matches what is written, and that decoding it yields
+ *	the same chain again.
+ */
+
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <netdb.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#include "clib/muacc.h"
+#include "lib/muacc_tlv.h"
+
+/** Fill in an addrinfo for a TCP address */
+static void make_addrinfo(struct addrinfo *ai, struct sockaddr_in6 *sa, const char *addr, char *canonname, struct addrinfo *next)
+{
+	memset(ai, 0x00, sizeof(struct addrinfo));
+	memset(sa, 0x00, sizeof(struct sockaddr_in6));
+
+	sa->sin6_family = AF_INET6;
+	sa->sin6_port = htons(80);
+	inet_pton(AF_INET6, addr, &(sa->sin6_addr));
+
+	ai->ai_family = AF_INET6;
+	ai->ai_socktype = SOCK_STREAM;
+	ai->ai_protocol = IPPROTO_TCP;
+	ai->ai_addrlen = sizeof(struct sockaddr_in6);
+	ai->ai_addr = (struct sockaddr *) sa;
+	ai->ai_canonname = canonname;
+	ai->ai_next = next;
+}
+
+/** Compare a decoded addrinfo with the one it was encoded from
+ *
+ *  \return 0 if equal, 1 otherwise
+ */
+static int compare_addrinfo(const struct addrinfo *a, const struct addrinfo *b)
+{
+	if (a->ai_family != b->ai_family || a->ai_socktype != b->ai_socktype ||
+		a->ai_protocol != b->ai_protocol || a->ai_addrlen != b->ai_addrlen)
+		return 1;
+	if (memcmp(a->ai_addr, b->ai_addr, a->ai_addrlen) != 0)
+		return 1;
+	if ((a->ai_canonname == NULL) != (b->ai_canonname == NULL))
+		return 1;
+	if (a->ai_canonname != NULL && strcmp(a->ai_canonname, b->ai_canonname) != 0)
+		return 1;
+	return 0;
+}
+
+int main(int argc, char *argv[])
+{
+	char canonname[] = "www.example.org";
+	struct sockaddr_in6 sa[2];
+	struct addrinfo ai[2];
+	struct addrinfo *out = NULL;
+	const struct addrinfo *orig, *copy;
+	char *buf;
+	ssize_t buf_pos = 0, buf_len;
+	ssize_t tlv_len, data_len;
+	int ret = 1;
+
+	make_addrinfo(&ai[1], &sa[1], "2001:db8::2", NULL, NULL);
+	make_addrinfo(&ai[0], &sa[0], "2001:db8::1", canonname, &ai[1]);
+
+	/* the checking call has to account for everything that is written */
+	tlv_len = _muacc_push_addrinfo_tlv(NULL, &buf_pos, 0, remote_addrinfo_res, &ai[0]);
+
+	/* leave room to detect writing more than was reported */
+	buf_len = tlv_len + 256;
+	if ((buf = malloc(buf_len)) == NULL)
+		return 1;
+
+	if (_muacc_push_addrinfo_tlv(buf, &buf_pos, buf_len, remote_addrinfo_res, &ai[0]) != tlv_len)
+	{
+		printf("encoding the addrinfo failed\n");
+		goto test_tlv_done;
+	}
+	if (buf_pos != tlv_len)
+	{
+		printf("addrinfo TLV has %ld bytes, but %ld were reported\n", (long) buf_pos, (long) tlv_len);
+		goto test_tlv_done;
+	}
+
+	data_len = *((ssize_t *) (buf + sizeof(muacc_tlv_t)));
+	if (_muacc_extract_addrinfo_tlv(buf + sizeof(muacc_tlv_t) + sizeof(ssize_t), data_len, &out) < 0)
+	{
+		printf("decoding the addrinfo failed\n");
+		goto test_tlv_done;
+	}
+
+	for (orig = &ai[0], copy = out; orig != NULL && copy != NULL; orig = orig->ai_next, copy = copy->ai_next)
+	{
+		if (compare_addrinfo(orig, copy) != 0)
+		{
+			printf("decoded addrinfo differs from the original\n");
+			goto test_tlv_done;
+		}
+	}
+	if (orig != NULL || copy != NULL)
+	{
+		printf("decoded addrinfo chain has a different length\n");
+		goto test_tlv_done;
+	}
+
+	printf("addrinfo with canonname survived the round trip\n");
+	ret = 0;
+
+	test_tlv_done:
+	if (out != NULL)
+		freeaddrinfo(out);
+	free(buf);
+	return ret;
+}